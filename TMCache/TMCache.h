@@ -11,6 +11,13 @@
  
  The parallel caches are accessible as public properties (<memoryCache> and <diskCache>) and can be manipulated
  separately if necessary. See the docs for <TMMemoryCache> and <TMDiskCache> for more details.
+
+ By default every object is written through to both caches. With <writeBehind> enabled objects are only stored in
+ memory right away and written to disk a little later, in batches, so an object that changes many times a second
+ is only archived once per <writeBehindInterval>.
+
+ Objects set with a time to live (see <setObject:forKey:ttl:>) expire in both caches at the same moment. They are
+ always written through, and an object read back from disk is kept in memory only for the time it has left.
  */
 
 #import <Foundation/Foundation.h>
@@ -22,6 +29,8 @@
 
 typedef void (^TMCacheBlock)(TMCache *cache);
 typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
+typedef void (^TMCacheObjectsBlock)(TMCache *cache, NSDictionary *objects);
+typedef id <NSCoding> (^TMCacheLoaderBlock)(NSString *key);
 
 @interface TMCache : NSObject
 
@@ -39,10 +48,37 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
 @property (readonly) dispatch_queue_t queue;
 
 /**
- Synchronously retrieves the total byte count of the <diskCache> on the shared disk queue.
+ Retrieves the total byte count of the <diskCache>, without waiting for its queue.
  */
 @property (readonly) NSUInteger diskByteCount;
 
+/**
+ Encodes objects for the <diskCache>, a shortcut for its <[TMDiskCache serializer]>.
+ */
+@property (strong) id <TMCacheSerializer> serializer;
+
+/**
+ When `YES`, setting an object completes as soon as it is in the <memoryCache>. It is queued as dirty and written
+ to the <diskCache> by a background flush up to <writeBehindInterval> later, together with everything else that
+ was set in the meantime. Setting the same key again before the flush replaces the queued object, so only the
+ latest one is written. Reads see queued objects even if the <memoryCache> has already evicted them. Call <flush>
+ to write everything out now; on iOS that happens automatically when the app enters the background. Setting this
+ back to `NO` flushes the queue. Defaults to `NO`, meaning every object is written through to disk.
+ */
+@property (assign) BOOL writeBehind;
+
+/**
+ How long a dirty object may wait before it is written to disk with <writeBehind> enabled. Defaults to `1.0`.
+ */
+@property (assign) NSTimeInterval writeBehindInterval;
+
+/**
+ How many objects may be dirty or in the middle of being flushed with <writeBehind> enabled. Once there are this
+ many, the queue is flushed right away and further objects are written through, so their blocks wait for the disk
+ again until the flush catches up. Defaults to `1000`.
+ */
+@property (assign) NSUInteger dirtyObjectLimit;
+
 /**
  The underlying disk cache, see <TMDiskCache> for additional configuration and trimming options.
  */
@@ -53,6 +89,13 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 @property (readonly) TMMemoryCache *memoryCache;
 
+/**
+ Reads that found an object in either cache and those that found nothing, writes and removals, and how long
+ reads took from start to finish. An object returned by a loader counts as a miss. Each of the <memoryCache>
+ and the <diskCache> keeps statistics of its own as well.
+ */
+@property (readonly) TMCacheStatistics *statistics;
+
 #pragma mark -
 /// @name Initialization
 
@@ -84,18 +127,45 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath;
 
+/**
+ Creates a cache whose <diskCache> names its files with the specified layout.
+
+ @see [TMDiskCache initWithName:rootPath:fileLayout:]
+ @param name The name of the cache.
+ @param rootPath The path of the cache on disk.
+ @param fileLayout How the disk cache names its files.
+ @result A new cache with the specified name.
+ */
+- (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath fileLayout:(TMDiskCacheFileLayout)fileLayout;
+
 #pragma mark -
 /// @name Asynchronous Methods
 
 /**
  Retrieves the object for the specified key. This method returns immediately and executes the passed
  block after the object is available, potentially in parallel with other blocks on the <queue>.
+
+ Concurrent requests for a key that isn't in the <memoryCache> share a single read from the <diskCache>.
  
  @param key The key associated with the requested object.
  @param block A block to be executed concurrently when the object is available.
  */
 - (void)objectForKey:(NSString *)key block:(TMCacheObjectBlock)block;
 
+/**
+ Retrieves the object for the specified key, producing it with the loader if neither cache has it. The loaded
+ object is stored in both caches. Concurrent requests for the same key share a single disk read and a single
+ call of the loader, so an expensive object is only produced once no matter how many callers are waiting
+ for it. This method returns immediately and executes the passed block after the object is available,
+ potentially in parallel with other blocks on the <queue>.
+
+ @param key The key associated with the requested object.
+ @param loader A block returning the object for the key, or `nil` if there is none. It runs on the <queue> and
+ may block.
+ @param block A block to be executed concurrently when the object is available.
+ */
+- (void)objectForKey:(NSString *)key loader:(TMCacheLoaderBlock)loader block:(TMCacheObjectBlock)block;
+
 /**
  Stores an object in the cache for the specified key. This method returns immediately and executes the
  passed block after the object has been stored, potentially in parallel with other blocks on the <queue>.
@@ -106,6 +176,18 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (void)setObject:(id <NSCoding>)object forKey:(NSString *)key block:(TMCacheObjectBlock)block;
 
+/**
+ Stores an object in both caches for the specified key that expires after the specified number of seconds, no
+ matter how often it is used. This method returns immediately and executes the passed block after the object has
+ been stored, potentially in parallel with other blocks on the <queue>.
+
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ @param block A block to be executed concurrently after the object has been stored, or nil.
+ */
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl block:(TMCacheObjectBlock)block;
+
 /**
  Removes the object for the specified key. This method returns immediately and executes the passed
  block after the object has been removed, potentially in parallel with other blocks on the <queue>.
@@ -115,6 +197,38 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (void)removeObjectForKey:(NSString *)key block:(TMCacheObjectBlock)block;
 
+/**
+ Retrieves the objects for the specified keys. Keys found in the <memoryCache> are resolved there, the rest are
+ read from the <diskCache> in a single batch and added to the <memoryCache>. This method returns immediately and
+ executes the passed block after all objects are available, potentially in parallel with other blocks on the <queue>.
+
+ @param keys The keys associated with the requested objects.
+ @param block A block to be executed concurrently with the objects that were found, keyed by their keys.
+ */
+- (void)objectsForKeys:(NSArray *)keys block:(TMCacheObjectsBlock)block;
+
+/**
+ Stores several objects in the cache at once, as one batch in each of the <memoryCache> and the <diskCache>.
+ As with <setObject:forKey:block:>, the objects are stored in the <memoryCache> without a cost. This method
+ returns immediately and executes the passed block after all objects have been stored, potentially in parallel
+ with other blocks on the <queue>.
+
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ @param block A block to be executed concurrently with the stored objects keyed by their keys, or nil.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys block:(TMCacheObjectsBlock)block;
+
+/**
+ Removes the objects for the specified keys, as one batch in each of the <memoryCache> and the <diskCache>.
+ This method returns immediately and executes the passed block after all objects have been removed, potentially
+ in parallel with other blocks on the <queue>.
+
+ @param keys The keys associated with the objects to be removed.
+ @param block A block to be executed concurrently after the objects have been removed, or nil.
+ */
+- (void)removeObjectsForKeys:(NSArray *)keys block:(TMCacheBlock)block;
+
 /**
  Removes all objects from the cache that have not been used since the specified date. This method returns immediately and
  executes the passed block after the cache has been trimmed, potentially in parallel with other blocks on the <queue>.
@@ -132,6 +246,14 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (void)removeAllObjects:(TMCacheBlock)block;
 
+/**
+ Writes every dirty object to the <diskCache> now, see <writeBehind>. This method returns immediately and executes
+ the passed block after all of them are on disk, potentially in parallel with other blocks on the <queue>.
+
+ @param block A block to be executed concurrently after the objects have been written, or nil.
+ */
+- (void)flushWithBlock:(TMCacheBlock)block;
+
 #pragma mark -
 /// @name Synchronous Methods
 
@@ -144,6 +266,17 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (id)objectForKey:(NSString *)key;
 
+/**
+ Retrieves the object for the specified key, producing it with the loader if neither cache has it. This method
+ blocks the calling thread until the object is available. Don't call it from a block running on the <queue>.
+
+ @see objectForKey:loader:block:
+ @param key The key associated with the object.
+ @param loader A block returning the object for the key, or `nil` if there is none.
+ @result The object for the specified key.
+ */
+- (id)objectForKey:(NSString *)key loader:(TMCacheLoaderBlock)loader;
+
 /**
  Stores an object in the cache for the specified key. This method blocks the calling thread until the object has been set.
  
@@ -153,6 +286,17 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (void)setObject:(id <NSCoding>)object forKey:(NSString *)key;
 
+/**
+ Stores an object in both caches for the specified key that expires after the specified number of seconds. This
+ method blocks the calling thread until the object has been set.
+
+ @see setObject:forKey:ttl:block:
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ */
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl;
+
 /**
  Removes the object for the specified key. This method blocks the calling thread until the object
  has been removed.
@@ -161,6 +305,32 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (void)removeObjectForKey:(NSString *)key;
 
+/**
+ Retrieves the objects for the specified keys. This method blocks the calling thread until all objects are available.
+
+ @see objectsForKeys:block:
+ @param keys The keys associated with the objects.
+ @result The objects that were found, keyed by their keys.
+ */
+- (NSDictionary *)objectsForKeys:(NSArray *)keys;
+
+/**
+ Stores several objects in the cache at once. This method blocks the calling thread until all objects have been stored.
+
+ @see setObjects:forKeys:block:
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys;
+
+/**
+ Removes the objects for the specified keys. This method blocks the calling thread until all objects have been removed.
+
+ @see removeObjectsForKeys:block:
+ @param keys The keys associated with the objects to be removed.
+ */
+- (void)removeObjectsForKeys:(NSArray *)keys;
+
 /**
  Removes all objects from the cache that have not been used since the specified date.
  This method blocks the calling thread until the cache has been trimmed.
@@ -174,4 +344,12 @@ typedef void (^TMCacheObjectBlock)(TMCache *cache, NSString *key, id object);
  */
 - (void)removeAllObjects;
 
+/**
+ Writes every dirty object to the <diskCache> now, see <writeBehind>. This method blocks the calling thread until
+ all of them are on disk.
+
+ @see flushWithBlock:
+ */
+- (void)flush;
+
 @end
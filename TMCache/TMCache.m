@@ -1,27 +1,77 @@
 #import "TMCache.h"
 
+#import <pthread.h>
+
+#if __IPHONE_OS_VERSION_MIN_REQUIRED >= __IPHONE_4_0
+#import <UIKit/UIKit.h>
+#endif
+
 NSString * const TMCachePrefix = @"com.tumblr.TMCache";
 NSString * const TMCacheSharedName = @"TMCacheShared";
 
-@interface TMCache ()
+static const NSTimeInterval TMCacheDefaultWriteBehindInterval = 1.0;
+static const NSUInteger TMCacheDefaultDirtyObjectLimit = 1000;
+static const NSTimeInterval TMCacheAccessHandoffInterval = 5.0;
+
+@interface TMCache () {
+    pthread_mutex_t _lock;
+    NSMutableDictionary *_dirtyObjects;
+    NSMutableDictionary *_flushingObjects;
+    NSMutableDictionary *_readWaiters;
+    NSMutableDictionary *_readLoaders;
+    NSMutableSet *_staleReads;
+    NSMutableDictionary *_accessDates;
+    NSUInteger _flushCount;
+    BOOL _flushScheduled;
+    BOOL _accessHandoffScheduled;
+}
 #if OS_OBJECT_USE_OBJC
 @property (strong, nonatomic) dispatch_queue_t queue;
+@property (strong, nonatomic) dispatch_group_t flushGroup;
 #else
 @property (assign, nonatomic) dispatch_queue_t queue;
+@property (assign, nonatomic) dispatch_group_t flushGroup;
 #endif
 @end
 
 @implementation TMCache
 
+@synthesize writeBehind = _writeBehind;
+@synthesize writeBehindInterval = _writeBehindInterval;
+@synthesize dirtyObjectLimit = _dirtyObjectLimit;
+
 #pragma mark - Initialization -
 
-#if !OS_OBJECT_USE_OBJC
 - (void)dealloc
 {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+
+    if ([_dirtyObjects count]) {
+        // the disk cache only finishes a batch while it is alive, keep it around until this one is written
+        TMDiskCache *diskCache = _diskCache;
+        NSDictionary *dirtyObjects = _dirtyObjects;
+
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+            [diskCache setObjects:[dirtyObjects allValues] forKeys:[dirtyObjects allKeys]];
+        });
+    }
+
+    [_diskCache setAccessDates:_accessDates];
+
+    // flushes still in flight only finish while this cache is alive, a group can't go away unbalanced
+    for (NSUInteger i = 0; i < _flushCount; i++)
+        dispatch_group_leave(_flushGroup);
+
+    pthread_mutex_destroy(&_lock);
+
+    #if !OS_OBJECT_USE_OBJC
+    dispatch_release(_flushGroup);
+    _flushGroup = nil;
+
     dispatch_release(_queue);
     _queue = nil;
+    #endif
 }
-#endif
 
 - (instancetype)initWithName:(NSString *)name
 {
@@ -29,6 +79,11 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
 }
 
 - (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath
+{
+    return [self initWithName:name rootPath:rootPath fileLayout:TMDiskCacheFileLayoutFlat];
+}
+
+- (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath fileLayout:(TMDiskCacheFileLayout)fileLayout
 {
     if (!name)
         return nil;
@@ -39,8 +94,36 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
         NSString *queueName = [[NSString alloc] initWithFormat:@"%@.%p", TMCachePrefix, self];
         _queue = dispatch_queue_create([queueName UTF8String], DISPATCH_QUEUE_CONCURRENT);
 
-        _diskCache = [[TMDiskCache alloc] initWithName:_name rootPath:rootPath];
+        _diskCache = [[TMDiskCache alloc] initWithName:_name rootPath:rootPath fileLayout:fileLayout];
         _memoryCache = [[TMMemoryCache alloc] init];
+
+        pthread_mutex_init(&_lock, NULL);
+
+        _flushGroup = dispatch_group_create();
+        _dirtyObjects = [[NSMutableDictionary alloc] init];
+        _flushingObjects = [[NSMutableDictionary alloc] init];
+        _flushCount = 0;
+        _flushScheduled = NO;
+
+        _readWaiters = [[NSMutableDictionary alloc] init];
+        _readLoaders = [[NSMutableDictionary alloc] init];
+        _staleReads = [[NSMutableSet alloc] init];
+
+        _accessDates = [[NSMutableDictionary alloc] init];
+        _accessHandoffScheduled = NO;
+
+        _statistics = [[TMCacheStatistics alloc] init];
+
+        _writeBehind = NO;
+        _writeBehindInterval = TMCacheDefaultWriteBehindInterval;
+        _dirtyObjectLimit = TMCacheDefaultDirtyObjectLimit;
+
+#if __IPHONE_OS_VERSION_MIN_REQUIRED >= __IPHONE_4_0
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(handleApplicationBackgrounding)
+                                                     name:UIApplicationDidEnterBackgroundNotification
+                                                   object:nil];
+#endif
     }
     return self;
 }
@@ -62,13 +145,401 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
     return cache;
 }
 
+#pragma mark - Private Write Behind Methods -
+
+// Guards the dirty objects, the write behind settings, the reads in flight and the recorded accesses. Disk work for a key that may be dirty is queued while
+// holding it, so a flush can never write an older object after a newer write or a removal of the same key.
+- (void)lock
+{
+    pthread_mutex_lock(&_lock);
+}
+
+- (void)unlock
+{
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)handleApplicationBackgrounding
+{
+    [self handOffAccesses];
+    [self flushWithBlock:nil];
+}
+
+// Objects that were written behind and may not be on disk yet, the newest ones.
+- (id)unflushedObjectForKey:(NSString *)key
+{
+    [self lock];
+    id object = [_dirtyObjects objectForKey:key] ?: [_flushingObjects objectForKey:key];
+    [self unlock];
+
+    return object;
+}
+
+- (NSDictionary *)unflushedObjectsForKeys:(NSArray *)keys
+{
+    NSMutableDictionary *objects = [[NSMutableDictionary alloc] init];
+
+    [self lock];
+
+    if ([_dirtyObjects count] || [_flushingObjects count]) {
+        for (NSString *key in keys) {
+            id object = [_dirtyObjects objectForKey:key] ?: [_flushingObjects objectForKey:key];
+            if (object)
+                [objects setObject:object forKey:key];
+        }
+    }
+
+    [self unlock];
+
+    return objects;
+}
+
+// Called with the lock held. Returns NO if the object has to be written through, because write behind is off or
+// too many objects are waiting for the disk. Either way nothing older is left to be flushed for the key.
+- (BOOL)writeBehindObject:(id)object forKey:(NSString *)key
+{
+    if (_writeBehind) {
+        BOOL coalesced = [_dirtyObjects objectForKey:key] != nil;
+
+        if (coalesced || [_dirtyObjects count] + [_flushingObjects count] < _dirtyObjectLimit) {
+            [_dirtyObjects setObject:object forKey:key];
+
+            if (!_flushScheduled) {
+                _flushScheduled = YES;
+                [self flushAfterInterval:_writeBehindInterval];
+            }
+
+            return YES;
+        }
+
+        if ([_dirtyObjects count])
+            [self flushAfterInterval:0.0]; // backpressure, the caller waits for the disk until the flush catches up
+    }
+
+    [self forgetUnflushedObjectForKey:key];
+
+    return NO;
+}
+
+// Called with the lock held, before the key is written through or removed.
+- (void)forgetUnflushedObjectForKey:(NSString *)key
+{
+    [_dirtyObjects removeObjectForKey:key];
+    [_flushingObjects removeObjectForKey:key];
+}
+
+- (void)flushAfterInterval:(NSTimeInterval)interval
+{
+    __weak TMCache *weakSelf = self;
+
+    dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(interval * NSEC_PER_SEC));
+    dispatch_after(time, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        TMCache *strongSelf = weakSelf;
+        [strongSelf flushDirtyObjects];
+    });
+}
+
+// Hands all dirty objects to the disk cache as one batch. They stay readable until the batch is written.
+- (void)flushDirtyObjects
+{
+    [self lock];
+
+    _flushScheduled = NO;
+
+    if ([_dirtyObjects count]) {
+        NSDictionary *objects = _dirtyObjects;
+        _dirtyObjects = [[NSMutableDictionary alloc] init];
+        [_flushingObjects addEntriesFromDictionary:objects];
+
+        _flushCount++;
+        dispatch_group_enter(_flushGroup);
+
+        __weak TMCache *weakSelf = self;
+
+        [_diskCache setObjects:[objects allValues] forKeys:[objects allKeys] block:^(TMDiskCache *cache, NSDictionary *storedObjects) {
+            TMCache *strongSelf = weakSelf;
+            if (!strongSelf)
+                return;
+
+            [strongSelf lock];
+
+            [objects enumerateKeysAndObjectsUsingBlock:^(NSString *key, id object, BOOL *stop) {
+                if ([strongSelf->_flushingObjects objectForKey:key] == object) // unless replaced in the meantime
+                    [strongSelf->_flushingObjects removeObjectForKey:key];
+            }];
+
+            strongSelf->_flushCount--;
+
+            [strongSelf unlock];
+
+            dispatch_group_leave(strongSelf->_flushGroup);
+        }];
+    }
+
+    [self unlock];
+}
+
+// Queues the object for the disk cache, written behind or through. Objects with a time to live are always written
+// through, the batches written behind don't carry one. The block is called once it is done with.
+- (void)setDiskObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl block:(TMDiskCacheObjectBlock)block
+{
+    [self lock];
+    BOOL writtenBehind = NO;
+    if (ttl > 0.0)
+        [self forgetUnflushedObjectForKey:key];
+    else
+        writtenBehind = [self writeBehindObject:object forKey:key];
+    [self unlock];
+
+    if (!writtenBehind)
+        [_diskCache setObject:object forKey:key ttl:ttl block:block];
+    else if (block)
+        block(_diskCache, key, object, nil);
+}
+
+#pragma mark - Private Access Methods -
+
+// Memory hits don't go to the disk cache one by one. Their dates are collected here and handed over in one batch
+// every few seconds, which only updates the disk cache's in-memory dates and index.
+- (void)recordAccessForKeys:(NSArray *)keys
+{
+    if (![keys count])
+        return;
+
+    NSDate *now = [[NSDate alloc] init];
+    BOOL scheduleHandoff = NO;
+
+    [self lock];
+
+    for (NSString *key in keys)
+        [_accessDates setObject:now forKey:key];
+
+    if (!_accessHandoffScheduled) {
+        _accessHandoffScheduled = YES;
+        scheduleHandoff = YES;
+    }
+
+    [self unlock];
+
+    if (!scheduleHandoff)
+        return;
+
+    __weak TMCache *weakSelf = self;
+
+    dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(TMCacheAccessHandoffInterval * NSEC_PER_SEC));
+    dispatch_after(time, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        TMCache *strongSelf = weakSelf;
+        [strongSelf handOffAccesses];
+    });
+}
+
+- (void)handOffAccesses
+{
+    [self lock];
+    NSDictionary *accessDates = _accessDates;
+    _accessDates = [[NSMutableDictionary alloc] init];
+    _accessHandoffScheduled = NO;
+    [self unlock];
+
+    [_diskCache setAccessDates:accessDates];
+}
+
+#pragma mark - Private Expiry Methods -
+
+// Objects read from disk are kept in memory for no longer than they have left on disk.
+- (void)setMemoryObject:(id)object fromDiskForKey:(NSString *)key
+{
+    if (!object || !key)
+        return;
+
+    NSDate *expirationDate = [_diskCache expirationDateForKey:key];
+    NSTimeInterval ttl = expirationDate ? [expirationDate timeIntervalSinceNow] : 0.0;
+
+    if (expirationDate && ttl <= 0.0)
+        return;
+
+    [_memoryCache setObject:object forKey:key withCost:0 ttl:ttl];
+}
+
+- (void)setMemoryObjectsFromDisk:(NSDictionary *)objects
+{
+    NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:[objects count]];
+    NSMutableArray *values = [[NSMutableArray alloc] initWithCapacity:[objects count]];
+
+    [objects enumerateKeysAndObjectsUsingBlock:^(NSString *key, id object, BOOL *stop) {
+        if ([_diskCache expirationDateForKey:key]) {
+            [self setMemoryObject:object fromDiskForKey:key];
+        } else {
+            [keys addObject:key];
+            [values addObject:object];
+        }
+    }];
+
+    if ([keys count])
+        [_memoryCache setObjects:values forKeys:keys];
+}
+
+#pragma mark - Private Disk Methods -
+
+// Keys the disk cache's filter rules out are definite misses, they don't need a trip through its queues.
+- (void)removeKeysMissingFromDisk:(NSMutableArray *)keys
+{
+    NSIndexSet *missingIndexes = [keys indexesOfObjectsPassingTest:^BOOL(NSString *key, NSUInteger index, BOOL *stop) {
+        return ![_diskCache mightContainObjectForKey:key];
+    }];
+
+    [keys removeObjectsAtIndexes:missingIndexes];
+}
+
+#pragma mark - Private Statistics Methods -
+
+- (void)recordReadOfKeys:(NSArray *)keys objects:(NSDictionary *)objects startTime:(uint64_t)startTime
+{
+    [_statistics addCount:[objects count] toCounter:TMCacheStatisticsCounterHits];
+    [_statistics addCount:[keys count] - [objects count] toCounter:TMCacheStatisticsCounterMisses];
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRead];
+}
+
+#pragma mark - Private Single Flight Methods -
+
+// Joins the read of the key already in flight, if there is one. Returns YES if the caller has to start the read.
+// The first loader offered for a key is the one that runs if the read comes up empty.
+- (BOOL)addReadWaiter:(TMCacheObjectBlock)block loader:(TMCacheLoaderBlock)loader forKey:(NSString *)key
+{
+    [self lock];
+
+    NSMutableArray *waiters = [_readWaiters objectForKey:key];
+    BOOL startRead = waiters == nil;
+
+    if (startRead) {
+        waiters = [[NSMutableArray alloc] init];
+        [_readWaiters setObject:waiters forKey:key];
+    }
+
+    [waiters addObject:[block copy]];
+
+    if (loader && ![_readLoaders objectForKey:key])
+        [_readLoaders setObject:[loader copy] forKey:key];
+
+    [self unlock];
+
+    return startRead;
+}
+
+- (TMCacheLoaderBlock)readLoaderForKey:(NSString *)key
+{
+    [self lock];
+    TMCacheLoaderBlock loader = [_readLoaders objectForKey:key];
+    [self unlock];
+
+    return loader;
+}
+
+// A set or remove of a key wins over the read of it in flight: the read still answers its waiters but doesn't store
+// what it found. Called before the new state is handed to the caches, with nil for every read in flight.
+- (void)invalidateReadsForKeys:(NSArray *)keys
+{
+    [self lock];
+
+    for (NSString *key in keys ?: [_readWaiters allKeys]) {
+        if ([_readWaiters objectForKey:key])
+            [_staleReads addObject:key];
+    }
+
+    [self unlock];
+}
+
+// Checking and storing under the lock orders the store before any set or remove that invalidates the read later.
+- (void)storeObject:(id)object forReadOfKey:(NSString *)key loaded:(BOOL)loaded
+{
+    NSDate *expirationDate = loaded ? nil : [_diskCache expirationDateForKey:key];
+    NSTimeInterval ttl = expirationDate ? [expirationDate timeIntervalSinceNow] : 0.0;
+
+    if (expirationDate && ttl <= 0.0)
+        return;
+
+    [self lock];
+
+    if (![_staleReads containsObject:key]) {
+        [_memoryCache setObject:object forKey:key withCost:0 ttl:ttl];
+
+        if (loaded && ![self writeBehindObject:object forKey:key])
+            [_diskCache setObject:object forKey:key block:nil];
+    }
+
+    [self unlock];
+}
+
+// Found is NO when the object comes from a loader, every waiter counts as a miss then.
+- (void)finishReadForKey:(NSString *)key object:(id)object found:(BOOL)found
+{
+    [self lock];
+    NSArray *waiters = [_readWaiters objectForKey:key];
+    [_readWaiters removeObjectForKey:key];
+    [_readLoaders removeObjectForKey:key];
+    [_staleReads removeObject:key];
+    [self unlock];
+
+    [_statistics addCount:[waiters count] toCounter:found ? TMCacheStatisticsCounterHits : TMCacheStatisticsCounterMisses];
+
+    __weak TMCache *weakSelf = self;
+
+    for (TMCacheObjectBlock waiter in waiters) {
+        dispatch_async(_queue, ^{
+            TMCache *strongSelf = weakSelf;
+            if (strongSelf)
+                waiter(strongSelf, key, object);
+        });
+    }
+}
+
+// Runs on a disk queue with the result of the read in flight, or right away for a key the disk cache rules out.
+// Loaders may block, they run on the queue instead.
+- (void)finishDiskReadForKey:(NSString *)key object:(id)object
+{
+    if (object) {
+        [self storeObject:object forReadOfKey:key loaded:NO];
+        [self finishReadForKey:key object:object found:YES];
+        return;
+    }
+
+    TMCacheLoaderBlock loader = [self readLoaderForKey:key];
+
+    if (!loader) {
+        [self finishReadForKey:key object:nil found:NO];
+        return;
+    }
+
+    __weak TMCache *weakSelf = self;
+
+    dispatch_async(_queue, ^{
+        TMCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        id loadedObject = loader(key);
+
+        if (loadedObject)
+            [strongSelf storeObject:loadedObject forReadOfKey:key loaded:YES];
+
+        [strongSelf finishReadForKey:key object:loadedObject found:NO];
+    });
+}
+
 #pragma mark - Public Asynchronous Methods -
 
 - (void)objectForKey:(NSString *)key block:(TMCacheObjectBlock)block
+{
+    [self objectForKey:key loader:nil block:block];
+}
+
+- (void)objectForKey:(NSString *)key loader:(TMCacheLoaderBlock)loader block:(TMCacheObjectBlock)block
 {
     if (!key || !block)
         return;
 
+    uint64_t startTime = TMCacheStatisticsTime();
+
     __weak TMCache *weakSelf = self;
 
     dispatch_async(_queue, ^{
@@ -76,49 +547,50 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
         if (!strongSelf)
             return;
 
+        id object = [strongSelf->_memoryCache objectForKey:key];
+
+        if (!object) {
+            object = [strongSelf unflushedObjectForKey:key];
+            [strongSelf->_memoryCache setObject:object forKey:key];
+        } else {
+            [strongSelf recordAccessForKeys:@[ key ]];
+        }
+
+        if (object) {
+            [strongSelf->_statistics addCount:1 toCounter:TMCacheStatisticsCounterHits];
+            [strongSelf->_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRead];
+            block(strongSelf, key, object);
+            return;
+        }
+
+        TMCacheObjectBlock waiter = ^(TMCache *cache, NSString *key, id object) {
+            [cache->_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRead];
+            block(cache, key, object);
+        };
+
+        if (![strongSelf addReadWaiter:waiter loader:loader forKey:key])
+            return; // the read in flight calls the block
+
+        if (![strongSelf->_diskCache mightContainObjectForKey:key]) {
+            [strongSelf finishDiskReadForKey:key object:nil];
+            return;
+        }
+
         __weak TMCache *weakSelf = strongSelf;
-        
-        [strongSelf->_memoryCache objectForKey:key block:^(TMMemoryCache *cache, NSString *key, id object) {
+
+        [strongSelf->_diskCache objectForKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
             TMCache *strongSelf = weakSelf;
-            if (!strongSelf)
-                return;
-            
-            if (object) {
-                [strongSelf->_diskCache fileURLForKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
-                    // update the access time on disk
-                }];
-
-                __weak TMCache *weakSelf = strongSelf;
-                
-                dispatch_async(strongSelf->_queue, ^{
-                    TMCache *strongSelf = weakSelf;
-                    if (strongSelf)
-                        block(strongSelf, key, object);
-                });
-            } else {
-                __weak TMCache *weakSelf = strongSelf;
-
-                [strongSelf->_diskCache objectForKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
-                    TMCache *strongSelf = weakSelf;
-                    if (!strongSelf)
-                        return;
-                    
-                    [strongSelf->_memoryCache setObject:object forKey:key block:nil];
-                    
-                    __weak TMCache *weakSelf = strongSelf;
-                    
-                    dispatch_async(strongSelf->_queue, ^{
-                        TMCache *strongSelf = weakSelf;
-                        if (strongSelf)
-                            block(strongSelf, key, object);
-                    });
-                }];
-            }
+            [strongSelf finishDiskReadForKey:key object:object];
         }];
     });
 }
 
 - (void)setObject:(id <NSCoding>)object forKey:(NSString *)key block:(TMCacheObjectBlock)block
+{
+    [self setObject:object forKey:key ttl:0.0 block:block];
+}
+
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl block:(TMCacheObjectBlock)block
 {
     if (!key || !object)
         return;
@@ -141,8 +613,12 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
         };
     }
     
-    [_memoryCache setObject:object forKey:key block:memBlock];
-    [_diskCache setObject:object forKey:key block:diskBlock];
+    [self invalidateReadsForKeys:@[ key ]];
+
+    [_memoryCache setObject:object forKey:key ttl:ttl block:memBlock];
+    [self setDiskObject:object forKey:key ttl:ttl block:diskBlock];
+
+    [_statistics addCount:1 toCounter:TMCacheStatisticsCounterWrites];
     
     if (group) {
         __weak TMCache *weakSelf = self;
@@ -181,8 +657,16 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
         };
     }
 
+    [self invalidateReadsForKeys:@[ key ]];
+
     [_memoryCache removeObjectForKey:key block:memBlock];
+
+    [self lock];
+    [self forgetUnflushedObjectForKey:key];
     [_diskCache removeObjectForKey:key block:diskBlock];
+    [self unlock];
+
+    [_statistics addCount:1 toCounter:TMCacheStatisticsCounterRemovals];
     
     if (group) {
         __weak TMCache *weakSelf = self;
@@ -198,6 +682,179 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
     }
 }
 
+- (void)objectsForKeys:(NSArray *)keys block:(TMCacheObjectsBlock)block
+{
+    if (!keys || !block)
+        return;
+
+    uint64_t startTime = TMCacheStatisticsTime();
+
+    __weak TMCache *weakSelf = self;
+
+    dispatch_async(_queue, ^{
+        TMCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        NSMutableDictionary *memoryObjects = [[strongSelf->_memoryCache objectsForKeys:keys] mutableCopy];
+        NSMutableArray *missingKeys = [[NSMutableArray alloc] init];
+
+        for (NSString *key in keys) {
+            if (![memoryObjects objectForKey:key])
+                [missingKeys addObject:key];
+        }
+
+        [strongSelf recordAccessForKeys:[memoryObjects allKeys]];
+
+        NSDictionary *unflushedObjects = [strongSelf unflushedObjectsForKeys:missingKeys];
+
+        if ([unflushedObjects count]) {
+            [strongSelf->_memoryCache setObjects:[unflushedObjects allValues] forKeys:[unflushedObjects allKeys]];
+            [memoryObjects addEntriesFromDictionary:unflushedObjects];
+            [missingKeys removeObjectsInArray:[unflushedObjects allKeys]];
+        }
+
+        [strongSelf removeKeysMissingFromDisk:missingKeys];
+
+        if (![missingKeys count]) {
+            [strongSelf recordReadOfKeys:keys objects:memoryObjects startTime:startTime];
+            block(strongSelf, memoryObjects);
+            return;
+        }
+
+        __weak TMCache *weakSelf = strongSelf;
+
+        [strongSelf->_diskCache objectsForKeys:missingKeys block:^(TMDiskCache *cache, NSDictionary *diskObjects) {
+            TMCache *strongSelf = weakSelf;
+            if (!strongSelf)
+                return;
+
+            [strongSelf setMemoryObjectsFromDisk:diskObjects];
+
+            NSMutableDictionary *objects = [memoryObjects mutableCopy];
+            [objects addEntriesFromDictionary:diskObjects];
+
+            [strongSelf recordReadOfKeys:keys objects:objects startTime:startTime];
+
+            __weak TMCache *weakSelf = strongSelf;
+
+            dispatch_async(strongSelf->_queue, ^{
+                TMCache *strongSelf = weakSelf;
+                if (strongSelf)
+                    block(strongSelf, objects);
+            });
+        }];
+    });
+}
+
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys block:(TMCacheObjectsBlock)block
+{
+    if (!objects || !keys || [objects count] != [keys count])
+        return;
+
+    dispatch_group_t group = nil;
+    TMMemoryCacheObjectsBlock memBlock = nil;
+    TMDiskCacheObjectsBlock diskBlock = nil;
+
+    if (block) {
+        group = dispatch_group_create();
+        dispatch_group_enter(group);
+        dispatch_group_enter(group);
+
+        memBlock = ^(TMMemoryCache *cache, NSDictionary *objects) {
+            dispatch_group_leave(group);
+        };
+
+        diskBlock = ^(TMDiskCache *cache, NSDictionary *objects) {
+            dispatch_group_leave(group);
+        };
+    }
+
+    [self invalidateReadsForKeys:keys];
+
+    [_memoryCache setObjects:objects forKeys:keys block:memBlock];
+
+    NSMutableArray *writtenThroughObjects = [[NSMutableArray alloc] init];
+    NSMutableArray *writtenThroughKeys = [[NSMutableArray alloc] init];
+
+    [self lock];
+
+    for (NSUInteger i = 0; i < [keys count]; i++) {
+        if (![self writeBehindObject:[objects objectAtIndex:i] forKey:[keys objectAtIndex:i]]) {
+            [writtenThroughObjects addObject:[objects objectAtIndex:i]];
+            [writtenThroughKeys addObject:[keys objectAtIndex:i]];
+        }
+    }
+
+    [self unlock];
+
+    [_diskCache setObjects:writtenThroughObjects forKeys:writtenThroughKeys block:diskBlock];
+
+    [_statistics addCount:[keys count] toCounter:TMCacheStatisticsCounterWrites];
+
+    if (group) {
+        __weak TMCache *weakSelf = self;
+        dispatch_group_notify(group, _queue, ^{
+            TMCache *strongSelf = weakSelf;
+            if (strongSelf)
+                block(strongSelf, [[NSDictionary alloc] initWithObjects:objects forKeys:keys]);
+        });
+
+        #if !OS_OBJECT_USE_OBJC
+        dispatch_release(group);
+        #endif
+    }
+}
+
+- (void)removeObjectsForKeys:(NSArray *)keys block:(TMCacheBlock)block
+{
+    if (!keys)
+        return;
+
+    dispatch_group_t group = nil;
+    TMMemoryCacheBlock memBlock = nil;
+    TMDiskCacheBlock diskBlock = nil;
+
+    if (block) {
+        group = dispatch_group_create();
+        dispatch_group_enter(group);
+        dispatch_group_enter(group);
+
+        memBlock = ^(TMMemoryCache *cache) {
+            dispatch_group_leave(group);
+        };
+
+        diskBlock = ^(TMDiskCache *cache) {
+            dispatch_group_leave(group);
+        };
+    }
+
+    [self invalidateReadsForKeys:keys];
+
+    [_memoryCache removeObjectsForKeys:keys block:memBlock];
+
+    [self lock];
+    for (NSString *key in keys)
+        [self forgetUnflushedObjectForKey:key];
+    [_diskCache removeObjectsForKeys:keys block:diskBlock];
+    [self unlock];
+
+    [_statistics addCount:[keys count] toCounter:TMCacheStatisticsCounterRemovals];
+
+    if (group) {
+        __weak TMCache *weakSelf = self;
+        dispatch_group_notify(group, _queue, ^{
+            TMCache *strongSelf = weakSelf;
+            if (strongSelf)
+                block(strongSelf);
+        });
+
+        #if !OS_OBJECT_USE_OBJC
+        dispatch_release(group);
+        #endif
+    }
+}
+
 - (void)removeAllObjects:(TMCacheBlock)block
 {
     dispatch_group_t group = nil;
@@ -218,8 +875,15 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
         };
     }
     
+    [self invalidateReadsForKeys:nil];
+
     [_memoryCache removeAllObjects:memBlock];
+
+    [self lock];
+    [_dirtyObjects removeAllObjects];
+    [_flushingObjects removeAllObjects];
     [_diskCache removeAllObjects:diskBlock];
+    [self unlock];
     
     if (group) {
         __weak TMCache *weakSelf = self;
@@ -235,6 +899,22 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
     }
 }
 
+- (void)flushWithBlock:(TMCacheBlock)block
+{
+    [self flushDirtyObjects];
+
+    if (!block)
+        return;
+
+    __weak TMCache *weakSelf = self;
+
+    dispatch_group_notify(_flushGroup, _queue, ^{
+        TMCache *strongSelf = weakSelf;
+        if (strongSelf)
+            block(strongSelf);
+    });
+}
+
 - (void)trimToDate:(NSDate *)date block:(TMCacheBlock)block
 {
     if (!date)
@@ -279,13 +959,68 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
 
 - (NSUInteger)diskByteCount
 {
-    __block NSUInteger byteCount = 0;
-    
-    dispatch_sync([TMDiskCache sharedQueue], ^{
-        byteCount = self.diskCache.byteCount;
-    });
-    
-    return byteCount;
+    return self.diskCache.byteCount;
+}
+
+- (id <TMCacheSerializer>)serializer
+{
+    return self.diskCache.serializer;
+}
+
+- (void)setSerializer:(id <TMCacheSerializer>)serializer
+{
+    self.diskCache.serializer = serializer;
+}
+
+- (BOOL)writeBehind
+{
+    [self lock];
+    BOOL writeBehind = _writeBehind;
+    [self unlock];
+
+    return writeBehind;
+}
+
+- (void)setWriteBehind:(BOOL)writeBehind
+{
+    [self lock];
+    _writeBehind = writeBehind;
+    [self unlock];
+
+    if (!writeBehind)
+        [self flushWithBlock:nil];
+}
+
+- (NSTimeInterval)writeBehindInterval
+{
+    [self lock];
+    NSTimeInterval writeBehindInterval = _writeBehindInterval;
+    [self unlock];
+
+    return writeBehindInterval;
+}
+
+- (void)setWriteBehindInterval:(NSTimeInterval)writeBehindInterval
+{
+    [self lock];
+    _writeBehindInterval = writeBehindInterval;
+    [self unlock];
+}
+
+- (NSUInteger)dirtyObjectLimit
+{
+    [self lock];
+    NSUInteger dirtyObjectLimit = _dirtyObjectLimit;
+    [self unlock];
+
+    return dirtyObjectLimit;
+}
+
+- (void)setDirtyObjectLimit:(NSUInteger)dirtyObjectLimit
+{
+    [self lock];
+    _dirtyObjectLimit = dirtyObjectLimit;
+    [self unlock];
 }
 
 #pragma mark - Public Synchronous Methods -
@@ -294,12 +1029,34 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
 {
     if (!key)
         return nil;
-    
-    __block id objectForKey = nil;
 
+    uint64_t startTime = TMCacheStatisticsTime();
+    id object = [_memoryCache objectForKey:key];
+
+    if (object) {
+        [self recordAccessForKeys:@[ key ]];
+    } else if ((object = [self unflushedObjectForKey:key])) {
+        [_memoryCache setObject:object forKey:key];
+    } else {
+        object = [_diskCache objectForKey:key];
+        [self setMemoryObject:object fromDiskForKey:key];
+    }
+
+    [_statistics addCount:1 toCounter:object ? TMCacheStatisticsCounterHits : TMCacheStatisticsCounterMisses];
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRead];
+
+    return object;
+}
+
+- (id)objectForKey:(NSString *)key loader:(TMCacheLoaderBlock)loader
+{
+    if (!key)
+        return nil;
+
+    __block id objectForKey = nil;
     dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self objectForKey:key block:^(TMCache *cache, NSString *key, id object) {
+    [self objectForKey:key loader:loader block:^(TMCache *cache, NSString *key, id object) {
         objectForKey = object;
         dispatch_semaphore_signal(semaphore);
     }];
@@ -314,72 +1071,162 @@ NSString * const TMCacheSharedName = @"TMCacheShared";
 }
 
 - (void)setObject:(id <NSCoding>)object forKey:(NSString *)key
+{
+    [self setObject:object forKey:key ttl:0.0];
+}
+
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl
 {
     if (!object || !key)
         return;
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self setObject:object forKey:key block:^(TMCache *cache, NSString *key, id object) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    [self invalidateReadsForKeys:@[ key ]];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [_memoryCache setObject:object forKey:key withCost:0 ttl:ttl];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [self lock];
+    BOOL writtenBehind = NO;
+    if (ttl > 0.0)
+        [self forgetUnflushedObjectForKey:key];
+    else
+        writtenBehind = [self writeBehindObject:object forKey:key];
+    [self unlock];
+
+    if (!writtenBehind)
+        [_diskCache setObject:object forKey:key ttl:ttl];
+
+    [_statistics addCount:1 toCounter:TMCacheStatisticsCounterWrites];
 }
 
 - (void)removeObjectForKey:(NSString *)key
 {
     if (!key)
         return;
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self removeObjectForKey:key block:^(TMCache *cache, NSString *key, id object) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    [self invalidateReadsForKeys:@[ key ]];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [_memoryCache removeObjectForKey:key];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [self lock];
+    [self forgetUnflushedObjectForKey:key];
+    [self unlock];
+
+    [_diskCache removeObjectForKey:key];
+
+    [_statistics addCount:1 toCounter:TMCacheStatisticsCounterRemovals];
 }
 
-- (void)trimToDate:(NSDate *)date
+- (NSDictionary *)objectsForKeys:(NSArray *)keys
 {
-    if (!date)
+    if (!keys)
+        return nil;
+
+    uint64_t startTime = TMCacheStatisticsTime();
+    NSMutableDictionary *objects = [[_memoryCache objectsForKeys:keys] mutableCopy];
+    NSMutableArray *missingKeys = [[NSMutableArray alloc] init];
+
+    for (NSString *key in keys) {
+        if (![objects objectForKey:key])
+            [missingKeys addObject:key];
+    }
+
+    [self recordAccessForKeys:[objects allKeys]];
+
+    NSDictionary *unflushedObjects = [self unflushedObjectsForKeys:missingKeys];
+    [missingKeys removeObjectsInArray:[unflushedObjects allKeys]];
+    [self removeKeysMissingFromDisk:missingKeys];
+
+    NSDictionary *diskObjects = [missingKeys count] ? [_diskCache objectsForKeys:missingKeys] : nil;
+
+    NSMutableDictionary *loadedObjects = [unflushedObjects mutableCopy];
+    [loadedObjects addEntriesFromDictionary:diskObjects];
+
+    if ([unflushedObjects count])
+        [_memoryCache setObjects:[unflushedObjects allValues] forKeys:[unflushedObjects allKeys]];
+
+    [self setMemoryObjectsFromDisk:diskObjects];
+    [objects addEntriesFromDictionary:loadedObjects];
+
+    [self recordReadOfKeys:keys objects:objects startTime:startTime];
+
+    return objects;
+}
+
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys
+{
+    if (!objects || !keys || [objects count] != [keys count])
         return;
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self trimToDate:date block:^(TMCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    [self invalidateReadsForKeys:keys];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [_memoryCache setObjects:objects forKeys:keys];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    NSMutableArray *writtenThroughObjects = [[NSMutableArray alloc] init];
+    NSMutableArray *writtenThroughKeys = [[NSMutableArray alloc] init];
+
+    [self lock];
+
+    for (NSUInteger i = 0; i < [keys count]; i++) {
+        if (![self writeBehindObject:[objects objectAtIndex:i] forKey:[keys objectAtIndex:i]]) {
+            [writtenThroughObjects addObject:[objects objectAtIndex:i]];
+            [writtenThroughKeys addObject:[keys objectAtIndex:i]];
+        }
+    }
+
+    [self unlock];
+
+    if ([writtenThroughKeys count])
+        [_diskCache setObjects:writtenThroughObjects forKeys:writtenThroughKeys];
+
+    [_statistics addCount:[keys count] toCounter:TMCacheStatisticsCounterWrites];
+}
+
+- (void)removeObjectsForKeys:(NSArray *)keys
+{
+    if (!keys)
+        return;
+
+    [self invalidateReadsForKeys:keys];
+
+    [_memoryCache removeObjectsForKeys:keys];
+
+    [self lock];
+    for (NSString *key in keys)
+        [self forgetUnflushedObjectForKey:key];
+    [self unlock];
+
+    [_diskCache removeObjectsForKeys:keys];
+    [_statistics addCount:[keys count] toCounter:TMCacheStatisticsCounterRemovals];
+}
+
+- (void)trimToDate:(NSDate *)date
+{
+    if (!date)
+        return;
+
+    [_memoryCache trimToDate:date];
+    [_diskCache trimToDate:date];
 }
 
 - (void)removeAllObjects
 {
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    [self invalidateReadsForKeys:nil];
 
-    [self removeAllObjects:^(TMCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    [_memoryCache removeAllObjects];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [self lock];
+    [_dirtyObjects removeAllObjects];
+    [_flushingObjects removeAllObjects];
+    [self unlock];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [_diskCache removeAllObjects];
+}
+
+- (void)flush
+{
+    [self flushDirtyObjects];
+
+    dispatch_group_wait(_flushGroup, DISPATCH_TIME_FOREVER);
 }
 
 @end
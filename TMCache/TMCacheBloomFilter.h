@@ -0,0 +1,63 @@
+/**
+ Private to `TMDiskCache`. A counting Bloom filter over the keys of a cache, so that a key the cache never stored
+ can be turned away without going to disk.
+
+ Every key sets four 4-bit counters picked by hashing it, and removing it clears them again. A key is only
+ reported as contained if all four of its counters are set, so a key that was added and not removed is always
+ found. A key that was not added is found anyway now and then, about one time in 40 while no more keys are added
+ than the filter was created for. Past that the rate goes up, the cache creates a larger filter then. A counter
+ that would overflow sticks at its maximum and is never cleared, which can only cause more false positives.
+
+ The filter does no locking, the cache guards it with its own lock.
+ */
+
+#import <Foundation/Foundation.h>
+
+@interface TMCacheBloomFilter : NSObject
+
+/**
+ The number of keys added and not removed since.
+ */
+@property (readonly) NSUInteger count;
+
+/**
+ The number of keys the filter was sized for.
+ */
+@property (readonly) NSUInteger capacity;
+
+/**
+ Creates an empty filter.
+
+ @param capacity The number of keys expected. The filter takes four bytes per key.
+ @result A new filter.
+ */
+- (instancetype)initWithCapacity:(NSUInteger)capacity;
+
+/**
+ Adds a key. Adding a key twice takes removing it twice.
+
+ @param key The key.
+ */
+- (void)addKey:(NSString *)key;
+
+/**
+ Removes a key that was added before. Removing a key that wasn't added corrupts the filter.
+
+ @param key The key.
+ */
+- (void)removeKey:(NSString *)key;
+
+/**
+ Removes all keys.
+ */
+- (void)removeAllKeys;
+
+/**
+ Tests whether a key may have been added.
+
+ @param key The key.
+ @result `NO` if the key was definitely not added, `YES` if it probably was.
+ */
+- (BOOL)containsKey:(NSString *)key;
+
+@end
@@ -0,0 +1,150 @@
+#import "TMCacheBloomFilter.h"
+
+#define TMCacheBloomFilterHashCount 4
+#define TMCacheBloomFilterCountersPerKey 8
+#define TMCacheBloomFilterMinimumCounterCount 1024
+#define TMCacheBloomFilterCounterMaximum 15
+
+// FNV-1a over the UTF-8 bytes of the key, finished with the MurmurHash3 mixer so both halves are usable.
+static uint64_t TMCacheBloomFilterHash(NSString *key)
+{
+    const unsigned char *bytes = (const unsigned char *)[key UTF8String];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; bytes && *bytes; bytes++) {
+        hash ^= *bytes;
+        hash *= 0x100000001b3ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+@implementation TMCacheBloomFilter {
+    uint8_t *_counters; // two counters per byte, the even one in the low nibble
+    NSUInteger _counterMask;
+}
+
+#pragma mark - Initialization -
+
+- (void)dealloc
+{
+    free(_counters);
+}
+
+- (instancetype)init
+{
+    return [self initWithCapacity:0];
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity
+{
+    if (self = [super init]) {
+        NSUInteger counterCount = TMCacheBloomFilterMinimumCounterCount;
+        while (counterCount < capacity * TMCacheBloomFilterCountersPerKey)
+            counterCount <<= 1;
+
+        _counters = calloc(counterCount / 2, sizeof(uint8_t));
+        if (!_counters)
+            return nil;
+
+        _counterMask = counterCount - 1;
+        _capacity = counterCount / TMCacheBloomFilterCountersPerKey;
+        _count = 0;
+    }
+    return self;
+}
+
+#pragma mark - Private Methods -
+
+// Double hashing, the probes are h1, h1 + h2, h1 + 2 * h2... An odd step visits distinct counters.
+- (void)getCounterIndexes:(NSUInteger *)indexes forKey:(NSString *)key
+{
+    uint64_t hash = TMCacheBloomFilterHash(key);
+    NSUInteger index = (NSUInteger)(hash & 0xffffffff);
+    NSUInteger step = (NSUInteger)(hash >> 32) | 1;
+
+    for (NSUInteger i = 0; i < TMCacheBloomFilterHashCount; i++) {
+        indexes[i] = index & _counterMask;
+        index += step;
+    }
+}
+
+- (NSUInteger)counterAtIndex:(NSUInteger)index
+{
+    uint8_t byte = _counters[index >> 1];
+    return (index & 1) ? byte >> 4 : byte & 0x0f;
+}
+
+- (void)setCounter:(NSUInteger)value atIndex:(NSUInteger)index
+{
+    uint8_t *byte = &_counters[index >> 1];
+    *byte = (index & 1) ? (uint8_t)((*byte & 0x0f) | (value << 4)) : (uint8_t)((*byte & 0xf0) | value);
+}
+
+#pragma mark - Public Methods -
+
+- (void)addKey:(NSString *)key
+{
+    if (!key)
+        return;
+
+    NSUInteger indexes[TMCacheBloomFilterHashCount];
+    [self getCounterIndexes:indexes forKey:key];
+
+    for (NSUInteger i = 0; i < TMCacheBloomFilterHashCount; i++) {
+        NSUInteger value = [self counterAtIndex:indexes[i]];
+        if (value < TMCacheBloomFilterCounterMaximum)
+            [self setCounter:value + 1 atIndex:indexes[i]];
+    }
+
+    _count++;
+}
+
+- (void)removeKey:(NSString *)key
+{
+    if (!key)
+        return;
+
+    NSUInteger indexes[TMCacheBloomFilterHashCount];
+    [self getCounterIndexes:indexes forKey:key];
+
+    // a saturated counter has lost track of how many keys share it, it has to stay set
+    for (NSUInteger i = 0; i < TMCacheBloomFilterHashCount; i++) {
+        NSUInteger value = [self counterAtIndex:indexes[i]];
+        if (value > 0 && value < TMCacheBloomFilterCounterMaximum)
+            [self setCounter:value - 1 atIndex:indexes[i]];
+    }
+
+    if (_count > 0)
+        _count--;
+}
+
+- (void)removeAllKeys
+{
+    memset(_counters, 0, (_counterMask + 1) / 2);
+    _count = 0;
+}
+
+- (BOOL)containsKey:(NSString *)key
+{
+    if (!key)
+        return NO;
+
+    NSUInteger indexes[TMCacheBloomFilterHashCount];
+    [self getCounterIndexes:indexes forKey:key];
+
+    for (NSUInteger i = 0; i < TMCacheBloomFilterHashCount; i++) {
+        if ([self counterAtIndex:indexes[i]] == 0)
+            return NO;
+    }
+
+    return YES;
+}
+
+@end
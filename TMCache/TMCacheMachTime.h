@@ -0,0 +1,34 @@
+/**
+ Private to TMCache. `mach_absolute_time()` and `mach_timebase_info()` where there is no Mach, so the caches
+ build with GNUstep and libdispatch on Linux. The clock is `CLOCK_MONOTONIC` and already counts nanoseconds.
+ */
+
+#if __APPLE__
+
+#import <mach/mach_time.h>
+
+#else
+
+#import <stdint.h>
+#import <time.h>
+
+typedef struct {
+    uint32_t numer;
+    uint32_t denom;
+} mach_timebase_info_data_t;
+
+static inline uint64_t mach_absolute_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static inline int mach_timebase_info(mach_timebase_info_data_t *info)
+{
+    info->numer = 1;
+    info->denom = 1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ `TMCacheSerializer` turns objects into the bytes <TMDiskCache> stores on disk and back. A cache writes every
+ object with its <[TMDiskCache serializer]> and records the <serializerID> in a small header in front of the
+ bytes, so entries can always be read back by the serializer that wrote them, no matter how the cache is
+ configured later. Objects a serializer can't handle are stored with <TMCacheKeyedArchiveSerializer>.
+
+ Three serializers are included:
+
+ - <TMCacheKeyedArchiveSerializer> handles any object conforming to `NSCoding`. It is the default.
+ - <TMCachePropertyListSerializer> handles strings, numbers, dates, data, arrays and dictionaries in a compact
+   binary format that is much faster to read and write than a keyed archive and stores no class names or keys.
+ - <TMCacheDataSerializer> handles `NSData` and stores it as it is.
+ */
+
+#import <Foundation/Foundation.h>
+
+@protocol TMCacheSerializer <NSObject>
+
+/**
+ Identifies the serializer in the header of every entry it writes, so it must never change. Values below
+ `16` are reserved for the serializers included with TMCache.
+ */
+@property (readonly) uint8_t serializerID;
+
+/**
+ Encodes the object.
+
+ @param object The object to encode.
+ @result The encoded bytes, or `nil` if this serializer can't encode the object.
+ */
+- (NSData *)dataWithObject:(id <NSCoding>)object;
+
+/**
+ Decodes bytes written by <dataWithObject:>.
+
+ @param data The encoded bytes.
+ @result The decoded object, or `nil` if the data is malformed.
+ */
+- (id <NSCoding>)objectWithData:(NSData *)data;
+
+@end
+
+/**
+ Encodes objects with `NSKeyedArchiver`.
+ */
+@interface TMCacheKeyedArchiveSerializer : NSObject <TMCacheSerializer>
+@end
+
+/**
+ A compact binary encoding of property list types: `NSString`, `NSNumber`, `NSDate`, `NSData`, `NSArray`
+ and `NSDictionary`, as well as `NSNull`. Containers are decoded as mutable instances.
+ */
+@interface TMCachePropertyListSerializer : NSObject <TMCacheSerializer>
+@end
+
+/**
+ Stores `NSData` objects as they are.
+ */
+@interface TMCacheDataSerializer : NSObject <TMCacheSerializer>
+@end
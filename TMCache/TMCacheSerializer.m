@@ -0,0 +1,305 @@
+#import "TMCacheSerializer.h"
+
+typedef NS_ENUM(uint8_t, TMCacheSerializerIdentifier) {
+    TMCacheSerializerIdentifierKeyedArchive = 1,
+    TMCacheSerializerIdentifierPropertyList = 2,
+    TMCacheSerializerIdentifierData = 3
+};
+
+@implementation TMCacheKeyedArchiveSerializer
+
+- (uint8_t)serializerID
+{
+    return TMCacheSerializerIdentifierKeyedArchive;
+}
+
+- (NSData *)dataWithObject:(id <NSCoding>)object
+{
+    return [NSKeyedArchiver archivedDataWithRootObject:object];
+}
+
+- (id <NSCoding>)objectWithData:(NSData *)data
+{
+    @try {
+        return [NSKeyedUnarchiver unarchiveObjectWithData:data];
+    }
+    @catch (NSException *exception) {
+        return nil;
+    }
+}
+
+@end
+
+#pragma mark -
+
+// Every value is a tag followed by its payload. Lengths and integers are varints, integers zigzag encoded.
+typedef NS_ENUM(uint8_t, TMCachePropertyListTag) {
+    TMCachePropertyListTagString = 1,
+    TMCachePropertyListTagData,
+    TMCachePropertyListTagInteger,
+    TMCachePropertyListTagUnsignedInteger,
+    TMCachePropertyListTagDouble,
+    TMCachePropertyListTagTrue,
+    TMCachePropertyListTagFalse,
+    TMCachePropertyListTagDate,
+    TMCachePropertyListTagArray,
+    TMCachePropertyListTagDictionary,
+    TMCachePropertyListTagNull
+};
+
+static const NSUInteger TMCachePropertyListMaximumDepth = 512;
+
+typedef struct {
+    const uint8_t *bytes;
+    NSUInteger length;
+    NSUInteger offset;
+} TMCachePropertyListReader;
+
+static void TMCachePropertyListWriteVarint(NSMutableData *data, uint64_t value)
+{
+    uint8_t buffer[10];
+    NSUInteger length = 0;
+
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        buffer[length++] = value ? (byte | 0x80) : byte;
+    } while (value);
+
+    [data appendBytes:buffer length:length];
+}
+
+static BOOL TMCachePropertyListReadVarint(TMCachePropertyListReader *reader, uint64_t *value)
+{
+    uint64_t result = 0;
+
+    for (NSUInteger shift = 0; shift < 64; shift += 7) {
+        if (reader->offset >= reader->length)
+            return NO;
+
+        uint8_t byte = reader->bytes[reader->offset++];
+        result |= (uint64_t)(byte & 0x7f) << shift;
+
+        if (!(byte & 0x80)) {
+            *value = result;
+            return YES;
+        }
+    }
+
+    return NO;
+}
+
+static void TMCachePropertyListWriteTag(NSMutableData *data, TMCachePropertyListTag tag)
+{
+    [data appendBytes:&tag length:1];
+}
+
+static void TMCachePropertyListWriteDouble(NSMutableData *data, double value)
+{
+    [data appendBytes:&value length:sizeof(value)];
+}
+
+static BOOL TMCachePropertyListReadDouble(TMCachePropertyListReader *reader, double *value)
+{
+    if (reader->length - reader->offset < sizeof(double))
+        return NO;
+
+    memcpy(value, reader->bytes + reader->offset, sizeof(double));
+    reader->offset += sizeof(double);
+    return YES;
+}
+
+static BOOL TMCachePropertyListWriteObject(NSMutableData *data, id object, NSUInteger depth)
+{
+    if (depth > TMCachePropertyListMaximumDepth)
+        return NO;
+
+    if ([object isKindOfClass:[NSString class]]) {
+        NSData *string = [object dataUsingEncoding:NSUTF8StringEncoding];
+        TMCachePropertyListWriteTag(data, TMCachePropertyListTagString);
+        TMCachePropertyListWriteVarint(data, [string length]);
+        [data appendData:string];
+    } else if ([object isKindOfClass:[NSNumber class]]) {
+        CFNumberRef number = (__bridge CFNumberRef)object;
+
+        if (CFGetTypeID(number) == CFBooleanGetTypeID()) {
+            TMCachePropertyListWriteTag(data, [object boolValue] ? TMCachePropertyListTagTrue : TMCachePropertyListTagFalse);
+        } else if (CFNumberIsFloatType(number)) {
+            TMCachePropertyListWriteTag(data, TMCachePropertyListTagDouble);
+            TMCachePropertyListWriteDouble(data, [object doubleValue]);
+        } else if (strcmp([object objCType], @encode(unsigned long long)) == 0 && [object unsignedLongLongValue] > INT64_MAX) {
+            TMCachePropertyListWriteTag(data, TMCachePropertyListTagUnsignedInteger);
+            TMCachePropertyListWriteVarint(data, [object unsignedLongLongValue]);
+        } else {
+            int64_t value = [object longLongValue];
+            TMCachePropertyListWriteTag(data, TMCachePropertyListTagInteger);
+            TMCachePropertyListWriteVarint(data, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+        }
+    } else if ([object isKindOfClass:[NSData class]]) {
+        TMCachePropertyListWriteTag(data, TMCachePropertyListTagData);
+        TMCachePropertyListWriteVarint(data, [object length]);
+        [data appendData:object];
+    } else if ([object isKindOfClass:[NSDate class]]) {
+        TMCachePropertyListWriteTag(data, TMCachePropertyListTagDate);
+        TMCachePropertyListWriteDouble(data, [object timeIntervalSinceReferenceDate]);
+    } else if ([object isKindOfClass:[NSArray class]]) {
+        TMCachePropertyListWriteTag(data, TMCachePropertyListTagArray);
+        TMCachePropertyListWriteVarint(data, [object count]);
+
+        for (id element in object) {
+            if (!TMCachePropertyListWriteObject(data, element, depth + 1))
+                return NO;
+        }
+    } else if ([object isKindOfClass:[NSDictionary class]]) {
+        TMCachePropertyListWriteTag(data, TMCachePropertyListTagDictionary);
+        TMCachePropertyListWriteVarint(data, [object count]);
+
+        for (id key in object) {
+            if (!TMCachePropertyListWriteObject(data, key, depth + 1)
+                || !TMCachePropertyListWriteObject(data, [object objectForKey:key], depth + 1))
+                return NO;
+        }
+    } else if ([object isKindOfClass:[NSNull class]]) {
+        TMCachePropertyListWriteTag(data, TMCachePropertyListTagNull);
+    } else {
+        return NO;
+    }
+
+    return YES;
+}
+
+static id TMCachePropertyListReadObject(TMCachePropertyListReader *reader, NSUInteger depth)
+{
+    if (depth > TMCachePropertyListMaximumDepth || reader->offset >= reader->length)
+        return nil;
+
+    uint8_t tag = reader->bytes[reader->offset++];
+    uint64_t value = 0;
+    double doubleValue = 0.0;
+
+    switch (tag) {
+        case TMCachePropertyListTagString:
+        case TMCachePropertyListTagData: {
+            if (!TMCachePropertyListReadVarint(reader, &value) || value > reader->length - reader->offset)
+                return nil;
+
+            const uint8_t *bytes = reader->bytes + reader->offset;
+            reader->offset += (NSUInteger)value;
+
+            if (tag == TMCachePropertyListTagData)
+                return [[NSData alloc] initWithBytes:bytes length:(NSUInteger)value];
+
+            return [[NSString alloc] initWithBytes:bytes length:(NSUInteger)value encoding:NSUTF8StringEncoding];
+        }
+        case TMCachePropertyListTagInteger:
+            if (!TMCachePropertyListReadVarint(reader, &value))
+                return nil;
+            return @((int64_t)(value >> 1) ^ -(int64_t)(value & 1));
+        case TMCachePropertyListTagUnsignedInteger:
+            if (!TMCachePropertyListReadVarint(reader, &value))
+                return nil;
+            return @(value);
+        case TMCachePropertyListTagDouble:
+            if (!TMCachePropertyListReadDouble(reader, &doubleValue))
+                return nil;
+            return @(doubleValue);
+        case TMCachePropertyListTagTrue:
+            return @YES;
+        case TMCachePropertyListTagFalse:
+            return @NO;
+        case TMCachePropertyListTagDate:
+            if (!TMCachePropertyListReadDouble(reader, &doubleValue))
+                return nil;
+            return [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:doubleValue];
+        case TMCachePropertyListTagArray: {
+            // every element takes at least one byte, which bounds the count of a malformed array
+            if (!TMCachePropertyListReadVarint(reader, &value) || value > reader->length - reader->offset)
+                return nil;
+
+            NSMutableArray *array = [[NSMutableArray alloc] initWithCapacity:(NSUInteger)value];
+
+            for (uint64_t i = 0; i < value; i++) {
+                id element = TMCachePropertyListReadObject(reader, depth + 1);
+                if (!element)
+                    return nil;
+                [array addObject:element];
+            }
+
+            return array;
+        }
+        case TMCachePropertyListTagDictionary: {
+            if (!TMCachePropertyListReadVarint(reader, &value) || value > (reader->length - reader->offset) / 2)
+                return nil;
+
+            NSMutableDictionary *dictionary = [[NSMutableDictionary alloc] initWithCapacity:(NSUInteger)value];
+
+            for (uint64_t i = 0; i < value; i++) {
+                id key = TMCachePropertyListReadObject(reader, depth + 1);
+                id object = key ? TMCachePropertyListReadObject(reader, depth + 1) : nil;
+                if (!object || ![key conformsToProtocol:@protocol(NSCopying)])
+                    return nil;
+                [dictionary setObject:object forKey:key];
+            }
+
+            return dictionary;
+        }
+        case TMCachePropertyListTagNull:
+            return [NSNull null];
+        default:
+            return nil;
+    }
+}
+
+@implementation TMCachePropertyListSerializer
+
+- (uint8_t)serializerID
+{
+    return TMCacheSerializerIdentifierPropertyList;
+}
+
+- (NSData *)dataWithObject:(id <NSCoding>)object
+{
+    NSMutableData *data = [[NSMutableData alloc] init];
+
+    if (!TMCachePropertyListWriteObject(data, object, 0))
+        return nil;
+
+    return data;
+}
+
+- (id <NSCoding>)objectWithData:(NSData *)data
+{
+    TMCachePropertyListReader reader = { [data bytes], [data length], 0 };
+    id object = TMCachePropertyListReadObject(&reader, 0);
+
+    if (reader.offset != reader.length)
+        return nil;
+
+    return object;
+}
+
+@end
+
+#pragma mark -
+
+@implementation TMCacheDataSerializer
+
+- (uint8_t)serializerID
+{
+    return TMCacheSerializerIdentifierData;
+}
+
+- (NSData *)dataWithObject:(id <NSCoding>)object
+{
+    if (![(id)object isKindOfClass:[NSData class]])
+        return nil;
+
+    return (NSData *)object;
+}
+
+- (id <NSCoding>)objectWithData:(NSData *)data
+{
+    return data;
+}
+
+@end
@@ -0,0 +1,100 @@
+/**
+ `TMCacheStatistics` counts what a cache does and how long it takes. Every <TMMemoryCache>, <TMDiskCache> and
+ <TMCache> keeps one in its `statistics` property and records every operation into it, always.
+
+ Recording is meant to be cheap enough for the hottest path of the memory cache: each thread adds to one of a
+ few stripes of counters with a single atomic add, so threads don't fight over a shared counter or lock. Reading
+ adds the stripes up, which makes a <snapshot> much slower than recording, but it is only done now and then.
+
+ Latencies are kept as histograms with logarithmic buckets. Bucket `0` counts operations that took no measurable
+ time, bucket `i` those that took from 2^(i-1) up to 2^i nanoseconds, and the last bucket everything longer.
+ */
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSUInteger, TMCacheStatisticsCounter) {
+    /** Reads that found an object. */
+    TMCacheStatisticsCounterHits,
+    /** Reads that found nothing. */
+    TMCacheStatisticsCounterMisses,
+    /** Objects set. */
+    TMCacheStatisticsCounterWrites,
+    /** Objects removed, whether by key or by trimming. Removing all objects at once isn't counted. */
+    TMCacheStatisticsCounterRemovals,
+    /** Objects removed by trimming, to stay within a limit or because they were too old. */
+    TMCacheStatisticsCounterEvictions,
+    /** Bytes read from disk. */
+    TMCacheStatisticsCounterBytesRead,
+    /** Bytes written to disk. */
+    TMCacheStatisticsCounterBytesWritten,
+    TMCacheStatisticsCounterCount
+};
+
+typedef NS_ENUM(NSUInteger, TMCacheStatisticsOperation) {
+    /** Reading one object, or a batch of objects. */
+    TMCacheStatisticsOperationRead,
+    /** Writing one object, or a batch of objects. */
+    TMCacheStatisticsOperationWrite,
+    /** Removing one object, or a batch of objects. */
+    TMCacheStatisticsOperationRemove,
+    /** Time an operation spent waiting for its queue before it started. */
+    TMCacheStatisticsOperationQueueWait,
+    TMCacheStatisticsOperationCount
+};
+
+#define TMCacheStatisticsLatencyBucketCount 32
+
+/**
+ A copy of the statistics at one point in time, plain data that can be stored or sent anywhere.
+ */
+typedef struct {
+    uint64_t counters[TMCacheStatisticsCounterCount];
+    uint64_t latencies[TMCacheStatisticsOperationCount][TMCacheStatisticsLatencyBucketCount];
+} TMCacheStatisticsSnapshot;
+
+/**
+ The current time in the units <[TMCacheStatistics recordLatencySinceTime:forOperation:]> expects.
+ */
+uint64_t TMCacheStatisticsTime(void);
+
+/**
+ Converts a snapshot into a dictionary of `NSNumber` counters keyed by `hits`, `misses`, `writes`, `removals`,
+ `evictions`, `bytesRead` and `bytesWritten`, and a `latencies` dictionary holding an array of bucket counts
+ for each of `read`, `write`, `remove` and `queueWait`. Ready to be serialized as JSON or a property list.
+ */
+NSDictionary *TMCacheStatisticsDictionary(TMCacheStatisticsSnapshot snapshot);
+
+@interface TMCacheStatistics : NSObject
+
+/**
+ Adds up the statistics recorded so far. Operations recorded while the snapshot is taken may or may not be in it.
+
+ @result A snapshot of the statistics.
+ */
+- (TMCacheStatisticsSnapshot)snapshot;
+
+/**
+ Like <snapshot>, but sets the statistics back to zero at the same time, without losing operations recorded
+ in between. Useful to report statistics in intervals.
+
+ @result A snapshot of the statistics up to now.
+ */
+- (TMCacheStatisticsSnapshot)snapshotAndReset;
+
+/**
+ Adds to a counter. Called by the caches, but can be used to record statistics of your own.
+
+ @param count The number to add.
+ @param counter The counter to add to.
+ */
+- (void)addCount:(uint64_t)count toCounter:(TMCacheStatisticsCounter)counter;
+
+/**
+ Adds the time since a start time to the latency histogram of an operation.
+
+ @param startTime The time the operation started, as returned by `TMCacheStatisticsTime()`.
+ @param operation The operation that took the time.
+ */
+- (void)recordLatencySinceTime:(uint64_t)startTime forOperation:(TMCacheStatisticsOperation)operation;
+
+@end
@@ -0,0 +1,119 @@
+#import "TMCacheStatistics.h"
+
+#import "TMCacheMachTime.h"
+#import <pthread.h>
+
+#define TMCacheStatisticsStripeCount 8
+
+typedef struct {
+    uint64_t counters[TMCacheStatisticsCounterCount];
+    uint64_t latencies[TMCacheStatisticsOperationCount][TMCacheStatisticsLatencyBucketCount];
+} TMCacheStatisticsStripe;
+
+uint64_t TMCacheStatisticsTime(void)
+{
+    return mach_absolute_time();
+}
+
+static uint64_t TMCacheStatisticsNanoseconds(uint64_t ticks)
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t predicate;
+
+    dispatch_once(&predicate, ^{
+        mach_timebase_info(&timebase);
+    });
+
+    if (timebase.numer == timebase.denom)
+        return ticks;
+
+    return (uint64_t)((double)ticks * timebase.numer / timebase.denom);
+}
+
+// Threads are spread over the stripes by a hash of their identity, so the same thread always uses the same one.
+static inline NSUInteger TMCacheStatisticsStripeIndex(void)
+{
+    uint64_t thread = (uint64_t)(uintptr_t)pthread_self();
+    return (NSUInteger)((thread * 0x9E3779B97F4A7C15ULL) >> 61) & (TMCacheStatisticsStripeCount - 1);
+}
+
+NSDictionary *TMCacheStatisticsDictionary(TMCacheStatisticsSnapshot snapshot)
+{
+    NSArray *counterNames = @[ @"hits", @"misses", @"writes", @"removals", @"evictions", @"bytesRead", @"bytesWritten" ];
+    NSArray *operationNames = @[ @"read", @"write", @"remove", @"queueWait" ];
+
+    NSMutableDictionary *dictionary = [[NSMutableDictionary alloc] init];
+    NSMutableDictionary *latencies = [[NSMutableDictionary alloc] init];
+
+    for (NSUInteger counter = 0; counter < TMCacheStatisticsCounterCount; counter++)
+        [dictionary setObject:@(snapshot.counters[counter]) forKey:[counterNames objectAtIndex:counter]];
+
+    for (NSUInteger operation = 0; operation < TMCacheStatisticsOperationCount; operation++) {
+        NSMutableArray *buckets = [[NSMutableArray alloc] initWithCapacity:TMCacheStatisticsLatencyBucketCount];
+
+        for (NSUInteger bucket = 0; bucket < TMCacheStatisticsLatencyBucketCount; bucket++)
+            [buckets addObject:@(snapshot.latencies[operation][bucket])];
+
+        [latencies setObject:buckets forKey:[operationNames objectAtIndex:operation]];
+    }
+
+    [dictionary setObject:latencies forKey:@"latencies"];
+
+    return dictionary;
+}
+
+@implementation TMCacheStatistics {
+    TMCacheStatisticsStripe _stripes[TMCacheStatisticsStripeCount];
+}
+
+- (TMCacheStatisticsSnapshot)snapshotResetting:(BOOL)reset
+{
+    TMCacheStatisticsSnapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+
+    for (NSUInteger i = 0; i < TMCacheStatisticsStripeCount; i++) {
+        uint64_t *cells = (uint64_t *)&_stripes[i];
+        uint64_t *totals = (uint64_t *)&snapshot;
+
+        // both are laid out the same, counters first, then the histograms
+        for (NSUInteger cell = 0; cell < sizeof(TMCacheStatisticsStripe) / sizeof(uint64_t); cell++)
+            totals[cell] += reset ? __sync_fetch_and_and(&cells[cell], 0) : __sync_fetch_and_add(&cells[cell], 0);
+    }
+
+    return snapshot;
+}
+
+- (TMCacheStatisticsSnapshot)snapshot
+{
+    return [self snapshotResetting:NO];
+}
+
+- (TMCacheStatisticsSnapshot)snapshotAndReset
+{
+    return [self snapshotResetting:YES];
+}
+
+- (void)addCount:(uint64_t)count toCounter:(TMCacheStatisticsCounter)counter
+{
+    if (count == 0 || counter >= TMCacheStatisticsCounterCount)
+        return;
+
+    __sync_fetch_and_add(&_stripes[TMCacheStatisticsStripeIndex()].counters[counter], count);
+}
+
+- (void)recordLatencySinceTime:(uint64_t)startTime forOperation:(TMCacheStatisticsOperation)operation
+{
+    if (operation >= TMCacheStatisticsOperationCount)
+        return;
+
+    uint64_t now = mach_absolute_time();
+    uint64_t nanoseconds = now > startTime ? TMCacheStatisticsNanoseconds(now - startTime) : 0;
+
+    NSUInteger bucket = nanoseconds ? 64 - __builtin_clzll(nanoseconds) : 0;
+    if (bucket >= TMCacheStatisticsLatencyBucketCount)
+        bucket = TMCacheStatisticsLatencyBucketCount - 1;
+
+    __sync_fetch_and_add(&_stripes[TMCacheStatisticsStripeIndex()].latencies[operation][bucket], 1);
+}
+
+@end
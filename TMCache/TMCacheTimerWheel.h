@@ -0,0 +1,74 @@
+/**
+ Private to TMCache. Keeps track of when keys expire, so that an expiry sweep only touches the keys that are due
+ instead of looking at every key in the cache.
+
+ This is a hierarchical timer wheel: four levels of 64 slots, each slot of a level spanning all 64 slots of the
+ level below. A key goes into the finest level that reaches its expiration. Advancing the wheel walks the slots of
+ the finest level one tick at a time and, each time that level comes around, moves the keys of the next slot of
+ the level above down into it. Scheduling, cancelling and each tick are constant time, however many keys there
+ are. Keys expire on the first tick that starts at or after their expiration time, never early.
+
+ Times are seconds since the reference date, like `-[NSDate timeIntervalSinceReferenceDate]`. The wheel does no
+ locking, every cache guards it with the lock of whatever it is part of.
+ */
+
+#import <Foundation/Foundation.h>
+
+@interface TMCacheTimerWheel : NSObject
+
+/**
+ The number of keys scheduled.
+ */
+@property (readonly) NSUInteger count;
+
+/**
+ Creates an empty wheel.
+
+ @param resolution The length of a tick in seconds. Keys expire up to this much later than scheduled.
+ @result A new wheel.
+ */
+- (instancetype)initWithResolution:(NSTimeInterval)resolution;
+
+/**
+ Schedules a key to expire, replacing the time it was scheduled for before. A time in the past expires it on the
+ next tick.
+
+ @param time When the key expires, or `0` to cancel it.
+ @param key The key.
+ */
+- (void)setExpirationTime:(NSTimeInterval)time forKey:(NSString *)key;
+
+/**
+ Cancels a key.
+
+ @param key The key.
+ */
+- (void)removeKey:(NSString *)key;
+
+/**
+ Cancels all keys.
+ */
+- (void)removeAllKeys;
+
+/**
+ Advances the wheel through every tick that started by the given time.
+
+ @param time The current time.
+ @result The keys that expired on the way, no longer scheduled.
+ */
+- (NSArray *)advanceToTime:(NSTimeInterval)time;
+
+/**
+ The earliest time at which <advanceToTime:> could return keys. It may return none then, when keys only move down
+ a level, so call it again after every advance.
+
+ @result A time, or `0` if no key is scheduled.
+ */
+- (NSTimeInterval)nextAdvanceTime;
+
+@end
+
+/**
+ Converts a time in seconds since the reference date into a wall clock time for `dispatch_source_set_timer()`.
+ */
+dispatch_time_t TMCacheTimerWheelDispatchTime(NSTimeInterval time);
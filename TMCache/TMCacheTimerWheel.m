@@ -0,0 +1,215 @@
+#import "TMCacheTimerWheel.h"
+
+#define TMCacheTimerWheelLevelCount 4
+#define TMCacheTimerWheelSlotBits 6
+#define TMCacheTimerWheelSlotCount (1 << TMCacheTimerWheelSlotBits)
+#define TMCacheTimerWheelSlotMask (TMCacheTimerWheelSlotCount - 1)
+
+@interface TMCacheTimerWheelTimer : NSObject
+@property (assign, nonatomic) int64_t tick; // the first tick starting at or after the expiration time
+@property (assign, nonatomic) NSUInteger slot; // level * TMCacheTimerWheelSlotCount + index
+@end
+
+@implementation TMCacheTimerWheelTimer
+@end
+
+dispatch_time_t TMCacheTimerWheelDispatchTime(NSTimeInterval time)
+{
+    NSTimeInterval seconds = time + NSTimeIntervalSince1970;
+    if (seconds < 0.0)
+        seconds = 0.0;
+
+    struct timespec walltime;
+    walltime.tv_sec = (time_t)seconds;
+    walltime.tv_nsec = (long)((seconds - (NSTimeInterval)walltime.tv_sec) * NSEC_PER_SEC);
+
+    return dispatch_walltime(&walltime, 0);
+}
+
+@implementation TMCacheTimerWheel {
+    NSTimeInterval _resolution;
+    int64_t _currentTick; // the last tick advanced through
+    NSMutableDictionary *_timers;
+    __strong NSMutableSet *_slots[TMCacheTimerWheelLevelCount * TMCacheTimerWheelSlotCount];
+}
+
+#pragma mark - Initialization -
+
+- (instancetype)init
+{
+    return [self initWithResolution:1.0];
+}
+
+- (instancetype)initWithResolution:(NSTimeInterval)resolution
+{
+    if (self = [super init]) {
+        _resolution = resolution > 0.0 ? resolution : 1.0;
+        _currentTick = (int64_t)floor([NSDate timeIntervalSinceReferenceDate] / _resolution);
+        _timers = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+#pragma mark - Private Methods -
+
+// Ticks far enough ahead go into the coarsest level, clamped to its reach. They move down as it comes around.
+- (NSUInteger)slotForTick:(int64_t)tick
+{
+    int64_t delta = tick - _currentTick;
+
+    for (NSUInteger level = 0; level < TMCacheTimerWheelLevelCount; level++) {
+        NSUInteger shift = level * TMCacheTimerWheelSlotBits;
+
+        if (delta < ((int64_t)1 << (shift + TMCacheTimerWheelSlotBits)) || level == TMCacheTimerWheelLevelCount - 1) {
+            int64_t reach = ((int64_t)1 << (shift + TMCacheTimerWheelSlotBits)) - 1;
+            int64_t placedTick = delta > reach ? _currentTick + reach : tick;
+
+            return level * TMCacheTimerWheelSlotCount + (NSUInteger)((placedTick >> shift) & TMCacheTimerWheelSlotMask);
+        }
+    }
+
+    return 0;
+}
+
+- (void)insertKey:(NSString *)key timer:(TMCacheTimerWheelTimer *)timer
+{
+    timer.slot = [self slotForTick:timer.tick];
+
+    NSMutableSet *slot = _slots[timer.slot];
+    if (!slot) {
+        slot = [[NSMutableSet alloc] init];
+        _slots[timer.slot] = slot;
+    }
+
+    [slot addObject:key];
+}
+
+// Moves the keys of one slot down to the levels below, now that the wheel has come around to it.
+- (void)cascadeSlot:(NSUInteger)slotIndex
+{
+    NSMutableSet *slot = _slots[slotIndex];
+    if (![slot count])
+        return;
+
+    _slots[slotIndex] = nil;
+
+    for (NSString *key in slot)
+        [self insertKey:key timer:[_timers objectForKey:key]];
+}
+
+#pragma mark - Public Methods -
+
+- (NSUInteger)count
+{
+    return [_timers count];
+}
+
+- (void)setExpirationTime:(NSTimeInterval)time forKey:(NSString *)key
+{
+    if (!key)
+        return;
+
+    [self removeKey:key];
+
+    if (time <= 0.0)
+        return;
+
+    if ([_timers count] == 0) // nothing to advance through while the wheel was empty, catch up with the clock
+        _currentTick = MAX(_currentTick, (int64_t)floor([NSDate timeIntervalSinceReferenceDate] / _resolution));
+
+    TMCacheTimerWheelTimer *timer = [[TMCacheTimerWheelTimer alloc] init];
+    timer.tick = MAX((int64_t)ceil(time / _resolution), _currentTick + 1);
+
+    [_timers setObject:timer forKey:key];
+    [self insertKey:key timer:timer];
+}
+
+- (void)removeKey:(NSString *)key
+{
+    if (!key)
+        return;
+
+    TMCacheTimerWheelTimer *timer = [_timers objectForKey:key];
+    if (!timer)
+        return;
+
+    [_slots[timer.slot] removeObject:key];
+    [_timers removeObjectForKey:key];
+}
+
+- (void)removeAllKeys
+{
+    [_timers removeAllObjects];
+
+    for (NSUInteger i = 0; i < TMCacheTimerWheelLevelCount * TMCacheTimerWheelSlotCount; i++)
+        _slots[i] = nil;
+}
+
+- (NSArray *)advanceToTime:(NSTimeInterval)time
+{
+    int64_t targetTick = (int64_t)floor(time / _resolution);
+    NSMutableArray *expiredKeys = [[NSMutableArray alloc] init];
+
+    while (_currentTick < targetTick) {
+        if ([_timers count] == 0) {
+            _currentTick = targetTick;
+            break;
+        }
+
+        _currentTick++;
+
+        // each level comes around once the one below has, coarsest first so keys can fall through several levels
+        NSUInteger level = 1;
+        while (level < TMCacheTimerWheelLevelCount
+               && ((_currentTick >> ((level - 1) * TMCacheTimerWheelSlotBits)) & TMCacheTimerWheelSlotMask) == 0)
+            level++;
+
+        while (--level > 0) {
+            NSUInteger index = (NSUInteger)((_currentTick >> (level * TMCacheTimerWheelSlotBits)) & TMCacheTimerWheelSlotMask);
+            [self cascadeSlot:level * TMCacheTimerWheelSlotCount + index];
+        }
+
+        NSUInteger slotIndex = (NSUInteger)(_currentTick & TMCacheTimerWheelSlotMask);
+        NSMutableSet *slot = _slots[slotIndex];
+        if (![slot count])
+            continue;
+
+        _slots[slotIndex] = nil;
+
+        for (NSString *key in slot) {
+            [_timers removeObjectForKey:key];
+            [expiredKeys addObject:key];
+        }
+    }
+
+    return expiredKeys;
+}
+
+- (NSTimeInterval)nextAdvanceTime
+{
+    if ([_timers count] == 0)
+        return 0.0;
+
+    int64_t nextTick = INT64_MAX;
+
+    for (NSUInteger level = 0; level < TMCacheTimerWheelLevelCount; level++) {
+        NSUInteger shift = level * TMCacheTimerWheelSlotBits;
+        int64_t position = _currentTick >> shift;
+
+        for (int64_t i = 1; i <= TMCacheTimerWheelSlotCount; i++) {
+            NSUInteger index = (NSUInteger)((position + i) & TMCacheTimerWheelSlotMask);
+
+            if ([_slots[level * TMCacheTimerWheelSlotCount + index] count]) {
+                nextTick = MIN(nextTick, (position + i) << shift); // expires, or moves down a level
+                break;
+            }
+        }
+    }
+
+    if (nextTick == INT64_MAX)
+        return 0.0;
+
+    return nextTick * _resolution;
+}
+
+@end
@@ -1,35 +1,114 @@
 /**
  `TMDiskCache` is a thread safe key/value store backed by the file system. It accepts any object conforming
  to the `NSCoding` protocol, which includes the basic Foundation data types and collection classes and also
- many UIKit classes, notably `UIImage`. All work is performed on a serial queue shared by all instances in
- the app, and archiving is handled by `NSKeyedArchiver`. This is a particular advantage for `UIImage` because
- it skips `UIImagePNGRepresentation()` and retains information like scale and orientation.
+ many UIKit classes, notably `UIImage`. Each cache directory gets its own concurrent <queue>, and objects
+ are encoded by a configurable <serializer>, by default with `NSKeyedArchiver`. This is a particular advantage
+ for `UIImage` because it skips `UIImagePNGRepresentation()` and retains information like scale and orientation.
  
  The designated initializer for `TMDiskCache` is <initWithName:>. The <name> string is used to create a directory
  under Library/Caches that scopes disk access for any instance sharing this name. Multiple instances with the
- same name are allowed because all disk access is serialized on the <sharedQueue>. The <name> also appears in
- stack traces and return value for `description:`.
+ same name are allowed because they share the same <queue>. The <name> also appears in stack traces and return
+ value for `description:`.
  
+ Work on a single key is ordered on one of several serial queues that target the <queue>, so reads and writes
+ of different keys run in parallel while those of the same key never overlap. Work on the whole cache (trimming,
+ removing all objects, enumerating) runs as a barrier on the <queue> and waits for everything else.
+
  Unless otherwise noted, all properties and methods are safe to access from any thread at any time. All blocks
- will cause the queue to wait, making it safe to access and manipulate the actual cache files on disk for the
- duration of the block. In addition, the <sharedQueue> can be set to target an existing serial I/O queue, should
- your app already have one.
+ will cause the work for their key to wait, making it safe to access and manipulate the cache file for that key
+ for the duration of the block. In addition, the <queue> can be set to target an existing I/O queue, should your
+ app already have one.
  
  Because this cache is bound by disk I/O it can be much slower than <TMMemoryCache>, although values stored in
  `TMDiskCache` persist after application relaunch. Using <TMCache> is recommended over using `TMDiskCache`
  by itself, as it adds a fast layer of additional memory caching while still writing to disk.
 
- All access to the cache is dated so the that the least-used objects can be trimmed first. Setting an optional
- <ageLimit> will trigger a GCD timer to periodically to trim the cache with <trimToDate:>.
+ All access to the cache is dated so the that the least-used objects can be trimmed first. The date and size of
+ every object are kept in a hidden index in the cache directory, a snapshot plus a journal that changes are
+ appended to every few seconds, so opening a cache doesn't need to look at every file and reads never modify
+ them. A background pass after launch repairs the index if it missed files added or removed outside the cache,
+ or changes lost in a crash. Setting an optional <ageLimit> will trigger a GCD timer to periodically to trim
+ the cache with <trimToDate:>.
+
+ Objects can also be set with a time to live of their own (see <setObject:forKey:ttl:>), kept in the index along
+ with their dates. Once it is over the object reads as missing, and a timer wheel removes the files that are due
+ within a second or so, without looking at any other file.
  */
 
 #import <Foundation/Foundation.h>
 
+#import "TMCacheSerializer.h"
+
 @class TMDiskCache;
 @protocol TMCacheBackgroundTaskManager;
 
+/**
+ How a <TMDiskCache> names the files of objects that get a file of their own.
+ */
+typedef NS_ENUM(NSUInteger, TMDiskCacheFileLayout) {
+    /**
+     Each file is named after its key, percent-escaped, directly in the cache directory. Keys longer than the
+     file system allows for a name can't be stored. The default.
+     */
+    TMDiskCacheFileLayoutFlat = 0,
+    /**
+     Each file is named after a 128-bit hash of its key in 32 hex digits, two levels of directories down, such
+     as `3f/a2/3fa2...`. No directory holds more than 256 entries until there are millions of files, and keys of
+     any length can be stored. The key is kept in a header at the start of the file, which files written by
+     <setData:forKey:block:> get as well. <dataForKey:block:> leaves it out.
+     */
+    TMDiskCacheFileLayoutHashed = 1
+};
+
+/**
+ How hard a <TMDiskCache> works to make sure objects that get a file of their own are on disk once they are added.
+ */
+typedef NS_ENUM(NSUInteger, TMDiskCacheDurability) {
+    /**
+     Files are written atomically, but left for the file system to put on disk when it gets around to it. A crash
+     or power loss soon after may lose recent objects, or leave their files empty. The default.
+     */
+    TMDiskCacheDurabilityNone = 0,
+    /**
+     Files are written to a temporary file, synced and renamed into place, and their directory is synced. Objects
+     added within a couple of milliseconds of each other share one sync, so adding takes at least that long but
+     many concurrent writes cost about as much as one.
+     */
+    TMDiskCacheDurabilityGroupCommit = 1,
+    /**
+     Like `TMDiskCacheDurabilityGroupCommit`, but each file is synced on its own right away. Fastest for a single
+     write, slowest for many.
+     */
+    TMDiskCacheDurabilityImmediate = 2
+};
+
+/**
+ The system calls a <TMDiskCache> makes for objects that get a file of their own. All engines read and write the
+ same files, so instances with the same name may use different ones.
+ */
+typedef NS_ENUM(NSUInteger, TMDiskCacheIOEngineType) {
+    /**
+     `NSData` and `NSFileManager`: a write is `-[NSData writeToURL:atomically:]` followed by a lookup of the size
+     the file takes up, a read maps the file.
+     */
+    TMDiskCacheIOEngineFoundation = 0,
+    /**
+     A file descriptor per file: a write creates a temporary file, writes it, takes its size from the descriptor
+     and renames it into place, a read opens, sizes and maps one descriptor. Removing a file is one `unlink()`.
+     The default.
+     */
+    TMDiskCacheIOEnginePOSIX = 1,
+    /**
+     Like `TMDiskCacheIOEnginePOSIX`, but the files of a batch, such as the keys of <objectsForKeys:block:> that
+     share a queue, go to the kernel together through io_uring: a few system calls per batch rather than several
+     per file. Linux 5.11 and later only, elsewhere the cache uses `TMDiskCacheIOEnginePOSIX` instead.
+     */
+    TMDiskCacheIOEngineIOUring = 2
+};
+
 typedef void (^TMDiskCacheBlock)(TMDiskCache *cache);
 typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL);
+typedef void (^TMDiskCacheObjectsBlock)(TMDiskCache *cache, NSDictionary *objects);
 
 @interface TMDiskCache : NSObject
 
@@ -44,54 +123,132 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
 /**
  The URL of the directory used by this cache, usually `Library/Caches/com.tumblr.TMDiskCache.(name)`
  
- @warning Do not interact with files under this URL except on the <sharedQueue>.
+ @warning Do not interact with files under this URL except in a barrier block on the <queue>.
  */
 @property (readonly) NSURL *cacheURL;
 
+/**
+ How the files of this cache are named, set when it is created.
+ */
+@property (readonly) TMDiskCacheFileLayout fileLayout;
+
+/**
+ The system calls used for the files of this cache, set when it is created. `TMDiskCacheIOEnginePOSIX` if the one
+ asked for is not available.
+ */
+@property (readonly) TMDiskCacheIOEngineType ioEngine;
+
+/**
+ The concurrent queue this cache does its disk work on, shared by all instances with the same <name>. Blocks
+ submitted with `dispatch_barrier_async` have the cache directory to themselves. It is exposed here so that it
+ can be set to target some other queue.
+ */
+@property (readonly) dispatch_queue_t queue;
+
 /**
  The total number of bytes used on disk, as reported by `NSURLTotalFileAllocatedSizeKey`.
  
  @warning This property is technically safe to access from any thread, but it reflects the value *right now*,
- not taking into account any pending operations. In most cases this value should only be read from a block on the
- <sharedQueue>, which will ensure its accuracy and prevent it from changing during the lifetime of the block.
+ not taking into account any pending operations. Reading it never waits on disk work. When an exact value is
+ needed, read it from a barrier block on the <queue>, which prevents it from changing during the block.
  
  For example:
  
-    // some background thread, not a block already running on the shared queue
+    // some background thread, not a block already running on the cache's queue
 
-    dispatch_sync([TMDiskCache sharedQueue], ^{
-        NSLog(@"accurate, unchanging byte count: %d", [[TMDiskCache sharedCache] byteCount]);
+    TMDiskCache *cache = [TMDiskCache sharedCache];
+    dispatch_barrier_sync(cache.queue, ^{
+        NSLog(@"accurate, unchanging byte count: %d", [cache byteCount]);
     });
  */
 @property (readonly) NSUInteger byteCount;
 
 /**
  The maximum number of bytes allowed on disk. This value is checked every time an object is set, if the written
- size exceeds the limit a trim call is queued. Defaults to `0.0`, meaning no practical limit.
- 
- @warning Do not read this property on the <sharedQueue> (including asynchronous method blocks).
+ size exceeds the limit a background trimmer starts removing the least recently used objects, a few at a time so
+ writes and reads go on in between, until the cache is down to the <trimTargetByteCount>. Defaults to `0.0`,
+ meaning no practical limit.
  */
 @property (assign) NSUInteger byteLimit;
 
+/**
+ The size the background trimmer brings the cache down to once it has gone over the <byteLimit>. Trimming a bit
+ further than the limit leaves room for the next writes, so the trimmer doesn't start again on the next one.
+ Defaults to `0`, meaning 90% of the <byteLimit>.
+ */
+@property (assign) NSUInteger trimTargetByteCount;
+
+/**
+ A ceiling above the <byteLimit> that the cache should never go past. Synchronous writers that find the cache
+ above it wait for the background trimmer before they queue their objects. Asynchronous writers never block the
+ calling thread: once their write gets its turn, it first evicts the least recently used objects that share its
+ queue, leaving older ones on other queues to the trimmer. Defaults to `0`, meaning writers never wait.
+
+ @warning With a hard limit set, don't call the synchronous setters from within a block running on the cache's
+ queues.
+ */
+@property (assign) NSUInteger hardByteLimit;
+
 /**
  The maximum number of seconds an object is allowed to exist in the cache. Setting this to a value
  greater than `0.0` will start a recurring GCD timer with the same period that calls <trimToDate:>.
  Setting it back to `0.0` will stop the timer. Defaults to `0.0`, meaning no limit.
- 
- @warning Do not read this property on the <sharedQueue> (including asynchronous method blocks).
  */
 @property (assign) NSTimeInterval ageLimit;
 
+/**
+ Objects that archive to this many bytes or fewer are appended to large segment files shared by many
+ objects, instead of getting a file each. This avoids an inode and a full allocation block per object, which
+ for small objects can take up many times their size. Space left behind by removed or replaced objects is
+ reclaimed in the background. Larger objects are still stored in a file of their own. Defaults to `0`,
+ meaning every object gets a file.
+ 
+ @warning Objects kept in segment files have no file URL: blocks receive `nil` for `fileURL` and
+ <fileURLForKey:> returns `nil` for them.
+ */
+@property (assign) NSUInteger segmentByteLimit;
+
+/**
+ Encodes objects passed to <setObject:forKey:block:> and decodes them again. Each stored object records which
+ serializer wrote it, so changing this property doesn't affect objects already in the cache; objects written
+ by a custom serializer can only be read while the cache is configured with it. Objects the serializer can't
+ encode are archived with `NSKeyedArchiver`. Defaults to a <TMCacheKeyedArchiveSerializer>.
+ */
+@property (strong) id <TMCacheSerializer> serializer;
+
+/**
+ Encoded objects of at least this many bytes are compressed with zlib before they are written, if that makes
+ them at least an eighth smaller. Each entry records whether it was compressed, so compressed and uncompressed
+ entries can be mixed and this can be changed at any time. <byteCount> and <byteLimit> count the compressed
+ size on disk. Data stored with <setData:forKey:block:> is never compressed. Defaults to `0`, meaning no
+ compression.
+ */
+@property (assign) NSUInteger compressionThreshold;
+
+/**
+ Whether objects are synced to disk before the blocks of methods that add them are executed. Objects appended to
+ segment files (see <segmentByteLimit>) are not synced at any level, but a crash never leaves a partly written
+ one behind. Defaults to `TMDiskCacheDurabilityNone`.
+ */
+@property (assign) TMDiskCacheDurability durability;
+
+/**
+ Hits, misses, writes, removals, evictions and bytes read and written by this cache. Read, write and remove
+ latencies are the time spent on the file system, time spent waiting for a queue before that is counted as
+ `TMCacheStatisticsOperationQueueWait`.
+ */
+@property (readonly) TMCacheStatistics *statistics;
+
 #pragma mark -
 /// @name Event Blocks
 
 /**
- A block to be executed just before an object is added to the cache. The queue waits during execution.
+ A block to be executed just before an object is added to the cache. Work on the same key waits during execution.
  */
 @property (copy) TMDiskCacheObjectBlock willAddObjectBlock;
 
 /**
- A block to be executed just before an object is removed from the cache. The queue waits during execution.
+ A block to be executed just before an object is removed from the cache. Work on the same key waits during execution.
  */
 @property (copy) TMDiskCacheObjectBlock willRemoveObjectBlock;
 
@@ -102,12 +259,12 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
 @property (copy) TMDiskCacheBlock willRemoveAllObjectsBlock;
 
 /**
- A block to be executed just after an object is added to the cache. The queue waits during execution.
+ A block to be executed just after an object is added to the cache. Work on the same key waits during execution.
  */
 @property (copy) TMDiskCacheObjectBlock didAddObjectBlock;
 
 /**
- A block to be executed just after an object is removed from the cache. The queue waits during execution.
+ A block to be executed just after an object is removed from the cache. Work on the same key waits during execution.
  */
 @property (copy) TMDiskCacheObjectBlock didRemoveObjectBlock;
 
@@ -128,15 +285,18 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
 + (instancetype)sharedCache;
 
 /**
- A shared serial queue, used by all instances of this class. Use `dispatch_set_target_queue` to integrate
- this queue with an exisiting serial I/O queue.
+ A shared serial queue. Caches no longer use it, each one does its work on its own <queue>.
  
+ @deprecated Use the <queue> of a cache instead.
  @result The shared singleton queue instance.
  */
 + (dispatch_queue_t)sharedQueue;
 
 /**
- Empties the trash with `DISPATCH_QUEUE_PRIORITY_BACKGROUND`. Does not block the <sharedQueue>.
+ Empties the trash with `DISPATCH_QUEUE_PRIORITY_BACKGROUND`. Does not block the <queue> of any cache.
+
+ Caches move removed files to the trash and the trash is emptied in batches on its own, so there is usually
+ no need to call this. Trash left behind by an earlier run is deleted when the first cache is created.
  */
 + (void)emptyTrash;
 
@@ -152,8 +312,8 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
 - (instancetype)initWithName:(NSString *)name;
 
 /**
- The designated initializer. Multiple instances with the same name are allowed and can safely access
- the same data on disk thanks to the magic of seriality.
+ Multiple instances with the same name are allowed and can safely access the same data on disk thanks to the
+ magic of seriality.
  
  @see name
  @param name The name of the cache.
@@ -162,12 +322,39 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
  */
 - (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath;
 
+/**
+ Creates a cache with the specified file layout. Caches created with the other initializers use the flat layout.
+
+ Opening a directory written in the flat layout with the hashed one moves its files over: in the background
+ after launch, and right away for any key used before that. Moving back to the flat layout is not supported,
+ files in the hashed layout are ignored by it. All instances with the same name must use the same layout.
+
+ @param name The name of the cache.
+ @param rootPath The path of the cache.
+ @param fileLayout How files are named.
+ @result A new cache with the specified name.
+ */
+- (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath fileLayout:(TMDiskCacheFileLayout)fileLayout;
+
+/**
+ Creates a cache with the specified file layout and I/O engine. Caches created with the other initializers use
+ `TMDiskCacheIOEnginePOSIX`.
+
+ @param name The name of the cache.
+ @param rootPath The path of the cache.
+ @param fileLayout How files are named.
+ @param ioEngine The system calls to use for files.
+ @result A new cache with the specified name.
+ */
+- (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath fileLayout:(TMDiskCacheFileLayout)fileLayout
+                    ioEngine:(TMDiskCacheIOEngineType)ioEngine;
+
 #pragma mark -
 /// @name Asynchronous Methods
 
 /**
  Retrieves the object for the specified key. This method returns immediately and executes the passed
- block as soon as the object is available on the serial <sharedQueue>.
+ block as soon as the object is available, in order with other work on the same key.
  
  @warning The fileURL is only valid for the duration of this block, do not use it after the block ends.
  
@@ -178,17 +365,34 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
 
 /**
  Retrieves the fileURL for the specified key without actually reading the data from disk. This method
- returns immediately and executes the passed block as soon as the object is available on the serial
- <sharedQueue>.
+ returns immediately and executes the passed block as soon as the object is available, in order with other
+ work on the same key.
  
  @warning Access is protected for the duration of the block, but to maintain safe disk access do not
- access this fileURL after the block has ended. Do all work on the <sharedQueue>.
+ access this fileURL after the block has ended. It is `nil` for objects kept in segment files, see
+ <segmentByteLimit>.
  
  @param key The key associated with the requested object.
  @param block A block to be executed serially when the file URL is available.
  */
 - (void)fileURLForKey:(NSString *)key block:(TMDiskCacheObjectBlock)block;
 
+/**
+ Retrieves the stored bytes for the specified key without unarchiving them. This is the data passed to
+ <setData:forKey:block:>, or the keyed archive of an object stored with <setObject:forKey:block:>. This method
+ returns immediately and executes the passed block as soon as the data is available, in order with other work
+ on the same key. The data is passed as the block's `object`.
+ 
+ The data maps the cache file rather than copying it into memory. Cache files are never modified in place,
+ writes replace them and removals unlink them, so the data stays valid and unchanged for as long as it lives,
+ even if the object is removed or replaced in the meantime. The disk space of a removed file is only freed
+ once the last data mapping it is released, and is not counted in <byteCount> until then.
+ 
+ @param key The key associated with the requested data.
+ @param block A block to be executed serially when the data is available.
+ */
+- (void)dataForKey:(NSString *)key block:(TMDiskCacheObjectBlock)block;
+
 /**
  Stores an object in the cache for the specified key. This method returns immediately and executes the
  passed block as soon as the object has been stored.
@@ -199,6 +403,29 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
  */
 - (void)setObject:(id <NSCoding>)object forKey:(NSString *)key block:(TMDiskCacheObjectBlock)block;
 
+/**
+ Stores an object in the cache for the specified key that expires after the specified number of seconds, no
+ matter how often it is read. Setting the key again replaces the time to live along with the object. This method
+ returns immediately and executes the passed block as soon as the object has been stored.
+
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ @param block A block to be executed serially after the object has been stored, or nil.
+ */
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl block:(TMDiskCacheObjectBlock)block;
+
+/**
+ Stores the bytes as they are for the specified key, without archiving them. This method returns immediately
+ and executes the passed block as soon as the data has been stored. <objectForKey:block:> returns the data
+ itself for such keys.
+ 
+ @param data The data to store in the cache.
+ @param key A key to associate with the data. This string will be copied.
+ @param block A block to be executed serially after the data has been stored, or nil.
+ */
+- (void)setData:(NSData *)data forKey:(NSString *)key block:(TMDiskCacheObjectBlock)block;
+
 /**
  Removes the object for the specified key. This method returns immediately and executes the passed block
  as soon as the object has been removed.
@@ -208,6 +435,36 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
  */
 - (void)removeObjectForKey:(NSString *)key block:(TMDiskCacheObjectBlock)block;
 
+/**
+ Retrieves the objects for the specified keys. The keys are grouped by the serial queue that owns them and each
+ queue is visited once for the whole batch. This method returns immediately and executes the passed block as soon
+ as all objects are available.
+
+ @param keys The keys associated with the requested objects.
+ @param block A block to be executed with the objects that were found, keyed by their keys.
+ */
+- (void)objectsForKeys:(NSArray *)keys block:(TMDiskCacheObjectsBlock)block;
+
+/**
+ Stores several objects in the cache at once. Each queue that owns some of the keys is visited once, and the
+ background trimmer is checked once for the whole batch. This method returns immediately and executes the
+ passed block as soon as all objects have been stored.
+
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ @param block A block to be executed with the stored objects keyed by their keys, or nil.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys block:(TMDiskCacheObjectsBlock)block;
+
+/**
+ Removes the objects for the specified keys, visiting each queue that owns some of the keys once. This method
+ returns immediately and executes the passed block as soon as all objects have been removed.
+
+ @param keys The keys associated with the objects to be removed.
+ @param block A block to be executed after the objects have been removed, or nil.
+ */
+- (void)removeObjectsForKeys:(NSArray *)keys block:(TMDiskCacheBlock)block;
+
 /**
  Removes all objects from the cache that have not been used since the specified date.
  This method returns immediately and executes the passed block as soon as the cache has been trimmed.
@@ -269,7 +526,7 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
 
 /**
  Retrieves the file URL for the specified key. This method blocks the calling thread until the
- url is available. Do not use this URL anywhere but on the <sharedQueue>. This method probably
+ url is available. Do not use this URL anywhere but in a barrier block on the <queue>. This method probably
  shouldn't even exist, just use the asynchronous one.
  
  @see fileURLForKey:block:
@@ -278,6 +535,51 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
  */
 - (NSURL *)fileURLForKey:(NSString *)key;
 
+/**
+ Records that objects were used at the specified dates without touching their files, for a layer in front of the
+ cache that serves them from somewhere else. The dates are only kept in memory and in the index, trimming by date
+ takes them into account. Dates older than the recorded ones and keys that aren't in the cache are ignored. This
+ method doesn't wait for the queue.
+
+ @param dates The dates the objects were last used, keyed by their keys.
+ */
+- (void)setAccessDates:(NSDictionary *)dates;
+
+/**
+ Tests whether the cache may hold an object for the specified key, without waiting for the queue or touching the
+ disk. The cache keeps a counting Bloom filter of its keys in memory for this, built from the index when the cache
+ is opened and updated by every write and removal. `NO` is definite: there is no such object, and no write of it
+ is queued either. `YES` is only probable, a read may still come up empty. Until the cache has checked the index
+ against the directory after opening, this method always returns `YES`.
+
+ The filter only knows the keys written through this instance. While another `TMDiskCache` instance with the same
+ name has the directory open, or once one has opened it after this one, this method always returns `YES`.
+ <objectForKey:> and <dataForKey:> return nil right away for keys this method rules out.
+
+ @param key The key associated with the object.
+ @result `NO` if there is definitely no object for the key.
+ */
+- (BOOL)mightContainObjectForKey:(NSString *)key;
+
+/**
+ The date the object for the specified key expires, if it was stored with a time to live. This method doesn't
+ wait for the queue.
+
+ @param key The key associated with the object.
+ @result The expiration date, or nil if the object never expires or isn't in the cache.
+ */
+- (NSDate *)expirationDateForKey:(NSString *)key;
+
+/**
+ Retrieves the stored bytes for the specified key, mapped from the cache file. This method blocks the
+ calling thread until the data is available.
+ 
+ @see dataForKey:block:
+ @param key The key associated with the data.
+ @result The data for the specified key.
+ */
+- (NSData *)dataForKey:(NSString *)key;
+
 /**
  Stores an object in the cache for the specified key. This method blocks the calling thread until
  the object has been stored.
@@ -288,6 +590,28 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
  */
 - (void)setObject:(id <NSCoding>)object forKey:(NSString *)key;
 
+/**
+ Stores an object in the cache for the specified key that expires after the specified number of seconds. Reads
+ treat it as missing from then on, even before the timer wheel has removed its file. This method blocks the
+ calling thread until the object has been stored.
+
+ @see setObject:forKey:ttl:block:
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ */
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl;
+
+/**
+ Stores the bytes as they are for the specified key. This method blocks the calling thread until the data
+ has been stored.
+ 
+ @see setData:forKey:block:
+ @param data The data to store in the cache.
+ @param key A key to associate with the data. This string will be copied.
+ */
+- (void)setData:(NSData *)data forKey:(NSString *)key;
+
 /**
  Removes the object for the specified key. This method blocks the calling thread until the object
  has been removed.
@@ -296,6 +620,32 @@ typedef void (^TMDiskCacheObjectBlock)(TMDiskCache *cache, NSString *key, id <NS
  */
 - (void)removeObjectForKey:(NSString *)key;
 
+/**
+ Retrieves the objects for the specified keys. This method blocks the calling thread until all objects are available.
+
+ @see objectsForKeys:block:
+ @param keys The keys associated with the objects.
+ @result The objects that were found, keyed by their keys.
+ */
+- (NSDictionary *)objectsForKeys:(NSArray *)keys;
+
+/**
+ Stores several objects in the cache at once. This method blocks the calling thread until all objects have been stored.
+
+ @see setObjects:forKeys:block:
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys;
+
+/**
+ Removes the objects for the specified keys. This method blocks the calling thread until all objects have been removed.
+
+ @see removeObjectsForKeys:block:
+ @param keys The keys associated with the objects to be removed.
+ */
+- (void)removeObjectsForKeys:(NSArray *)keys;
+
 /**
  Removes all objects from the cache that have not been used since the specified date.
  This method blocks the calling thread until the cache has been trimmed.
@@ -1,5 +1,17 @@
 #import "TMDiskCache.h"
 #import "TMCacheBackgroundTaskManager.h"
+#import "TMCacheBloomFilter.h"
+#import "TMCacheSerializer.h"
+#import "TMCacheTimerWheel.h"
+#import "TMDiskCacheFileWriter.h"
+#import "TMDiskCacheIOEngine.h"
+#import "TMDiskCacheIndex.h"
+#import "TMDiskCacheSegmentStore.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <sys/file.h>
+#import <zlib.h>
 
 #if __IPHONE_OS_VERSION_MIN_REQUIRED >= __IPHONE_4_0
 #import <UIKit/UIKit.h>
@@ -9,17 +21,557 @@
                                     [[NSString stringWithUTF8String:__FILE__] lastPathComponent], \
                                     __LINE__, [error localizedDescription]); }
 
+#define TMDiskCacheKeyQueueCount 16
+#define TMDiskCacheHashedFileNameLength 32
+
+static const NSTimeInterval TMDiskCacheIndexFlushInterval = 5.0;
+static const NSUInteger TMDiskCacheTrimIncrement = 64;
+static const NSUInteger TMDiskCacheRecencyMaximumWalk = 64;
+static const NSTimeInterval TMDiskCacheExpiryResolution = 1.0;
+
 static id <TMCacheBackgroundTaskManager> TMCacheBackgroundTaskManager;
 
+// Written in front of every object so it can be read back by the serializer that wrote it. Entries written before
+// there was a header are keyed archives, which start with the binary property list header instead.
+typedef struct {
+    uint8_t magic[4];
+    uint8_t version;
+    uint8_t serializerID;
+    uint8_t flags;
+    uint8_t reserved;
+} TMDiskCacheEntryHeader;
+
+typedef NS_OPTIONS(uint8_t, TMDiskCacheEntryFlags) {
+    TMDiskCacheEntryCompressed = 1 << 0, // zlib, preceded by the uncompressed length as a uint32_t
+    TMDiskCacheEntryKeyed = 1 << 1, // the key follows the header, its UTF-8 length as a uint32_t first
+    TMDiskCacheEntryRawData = 1 << 2 // stored with -setData:forKey:, the payload is read back as it is
+};
+
+static const uint8_t TMDiskCacheEntryMagic[4] = { 'T', 'M', 'C', 'E' };
+static const uint8_t TMDiskCacheEntryVersion = 1;
+
+// Pass a key to have it written after the header, as files in the hashed layout are.
+static NSData *TMDiskCacheEntryData(NSData *payload, uint8_t serializerID, uint8_t flags, NSString *key)
+{
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    uint32_t keyLength = (uint32_t)[keyData length];
+
+    if (keyData)
+        flags |= TMDiskCacheEntryKeyed;
+
+    TMDiskCacheEntryHeader header = { { 0 }, TMDiskCacheEntryVersion, serializerID, flags, 0 };
+    memcpy(header.magic, TMDiskCacheEntryMagic, sizeof(header.magic));
+
+    NSUInteger length = sizeof(header) + (keyData ? sizeof(keyLength) + keyLength : 0) + [payload length];
+    NSMutableData *data = [[NSMutableData alloc] initWithCapacity:length];
+    [data appendBytes:&header length:sizeof(header)];
+
+    if (keyData) {
+        [data appendBytes:&keyLength length:sizeof(keyLength)];
+        [data appendData:keyData];
+    }
+
+    [data appendData:payload];
+
+    return data;
+}
+
+static BOOL TMDiskCacheReadEntryHeader(NSData *data, TMDiskCacheEntryHeader *header)
+{
+    if ([data length] < sizeof(TMDiskCacheEntryHeader))
+        return NO;
+
+    memcpy(header, [data bytes], sizeof(TMDiskCacheEntryHeader));
+
+    return memcmp(header->magic, TMDiskCacheEntryMagic, sizeof(header->magic)) == 0
+           && header->version == TMDiskCacheEntryVersion;
+}
+
+// Finds where the payload of an entry starts, past the key if it has one. Returns NSNotFound for a cut off entry.
+static NSUInteger TMDiskCacheReadEntryKey(NSData *data, const TMDiskCacheEntryHeader *header, NSString **outKey)
+{
+    if (!(header->flags & TMDiskCacheEntryKeyed))
+        return sizeof(TMDiskCacheEntryHeader);
+
+    uint32_t keyLength = 0;
+    if ([data length] < sizeof(TMDiskCacheEntryHeader) + sizeof(keyLength))
+        return NSNotFound;
+
+    memcpy(&keyLength, (const uint8_t *)[data bytes] + sizeof(TMDiskCacheEntryHeader), sizeof(keyLength));
+
+    NSUInteger keyOffset = sizeof(TMDiskCacheEntryHeader) + sizeof(keyLength);
+    if ([data length] - keyOffset < keyLength)
+        return NSNotFound;
+
+    if (outKey)
+        *outKey = [[NSString alloc] initWithBytes:(const uint8_t *)[data bytes] + keyOffset length:keyLength
+                                         encoding:NSUTF8StringEncoding];
+
+    return keyOffset + keyLength;
+}
+
+// Two independent 64-bit hashes of the key, 128 bits in all, so names practically never collide. The reader
+// still checks the key stored in the file.
+static void TMDiskCacheHashKey(const char *bytes, size_t length, uint64_t hash[2])
+{
+    uint64_t h1 = 0xcbf29ce484222325ULL ^ length;
+    uint64_t h2 = 0x9e3779b97f4a7c15ULL ^ length;
+
+    for (size_t i = 0; i < length; i++) {
+        h1 = (h1 ^ (uint8_t)bytes[i]) * 0x100000001b3ULL;
+        h2 = (((h2 << 5) | (h2 >> 59)) ^ (uint8_t)bytes[i]) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    for (NSUInteger i = 0; i < 2; i++) {
+        uint64_t h = i == 0 ? h1 : h2 ^ (h1 >> 32);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        hash[i] = h;
+    }
+}
+
+// Writes the 32 hex digit name of the key's file into the buffer, plus the terminator.
+static BOOL TMDiskCacheGetHashedFileName(NSString *key, char name[TMDiskCacheHashedFileNameLength + 1])
+{
+    char buffer[256];
+    const char *bytes = CFStringGetCStringPtr((__bridge CFStringRef)key, kCFStringEncodingUTF8);
+
+    if (!bytes && CFStringGetCString((__bridge CFStringRef)key, buffer, sizeof(buffer), kCFStringEncodingUTF8))
+        bytes = buffer;
+
+    if (!bytes)
+        bytes = [key UTF8String]; // too long for the buffer
+
+    if (!bytes)
+        return NO;
+
+    uint64_t hash[2];
+    TMDiskCacheHashKey(bytes, strlen(bytes), hash);
+
+    snprintf(name, TMDiskCacheHashedFileNameLength + 1, "%016llx%016llx",
+             (unsigned long long)hash[0], (unsigned long long)hash[1]);
+
+    return YES;
+}
+
+static BOOL TMDiskCacheIsFanOutDirectoryName(NSString *name)
+{
+    if ([name length] != 2)
+        return NO;
+
+    for (NSUInteger i = 0; i < 2; i++) {
+        unichar c = [name characterAtIndex:i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+            return NO;
+    }
+
+    return YES;
+}
+
+// Returns nil unless compressing saves at least an eighth of the size.
+static NSData *TMDiskCacheCompressedData(NSData *data)
+{
+    if ([data length] > UINT32_MAX)
+        return nil;
+
+    uint32_t length = (uint32_t)[data length];
+    uLongf compressedLength = compressBound(length);
+    NSMutableData *compressedData = [[NSMutableData alloc] initWithLength:sizeof(length) + compressedLength];
+
+    memcpy([compressedData mutableBytes], &length, sizeof(length));
+
+    int result = compress2((Bytef *)[compressedData mutableBytes] + sizeof(length), &compressedLength,
+                           [data bytes], length, Z_BEST_SPEED);
+
+    if (result != Z_OK || sizeof(length) + compressedLength > length - length / 8)
+        return nil;
+
+    [compressedData setLength:sizeof(length) + compressedLength];
+    return compressedData;
+}
+
+static NSData *TMDiskCacheDecompressedData(NSData *compressedData)
+{
+    uint32_t length = 0;
+    if ([compressedData length] < sizeof(length))
+        return nil;
+
+    memcpy(&length, [compressedData bytes], sizeof(length));
+
+    // deflate expands at most 1032:1, so a larger length is a corrupt header; never allocate for it
+    uint64_t streamLength = [compressedData length] - sizeof(length);
+    if (length == 0 || length > streamLength * 1032)
+        return nil;
+
+    NSMutableData *data = [[NSMutableData alloc] initWithLength:length];
+    uLongf decompressedLength = length;
+
+    int result = uncompress([data mutableBytes], &decompressedLength,
+                            (const Bytef *)[compressedData bytes] + sizeof(length), (uLong)streamLength);
+
+    if (result != Z_OK || decompressedLength != length)
+        return nil;
+
+    return data;
+}
+
+static id <TMCacheSerializer> TMDiskCacheSerializerWithID(uint8_t serializerID)
+{
+    static NSArray *serializers;
+    static dispatch_once_t predicate;
+
+    dispatch_once(&predicate, ^{
+        serializers = @[ [[TMCacheKeyedArchiveSerializer alloc] init],
+                         [[TMCachePropertyListSerializer alloc] init],
+                         [[TMCacheDataSerializer alloc] init] ];
+    });
+
+    for (id <TMCacheSerializer> serializer in serializers) {
+        if (serializer.serializerID == serializerID)
+            return serializer;
+    }
+
+    return nil;
+}
+
+static BOOL TMDiskCacheDataIsKeyedArchive(NSData *data)
+{
+    static const char binaryPropertyListHeader[] = "bplist00";
+    const NSUInteger headerLength = sizeof(binaryPropertyListHeader) - 1;
+
+    return [data length] >= headerLength && memcmp([data bytes], binaryPropertyListHeader, headerLength) == 0;
+}
+
 NSString * const TMDiskCachePrefix = @"com.tumblr.TMDiskCache";
 NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
 
-@interface TMDiskCache ()
+/**
+ The queues a cache directory is accessed on. Work on a single key runs on one of several serial queues picked
+ by key hash, so different keys are read and written in parallel while work on the same key stays in order.
+ The key queues all target one concurrent queue, on which whole-cache work (trimming, removing everything,
+ enumerating) runs as a barrier. There is one context per directory, kept for the life of the process, so
+ instances with the same name still never touch the same file at the same time. The context also owns the
+ directory's index, segment store and file writer.
+ */
+@interface TMDiskCacheIOContext : NSObject {
+    dispatch_queue_t _keyQueues[TMDiskCacheKeyQueueCount];
+    pthread_mutex_t _instanceLock;
+    NSUInteger _instanceCount;
+    NSUInteger _openCount;
+}
+#if OS_OBJECT_USE_OBJC
+@property (strong, nonatomic, readonly) dispatch_queue_t queue;
+#else
+@property (assign, nonatomic, readonly) dispatch_queue_t queue;
+#endif
+@property (strong, nonatomic, readonly) TMDiskCacheIndex *index;
+@property (strong, nonatomic, readonly) TMDiskCacheSegmentStore *segmentStore;
+@property (strong, nonatomic, readonly) TMDiskCacheFileWriter *fileWriter;
++ (instancetype)contextForURL:(NSURL *)url;
+- (NSUInteger)openInstance;
+- (void)closeInstance;
+- (BOOL)hasOneInstance;
+- (BOOL)isLastOpenedInstance:(NSUInteger)openNumber;
+- (dispatch_queue_t)queueForKey:(NSString *)key;
+- (dispatch_queue_t)queueAtIndex:(NSUInteger)queueIndex;
+- (NSArray *)indexesByQueueForKeys:(NSArray *)keys;
+@end
+
+@implementation TMDiskCacheIOContext
+
+- (void)dealloc
+{
+    #if !OS_OBJECT_USE_OBJC
+    for (NSUInteger i = 0; i < TMDiskCacheKeyQueueCount; i++)
+        dispatch_release(_keyQueues[i]);
+
+    dispatch_release(_queue);
+    _queue = nil;
+    #endif
+
+    pthread_mutex_destroy(&_instanceLock);
+}
+
+- (instancetype)initWithURL:(NSURL *)url
+{
+    if (self = [super init]) {
+        NSString *queueName = [[NSString alloc] initWithFormat:@"%@.%@", TMDiskCachePrefix, [url lastPathComponent]];
+        _queue = dispatch_queue_create([queueName UTF8String], DISPATCH_QUEUE_CONCURRENT);
+
+        for (NSUInteger i = 0; i < TMDiskCacheKeyQueueCount; i++) {
+            NSString *keyQueueName = [[NSString alloc] initWithFormat:@"%@.%lu", queueName, (unsigned long)i];
+            _keyQueues[i] = dispatch_queue_create([keyQueueName UTF8String], DISPATCH_QUEUE_SERIAL);
+            dispatch_set_target_queue(_keyQueues[i], _queue);
+        }
+
+        _index = [[TMDiskCacheIndex alloc] initWithDirectoryURL:url];
+        _segmentStore = [[TMDiskCacheSegmentStore alloc] initWithDirectoryURL:url];
+        _fileWriter = [[TMDiskCacheFileWriter alloc] initWithDirectoryURL:url];
+
+        pthread_mutex_init(&_instanceLock, NULL);
+        _instanceCount = 0;
+        _openCount = 0;
+    }
+    return self;
+}
+
++ (instancetype)contextForURL:(NSURL *)url
+{
+    static NSMutableDictionary *contexts;
+    static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    NSString *path = [[url URLByStandardizingPath] path];
+
+    pthread_mutex_lock(&mutex);
+
+    if (!contexts)
+        contexts = [[NSMutableDictionary alloc] init];
+
+    TMDiskCacheIOContext *context = [contexts objectForKey:path];
+    if (!context) {
+        context = [[self alloc] initWithURL:url];
+        [contexts setObject:context forKey:path];
+    }
+
+    pthread_mutex_unlock(&mutex);
+
+    return context;
+}
+
+// Instances keep the keys of the directory in memory, each its own copy. An instance only has all of them if it
+// was alone when it loaded them and no other instance has opened the directory since. Returns the instance's number.
+- (NSUInteger)openInstance
+{
+    pthread_mutex_lock(&_instanceLock);
+    NSUInteger openNumber = ++_openCount;
+    _instanceCount++;
+    pthread_mutex_unlock(&_instanceLock);
+
+    return openNumber;
+}
+
+- (BOOL)hasOneInstance
+{
+    pthread_mutex_lock(&_instanceLock);
+    BOOL one = _instanceCount == 1;
+    pthread_mutex_unlock(&_instanceLock);
+
+    return one;
+}
+
+- (void)closeInstance
+{
+    pthread_mutex_lock(&_instanceLock);
+    _instanceCount--;
+    pthread_mutex_unlock(&_instanceLock);
+}
+
+- (BOOL)isLastOpenedInstance:(NSUInteger)openNumber
+{
+    pthread_mutex_lock(&_instanceLock);
+    BOOL last = _openCount == openNumber;
+    pthread_mutex_unlock(&_instanceLock);
+
+    return last;
+}
+
+- (NSUInteger)queueIndexForKey:(NSString *)key
+{
+    NSUInteger hash = [key hash];
+    hash ^= hash >> 16;
+
+    return hash % TMDiskCacheKeyQueueCount;
+}
+
+- (dispatch_queue_t)queueForKey:(NSString *)key
+{
+    return _keyQueues[[self queueIndexForKey:key]];
+}
+
+- (dispatch_queue_t)queueAtIndex:(NSUInteger)queueIndex
+{
+    return _keyQueues[queueIndex];
+}
+
+// One index set per key queue, holding the positions of the keys that belong to it.
+- (NSArray *)indexesByQueueForKeys:(NSArray *)keys
+{
+    NSMutableArray *indexesByQueue = [[NSMutableArray alloc] initWithCapacity:TMDiskCacheKeyQueueCount];
+    for (NSUInteger i = 0; i < TMDiskCacheKeyQueueCount; i++)
+        [indexesByQueue addObject:[[NSMutableIndexSet alloc] init]];
+
+    [keys enumerateObjectsUsingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+        [[indexesByQueue objectAtIndex:[self queueIndexForKey:key]] addIndex:index];
+    }];
+
+    return indexesByQueue;
+}
+
+@end
+
+@interface TMDiskCacheRecencyNode : NSObject {
+@public
+    NSString *_key;
+    NSDate *_date;
+    __unsafe_unretained TMDiskCacheRecencyNode *_older;
+    __unsafe_unretained TMDiskCacheRecencyNode *_newer;
+}
+@end
+
+@implementation TMDiskCacheRecencyNode
+@end
+
+/**
+ The keys of the cache ordered by access date, oldest first, so trimming by date never has to sort. Dates are
+ almost always the current time and go straight to the newest end. An older date walks back a bounded number of
+ steps, which keeps every update cheap at the price of a slightly approximate order for the rare late update.
+ */
+@interface TMDiskCacheRecencyList : NSObject {
+    NSMutableDictionary *_nodes;
+    __unsafe_unretained TMDiskCacheRecencyNode *_oldest;
+    __unsafe_unretained TMDiskCacheRecencyNode *_newest;
+}
+- (void)setDate:(NSDate *)date forKey:(NSString *)key;
+- (void)removeKey:(NSString *)key;
+- (void)removeAllKeys;
+- (NSArray *)oldestKeys:(NSUInteger)count;
+- (NSArray *)keysOlderThanDate:(NSDate *)date;
+@end
+
+@implementation TMDiskCacheRecencyList
+
+- (instancetype)init
+{
+    if (self = [super init]) {
+        _nodes = [[NSMutableDictionary alloc] init];
+        _oldest = nil;
+        _newest = nil;
+    }
+    return self;
+}
+
+- (void)unlinkNode:(TMDiskCacheRecencyNode *)node
+{
+    if (node->_older)
+        node->_older->_newer = node->_newer;
+    else
+        _oldest = node->_newer;
+
+    if (node->_newer)
+        node->_newer->_older = node->_older;
+    else
+        _newest = node->_older;
+
+    node->_older = nil;
+    node->_newer = nil;
+}
+
+- (void)setDate:(NSDate *)date forKey:(NSString *)key
+{
+    TMDiskCacheRecencyNode *node = [_nodes objectForKey:key];
+
+    if (node) {
+        [self unlinkNode:node];
+    } else {
+        node = [[TMDiskCacheRecencyNode alloc] init];
+        node->_key = [key copy];
+        [_nodes setObject:node forKey:node->_key];
+    }
+
+    node->_date = date;
+
+    TMDiskCacheRecencyNode *older = _newest;
+    TMDiskCacheRecencyNode *newer = nil;
+
+    for (NSUInteger steps = 0; older && steps < TMDiskCacheRecencyMaximumWalk; steps++) {
+        if ([older->_date compare:date] != NSOrderedDescending)
+            break;
+
+        newer = older;
+        older = older->_older;
+    }
+
+    node->_older = older;
+    node->_newer = newer;
+
+    if (older)
+        older->_newer = node;
+    else
+        _oldest = node;
+
+    if (newer)
+        newer->_older = node;
+    else
+        _newest = node;
+}
+
+- (void)removeKey:(NSString *)key
+{
+    TMDiskCacheRecencyNode *node = [_nodes objectForKey:key];
+    if (!node)
+        return;
+
+    [self unlinkNode:node];
+    [_nodes removeObjectForKey:key];
+}
+
+- (void)removeAllKeys
+{
+    _oldest = nil;
+    _newest = nil;
+    [_nodes removeAllObjects];
+}
+
+- (NSArray *)oldestKeys:(NSUInteger)count
+{
+    NSMutableArray *keys = [[NSMutableArray alloc] init];
+
+    for (TMDiskCacheRecencyNode *node = _oldest; node && [keys count] < count; node = node->_newer)
+        [keys addObject:node->_key];
+
+    return keys;
+}
+
+- (NSArray *)keysOlderThanDate:(NSDate *)date
+{
+    NSMutableArray *keys = [[NSMutableArray alloc] init];
+
+    for (TMDiskCacheRecencyNode *node = _oldest; node && [node->_date compare:date] == NSOrderedAscending; node = node->_newer)
+        [keys addObject:node->_key];
+
+    return keys;
+}
+
+@end
+
+@interface TMDiskCache () {
+    pthread_mutex_t _lock;
+    pthread_cond_t _trimCondition;
+    TMDiskCacheRecencyList *_recency;
+    TMCacheTimerWheel *_expirations;
+    dispatch_source_t _expiryTimer;
+    NSTimeInterval _expiryTime;
+    TMCacheBloomFilter *_keyFilter;
+    NSCountedSet *_writingKeys;
+    BOOL _keyFilterComplete;
+    NSUInteger _openNumber;
+    BOOL _loadedAlone; // no other instance had the directory open when this one loaded its keys
+    char *_cachePath;
+    id <TMDiskCacheIOEngine> _engine;
+    BOOL _migratingFlatFiles;
+    BOOL _trimming;
+    BOOL _indexFlushScheduled;
+    BOOL _segmentCompactionScheduled;
+}
 @property (assign) NSUInteger byteCount;
 @property (strong, nonatomic) NSURL *cacheURL;
-@property (assign, nonatomic) dispatch_queue_t queue;
+@property (strong, nonatomic) TMDiskCacheIOContext *context;
 @property (strong, nonatomic) NSMutableDictionary *dates;
 @property (strong, nonatomic) NSMutableDictionary *sizes;
+@property (strong, nonatomic) NSMutableDictionary *expirationDates;
 @end
 
 @implementation TMDiskCache
@@ -31,23 +583,59 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
 @synthesize didRemoveObjectBlock = _didRemoveObjectBlock;
 @synthesize didRemoveAllObjectsBlock = _didRemoveAllObjectsBlock;
 @synthesize byteLimit = _byteLimit;
+@synthesize trimTargetByteCount = _trimTargetByteCount;
+@synthesize hardByteLimit = _hardByteLimit;
 @synthesize ageLimit = _ageLimit;
+@synthesize segmentByteLimit = _segmentByteLimit;
+@synthesize serializer = _serializer;
+@synthesize compressionThreshold = _compressionThreshold;
+@synthesize durability = _durability;
 
 #pragma mark - Initialization -
 
+- (void)dealloc
+{
+    [_context closeInstance];
+
+    dispatch_source_cancel(_expiryTimer);
+
+    #if !OS_OBJECT_USE_OBJC
+    dispatch_release(_expiryTimer);
+    #endif
+
+    free(_cachePath);
+
+    pthread_cond_destroy(&_trimCondition);
+    pthread_mutex_destroy(&_lock);
+}
+
 - (instancetype)initWithName:(NSString *)name
 {
     return [self initWithName:name rootPath:[NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0]];
 }
 
 - (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath
+{
+    return [self initWithName:name rootPath:rootPath fileLayout:TMDiskCacheFileLayoutFlat];
+}
+
+- (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath fileLayout:(TMDiskCacheFileLayout)fileLayout
+{
+    return [self initWithName:name rootPath:rootPath fileLayout:fileLayout ioEngine:TMDiskCacheIOEnginePOSIX];
+}
+
+- (instancetype)initWithName:(NSString *)name rootPath:(NSString *)rootPath fileLayout:(TMDiskCacheFileLayout)fileLayout
+                    ioEngine:(TMDiskCacheIOEngineType)ioEngine
 {
     if (!name)
         return nil;
 
     if (self = [super init]) {
         _name = [name copy];
-        _queue = [TMDiskCache sharedQueue];
+        _fileLayout = fileLayout;
+
+        pthread_mutex_init(&_lock, NULL);
+        pthread_cond_init(&_trimCondition, NULL);
 
         _willAddObjectBlock = nil;
         _willRemoveObjectBlock = nil;
@@ -58,20 +646,67 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
         
         _byteCount = 0;
         _byteLimit = 0;
+        _trimTargetByteCount = 0;
+        _hardByteLimit = 0;
+        _trimming = NO;
         _ageLimit = 0.0;
+        _segmentByteLimit = 0;
+        _serializer = [[TMCacheKeyedArchiveSerializer alloc] init];
+        _compressionThreshold = 0;
+        _durability = TMDiskCacheDurabilityNone;
+
+        _statistics = [[TMCacheStatistics alloc] init];
 
         _dates = [[NSMutableDictionary alloc] init];
         _sizes = [[NSMutableDictionary alloc] init];
+        _recency = [[TMDiskCacheRecencyList alloc] init];
+        _expirationDates = [[NSMutableDictionary alloc] init];
+        _expirations = [[TMCacheTimerWheel alloc] initWithResolution:TMDiskCacheExpiryResolution];
+        _keyFilter = [[TMCacheBloomFilter alloc] initWithCapacity:0];
+        _writingKeys = [[NSCountedSet alloc] init];
+        _keyFilterComplete = NO;
+        _indexFlushScheduled = NO;
+        _segmentCompactionScheduled = NO;
 
         NSString *pathComponent = [[NSString alloc] initWithFormat:@"%@.%@", TMDiskCachePrefix, _name];
         _cacheURL = [NSURL fileURLWithPathComponents:@[ rootPath, pathComponent ]];
+        _cachePath = strdup([[_cacheURL path] fileSystemRepresentation]);
+
+        // files in the flat layout are moved over in the background, and when their keys are used before that
+        _migratingFlatFiles = _fileLayout == TMDiskCacheFileLayoutHashed;
+
+        _context = [TMDiskCacheIOContext contextForURL:_cacheURL];
+        _queue = _context.queue;
+        _openNumber = [_context openInstance];
+        _loadedAlone = NO;
+
+        _ioEngine = ioEngine;
+        _engine = [TMDiskCache engineOfType:&_ioEngine temporaryDirectoryPath:_context.fileWriter.temporaryDirectoryPath];
 
         __weak TMDiskCache *weakSelf = self;
 
-        dispatch_async(_queue, ^{
+        // disarmed until an object with a time to live is set or loaded
+        _expiryTime = 0.0;
+        _expiryTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0,
+                                              dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+        dispatch_source_set_timer(_expiryTimer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        dispatch_source_set_event_handler(_expiryTimer, ^{
+            TMDiskCache *strongSelf = weakSelf;
+            [strongSelf removeExpiredObjects];
+        });
+        dispatch_resume(_expiryTimer);
+
+        dispatch_barrier_async(_queue, ^{
+            [TMDiskCache sharedTrashURL]; // sets up the trash and deletes what earlier runs left in it
+
             TMDiskCache *strongSelf = weakSelf;
             [strongSelf createCacheDirectory];
+            [strongSelf.context.fileWriter removeTemporaryFiles]; // left by writes a crash interrupted
             [strongSelf initializeDiskProperties];
+
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+                [weakSelf reconcileIndex];
+            });
         });
     }
     return self;
@@ -108,7 +743,26 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
 
 #pragma mark - Private Methods -
 
+// Guards the dates, sizes and byte count, the event blocks and the limits. Never held across file I/O.
+- (void)lock
+{
+    pthread_mutex_lock(&_lock);
+}
+
+- (void)unlock
+{
+    pthread_mutex_unlock(&_lock);
+}
+
 - (NSURL *)encodedFileURLForKey:(NSString *)key
+{
+    if (_fileLayout == TMDiskCacheFileLayoutHashed)
+        return [self hashedFileURLForKey:key];
+
+    return [self flatFileURLForKey:key];
+}
+
+- (NSURL *)flatFileURLForKey:(NSString *)key
 {
     if (![key length])
         return nil;
@@ -116,6 +770,23 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
     return [_cacheURL URLByAppendingPathComponent:[self encodedString:key]];
 }
 
+// Built in a buffer on the stack, the URL is the only object created.
+- (NSURL *)hashedFileURLForKey:(NSString *)key
+{
+    char name[TMDiskCacheHashedFileNameLength + 1];
+    char path[PATH_MAX];
+
+    if (![key length] || !TMDiskCacheGetHashedFileName(key, name))
+        return nil;
+
+    int length = snprintf(path, sizeof(path), "%s/%.2s/%.2s/%s", _cachePath, name, name + 2, name);
+    if (length <= 0 || length >= (int)sizeof(path))
+        return nil;
+
+    CFURLRef url = CFURLCreateFromFileSystemRepresentation(kCFAllocatorDefault, (const UInt8 *)path, length, false);
+    return (__bridge_transfer NSURL *)url;
+}
+
 - (NSString *)keyForEncodedFileURL:(NSURL *)url
 {
     NSString *fileName = [url lastPathComponent];
@@ -151,78 +822,231 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
     return (__bridge_transfer NSString *)unescapedString;
 }
 
-#pragma mark - Private Trash Methods -
+#pragma mark - Private Key Filter Methods -
 
-+ (dispatch_queue_t)sharedTrashQueue
+// Call with the lock held, once the key is in the dates. A filter past its capacity is replaced by one twice the
+// size of the cache, rebuilt from the dates, so its false positive rate stays put however much the cache grows.
+- (void)addKeyToFilter:(NSString *)key
 {
-    static dispatch_queue_t trashQueue;
-    static dispatch_once_t predicate;
-    
-    dispatch_once(&predicate, ^{
-        NSString *queueName = [[NSString alloc] initWithFormat:@"%@.trash", TMDiskCachePrefix];
-        trashQueue = dispatch_queue_create([queueName UTF8String], DISPATCH_QUEUE_SERIAL);
+    if ([_keyFilter count] < [_keyFilter capacity]) {
+        [_keyFilter addKey:key];
+        return;
+    }
+
+    _keyFilter = [[TMCacheBloomFilter alloc] initWithCapacity:[_dates count] * 2];
+
+    for (NSString *indexedKey in _dates)
+        [_keyFilter addKey:indexedKey];
+}
+
+// Keys with a write queued but not done yet might be on disk by the time a read issued after it gets its turn.
+- (void)beginWritingKeys:(NSArray *)keys
+{
+    [self lock];
+    for (NSString *key in keys)
+        [_writingKeys addObject:key];
+    [self unlock];
+}
+
+- (void)endWritingKey:(NSString *)key
+{
+    [self lock];
+    [_writingKeys removeObject:key];
+    [self unlock];
+}
+
+#pragma mark - Private Trash Methods -
+
++ (dispatch_queue_t)sharedTrashQueue
+{
+    static dispatch_queue_t trashQueue;
+    static dispatch_once_t predicate;
+    
+    dispatch_once(&predicate, ^{
+        NSString *queueName = [[NSString alloc] initWithFormat:@"%@.trash", TMDiskCachePrefix];
+        trashQueue = dispatch_queue_create([queueName UTF8String], DISPATCH_QUEUE_SERIAL);
         dispatch_set_target_queue(trashQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
     });
     
     return trashQueue;
 }
 
+static NSString * const TMDiskCacheTrashLockExtension = @"lock";
+
+// Every run trashes into a directory of its own. The root is shared by every process using the cache, so each run
+// holds an flock on a lock file next to its directory for as long as it lives, taken before the directory exists.
+// Directories whose lock can be taken belong to runs that are gone and are deleted in the background, together
+// with their lock files. Items without a lock file were left by versions that trashed into the root itself.
 + (NSURL *)sharedTrashURL
 {
     static NSURL *sharedTrashURL;
     static dispatch_once_t predicate;
     
     dispatch_once(&predicate, ^{
-        sharedTrashURL = [[[NSURL alloc] initFileURLWithPath:NSTemporaryDirectory()] URLByAppendingPathComponent:TMDiskCachePrefix isDirectory:YES];
-        
-        if (![[NSFileManager defaultManager] fileExistsAtPath:[sharedTrashURL path]]) {
+        NSURL *trashRootURL = [[[NSURL alloc] initFileURLWithPath:NSTemporaryDirectory()] URLByAppendingPathComponent:TMDiskCachePrefix isDirectory:YES];
+        NSString *runString = [[NSProcessInfo processInfo] globallyUniqueString];
+        sharedTrashURL = [trashRootURL URLByAppendingPathComponent:runString isDirectory:YES];
+
+        NSError *error = nil;
+        [[NSFileManager defaultManager] createDirectoryAtURL:trashRootURL
+                                 withIntermediateDirectories:YES
+                                                  attributes:nil
+                                                       error:&error];
+        TMDiskCacheError(error);
+
+        NSURL *lockURL = [sharedTrashURL URLByAppendingPathExtension:TMDiskCacheTrashLockExtension];
+        int lockDescriptor = open([[lockURL path] fileSystemRepresentation], O_RDWR | O_CREAT, 0600);
+        if (lockDescriptor >= 0)
+            flock(lockDescriptor, LOCK_EX); // held, and the descriptor left open, until the process exits
+
+        error = nil;
+        [[NSFileManager defaultManager] createDirectoryAtURL:sharedTrashURL
+                                 withIntermediateDirectories:YES
+                                                  attributes:nil
+                                                       error:&error];
+        TMDiskCacheError(error);
+
+        UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+        dispatch_async([self sharedTrashQueue], ^{
             NSError *error = nil;
-            [[NSFileManager defaultManager] createDirectoryAtURL:sharedTrashURL
-                                     withIntermediateDirectories:YES
-                                                      attributes:nil
-                                                           error:&error];
+            NSArray *trashedItems = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:trashRootURL
+                                                                  includingPropertiesForKeys:nil
+                                                                                     options:0
+                                                                                       error:&error];
             TMDiskCacheError(error);
-        }
+
+            for (NSURL *trashedItemURL in trashedItems) {
+                if ([[trashedItemURL lastPathComponent] isEqualToString:runString]
+                    || [[trashedItemURL pathExtension] isEqualToString:TMDiskCacheTrashLockExtension])
+                    continue;
+
+                NSURL *itemLockURL = [trashedItemURL URLByAppendingPathExtension:TMDiskCacheTrashLockExtension];
+                int itemLockDescriptor = open([[itemLockURL path] fileSystemRepresentation], O_RDWR);
+
+                if (itemLockDescriptor >= 0 && flock(itemLockDescriptor, LOCK_EX | LOCK_NB) != 0) {
+                    close(itemLockDescriptor);
+                    continue; // the run trashing into it is still alive
+                }
+
+                NSError *error = nil;
+                [[NSFileManager defaultManager] removeItemAtURL:trashedItemURL error:&error];
+                TMDiskCacheError(error);
+
+                if (itemLockDescriptor >= 0) {
+                    unlink([[itemLockURL path] fileSystemRepresentation]);
+                    close(itemLockDescriptor);
+                }
+            }
+
+            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+        });
     });
     
     return sharedTrashURL;
 }
 
+static pthread_mutex_t TMDiskCacheTrashLock = PTHREAD_MUTEX_INITIALIZER;
+static NSMutableArray *TMDiskCacheTrashedItemURLs;
+static BOOL TMDiskCacheTrashDeletionScheduled;
+
+// Moving an item to the trash is a cheap rename that frees its path right away, the actual deletion is batched
+// up and left to the trash queue.
 +(BOOL)moveItemAtURLToTrash:(NSURL *)itemURL
 {
-    if (![[NSFileManager defaultManager] fileExistsAtPath:[itemURL path]])
-        return NO;
-
     NSError *error = nil;
     NSString *uniqueString = [[NSProcessInfo processInfo] globallyUniqueString];
     NSURL *uniqueTrashURL = [[TMDiskCache sharedTrashURL] URLByAppendingPathComponent:uniqueString];
     BOOL moved = [[NSFileManager defaultManager] moveItemAtURL:itemURL toURL:uniqueTrashURL error:&error];
-    TMDiskCacheError(error);
-    return moved;
+
+    if (!moved) {
+        if (![error.domain isEqualToString:NSCocoaErrorDomain] || error.code != NSFileNoSuchFileError)
+            TMDiskCacheError(error);
+        return NO;
+    }
+
+    pthread_mutex_lock(&TMDiskCacheTrashLock);
+
+    if (!TMDiskCacheTrashedItemURLs)
+        TMDiskCacheTrashedItemURLs = [[NSMutableArray alloc] init];
+
+    [TMDiskCacheTrashedItemURLs addObject:uniqueTrashURL];
+
+    BOOL scheduleDeletion = !TMDiskCacheTrashDeletionScheduled;
+    TMDiskCacheTrashDeletionScheduled = YES;
+
+    pthread_mutex_unlock(&TMDiskCacheTrashLock);
+
+    if (scheduleDeletion)
+        [self emptyTrash];
+
+    return YES;
 }
 
 + (void)emptyTrash
 {
     UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
     
-    dispatch_async([self sharedTrashQueue], ^{        
-        NSError *error = nil;
-        NSArray *trashedItems = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:[self sharedTrashURL]
-                                                              includingPropertiesForKeys:nil
-                                                                                 options:0
-                                                                                   error:&error];
-        TMDiskCacheError(error);
+    dispatch_async([self sharedTrashQueue], ^{
+        while (YES) {
+            pthread_mutex_lock(&TMDiskCacheTrashLock);
 
-        for (NSURL *trashedItemURL in trashedItems) {
-            NSError *error = nil;
-            [[NSFileManager defaultManager] removeItemAtURL:trashedItemURL error:&error];
-            TMDiskCacheError(error);
+            NSArray *trashedItems = TMDiskCacheTrashedItemURLs;
+            TMDiskCacheTrashedItemURLs = nil;
+            TMDiskCacheTrashDeletionScheduled = [trashedItems count] > 0;
+
+            pthread_mutex_unlock(&TMDiskCacheTrashLock);
+
+            if (![trashedItems count])
+                break;
+
+            for (NSURL *trashedItemURL in trashedItems) {
+                NSError *error = nil;
+                [[NSFileManager defaultManager] removeItemAtURL:trashedItemURL error:&error];
+                TMDiskCacheError(error);
+            }
         }
         
         [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
     });
 }
 
+#pragma mark - Private I/O Methods -
+
+// Falls back to POSIX where io_uring is not available, and says so through the type.
++ (id <TMDiskCacheIOEngine>)engineOfType:(TMDiskCacheIOEngineType *)type temporaryDirectoryPath:(NSString *)path
+{
+    if (*type == TMDiskCacheIOEngineFoundation)
+        return [[TMDiskCacheFoundationIOEngine alloc] init];
+
+    #if TM_DISK_CACHE_IO_URING
+    if (*type == TMDiskCacheIOEngineIOUring) {
+        id <TMDiskCacheIOEngine> engine = [[TMDiskCacheIOUringEngine alloc] initWithTemporaryDirectoryPath:path];
+        if (engine)
+            return engine;
+    }
+    #endif
+
+    *type = TMDiskCacheIOEnginePOSIX;
+    return [[TMDiskCachePOSIXIOEngine alloc] initWithTemporaryDirectoryPath:path];
+}
+
+- (NSData *)readFileAtURL:(NSURL *)fileURL
+{
+    id data = fileURL ? [[_engine readFilesAtURLs:@[ fileURL ]] objectAtIndex:0] : nil;
+    return data == [NSNull null] ? nil : data;
+}
+
+- (BOOL)fileExistsAtURL:(NSURL *)fileURL
+{
+    return fileURL && [[[_engine fileExistsAtURLs:@[ fileURL ]] objectAtIndex:0] boolValue];
+}
+
+- (BOOL)removeFileAtURL:(NSURL *)fileURL
+{
+    return fileURL && [[[_engine removeFilesAtURLs:@[ fileURL ]] objectAtIndex:0] boolValue];
+}
+
 #pragma mark - Private Queue Methods -
 
 - (BOOL)createCacheDirectory
@@ -240,157 +1064,1405 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
     return success;
 }
 
+// Loading the index reads two files, no matter how many objects are cached. Without an index (the first launch
+// or a cache written by an older version) the cache starts out empty and <reconcileIndex> fills it in.
 - (void)initializeDiskProperties
 {
+    NSMutableDictionary *dates = [[NSMutableDictionary alloc] init];
+    NSMutableDictionary *sizes = [[NSMutableDictionary alloc] init];
+    NSMutableDictionary *expirationDates = [[NSMutableDictionary alloc] init];
+
+    [_context.index flush]; // records an earlier instance on the directory still had buffered
+
+    BOOL loadedAlone = [_context hasOneInstance];
+    BOOL loaded = [_context.index loadDates:dates sizes:sizes expirationDates:expirationDates];
+
+    // the segments have to be read anyway to find the values, any key the index missed is added as used just now
+    NSDictionary *segmentSizes = [_context.segmentStore load];
+    NSDate *now = [[NSDate alloc] init];
+
+    for (NSString *key in segmentSizes) {
+        if ([dates objectForKey:key])
+            continue;
+
+        [dates setObject:now forKey:key];
+        [sizes setObject:[segmentSizes objectForKey:key] forKey:key];
+        [_context.index setSize:[[segmentSizes objectForKey:key] unsignedIntegerValue] date:now forKey:key];
+        loaded = YES;
+    }
+
+    [self lock];
+    _loadedAlone = loadedAlone;
+    [self unlock];
+
+    if (!loaded)
+        return;
+
     NSUInteger byteCount = 0;
-    NSArray *keys = @[ NSURLContentModificationDateKey, NSURLTotalFileAllocatedSizeKey ];
+    for (NSNumber *fileSize in [sizes objectEnumerator])
+        byteCount += [fileSize unsignedIntegerValue];
+
+    NSArray *keysSortedByDate = [dates keysSortedByValueUsingSelector:@selector(compare:)];
+
+    [self lock];
+    [_dates addEntriesFromDictionary:dates];
+    [_sizes addEntriesFromDictionary:sizes];
+    _keyFilter = [[TMCacheBloomFilter alloc] initWithCapacity:[_dates count] * 2];
+    for (NSString *key in _dates)
+        [_keyFilter addKey:key];
+    for (NSString *key in keysSortedByDate) // the only sort, from here on the list stays in order
+        [_recency setDate:[dates objectForKey:key] forKey:key];
+    [_expirationDates addEntriesFromDictionary:expirationDates];
+    for (NSString *key in expirationDates)
+        [_expirations setExpirationTime:[[expirationDates objectForKey:key] timeIntervalSinceReferenceDate] forKey:key];
+    NSTimeInterval expiryTime = [_expirations nextAdvanceTime];
+    if (byteCount > 0)
+        self.byteCount = _byteCount + byteCount; // atomic
+    [self unlock];
+
+    [self scheduleExpiryAtTime:expiryTime];
+}
+
+// Runs in the background after launch while the cache is already in use. Lists the directory without reading any
+// attributes and compares it with the index, which can be behind after a crash or files removed by someone else.
+// Only keys that differ are checked again, on their own key queue so they can't race a write or removal.
+- (void)reconcileIndex
+{
+    NSMutableSet *flatKeys = [self flatDiskKeys];
+    if (!flatKeys)
+        return;
+
+    [self lock];
+    NSMutableSet *indexedKeys = [[NSMutableSet alloc] initWithArray:[_dates allKeys]];
+    [self unlock];
+
+    NSMutableSet *diskKeys = flatKeys;
+
+    // in the hashed layout, files left in the flat one are all visited to move them over
+    if (_fileLayout == TMDiskCacheFileLayoutHashed) {
+        diskKeys = [self hashedDiskKeysWithIndexedKeys:indexedKeys];
+        [diskKeys unionSet:flatKeys];
+    }
+
+    [diskKeys addObjectsFromArray:[_context.segmentStore allKeys]];
+
+    NSMutableSet *changedKeys = [diskKeys mutableCopy];
+    [changedKeys minusSet:indexedKeys];
+    [indexedKeys minusSet:diskKeys];
+    [changedKeys unionSet:indexedKeys];
+
+    if (_fileLayout == TMDiskCacheFileLayoutHashed)
+        [changedKeys unionSet:flatKeys];
+
+    __weak TMDiskCache *weakSelf = self;
+    dispatch_group_t group = dispatch_group_create();
+
+    for (NSString *key in changedKeys) {
+        dispatch_group_async(group, [_context queueForKey:key], ^{
+            TMDiskCache *strongSelf = weakSelf;
+            [strongSelf reconcileIndexForKey:key];
+        });
+    }
+
+    // from here on every key on disk is indexed, a key the filter doesn't know is a definite miss
+    dispatch_group_notify(group, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        [strongSelf lock];
+        strongSelf->_keyFilterComplete = YES;
+        strongSelf->_migratingFlatFiles = NO;
+        [strongSelf unlock];
+    });
+
+    #if !OS_OBJECT_USE_OBJC
+    dispatch_release(group);
+    #endif
+}
 
+// Lists the files directly in the cache directory, which are all there is in the flat layout. Returns nil if the
+// directory can't be read.
+- (NSMutableSet *)flatDiskKeys
+{
     NSError *error = nil;
-    NSArray *files = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:_cacheURL
-                                                   includingPropertiesForKeys:keys
-                                                                      options:NSDirectoryEnumerationSkipsHiddenFiles
-                                                                        error:&error];
+    NSArray *fileURLs = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:_cacheURL
+                                                      includingPropertiesForKeys:@[ NSURLIsDirectoryKey ]
+                                                                         options:NSDirectoryEnumerationSkipsHiddenFiles
+                                                                           error:&error];
     TMDiskCacheError(error);
 
-    for (NSURL *fileURL in files) {
+    if (!fileURLs)
+        return nil;
+
+    NSMutableSet *keys = [[NSMutableSet alloc] initWithCapacity:[fileURLs count]];
+
+    for (NSURL *fileURL in fileURLs) {
+        NSNumber *isDirectory = nil;
+        [fileURL getResourceValue:&isDirectory forKey:NSURLIsDirectoryKey error:NULL];
+
+        if ([isDirectory boolValue]) // the fan-out of the hashed layout
+            continue;
+
         NSString *key = [self keyForEncodedFileURL:fileURL];
+        if ([key length])
+            [keys addObject:key];
+    }
 
-        error = nil;
-        NSDictionary *dictionary = [fileURL resourceValuesForKeys:keys error:&error];
-        TMDiskCacheError(error);
+    return keys;
+}
 
-        NSDate *date = [dictionary objectForKey:NSURLContentModificationDateKey];
-        if (date && key)
-            [_dates setObject:date forKey:key];
+// Lists the fan-out directories of the hashed layout. File names are matched against the hashes of the indexed
+// keys, only files the index doesn't know are opened to read the key in their header. A file whose key can't be
+// read, or doesn't hash to its name, can never be looked up and goes to the trash.
+- (NSMutableSet *)hashedDiskKeysWithIndexedKeys:(NSSet *)indexedKeys
+{
+    NSMutableDictionary *keysByName = [[NSMutableDictionary alloc] initWithCapacity:[indexedKeys count]];
+    char name[TMDiskCacheHashedFileNameLength + 1];
 
-        NSNumber *fileSize = [dictionary objectForKey:NSURLTotalFileAllocatedSizeKey];
-        if (fileSize) {
-            [_sizes setObject:fileSize forKey:key];
-            byteCount += [fileSize unsignedIntegerValue];
+    for (NSString *key in indexedKeys) {
+        if (TMDiskCacheGetHashedFileName(key, name))
+            [keysByName setObject:key forKey:[[NSString alloc] initWithUTF8String:name]];
+    }
+
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSMutableSet *keys = [[NSMutableSet alloc] initWithCapacity:[indexedKeys count]];
+    NSString *cachePath = [_cacheURL path];
+
+    for (NSString *directoryName in [fileManager contentsOfDirectoryAtPath:cachePath error:NULL]) {
+        if (!TMDiskCacheIsFanOutDirectoryName(directoryName))
+            continue;
+
+        NSString *directoryPath = [cachePath stringByAppendingPathComponent:directoryName];
+
+        for (NSString *subdirectoryName in [fileManager contentsOfDirectoryAtPath:directoryPath error:NULL]) {
+            if (!TMDiskCacheIsFanOutDirectoryName(subdirectoryName))
+                continue;
+
+            NSString *subdirectoryPath = [directoryPath stringByAppendingPathComponent:subdirectoryName];
+
+            for (NSString *fileName in [fileManager contentsOfDirectoryAtPath:subdirectoryPath error:NULL]) {
+                if ([fileName length] != TMDiskCacheHashedFileNameLength) // temporary files of atomic writes
+                    continue;
+
+                NSString *key = [keysByName objectForKey:fileName];
+
+                if (!key) {
+                    NSString *filePath = [subdirectoryPath stringByAppendingPathComponent:fileName];
+                    key = [self keyOfEntryAtPath:filePath];
+
+                    if (!key || !TMDiskCacheGetHashedFileName(key, name) || strcmp(name, [fileName UTF8String]) != 0) {
+                        [TMDiskCache moveItemAtURLToTrash:[NSURL fileURLWithPath:filePath]];
+                        continue;
+                    }
+                }
+
+                [keys addObject:key];
+            }
         }
     }
 
-    if (byteCount > 0)
-        self.byteCount = byteCount; // atomic
+    return keys;
 }
 
-- (BOOL)setFileModificationDate:(NSDate *)date forURL:(NSURL *)fileURL
+- (NSString *)keyOfEntryAtPath:(NSString *)path
 {
-    if (!date || !fileURL) {
-        return NO;
+    NSData *data = [[NSData alloc] initWithContentsOfFile:path options:NSDataReadingMappedIfSafe error:NULL];
+    TMDiskCacheEntryHeader header;
+    NSString *key = nil;
+
+    if (!TMDiskCacheReadEntryHeader(data, &header) || TMDiskCacheReadEntryKey(data, &header, &key) == NSNotFound)
+        return nil;
+
+    return key;
+}
+
+// Moves the key's file over from the flat layout, unless the key has been written in the hashed one since.
+// Runs on the key's queue, before anything else looks for its file, for as long as files may be left to move.
+- (void)migrateFlatFileForKey:(NSString *)key
+{
+    if (_fileLayout != TMDiskCacheFileLayoutHashed)
+        return;
+
+    [self lock];
+    BOOL migrating = _migratingFlatFiles;
+    [self unlock];
+
+    if (!migrating)
+        return;
+
+    NSURL *flatFileURL = [self flatFileURLForKey:key];
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+
+    if (!flatFileURL || ![fileManager fileExistsAtPath:[flatFileURL path]])
+        return;
+
+    NSURL *fileURL = [self hashedFileURLForKey:key];
+
+    if (!fileURL || [_context.segmentStore containsDataForKey:key] || [fileManager fileExistsAtPath:[fileURL path]]) {
+        [TMDiskCache moveItemAtURLToTrash:flatFileURL];
+        return;
     }
-    
+
+    [self createDirectoryForFileURL:fileURL];
+
     NSError *error = nil;
-    BOOL success = [[NSFileManager defaultManager] setAttributes:@{ NSFileModificationDate: date }
-                                                    ofItemAtPath:[fileURL path]
-                                                           error:&error];
+    [fileManager moveItemAtURL:flatFileURL toURL:fileURL error:&error];
     TMDiskCacheError(error);
+}
 
-    if (success) {
-        NSString *key = [self keyForEncodedFileURL:fileURL];
-        if (key) {
-            [_dates setObject:date forKey:key];
-        }
-    }
+// The fan-out directories of the hashed layout are created as the first files land in them.
+- (BOOL)createDirectoryForFileURL:(NSURL *)fileURL
+{
+    NSError *error = nil;
+    BOOL success = [[NSFileManager defaultManager] createDirectoryAtURL:[fileURL URLByDeletingLastPathComponent]
+                                            withIntermediateDirectories:YES
+                                                             attributes:nil
+                                                                  error:&error];
+    TMDiskCacheError(error);
 
     return success;
 }
 
-- (BOOL)removeFileAndExecuteBlocksForKey:(NSString *)key
+- (void)reconcileIndexForKey:(NSString *)key
 {
+    [self migrateFlatFileForKey:key];
+
+    if ([_context.segmentStore containsDataForKey:key])
+        return;
+
     NSURL *fileURL = [self encodedFileURLForKey:key];
-    if (!fileURL || ![[NSFileManager defaultManager] fileExistsAtPath:[fileURL path]])
-        return NO;
+    NSArray *keys = @[ NSURLContentModificationDateKey, NSURLTotalFileAllocatedSizeKey ];
+    NSDictionary *values = [fileURL resourceValuesForKeys:keys error:NULL];
+    NSDate *date = [values objectForKey:NSURLContentModificationDateKey];
+    NSNumber *fileSize = [values objectForKey:NSURLTotalFileAllocatedSizeKey];
+
+    BOOL scheduleFlush = NO;
+
+    [self lock];
+
+    NSNumber *indexedSize = [_sizes objectForKey:key];
+    BOOL indexed = [_dates objectForKey:key] != nil;
+
+    if (date && !indexed) {
+        [_dates setObject:date forKey:key];
+        [_recency setDate:date forKey:key];
+        [_sizes setObject:fileSize ?: @0 forKey:key];
+        [self addKeyToFilter:key];
+        self.byteCount = _byteCount + [fileSize unsignedIntegerValue]; // atomic
+        scheduleFlush = [_context.index setSize:[fileSize unsignedIntegerValue] date:date forKey:key];
+    } else if (!date && indexed) {
+        [_dates removeObjectForKey:key];
+        [_recency removeKey:key];
+        [_sizes removeObjectForKey:key];
+        [_expirationDates removeObjectForKey:key];
+        [_expirations removeKey:key];
+        [_keyFilter removeKey:key];
+        self.byteCount = _byteCount - [indexedSize unsignedIntegerValue]; // atomic
+        scheduleFlush = [_context.index removeKey:key];
+    }
 
-    if (_willRemoveObjectBlock)
-        _willRemoveObjectBlock(self, key, nil, fileURL);
+    [self unlock];
 
-    BOOL trashed = [TMDiskCache moveItemAtURLToTrash:fileURL];
-    if (!trashed)
-        return NO;
-    
-    [TMDiskCache emptyTrash];
+    if (scheduleFlush)
+        [self scheduleIndexFlush];
+}
+
+// Reads only move the key in memory, the file is never touched. Like every other change they reach the index
+// journal in batches, so the order survives a relaunch while a workload that only reads does no metadata writes.
+- (void)setAccessDate:(NSDate *)date forKey:(NSString *)key
+{
+    if (!date || !key)
+        return;
+
+    BOOL scheduleFlush = NO;
+
+    [self lock];
+
+    if ([_dates objectForKey:key]) {
+        [_dates setObject:date forKey:key];
+        [_recency setDate:date forKey:key];
+        scheduleFlush = [_context.index setAccessDate:date forKey:key];
+    }
+
+    [self unlock];
+
+    if (scheduleFlush)
+        [self scheduleIndexFlush];
+}
+
+- (void)scheduleIndexFlush
+{
+    [self lock];
+    BOOL scheduled = _indexFlushScheduled;
+    _indexFlushScheduled = YES;
+    [self unlock];
+
+    if (scheduled)
+        return;
+
+    __weak TMDiskCache *weakSelf = self;
+
+    dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(TMDiskCacheIndexFlushInterval * NSEC_PER_SEC));
+    dispatch_after(time, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(void) {
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        dispatch_barrier_async(strongSelf->_queue, ^{
+            [strongSelf flushIndex];
+        });
+    });
+}
 
-    NSNumber *byteSize = [_sizes objectForKey:key];
-    if (byteSize)
-        self.byteCount = _byteCount - [byteSize unsignedIntegerValue]; // atomic
+- (void)flushIndex
+{
+    [self lock];
+    _indexFlushScheduled = NO;
+    [self unlock];
+
+    TMDiskCacheIndex *index = _context.index;
+
+    [index flush];
+
+    if (![index needsSnapshot])
+        return;
+
+    if (![self hasDirectoryToItself]) { // the journal has every instance's records, this one's dictionaries don't
+        NSMutableDictionary *dates = [[NSMutableDictionary alloc] init];
+        NSMutableDictionary *sizes = [[NSMutableDictionary alloc] init];
+        NSMutableDictionary *expirationDates = [[NSMutableDictionary alloc] init];
+
+        if ([index loadDates:dates sizes:sizes expirationDates:expirationDates])
+            [index writeSnapshotWithDates:dates sizes:sizes expirationDates:expirationDates];
+
+        return;
+    }
+
+    [self lock];
+    NSDictionary *dates = [_dates copy];
+    NSDictionary *sizes = [_sizes copy];
+    NSDictionary *expirationDates = [_expirationDates copy];
+    [self unlock];
+
+    [index writeSnapshotWithDates:dates sizes:sizes expirationDates:expirationDates];
+}
+
+// Whether this instance knows every key of the directory, which it can't if another instance with the same name
+// had the directory open alongside it at any point.
+- (BOOL)hasDirectoryToItself
+{
+    [self lock];
+    BOOL loadedAlone = _loadedAlone;
+    [self unlock];
+
+    return loadedAlone && [_context isLastOpenedInstance:_openNumber];
+}
+
+- (void)compactSegmentsIfNeeded
+{
+    if (![_context.segmentStore needsCompaction])
+        return;
+
+    [self lock];
+    BOOL scheduled = _segmentCompactionScheduled;
+    _segmentCompactionScheduled = YES;
+    [self unlock];
+
+    if (scheduled)
+        return;
+
+    __weak TMDiskCache *weakSelf = self;
+
+    dispatch_barrier_async(_queue, ^{
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
 
-    [_sizes removeObjectForKey:key];
-    [_dates removeObjectForKey:key];
+        [strongSelf->_context.segmentStore compact];
+
+        [strongSelf lock];
+        strongSelf->_segmentCompactionScheduled = NO;
+        [strongSelf unlock];
+    });
+}
+
+- (BOOL)removeFileAndExecuteBlocksForKey:(NSString *)key
+{
+    return [[self removeFilesAndExecuteBlocksForKeys:@[ key ]] count] > 0;
+}
+
+// The files of all keys are looked up and then removed in one go each, so the I/O engine can batch them. Returns
+// the indexes of the keys that were removed.
+- (NSIndexSet *)removeFilesAndExecuteBlocksForKeys:(NSArray *)keys
+{
+    uint64_t startTime = TMCacheStatisticsTime();
+    NSMutableIndexSet *removedIndexes = [[NSMutableIndexSet alloc] init];
+    NSMutableIndexSet *fileIndexes = [[NSMutableIndexSet alloc] init];
+    NSMutableArray *fileURLs = [[NSMutableArray alloc] init];
+
+    [keys enumerateObjectsUsingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+        [self migrateFlatFileForKey:key]; // or it would come back once it is moved
+
+        NSURL *fileURL = [self encodedFileURLForKey:key];
+
+        if (!fileURL)
+            return;
+
+        if ([_context.segmentStore containsDataForKey:key]) {
+            [removedIndexes addIndex:index];
+        } else {
+            [fileIndexes addIndex:index];
+            [fileURLs addObject:fileURL];
+        }
+    }];
+
+    NSArray *exists = [fileURLs count] ? [_engine fileExistsAtURLs:fileURLs] : nil;
+    NSUInteger fileIndex = 0;
+
+    for (NSUInteger index = [fileIndexes firstIndex]; index != NSNotFound; index = [fileIndexes indexGreaterThanIndex:index]) {
+        if ([[exists objectAtIndex:fileIndex++] boolValue])
+            [removedIndexes addIndex:index];
+    }
+
+    [fileIndexes removeAllIndexes];
+    [fileURLs removeAllObjects];
+
+    if (![removedIndexes count])
+        return removedIndexes;
+
+    [self lock];
+    TMDiskCacheObjectBlock willRemoveObjectBlock = _willRemoveObjectBlock;
+    TMDiskCacheObjectBlock didRemoveObjectBlock = _didRemoveObjectBlock;
+    [self unlock];
+
+    BOOL compactSegments = NO;
+
+    for (NSUInteger index = [removedIndexes firstIndex]; index != NSNotFound; index = [removedIndexes indexGreaterThanIndex:index]) {
+        NSString *key = [keys objectAtIndex:index];
+        BOOL inSegment = [_context.segmentStore containsDataForKey:key];
+        NSURL *fileURL = inSegment ? nil : [self encodedFileURLForKey:key];
+
+        if (willRemoveObjectBlock)
+            willRemoveObjectBlock(self, key, nil, fileURL);
+
+        if (!inSegment) {
+            [fileIndexes addIndex:index];
+            [fileURLs addObject:fileURL];
+        } else if ([_context.segmentStore removeDataForKey:key]) {
+            compactSegments = YES;
+        } else {
+            [removedIndexes removeIndex:index];
+        }
+    }
+
+    if (compactSegments)
+        [self compactSegmentsIfNeeded];
+
+    NSArray *removed = [fileURLs count] ? [_engine removeFilesAtURLs:fileURLs] : nil;
+    fileIndex = 0;
+
+    for (NSUInteger index = [fileIndexes firstIndex]; index != NSNotFound; index = [fileIndexes indexGreaterThanIndex:index]) {
+        if (![[removed objectAtIndex:fileIndex++] boolValue])
+            [removedIndexes removeIndex:index];
+    }
+
+    BOOL scheduleFlush = NO;
+
+    [self lock];
+
+    for (NSUInteger index = [removedIndexes firstIndex]; index != NSNotFound; index = [removedIndexes indexGreaterThanIndex:index]) {
+        NSString *key = [keys objectAtIndex:index];
+
+        NSNumber *byteSize = [_sizes objectForKey:key];
+        if (byteSize)
+            self.byteCount = _byteCount - [byteSize unsignedIntegerValue]; // atomic
+
+        if ([_dates objectForKey:key])
+            [_keyFilter removeKey:key];
+
+        [_sizes removeObjectForKey:key];
+        [_dates removeObjectForKey:key];
+        [_recency removeKey:key];
+        [_expirationDates removeObjectForKey:key];
+        [_expirations removeKey:key];
+
+        if ([_context.index removeKey:key])
+            scheduleFlush = YES;
+    }
+
+    [self unlock];
+
+    if (scheduleFlush)
+        [self scheduleIndexFlush];
+
+    [_statistics addCount:[removedIndexes count] toCounter:TMCacheStatisticsCounterRemovals];
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRemove];
+
+    for (NSUInteger index = [removedIndexes firstIndex]; index != NSNotFound; index = [removedIndexes indexGreaterThanIndex:index]) {
+        NSString *key = [keys objectAtIndex:index];
+
+        if (didRemoveObjectBlock)
+            didRemoveObjectBlock(self, key, nil, [fileIndexes containsIndex:index] ? [self encodedFileURLForKey:key] : nil);
+    }
+
+    return removedIndexes;
+}
+
+// Whole-cache methods like this one run as barriers on the queue, no work on single keys is in flight.
+- (void)trimDiskToSize:(NSUInteger)trimByteCount
+{
+    if (self.byteCount <= trimByteCount)
+        return;
+
+    [self lock];
+    NSArray *keysSortedBySize = [_sizes keysSortedByValueUsingSelector:@selector(compare:)];
+    [self unlock];
+
+    for (NSString *key in [keysSortedBySize reverseObjectEnumerator]) { // largest objects first
+        if ([self removeFileAndExecuteBlocksForKey:key])
+            [_statistics addCount:1 toCounter:TMCacheStatisticsCounterEvictions];
+
+        if (self.byteCount <= trimByteCount)
+            break;
+    }
+}
+
+- (void)trimDiskToSizeByDate:(NSUInteger)trimByteCount
+{
+    if (self.byteCount <= trimByteCount)
+        return;
+
+    [self lock];
+    NSArray *keysSortedByDate = [_recency oldestKeys:NSUIntegerMax];
+    [self unlock];
+
+    for (NSString *key in keysSortedByDate) { // oldest objects first
+        if ([self removeFileAndExecuteBlocksForKey:key])
+            [_statistics addCount:1 toCounter:TMCacheStatisticsCounterEvictions];
+
+        if (self.byteCount <= trimByteCount)
+            break;
+    }
+}
+
+- (void)trimDiskToDate:(NSDate *)trimDate
+{
+    [self lock];
+    NSArray *keys = [_recency keysOlderThanDate:trimDate]; // oldest files first, up to the trim date
+    [self unlock];
+
+    NSIndexSet *removedIndexes = [self removeFilesAndExecuteBlocksForKeys:keys];
+    [_statistics addCount:[removedIndexes count] toCounter:TMCacheStatisticsCounterEvictions];
+}
+
+- (void)trimToAgeLimitRecursively
+{
+    [self lock];
+    NSTimeInterval ageLimit = _ageLimit;
+    [self unlock];
+
+    if (ageLimit == 0.0)
+        return;
+    
+    NSDate *date = [[NSDate alloc] initWithTimeIntervalSinceNow:-ageLimit];
+    [self trimDiskToDate:date];
+    
+    __weak TMDiskCache *weakSelf = self;
+    
+    dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(ageLimit * NSEC_PER_SEC));
+    dispatch_after(time, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^(void) {
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        dispatch_barrier_async(strongSelf->_queue, ^{
+            [strongSelf trimToAgeLimitRecursively];
+        });
+    });
+}
+
+- (BOOL)isExpiredKey:(NSString *)key date:(NSDate *)now
+{
+    [self lock];
+    NSDate *expirationDate = [_expirationDates objectForKey:key];
+    [self unlock];
+
+    return expirationDate && [expirationDate compare:now] != NSOrderedDescending;
+}
+
+// Moves the expiry timer up to the given time, unless it is set to go off sooner already.
+- (void)scheduleExpiryAtTime:(NSTimeInterval)time
+{
+    if (time <= 0.0)
+        return;
+
+    [self lock];
+
+    if (_expiryTime == 0.0 || time < _expiryTime) {
+        _expiryTime = time;
+        dispatch_source_set_timer(_expiryTimer, TMCacheTimerWheelDispatchTime(time), DISPATCH_TIME_FOREVER, NSEC_PER_SEC);
+    }
+
+    [self unlock];
+}
+
+// Runs on the expiry timer. Only the keys that are due come out of the wheel, and each is removed on its own key
+// queue like the trimmer does, unless it was set again in the meantime.
+- (void)removeExpiredObjects
+{
+    NSDate *now = [[NSDate alloc] init];
+
+    [self lock];
+    _expiryTime = 0.0;
+    NSArray *keys = [_expirations advanceToTime:[now timeIntervalSinceReferenceDate]];
+    NSTimeInterval expiryTime = [_expirations nextAdvanceTime];
+    [self unlock];
+
+    [self scheduleExpiryAtTime:expiryTime];
+
+    if (![keys count])
+        return;
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    [self performBatchForKeys:keys wait:NO block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        NSMutableArray *expiredKeys = [[NSMutableArray alloc] init];
+
+        [keys enumerateObjectsAtIndexes:indexes options:0 usingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+            if ([cache isExpiredKey:key date:now])
+                [expiredKeys addObject:key];
+        }];
+
+        NSIndexSet *removedIndexes = [cache removeFilesAndExecuteBlocksForKeys:expiredKeys];
+        for (NSString *key in [expiredKeys objectsAtIndexes:removedIndexes])
+            [results setObject:key forKey:key];
+    } completion:^(TMDiskCache *cache, NSDictionary *results) {
+        if (cache)
+            [cache->_statistics addCount:[results count] toCounter:TMCacheStatisticsCounterEvictions];
+
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    }];
+}
+
+- (NSData *)dataForKey:(NSString *)key date:(NSDate *)now fileURL:(NSURL **)outFileURL
+{
+    return [self dataForKey:key date:now fileData:nil fileURL:outFileURL];
+}
+
+// Reads the files of the keys in one go, so the I/O engine can batch them, for <dataForKey:date:fileData:fileURL:>
+// to pick up. Keys that are expired or kept in a segment are left out, `NSNull` stands for a file that is missing.
+- (NSDictionary *)readFilesForKeys:(NSArray *)keys date:(NSDate *)now
+{
+    NSMutableArray *fileKeys = [[NSMutableArray alloc] init];
+    NSMutableArray *fileURLs = [[NSMutableArray alloc] init];
+
+    for (NSString *key in keys) {
+        NSURL *fileURL = [self encodedFileURLForKey:key];
+
+        if (!fileURL || [self isExpiredKey:key date:now] || [_context.segmentStore containsDataForKey:key])
+            continue;
+
+        [self migrateFlatFileForKey:key];
+
+        [fileKeys addObject:key];
+        [fileURLs addObject:fileURL];
+    }
+
+    if (![fileKeys count])
+        return nil;
+
+    return [[NSDictionary alloc] initWithObjects:[_engine readFilesAtURLs:fileURLs] forKeys:fileKeys];
+}
+
+// Pass the file's data if it was already read, or nil to have it read now. Files are never changed in place, a
+// write replaces the file and a removal unlinks it, so data mapping a file keeps its contents for as long as it lives.
+- (NSData *)dataForKey:(NSString *)key date:(NSDate *)now fileData:(id)fileData fileURL:(NSURL **)outFileURL
+{
+    uint64_t startTime = TMCacheStatisticsTime();
+    NSURL *fileURL = [self encodedFileURLForKey:key];
+    NSData *data = nil;
+
+    if ([self isExpiredKey:key date:now]) { // a miss, whether or not the timer got to it yet
+        if ([self removeFileAndExecuteBlocksForKey:key])
+            [_statistics addCount:1 toCounter:TMCacheStatisticsCounterEvictions];
+
+        fileURL = nil;
+    } else {
+        data = [_context.segmentStore dataForKey:key];
+
+        if (data) {
+            fileURL = nil;
+        } else if (fileURL) {
+            if (!fileData) { // not read ahead by readFilesForKeys:date:
+                [self migrateFlatFileForKey:key];
+                fileData = [self readFileAtURL:fileURL];
+            }
+
+            data = fileData == [NSNull null] ? nil : fileData;
+
+            if (data && ![self entryData:data belongsToKey:key]) // another key with the same hash
+                data = nil;
+        }
+    }
+
+    if (data)
+        [self setAccessDate:now forKey:key];
+
+    [_statistics addCount:1 toCounter:data ? TMCacheStatisticsCounterHits : TMCacheStatisticsCounterMisses];
+    [_statistics addCount:[data length] toCounter:TMCacheStatisticsCounterBytesRead];
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRead];
+
+    if (outFileURL)
+        *outFileURL = fileURL;
+
+    return data;
+}
+
+// Only files in the hashed layout carry their key. Any other entry is taken to be the key's, its name says so.
+- (BOOL)entryData:(NSData *)data belongsToKey:(NSString *)key
+{
+    TMDiskCacheEntryHeader header;
+    NSString *entryKey = nil;
+
+    if (!TMDiskCacheReadEntryHeader(data, &header) || !(header.flags & TMDiskCacheEntryKeyed))
+        return YES;
+
+    return TMDiskCacheReadEntryKey(data, &header, &entryKey) != NSNotFound && [entryKey isEqualToString:key];
+}
+
+// Data stored with -setData:forKey: has no header and isn't a keyed archive, it is returned as is. In the hashed
+// layout it has a header with its key, which readers never see.
+- (NSData *)storedDataWithEntryData:(NSData *)data
+{
+    TMDiskCacheEntryHeader header;
+
+    if (!TMDiskCacheReadEntryHeader(data, &header) || !(header.flags & TMDiskCacheEntryRawData))
+        return data;
+
+    NSUInteger payloadOffset = TMDiskCacheReadEntryKey(data, &header, NULL);
+    if (payloadOffset == NSNotFound)
+        return nil;
+
+    return [data subdataWithRange:NSMakeRange(payloadOffset, [data length] - payloadOffset)];
+}
+
+- (id <NSCoding>)objectWithEntryData:(NSData *)data
+{
+    TMDiskCacheEntryHeader header;
+
+    if (TMDiskCacheReadEntryHeader(data, &header)) {
+        if (header.flags & TMDiskCacheEntryRawData)
+            return [self storedDataWithEntryData:data];
+
+        id <TMCacheSerializer> serializer = self.serializer;
+        if (serializer.serializerID != header.serializerID)
+            serializer = TMDiskCacheSerializerWithID(header.serializerID);
+
+        NSUInteger payloadOffset = TMDiskCacheReadEntryKey(data, &header, NULL);
+        if (payloadOffset == NSNotFound)
+            return nil;
+
+        NSRange payloadRange = NSMakeRange(payloadOffset, [data length] - payloadOffset);
+        NSData *payload = [data subdataWithRange:payloadRange];
+
+        if (header.flags & TMDiskCacheEntryCompressed)
+            payload = TMDiskCacheDecompressedData(payload);
+
+        return payload ? [serializer objectWithData:payload] : nil;
+    }
+
+    if (!TMDiskCacheDataIsKeyedArchive(data))
+        return data;
+
+    @try {
+        return [NSKeyedUnarchiver unarchiveObjectWithData:data];
+    }
+    @catch (NSException *exception) {
+        return nil;
+    }
+}
+
+// A key passed in is written to the header.
+- (NSData *)entryDataWithObject:(id <NSCoding>)object key:(NSString *)key serializer:(id <TMCacheSerializer>)serializer
+              compressionThreshold:(NSUInteger)compressionThreshold
+{
+    NSData *payload = [serializer dataWithObject:object];
+
+    if (!payload) {
+        serializer = [[TMCacheKeyedArchiveSerializer alloc] init];
+        payload = [serializer dataWithObject:object];
+    }
+
+    if (!payload)
+        return nil;
+
+    uint8_t flags = 0;
+
+    if (compressionThreshold > 0 && [payload length] >= compressionThreshold) {
+        NSData *compressedPayload = TMDiskCacheCompressedData(payload);
+
+        if (compressedPayload) {
+            payload = compressedPayload;
+            flags |= TMDiskCacheEntryCompressed;
+        }
+    }
+
+    return TMDiskCacheEntryData(payload, serializer.serializerID, flags, key);
+}
+
+- (id <NSCoding>)objectForKey:(NSString *)key date:(NSDate *)now fileURL:(NSURL **)outFileURL
+{
+    return [self objectForKey:key date:now fileData:nil fileURL:outFileURL];
+}
+
+- (id <NSCoding>)objectForKey:(NSString *)key date:(NSDate *)now fileData:(id)fileData fileURL:(NSURL **)outFileURL
+{
+    NSURL *fileURL = nil;
+    NSData *data = [self dataForKey:key date:now fileData:fileData fileURL:&fileURL];
+    id <NSCoding> object = data ? [self objectWithEntryData:data] : nil;
+
+    if (data && !object) { // unreadable
+        if (fileURL)
+            [self removeFileAtURL:fileURL];
+        else
+            [_context.segmentStore removeDataForKey:key];
+    }
+
+    if (outFileURL)
+        *outFileURL = fileURL;
+
+    return object;
+}
+
+- (NSURL *)existingFileURLForKey:(NSString *)key date:(NSDate *)now
+{
+    if ([self isExpiredKey:key date:now]) {
+        if ([self removeFileAndExecuteBlocksForKey:key])
+            [_statistics addCount:1 toCounter:TMCacheStatisticsCounterEvictions];
+
+        return nil;
+    }
+
+    if ([_context.segmentStore containsDataForKey:key]) {
+        [self setAccessDate:now forKey:key];
+        return nil; // no file of its own
+    }
+
+    [self migrateFlatFileForKey:key];
+
+    NSURL *fileURL = [self encodedFileURLForKey:key];
+
+    if (![self fileExistsAtURL:fileURL])
+        return nil;
+
+    [self setAccessDate:now forKey:key];
+
+    return fileURL;
+}
+
+#pragma mark - Private Trimmer Methods -
+
+// Starts the background trimmer if the writes so far went over the byte limit. A batch of writes only checks once.
+- (void)trimToByteLimitIfNeeded
+{
+    [self lock];
+
+    BOOL startTrimming = !_trimming && _byteLimit > 0 && _byteCount > _byteLimit;
+    if (startTrimming)
+        _trimming = YES;
+
+    [self unlock];
+
+    if (startTrimming)
+        [self trimNextIncrement];
+}
+
+// Called with the lock held.
+- (NSUInteger)trimTarget
+{
+    NSUInteger byteLimit = _byteLimit ?: _hardByteLimit;
+
+    if (_trimTargetByteCount > 0 && _trimTargetByteCount < byteLimit)
+        return _trimTargetByteCount;
+
+    return byteLimit - byteLimit / 10;
+}
+
+// Removes the next few least recently used objects, each on its own key queue so nothing else has to wait, and
+// goes on with the next few once they are gone. Objects used or replaced since they were picked are skipped.
+// The trimmer stops at the target, or when an increment couldn't remove anything.
+- (void)trimNextIncrement
+{
+    [self lock];
+
+    NSUInteger target = [self trimTarget];
+    NSArray *keys = nil;
+    NSMutableArray *dates = nil;
+
+    if (target > 0 && _byteCount > target) {
+        keys = [_recency oldestKeys:TMDiskCacheTrimIncrement];
+        dates = [[NSMutableArray alloc] initWithCapacity:[keys count]];
+
+        for (NSString *key in keys)
+            [dates addObject:[_dates objectForKey:key] ?: [NSNull null]];
+    }
+
+    if (![keys count]) {
+        _trimming = NO;
+        pthread_cond_broadcast(&_trimCondition);
+    }
+
+    [self unlock];
+
+    if (![keys count])
+        return;
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    [self performBatchForKeys:keys wait:NO block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        [keys enumerateObjectsAtIndexes:indexes options:0 usingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+            if (cache.byteCount <= target) {
+                *stop = YES;
+                return;
+            }
+
+            [cache lock];
+            BOOL unused = [[dates objectAtIndex:index] isEqual:[cache->_dates objectForKey:key]];
+            [cache unlock];
+
+            if (unused && [cache removeFileAndExecuteBlocksForKey:key])
+                [results setObject:key forKey:key];
+        }];
+    } completion:^(TMDiskCache *cache, NSDictionary *results) {
+        if (cache) {
+            [cache->_statistics addCount:[results count] toCounter:TMCacheStatisticsCounterEvictions];
+
+            [cache lock];
+            BOOL stalled = [results count] == 0 && cache->_byteCount > target;
+            if (stalled)
+                cache->_trimming = NO;
+            pthread_cond_broadcast(&cache->_trimCondition);
+            [cache unlock];
+
+            if (!stalled)
+                [cache trimNextIncrement];
+        }
+
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    }];
+}
+
+// Holds up a writer while the cache is over its hard limit, until the trimmer has brought it back below.
+- (void)waitForHardByteLimit
+{
+    BOOL restarted = NO;
+
+    [self lock];
+
+    while (_hardByteLimit > 0 && _byteCount > _hardByteLimit) {
+        if (!_trimming) {
+            if (restarted)
+                break; // the trimmer is stuck, waiting wouldn't help
+
+            restarted = YES;
+            _trimming = YES;
+
+            [self unlock];
+            [self trimNextIncrement];
+            [self lock];
+
+            continue;
+        }
+
+        pthread_cond_wait(&_trimCondition, &_lock);
+    }
+
+    [self unlock];
+}
+
+// Makes room for an asynchronous write, on the key queue it writes on. Waiting for the trimmer there could wait
+// forever, since the trimmer may need this very queue, so it evicts the least recently used objects this queue
+// owns itself. If the oldest ones all belong to other queues the write goes ahead and leaves them to the trimmer.
+- (void)trimToHardByteLimitOnQueueForKey:(NSString *)key
+{
+    dispatch_queue_t queue = [_context queueForKey:key];
+
+    while (YES) {
+        NSMutableArray *ownKeys = [[NSMutableArray alloc] init];
+
+        [self lock];
+
+        if (_hardByteLimit > 0 && _byteCount > _hardByteLimit) {
+            NSUInteger excess = _byteCount - _hardByteLimit;
+            NSUInteger freed = 0;
+
+            for (NSString *oldKey in [_recency oldestKeys:TMDiskCacheTrimIncrement * TMDiskCacheKeyQueueCount]) {
+                if ([_context queueForKey:oldKey] != queue)
+                    continue;
+
+                id size = [_sizes objectForKey:oldKey];
+                if ([size isKindOfClass:[NSNumber class]])
+                    freed += [size unsignedIntegerValue];
+
+                [ownKeys addObject:oldKey];
+
+                if (freed >= excess)
+                    break;
+            }
+        }
+
+        [self unlock];
+
+        if (![ownKeys count])
+            return;
+
+        NSUInteger evictions = [[self removeFilesAndExecuteBlocksForKeys:ownKeys] count];
+        [_statistics addCount:evictions toCounter:TMCacheStatisticsCounterEvictions];
+
+        if (evictions == 0)
+            return;
+    }
+}
+
+// Runs the block once on every key queue that owns some of the keys, with the positions of those keys, so a batch
+// costs one hop per queue instead of one per key. Each run fills a dictionary of its own and the completion gets
+// them merged, on the calling thread if it waits and concurrently on the queue if not. The completion is always
+// called, with a nil cache if the cache went away in the meantime.
+- (void)performBatchForKeys:(NSArray *)keys wait:(BOOL)wait
+                      block:(void (^)(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results))block
+                 completion:(void (^)(TMDiskCache *cache, NSDictionary *results))completion
+{
+    NSArray *indexesByQueue = [_context indexesByQueueForKeys:keys];
+    NSMutableArray *resultsByQueue = [[NSMutableArray alloc] initWithCapacity:TMDiskCacheKeyQueueCount];
+    dispatch_group_t group = dispatch_group_create();
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    __weak TMDiskCache *weakSelf = self;
+
+    for (NSUInteger i = 0; i < TMDiskCacheKeyQueueCount; i++) {
+        NSIndexSet *indexes = [indexesByQueue objectAtIndex:i];
+        NSMutableDictionary *results = [[NSMutableDictionary alloc] init];
+        [resultsByQueue addObject:results];
+
+        if (![indexes count])
+            continue;
+
+        dispatch_group_async(group, [_context queueAtIndex:i], ^{
+            TMDiskCache *strongSelf = weakSelf;
+            if (!strongSelf)
+                return;
+
+            [strongSelf->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+            block(strongSelf, indexes, results);
+        });
+    }
+
+    void (^finish)(void) = ^{
+        NSMutableDictionary *results = [[NSMutableDictionary alloc] init];
+        for (NSDictionary *queueResults in resultsByQueue)
+            [results addEntriesFromDictionary:queueResults];
+
+        if (completion)
+            completion(weakSelf, results);
+    };
+
+    if (wait) {
+        dispatch_group_wait(group, DISPATCH_TIME_FOREVER);
+        finish();
+    } else {
+        dispatch_group_notify(group, _queue, finish);
+    }
+
+    #if !OS_OBJECT_USE_OBJC
+    dispatch_release(group);
+    #endif
+}
+
+// Pass nil data to have the object encoded by the serializer, and a nil expiration date for an object that never
+// expires. Writing a key replaces the expiration date it had before.
+- (NSURL *)writeObject:(id <NSCoding>)object data:(NSData *)data forKey:(NSString *)key date:(NSDate *)now
+        expirationDate:(NSDate *)expirationDate
+{
+    NSArray *fileURLs = [self writeObjects:@[ object ?: [NSNull null] ] data:@[ data ?: [NSNull null] ] forKeys:@[ key ]
+                                      date:now expirationDate:expirationDate];
+    id fileURL = [fileURLs objectAtIndex:0];
+
+    return fileURL == [NSNull null] ? nil : fileURL;
+}
+
+// The same for many keys, with `NSNull` for nil objects and data. The files are written in one go, so the I/O
+// engine can batch them. Returns the file URL of each key, `NSNull` where it has none or was not written.
+- (NSArray *)writeObjects:(NSArray *)objects data:(NSArray *)data forKeys:(NSArray *)keys date:(NSDate *)now
+           expirationDate:(NSDate *)expirationDate
+{
+    uint64_t startTime = TMCacheStatisticsTime();
+    NSUInteger count = [keys count];
+
+    [self lock];
+    TMDiskCacheObjectBlock willAddObjectBlock = _willAddObjectBlock;
+    TMDiskCacheObjectBlock didAddObjectBlock = _didAddObjectBlock;
+    NSUInteger segmentByteLimit = _segmentByteLimit;
+    id <TMCacheSerializer> serializer = _serializer;
+    NSUInteger compressionThreshold = _compressionThreshold;
+    TMDiskCacheDurability durability = _durability;
+    [self unlock];
+
+    NSMutableArray *fileURLs = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray *entries = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray *sizes = [[NSMutableArray alloc] initWithCapacity:count]; // on disk, NSNull if not written
+    NSMutableIndexSet *fileIndexes = [[NSMutableIndexSet alloc] init];
+    NSMutableArray *replacedFileURLs = [[NSMutableArray alloc] init];
+
+    for (NSUInteger i = 0; i < count; i++) {
+        NSString *key = [keys objectAtIndex:i];
+        id object = [objects objectAtIndex:i];
+        id entry = [data objectAtIndex:i];
+        NSURL *fileURL = [self encodedFileURLForKey:key];
+
+        if (object == [NSNull null])
+            object = nil;
+
+        if (willAddObjectBlock)
+            willAddObjectBlock(self, key, object, fileURL);
+
+        NSString *entryKey = _fileLayout == TMDiskCacheFileLayoutHashed ? key : nil;
+
+        if (entry == [NSNull null])
+            entry = [self entryDataWithObject:object key:entryKey serializer:serializer compressionThreshold:compressionThreshold];
+        else if (entryKey)
+            entry = TMDiskCacheEntryData(entry, 0, TMDiskCacheEntryRawData, entryKey);
+
+        [sizes addObject:[NSNull null]];
+
+        if (segmentByteLimit > 0 && [entry length] <= segmentByteLimit) {
+            NSUInteger recordLength = [_context.segmentStore setData:entry forKey:key];
+
+            if (recordLength > 0) {
+                if (fileURL)
+                    [replacedFileURLs addObject:fileURL]; // stored as a file before, if at all
+
+                [sizes replaceObjectAtIndex:i withObject:@(recordLength)];
+                [self compactSegmentsIfNeeded]; // the value may have replaced an older one
+            }
+
+            fileURL = nil;
+        } else if (fileURL && entry) {
+            [fileIndexes addIndex:i];
+        }
+
+        [fileURLs addObject:fileURL ?: [NSNull null]];
+        [entries addObject:entry ?: [NSNull null]];
+    }
+
+    if ([replacedFileURLs count])
+        [_engine removeFilesAtURLs:replacedFileURLs];
+
+    [self writeEntries:entries toURLs:fileURLs atIndexes:fileIndexes durability:durability sizes:sizes];
+
+    if (_fileLayout == TMDiskCacheFileLayoutHashed) { // the first file in its directory
+        NSIndexSet *retryIndexes = [fileIndexes indexesPassingTest:^BOOL(NSUInteger index, BOOL *stop) {
+            return [sizes objectAtIndex:index] == [NSNull null] && [self createDirectoryForFileURL:[fileURLs objectAtIndex:index]];
+        }];
+
+        [self writeEntries:entries toURLs:fileURLs atIndexes:retryIndexes durability:durability sizes:sizes];
+    }
+
+    for (NSUInteger i = 0; i < count; i++) {
+        NSString *key = [keys objectAtIndex:i];
+        id object = [objects objectAtIndex:i];
+        NSData *entry = [entries objectAtIndex:i];
+        NSURL *fileURL = [fileURLs objectAtIndex:i];
+        NSNumber *diskFileSize = [sizes objectAtIndex:i];
+
+        if (object == [NSNull null])
+            object = nil;
+
+        if ((id)fileURL == [NSNull null])
+            fileURL = nil;
+
+        if ((id)diskFileSize != [NSNull null]) {
+            if ([fileIndexes containsIndex:i] && [_context.segmentStore removeDataForKey:key])
+                [self compactSegmentsIfNeeded];
+
+            [self lock];
+
+            BOOL indexed = [_dates objectForKey:key] != nil;
+
+            [_dates setObject:now forKey:key];
+            [_recency setDate:now forKey:key];
+
+            if (!indexed)
+                [self addKeyToFilter:key];
+
+            NSNumber *oldEntry = [_sizes objectForKey:key];
+
+            if ([oldEntry isKindOfClass:[NSNumber class]]){
+                self.byteCount = _byteCount - [oldEntry unsignedIntegerValue];
+            }
+
+            [_sizes setObject:diskFileSize ?: @0 forKey:key];
+            self.byteCount = _byteCount + [diskFileSize unsignedIntegerValue]; // atomic
+
+            BOOL scheduleFlush = [_context.index setSize:[diskFileSize unsignedIntegerValue] date:now forKey:key];
+
+            NSTimeInterval expiryTime = 0.0;
+
+            if (expirationDate) {
+                [_expirationDates setObject:expirationDate forKey:key];
+                [_expirations setExpirationTime:[expirationDate timeIntervalSinceReferenceDate] forKey:key];
+                [_context.index setExpirationDate:expirationDate forKey:key];
+                expiryTime = [_expirations nextAdvanceTime];
+            } else if ([_expirationDates objectForKey:key]) {
+                [_expirationDates removeObjectForKey:key];
+                [_expirations removeKey:key];
+            }
+
+            [self unlock];
+
+            if (scheduleFlush)
+                [self scheduleIndexFlush];
+
+            [self scheduleExpiryAtTime:expiryTime];
+
+            [_statistics addCount:1 toCounter:TMCacheStatisticsCounterWrites];
+            [_statistics addCount:[entry length] toCounter:TMCacheStatisticsCounterBytesWritten];
+            [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationWrite];
+        } else {
+            fileURL = nil;
+            [fileURLs replaceObjectAtIndex:i withObject:[NSNull null]];
+        }
+
+        if (didAddObjectBlock)
+            didAddObjectBlock(self, key, object, fileURL);
+    }
+
+    return fileURLs;
+}
+
+// For the batch setters. A key given more than once is written once, with the last object given for it.
+- (void)writeObjectsAtIndexes:(NSIndexSet *)indexes objects:(NSArray *)objects forKeys:(NSArray *)keys date:(NSDate *)now
+{
+    NSMutableDictionary *lastIndexes = [[NSMutableDictionary alloc] initWithCapacity:[indexes count]];
+
+    [keys enumerateObjectsAtIndexes:indexes options:0 usingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+        [lastIndexes setObject:@(index) forKey:key];
+    }];
+
+    NSIndexSet *writeIndexes = [indexes indexesPassingTest:^BOOL(NSUInteger index, BOOL *stop) {
+        return [[lastIndexes objectForKey:[keys objectAtIndex:index]] unsignedIntegerValue] == index;
+    }];
 
-    if (_didRemoveObjectBlock)
-        _didRemoveObjectBlock(self, key, nil, fileURL);
+    NSMutableArray *data = [[NSMutableArray alloc] initWithCapacity:[writeIndexes count]];
+    for (NSUInteger i = 0; i < [writeIndexes count]; i++)
+        [data addObject:[NSNull null]];
 
-    return YES;
+    [self writeObjects:[objects objectsAtIndexes:writeIndexes] data:data forKeys:[keys objectsAtIndexes:writeIndexes]
+                  date:now expirationDate:nil];
 }
 
-- (void)trimDiskToSize:(NSUInteger)trimByteCount
+// Sets the size of each entry written into its file, and leaves NSNull for the ones that could not be. Files that
+// have to be synced go through the file writer one by one, the others to the I/O engine all at once.
+- (void)writeEntries:(NSArray *)entries toURLs:(NSArray *)fileURLs atIndexes:(NSIndexSet *)indexes
+          durability:(TMDiskCacheDurability)durability sizes:(NSMutableArray *)sizes
 {
-    if (_byteCount <= trimByteCount)
+    if (![indexes count])
         return;
 
-    NSArray *keysSortedBySize = [_sizes keysSortedByValueUsingSelector:@selector(compare:)];
+    NSArray *data = [entries objectsAtIndexes:indexes];
+    NSArray *urls = [fileURLs objectsAtIndexes:indexes];
+    NSArray *writtenSizes = nil;
 
-    for (NSString *key in [keysSortedBySize reverseObjectEnumerator]) { // largest objects first
-        [self removeFileAndExecuteBlocksForKey:key];
+    if (durability == TMDiskCacheDurabilityNone)
+        writtenSizes = [_engine writeData:data toURLs:urls];
+    else // the whole batch shares one sync pass
+        writtenSizes = [_context.fileWriter writeData:data toURLs:urls
+                                          groupCommit:durability == TMDiskCacheDurabilityGroupCommit];
 
-        if (_byteCount <= trimByteCount)
-            break;
-    }
+    __block NSUInteger writeIndex = 0;
+
+    [indexes enumerateIndexesUsingBlock:^(NSUInteger index, BOOL *stop) {
+        [sizes replaceObjectAtIndex:index withObject:[writtenSizes objectAtIndex:writeIndex++]];
+    }];
 }
 
-- (void)trimDiskToSizeByDate:(NSUInteger)trimByteCount
+- (void)removeAllFilesAndExecuteBlocks
 {
-    if (_byteCount <= trimByteCount)
-        return;
-
-    NSArray *keysSortedByDate = [_dates keysSortedByValueUsingSelector:@selector(compare:)];
-
-    for (NSString *key in keysSortedByDate) { // oldest objects first
-        [self removeFileAndExecuteBlocksForKey:key];
-
-        if (_byteCount <= trimByteCount)
-            break;
-    }
+    [self lock];
+    TMDiskCacheBlock willRemoveAllObjectsBlock = _willRemoveAllObjectsBlock;
+    TMDiskCacheBlock didRemoveAllObjectsBlock = _didRemoveAllObjectsBlock;
+    [self unlock];
+
+    if (willRemoveAllObjectsBlock)
+        willRemoveAllObjectsBlock(self);
+
+    [_context.segmentStore removeAllData];
+
+    [TMDiskCache moveItemAtURLToTrash:_cacheURL]; // one rename, however many files there are
+
+    [self createCacheDirectory];
+
+    [self lock];
+    [_dates removeAllObjects];
+    [_sizes removeAllObjects];
+    [_recency removeAllKeys];
+    [_expirationDates removeAllObjects];
+    [_expirations removeAllKeys];
+    [_keyFilter removeAllKeys];
+    [_context.index removeAllRecords];
+    self.byteCount = 0; // atomic
+    pthread_cond_broadcast(&_trimCondition);
+    [self unlock];
+
+    if (didRemoveAllObjectsBlock)
+        didRemoveAllObjectsBlock(self);
 }
 
-- (void)trimDiskToDate:(NSDate *)trimDate
+- (void)enumerateFilesWithBlock:(TMDiskCacheObjectBlock)block
 {
-    NSArray *keysSortedByDate = [_dates keysSortedByValueUsingSelector:@selector(compare:)];
-    
-    for (NSString *key in keysSortedByDate) { // oldest files first
-        NSDate *accessDate = [_dates objectForKey:key];
-        if (!accessDate)
+    NSDate *now = [[NSDate alloc] init];
+
+    [self lock];
+    NSArray *keysSortedByDate = [_recency oldestKeys:NSUIntegerMax];
+    [self unlock];
+
+    for (NSString *key in keysSortedByDate) {
+        if ([self isExpiredKey:key date:now])
             continue;
-        
-        if ([accessDate compare:trimDate] == NSOrderedAscending) { // older than trim date
-            [self removeFileAndExecuteBlocksForKey:key];
-        } else {
-            break;
-        }
+
+        NSURL *fileURL = [_context.segmentStore containsDataForKey:key] ? nil : [self encodedFileURLForKey:key];
+        block(self, key, nil, fileURL);
     }
 }
 
-- (void)trimToAgeLimitRecursively
+#pragma mark - Public Asynchronous Methods -
+
+- (void)objectForKey:(NSString *)key block:(TMDiskCacheObjectBlock)block
 {
-    if (_ageLimit == 0.0)
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!key || !block)
         return;
-    
-    NSDate *date = [[NSDate alloc] initWithTimeIntervalSinceNow:-_ageLimit];
-    [self trimDiskToDate:date];
-    
+
     __weak TMDiskCache *weakSelf = self;
-    
-    dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_ageLimit * NSEC_PER_SEC));
-    dispatch_after(time, _queue, ^(void) {
+
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_async([_context queueForKey:key], ^{
         TMDiskCache *strongSelf = weakSelf;
-        [strongSelf trimToAgeLimitRecursively];
+        if (!strongSelf)
+            return;
+
+        [strongSelf->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+
+        NSURL *fileURL = nil;
+        id <NSCoding> object = [strongSelf objectForKey:key date:now fileURL:&fileURL];
+
+        block(strongSelf, key, object, fileURL);
     });
 }
 
-#pragma mark - Public Asynchronous Methods -
-
-- (void)objectForKey:(NSString *)key block:(TMDiskCacheObjectBlock)block
+- (void)dataForKey:(NSString *)key block:(TMDiskCacheObjectBlock)block
 {
     NSDate *now = [[NSDate alloc] init];
 
@@ -399,28 +2471,19 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
 
     __weak TMDiskCache *weakSelf = self;
 
-    dispatch_async(_queue, ^{
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_async([_context queueForKey:key], ^{
         TMDiskCache *strongSelf = weakSelf;
         if (!strongSelf)
             return;
 
-        NSURL *fileURL = [strongSelf encodedFileURLForKey:key];
-        id <NSCoding> object = nil;
-
-        if ([[NSFileManager defaultManager] fileExistsAtPath:[fileURL path]]) {
-            @try {
-                object = [NSKeyedUnarchiver unarchiveObjectWithFile:[fileURL path]];
-            }
-            @catch (NSException *exception) {
-                NSError *error = nil;
-                [[NSFileManager defaultManager] removeItemAtPath:[fileURL path] error:&error];
-                TMDiskCacheError(error);
-            }
+        [strongSelf->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
 
-            [strongSelf setFileModificationDate:now forURL:fileURL];
-        }
+        NSURL *fileURL = nil;
+        NSData *data = [strongSelf storedDataWithEntryData:[strongSelf dataForKey:key date:now fileURL:&fileURL]];
 
-        block(strongSelf, key, object, fileURL);
+        block(strongSelf, key, data, fileURL);
     });
 }
 
@@ -433,78 +2496,96 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
 
     __weak TMDiskCache *weakSelf = self;
 
-    dispatch_async(_queue, ^{
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_async([_context queueForKey:key], ^{
         TMDiskCache *strongSelf = weakSelf;
         if (!strongSelf)
             return;
 
-        NSURL *fileURL = [strongSelf encodedFileURLForKey:key];
+        [strongSelf->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
 
-        if ([[NSFileManager defaultManager] fileExistsAtPath:[fileURL path]]) {
-            [strongSelf setFileModificationDate:now forURL:fileURL];
-        } else {
-            fileURL = nil;
-        }
+        NSURL *fileURL = [strongSelf existingFileURLForKey:key date:now];
 
         block(strongSelf, key, nil, fileURL);
     });
 }
 
 - (void)setObject:(id <NSCoding>)object forKey:(NSString *)key block:(TMDiskCacheObjectBlock)block
+{
+    [self setObject:object forKey:key ttl:0.0 block:block];
+}
+
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl block:(TMDiskCacheObjectBlock)block
 {
     NSDate *now = [[NSDate alloc] init];
+    NSDate *expirationDate = ttl > 0.0 ? [[NSDate alloc] initWithTimeInterval:ttl sinceDate:now] : nil;
 
     if (!key || !object)
         return;
 
+    [self beginWritingKeys:@[ key ]];
+
     UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
     __weak TMDiskCache *weakSelf = self;
 
-    dispatch_async(_queue, ^{
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_async([_context queueForKey:key], ^{
         TMDiskCache *strongSelf = weakSelf;
         if (!strongSelf) {
             [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
             return;
         }
 
-        NSURL *fileURL = [strongSelf encodedFileURLForKey:key];
+        [strongSelf->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
 
-        if (strongSelf->_willAddObjectBlock)
-            strongSelf->_willAddObjectBlock(strongSelf, key, object, fileURL);
+        [strongSelf trimToHardByteLimitOnQueueForKey:key];
 
-        BOOL written = [NSKeyedArchiver archiveRootObject:object toFile:[fileURL path]];
+        NSURL *fileURL = [strongSelf writeObject:object data:nil forKey:key date:now expirationDate:expirationDate];
+        [strongSelf endWritingKey:key];
+        [strongSelf trimToByteLimitIfNeeded];
 
-        if (written) {
-            [strongSelf setFileModificationDate:now forURL:fileURL];
+        if (block)
+            block(strongSelf, key, object, fileURL);
 
-            NSError *error = nil;
-            NSDictionary *values = [fileURL resourceValuesForKeys:@[ NSURLTotalFileAllocatedSizeKey ] error:&error];
-            TMDiskCacheError(error);
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    });
+}
 
-            NSNumber *diskFileSize = [values objectForKey:NSURLTotalFileAllocatedSizeKey];
-            if (diskFileSize) {
-                NSNumber *oldEntry = [strongSelf->_sizes objectForKey:key];
-                
-                if ([oldEntry isKindOfClass:[NSNumber class]]){
-                    strongSelf.byteCount = strongSelf->_byteCount - [oldEntry unsignedIntegerValue];
-                }
-                
-                [strongSelf->_sizes setObject:diskFileSize forKey:key];
-                strongSelf.byteCount = strongSelf->_byteCount + [diskFileSize unsignedIntegerValue]; // atomic
-            }
-            
-            if (strongSelf->_byteLimit > 0 && strongSelf->_byteCount > strongSelf->_byteLimit)
-                [strongSelf trimToSizeByDate:strongSelf->_byteLimit block:nil];
-        } else {
-            fileURL = nil;
+- (void)setData:(NSData *)data forKey:(NSString *)key block:(TMDiskCacheObjectBlock)block
+{
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!key || !data)
+        return;
+
+    [self beginWritingKeys:@[ key ]];
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    __weak TMDiskCache *weakSelf = self;
+
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_async([_context queueForKey:key], ^{
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf) {
+            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+            return;
         }
 
-        if (strongSelf->_didAddObjectBlock)
-            strongSelf->_didAddObjectBlock(strongSelf, key, object, written ? fileURL : nil);
+        [strongSelf->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+
+        [strongSelf trimToHardByteLimitOnQueueForKey:key];
+
+        NSURL *fileURL = [strongSelf writeObject:data data:data forKey:key date:now expirationDate:nil];
+        [strongSelf endWritingKey:key];
+        [strongSelf trimToByteLimitIfNeeded];
 
         if (block)
-            block(strongSelf, key, object, fileURL);
+            block(strongSelf, key, data, fileURL);
 
         [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
     });
@@ -519,13 +2600,17 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
 
     __weak TMDiskCache *weakSelf = self;
 
-    dispatch_async(_queue, ^{
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_async([_context queueForKey:key], ^{
         TMDiskCache *strongSelf = weakSelf;
         if (!strongSelf) {
             [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
             return;
         }
 
+        [strongSelf->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+
         NSURL *fileURL = [strongSelf encodedFileURLForKey:key];
         [strongSelf removeFileAndExecuteBlocksForKey:key];
 
@@ -536,6 +2621,74 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
     });
 }
 
+- (void)objectsForKeys:(NSArray *)keys block:(TMDiskCacheObjectsBlock)block
+{
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!keys || !block)
+        return;
+
+    [self performBatchForKeys:keys wait:NO block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        NSDictionary *files = [cache readFilesForKeys:[keys objectsAtIndexes:indexes] date:now];
+
+        [keys enumerateObjectsAtIndexes:indexes options:0 usingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+            id <NSCoding> object = [cache objectForKey:key date:now fileData:[files objectForKey:key] fileURL:NULL];
+            if (object)
+                [results setObject:object forKey:key];
+        }];
+    } completion:^(TMDiskCache *cache, NSDictionary *results) {
+        if (cache)
+            block(cache, results);
+    }];
+}
+
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys block:(TMDiskCacheObjectsBlock)block
+{
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!objects || !keys || [objects count] != [keys count])
+        return;
+
+    [self beginWritingKeys:keys];
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    [self performBatchForKeys:keys wait:NO block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        [cache trimToHardByteLimitOnQueueForKey:[keys objectAtIndex:[indexes firstIndex]]];
+        [cache writeObjectsAtIndexes:indexes objects:objects forKeys:keys date:now];
+
+        [keys enumerateObjectsAtIndexes:indexes options:0 usingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+            [cache endWritingKey:key];
+        }];
+    } completion:^(TMDiskCache *cache, NSDictionary *results) {
+        if (cache) {
+            [cache trimToByteLimitIfNeeded];
+
+            if (block)
+                block(cache, [[NSDictionary alloc] initWithObjects:objects forKeys:keys]);
+        }
+
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    }];
+}
+
+- (void)removeObjectsForKeys:(NSArray *)keys block:(TMDiskCacheBlock)block
+{
+    if (!keys)
+        return;
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    [self performBatchForKeys:keys wait:NO block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        [cache removeFilesAndExecuteBlocksForKeys:[keys objectsAtIndexes:indexes]];
+    } completion:^(TMDiskCache *cache, NSDictionary *results) {
+        if (cache && block)
+            block(cache);
+
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    }];
+}
+
 - (void)trimToSize:(NSUInteger)trimByteCount block:(TMDiskCacheBlock)block
 {
     if (trimByteCount == 0) {
@@ -547,7 +2700,7 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
     
     __weak TMDiskCache *weakSelf = self;
     
-    dispatch_async(_queue, ^{
+    dispatch_barrier_async(_queue, ^{
         TMDiskCache *strongSelf = weakSelf;
         if (!strongSelf) {
             [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
@@ -577,7 +2730,7 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
 
     __weak TMDiskCache *weakSelf = self;
 
-    dispatch_async(_queue, ^{
+    dispatch_barrier_async(_queue, ^{
         TMDiskCache *strongSelf = weakSelf;
         if (!strongSelf) {
             [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
@@ -598,190 +2751,338 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
     if (trimByteCount == 0) {
         [self removeAllObjects:block];
         return;
-    }
+    }
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    __weak TMDiskCache *weakSelf = self;
+
+    dispatch_barrier_async(_queue, ^{
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf) {
+            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+            return;
+        }
+
+        [strongSelf trimDiskToSizeByDate:trimByteCount];
+
+        if (block)
+            block(strongSelf);
+
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    });
+}
+
+- (void)removeAllObjects:(TMDiskCacheBlock)block
+{
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+    
+    __weak TMDiskCache *weakSelf = self;
+
+    dispatch_barrier_async(_queue, ^{
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf) {
+            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+            return;
+        }
+
+        [strongSelf removeAllFilesAndExecuteBlocks];
+
+        if (block)
+            block(strongSelf);
+        
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    });
+}
+
+- (void)enumerateObjectsWithBlock:(TMDiskCacheObjectBlock)block completionBlock:(TMDiskCacheBlock)completionBlock
+{
+    if (!block)
+        return;
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    __weak TMDiskCache *weakSelf = self;
+
+    dispatch_barrier_async(_queue, ^{
+        TMDiskCache *strongSelf = weakSelf;
+        if (!strongSelf) {
+            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+            return;
+        }
+
+        [strongSelf enumerateFilesWithBlock:block];
+
+        if (completionBlock)
+            completionBlock(strongSelf);
+
+        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    });
+}
+
+#pragma mark - Public Synchronous Methods -
+
+// dispatch_sync runs the work on the calling thread, ordered with the queues, without a second thread hop
+// or a semaphore. Don't call these from a block that is already running on the queues.
+
+- (id <NSCoding>)objectForKey:(NSString *)key
+{
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!key)
+        return nil;
+
+    if (![self mightContainObjectForKey:key]) {
+        [_statistics addCount:1 toCounter:TMCacheStatisticsCounterMisses];
+        return nil;
+    }
+
+    __block id <NSCoding> object = nil;
+
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_sync([_context queueForKey:key], ^{
+        [self->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+        object = [self objectForKey:key date:now fileURL:NULL];
+    });
+
+    return object;
+}
+
+- (NSData *)dataForKey:(NSString *)key
+{
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!key)
+        return nil;
+
+    if (![self mightContainObjectForKey:key]) {
+        [_statistics addCount:1 toCounter:TMCacheStatisticsCounterMisses];
+        return nil;
+    }
+
+    __block NSData *data = nil;
+
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_sync([_context queueForKey:key], ^{
+        [self->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+        data = [self storedDataWithEntryData:[self dataForKey:key date:now fileURL:NULL]];
+    });
+
+    return data;
+}
+
+- (NSURL *)fileURLForKey:(NSString *)key
+{
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!key)
+        return nil;
+
+    __block NSURL *fileURL = nil;
+
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_sync([_context queueForKey:key], ^{
+        [self->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+        fileURL = [self existingFileURLForKey:key date:now];
+    });
+
+    return fileURL;
+}
+
+- (void)setAccessDates:(NSDictionary *)dates
+{
+    if (![dates count])
+        return;
 
-    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+    __block BOOL scheduleFlush = NO;
 
-    __weak TMDiskCache *weakSelf = self;
+    [self lock];
 
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf) {
-            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
-            return;
-        }
+    [dates enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSDate *date, BOOL *stop) {
+        NSDate *accessDate = [_dates objectForKey:key];
 
-        [strongSelf trimDiskToSizeByDate:trimByteCount];
+        if (accessDate && [accessDate compare:date] == NSOrderedAscending) {
+            [_dates setObject:date forKey:key];
+            [_recency setDate:date forKey:key];
+            scheduleFlush |= [_context.index setAccessDate:date forKey:key];
+        }
+    }];
 
-        if (block)
-            block(strongSelf);
+    [self unlock];
 
-        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
-    });
+    if (scheduleFlush)
+        [self scheduleIndexFlush];
 }
 
-- (void)removeAllObjects:(TMDiskCacheBlock)block
+- (BOOL)mightContainObjectForKey:(NSString *)key
 {
-    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
-    
-    __weak TMDiskCache *weakSelf = self;
+    if (!key)
+        return NO;
 
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf) {
-            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
-            return;
-        }
+    [self lock];
+    BOOL mightContain = !_keyFilterComplete || [_writingKeys containsObject:key] || [_keyFilter containsKey:key];
+    [self unlock];
 
-        if (strongSelf->_willRemoveAllObjectsBlock)
-            strongSelf->_willRemoveAllObjectsBlock(strongSelf);
-        
-        [TMDiskCache moveItemAtURLToTrash:strongSelf->_cacheURL];
-        [TMDiskCache emptyTrash];
+    if (!mightContain && ![self hasDirectoryToItself])
+        mightContain = YES; // the key may have been written by the other instance
+
+    return mightContain;
+}
 
-        [strongSelf createCacheDirectory];
+- (NSDate *)expirationDateForKey:(NSString *)key
+{
+    if (!key)
+        return nil;
 
-        [strongSelf->_dates removeAllObjects];
-        [strongSelf->_sizes removeAllObjects];
-        strongSelf.byteCount = 0; // atomic
+    [self lock];
+    NSDate *expirationDate = [_expirationDates objectForKey:key];
+    [self unlock];
 
-        if (strongSelf->_didRemoveAllObjectsBlock)
-            strongSelf->_didRemoveAllObjectsBlock(strongSelf);
+    return expirationDate;
+}
 
-        if (block)
-            block(strongSelf);
-        
-        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
-    });
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key
+{
+    [self setObject:object forKey:key ttl:0.0];
 }
 
-- (void)enumerateObjectsWithBlock:(TMDiskCacheObjectBlock)block completionBlock:(TMDiskCacheBlock)completionBlock
+- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl
 {
-    if (!block)
+    NSDate *now = [[NSDate alloc] init];
+    NSDate *expirationDate = ttl > 0.0 ? [[NSDate alloc] initWithTimeInterval:ttl sinceDate:now] : nil;
+
+    if (!object || !key)
         return;
 
+    [self waitForHardByteLimit];
+
     UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    __weak TMDiskCache *weakSelf = self;
+    uint64_t queuedTime = TMCacheStatisticsTime();
 
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf) {
-            [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
-            return;
-        }
+    dispatch_sync([_context queueForKey:key], ^{
+        [self->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+        [self writeObject:object data:nil forKey:key date:now expirationDate:expirationDate];
+        [self trimToByteLimitIfNeeded];
+    });
 
-        NSArray *keysSortedByDate = [strongSelf->_dates keysSortedByValueUsingSelector:@selector(compare:)];
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+}
 
-        for (NSString *key in keysSortedByDate) {
-            NSURL *fileURL = [strongSelf encodedFileURLForKey:key];
-            block(strongSelf, key, nil, fileURL);
-        }
+- (void)setData:(NSData *)data forKey:(NSString *)key
+{
+    NSDate *now = [[NSDate alloc] init];
 
-        if (completionBlock)
-            completionBlock(strongSelf);
+    if (!data || !key)
+        return;
 
-        [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+    [self waitForHardByteLimit];
+
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
+
+    uint64_t queuedTime = TMCacheStatisticsTime();
+
+    dispatch_sync([_context queueForKey:key], ^{
+        [self->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+        [self writeObject:data data:data forKey:key date:now expirationDate:nil];
+        [self trimToByteLimitIfNeeded];
     });
-}
 
-#pragma mark - Public Synchronous Methods -
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
+}
 
-- (id <NSCoding>)objectForKey:(NSString *)key
+- (void)removeObjectForKey:(NSString *)key
 {
     if (!key)
-        return nil;
-
-    __block id <NSCoding> objectForKey = nil;
+        return;
 
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    [self objectForKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
-        objectForKey = object;
-        dispatch_semaphore_signal(semaphore);
-    }];
-    
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    uint64_t queuedTime = TMCacheStatisticsTime();
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    dispatch_sync([_context queueForKey:key], ^{
+        [self->_statistics recordLatencySinceTime:queuedTime forOperation:TMCacheStatisticsOperationQueueWait];
+        [self removeFileAndExecuteBlocksForKey:key];
+    });
 
-    return objectForKey;
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
-- (NSURL *)fileURLForKey:(NSString *)key
+- (NSDictionary *)objectsForKeys:(NSArray *)keys
 {
-    if (!key)
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!keys)
         return nil;
 
-    __block NSURL *fileURLForKey = nil;
+    __block NSDictionary *objects = nil;
 
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    [self performBatchForKeys:keys wait:YES block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        NSDictionary *files = [cache readFilesForKeys:[keys objectsAtIndexes:indexes] date:now];
 
-    [self fileURLForKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
-        fileURLForKey = fileURL;
-        dispatch_semaphore_signal(semaphore);
+        [keys enumerateObjectsAtIndexes:indexes options:0 usingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+            id <NSCoding> object = [cache objectForKey:key date:now fileData:[files objectForKey:key] fileURL:NULL];
+            if (object)
+                [results setObject:object forKey:key];
+        }];
+    } completion:^(TMDiskCache *cache, NSDictionary *results) {
+        objects = results;
     }];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
-
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
-
-    return fileURLForKey;
+    return objects;
 }
 
-- (void)setObject:(id <NSCoding>)object forKey:(NSString *)key
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys
 {
-    if (!object || !key)
+    NSDate *now = [[NSDate alloc] init];
+
+    if (!objects || !keys || [objects count] != [keys count])
         return;
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self setObject:object forKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    [self waitForHardByteLimit];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [self performBatchForKeys:keys wait:YES block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        [cache writeObjectsAtIndexes:indexes objects:objects forKeys:keys date:now];
+    } completion:nil];
+
+    [self trimToByteLimitIfNeeded];
+
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
-- (void)removeObjectForKey:(NSString *)key
+- (void)removeObjectsForKeys:(NSArray *)keys
 {
-    if (!key)
+    if (!keys)
         return;
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self removeObjectForKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [self performBatchForKeys:keys wait:YES block:^(TMDiskCache *cache, NSIndexSet *indexes, NSMutableDictionary *results) {
+        [cache removeFilesAndExecuteBlocksForKeys:[keys objectsAtIndexes:indexes]];
+    } completion:nil];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
 - (void)trimToSize:(NSUInteger)byteCount
 {
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    if (byteCount == 0) {
+        [self removeAllObjects];
+        return;
+    }
 
-    [self trimToSize:byteCount block:^(TMDiskCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    dispatch_barrier_sync(_queue, ^{
+        [self trimDiskToSize:byteCount];
+    });
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
 - (void)trimToDate:(NSDate *)date
@@ -794,47 +3095,40 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
         return;
     }
 
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
-
-    [self trimToDate:date block:^(TMDiskCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    dispatch_barrier_sync(_queue, ^{
+        [self trimDiskToDate:date];
+    });
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
 - (void)trimToSizeByDate:(NSUInteger)byteCount
 {
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    if (byteCount == 0) {
+        [self removeAllObjects];
+        return;
+    }
 
-    [self trimToSizeByDate:byteCount block:^(TMDiskCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    dispatch_barrier_sync(_queue, ^{
+        [self trimDiskToSizeByDate:byteCount];
+    });
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
 - (void)removeAllObjects
 {
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
-
-    [self removeAllObjects:^(TMDiskCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    dispatch_barrier_sync(_queue, ^{
+        [self removeAllFilesAndExecuteBlocks];
+    });
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
 - (void)enumerateObjectsWithBlock:(TMDiskCacheObjectBlock)block
@@ -842,214 +3136,247 @@ NSString * const TMDiskCacheSharedName = @"TMDiskCacheShared";
     if (!block)
         return;
 
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
-
-    [self enumerateObjectsWithBlock:block completionBlock:^(TMDiskCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    UIBackgroundTaskIdentifier taskID = [TMCacheBackgroundTaskManager beginBackgroundTask];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    dispatch_barrier_sync(_queue, ^{
+        [self enumerateFilesWithBlock:block];
+    });
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [TMCacheBackgroundTaskManager endBackgroundTask:taskID];
 }
 
 #pragma mark - Public Thread Safe Accessors -
 
 - (TMDiskCacheObjectBlock)willAddObjectBlock
 {
-    __block TMDiskCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _willAddObjectBlock;
-    });
+    [self lock];
+    TMDiskCacheObjectBlock block = _willAddObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setWillAddObjectBlock:(TMDiskCacheObjectBlock)block
 {
-    __weak TMDiskCache *weakSelf = self;
-
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_willAddObjectBlock = [block copy];
-    });
+    [self lock];
+    _willAddObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMDiskCacheObjectBlock)willRemoveObjectBlock
 {
-    __block TMDiskCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _willRemoveObjectBlock;
-    });
+    [self lock];
+    TMDiskCacheObjectBlock block = _willRemoveObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setWillRemoveObjectBlock:(TMDiskCacheObjectBlock)block
 {
-    __weak TMDiskCache *weakSelf = self;
-
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_willRemoveObjectBlock = [block copy];
-    });
+    [self lock];
+    _willRemoveObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMDiskCacheBlock)willRemoveAllObjectsBlock
 {
-    __block TMDiskCacheBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _willRemoveAllObjectsBlock;
-    });
+    [self lock];
+    TMDiskCacheBlock block = _willRemoveAllObjectsBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setWillRemoveAllObjectsBlock:(TMDiskCacheBlock)block
 {
-    __weak TMDiskCache *weakSelf = self;
-
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_willRemoveAllObjectsBlock = [block copy];
-    });
+    [self lock];
+    _willRemoveAllObjectsBlock = [block copy];
+    [self unlock];
 }
 
 - (TMDiskCacheObjectBlock)didAddObjectBlock
 {
-    __block TMDiskCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didAddObjectBlock;
-    });
+    [self lock];
+    TMDiskCacheObjectBlock block = _didAddObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidAddObjectBlock:(TMDiskCacheObjectBlock)block
 {
-    __weak TMDiskCache *weakSelf = self;
-
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didAddObjectBlock = [block copy];
-    });
+    [self lock];
+    _didAddObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMDiskCacheObjectBlock)didRemoveObjectBlock
 {
-    __block TMDiskCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didRemoveObjectBlock;
-    });
+    [self lock];
+    TMDiskCacheObjectBlock block = _didRemoveObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidRemoveObjectBlock:(TMDiskCacheObjectBlock)block
 {
-    __weak TMDiskCache *weakSelf = self;
-
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didRemoveObjectBlock = [block copy];
-    });
+    [self lock];
+    _didRemoveObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMDiskCacheBlock)didRemoveAllObjectsBlock
 {
-    __block TMDiskCacheBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didRemoveAllObjectsBlock;
-    });
+    [self lock];
+    TMDiskCacheBlock block = _didRemoveAllObjectsBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidRemoveAllObjectsBlock:(TMDiskCacheBlock)block
 {
-    __weak TMDiskCache *weakSelf = self;
-
-    dispatch_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didRemoveAllObjectsBlock = [block copy];
-    });
+    [self lock];
+    _didRemoveAllObjectsBlock = [block copy];
+    [self unlock];
 }
 
 - (NSUInteger)byteLimit
 {
-    __block NSUInteger byteLimit = 0;
-    
-    dispatch_sync(_queue, ^{
-        byteLimit = _byteLimit;
-    });
+    [self lock];
+    NSUInteger byteLimit = _byteLimit;
+    [self unlock];
     
     return byteLimit;
 }
 
 - (void)setByteLimit:(NSUInteger)byteLimit
 {
-    __weak TMDiskCache *weakSelf = self;
-    
-    dispatch_barrier_async(_queue, ^{
-        TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-        
-        strongSelf->_byteLimit = byteLimit;
+    [self lock];
+    _byteLimit = byteLimit;
+    [self unlock];
 
-        if (byteLimit > 0)
-            [strongSelf trimDiskToSizeByDate:byteLimit];
-    });
+    [self trimToByteLimitIfNeeded];
+}
+
+- (NSUInteger)trimTargetByteCount
+{
+    [self lock];
+    NSUInteger trimTargetByteCount = _trimTargetByteCount;
+    [self unlock];
+
+    return trimTargetByteCount;
+}
+
+- (void)setTrimTargetByteCount:(NSUInteger)trimTargetByteCount
+{
+    [self lock];
+    _trimTargetByteCount = trimTargetByteCount;
+    [self unlock];
+}
+
+- (NSUInteger)hardByteLimit
+{
+    [self lock];
+    NSUInteger hardByteLimit = _hardByteLimit;
+    [self unlock];
+
+    return hardByteLimit;
+}
+
+- (void)setHardByteLimit:(NSUInteger)hardByteLimit
+{
+    [self lock];
+    _hardByteLimit = hardByteLimit;
+    pthread_cond_broadcast(&_trimCondition);
+    [self unlock];
+}
+
+- (NSUInteger)segmentByteLimit
+{
+    [self lock];
+    NSUInteger segmentByteLimit = _segmentByteLimit;
+    [self unlock];
+
+    return segmentByteLimit;
+}
+
+- (void)setSegmentByteLimit:(NSUInteger)segmentByteLimit
+{
+    [self lock];
+    _segmentByteLimit = segmentByteLimit;
+    [self unlock];
+}
+
+- (id <TMCacheSerializer>)serializer
+{
+    [self lock];
+    id <TMCacheSerializer> serializer = _serializer;
+    [self unlock];
+
+    return serializer;
+}
+
+- (void)setSerializer:(id <TMCacheSerializer>)serializer
+{
+    [self lock];
+    _serializer = serializer ?: [[TMCacheKeyedArchiveSerializer alloc] init];
+    [self unlock];
+}
+
+- (NSUInteger)compressionThreshold
+{
+    [self lock];
+    NSUInteger compressionThreshold = _compressionThreshold;
+    [self unlock];
+
+    return compressionThreshold;
+}
+
+- (void)setCompressionThreshold:(NSUInteger)compressionThreshold
+{
+    [self lock];
+    _compressionThreshold = compressionThreshold;
+    [self unlock];
+}
+
+- (TMDiskCacheDurability)durability
+{
+    [self lock];
+    TMDiskCacheDurability durability = _durability;
+    [self unlock];
+
+    return durability;
+}
+
+- (void)setDurability:(TMDiskCacheDurability)durability
+{
+    [self lock];
+    _durability = durability;
+    [self unlock];
 }
 
 - (NSTimeInterval)ageLimit
 {
-    __block NSTimeInterval ageLimit = 0.0;
-    
-    dispatch_sync(_queue, ^{
-        ageLimit = _ageLimit;
-    });
+    [self lock];
+    NSTimeInterval ageLimit = _ageLimit;
+    [self unlock];
     
     return ageLimit;
 }
 
 - (void)setAgeLimit:(NSTimeInterval)ageLimit
 {
+    [self lock];
+    _ageLimit = ageLimit;
+    [self unlock];
+
     __weak TMDiskCache *weakSelf = self;
     
     dispatch_barrier_async(_queue, ^{
         TMDiskCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-        
-        strongSelf->_ageLimit = ageLimit;
-        
         [strongSelf trimToAgeLimitRecursively];
     });
 }
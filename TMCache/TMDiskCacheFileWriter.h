@@ -0,0 +1,60 @@
+/**
+ Private to TMDiskCache. Writes files durably: once a write returns, the file survives a crash or a power loss
+ with either its new contents or, if the write failed, its old ones, never anything in between.
+
+ Each write goes to a temporary file in a hidden directory inside the cache directory. The temporary file is
+ synced, renamed over the destination and then the destination's directory is synced, so the new name is on
+ disk as well. Syncing is what makes durable writes slow, so writes can commit as a group: the first one waits
+ a couple of milliseconds for others to arrive, and then one thread syncs the whole group's files and each of
+ their directories once, with a single flush of the drive's cache on OS X and iOS.
+
+ <writeData:toURLs:groupCommit:> writes a batch of files and commits them as one group, with one sync pass and one
+ sync of each directory however many files there are.
+
+ The write methods are safe to call from any thread and block until their writes are committed.
+ <removeTemporaryFiles> must only be called while nothing else writes, i.e. in a barrier block on the cache's
+ queue.
+ */
+
+#import <Foundation/Foundation.h>
+
+@interface TMDiskCacheFileWriter : NSObject
+
+/**
+ The hidden directory the temporary files go into. Other writers may put theirs there too, it is emptied by
+ <removeTemporaryFiles> all the same.
+ */
+@property (readonly) NSString *temporaryDirectoryPath;
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL;
+
+/**
+ Writes the data to a file, replacing it if it exists.
+
+ @param data The contents of the file.
+ @param url The file URL, anywhere in the directory or below it. Its directory must exist.
+ @param groupCommit Whether to share the sync with other writes arriving at about the same time, or to sync
+ right away.
+ @param outSize Set to the number of bytes the file takes up on disk if it was written.
+ @result `NO` if the file could not be written, in which case it still has its old contents.
+ */
+- (BOOL)writeData:(NSData *)data toURL:(NSURL *)url groupCommit:(BOOL)groupCommit allocatedSize:(NSUInteger *)outSize;
+
+/**
+ Writes several files, replacing any that exist, and commits them together.
+
+ @param data The contents of each file.
+ @param fileURLs The files, anywhere in the directory or below it. Their directories must exist.
+ @param groupCommit Whether to share the sync with other writes arriving at about the same time, or to sync
+ the batch right away.
+ @result The number of bytes each file takes up on disk as an `NSNumber`, or `NSNull` where it could not be
+ written and still has its old contents.
+ */
+- (NSArray *)writeData:(NSArray *)data toURLs:(NSArray *)fileURLs groupCommit:(BOOL)groupCommit;
+
+/**
+ Deletes temporary files left behind by writes a crash interrupted.
+ */
+- (void)removeTemporaryFiles;
+
+@end
@@ -0,0 +1,278 @@
+#import "TMDiskCacheFileWriter.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+static NSString * const TMDiskCacheFileWriterDirectoryName = @".TMDiskCacheWrites";
+
+static const useconds_t TMDiskCacheGroupCommitDelay = 2000; // microseconds
+
+@interface TMDiskCacheFileWrite : NSObject
+@property (assign, nonatomic) int fileDescriptor;
+@property (copy, nonatomic) NSString *temporaryPath;
+@property (copy, nonatomic) NSString *path;
+@property (assign, nonatomic) BOOL committed;
+@property (assign, nonatomic) BOOL succeeded;
+@property (assign, nonatomic) NSUInteger allocatedSize;
+@end
+
+@implementation TMDiskCacheFileWrite
+@end
+
+@interface TMDiskCacheFileWriter () {
+    pthread_mutex_t _lock;
+    pthread_cond_t _commitCondition;
+    NSMutableArray *_pendingWrites;
+    BOOL _committing;
+}
+@end
+
+@implementation TMDiskCacheFileWriter
+
+#pragma mark - Initialization -
+
+- (void)dealloc
+{
+    pthread_cond_destroy(&_commitCondition);
+    pthread_mutex_destroy(&_lock);
+}
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL
+{
+    if (!directoryURL)
+        return nil;
+
+    if (self = [super init]) {
+        pthread_mutex_init(&_lock, NULL);
+        pthread_cond_init(&_commitCondition, NULL);
+
+        _temporaryDirectoryPath = [[directoryURL path] stringByAppendingPathComponent:TMDiskCacheFileWriterDirectoryName];
+        _pendingWrites = [[NSMutableArray alloc] init];
+        _committing = NO;
+    }
+    return self;
+}
+
+#pragma mark - Private Methods -
+
+// The directory is created again on demand, removing all objects from the cache takes it along.
+- (int)createTemporaryFile:(NSString **)outPath
+{
+    NSString *template = [_temporaryDirectoryPath stringByAppendingPathComponent:@"write.XXXXXX"];
+
+    for (NSUInteger attempt = 0; attempt < 2; attempt++) {
+        char path[PATH_MAX];
+        if (![template getFileSystemRepresentation:path maxLength:sizeof(path)])
+            return -1;
+
+        int fd = mkstemp(path);
+
+        if (fd >= 0) {
+            *outPath = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:path length:strlen(path)];
+            return fd;
+        }
+
+        if (errno != ENOENT || (mkdir([_temporaryDirectoryPath fileSystemRepresentation], 0755) != 0 && errno != EEXIST))
+            break;
+    }
+
+    return -1;
+}
+
+static BOOL TMDiskCacheWriteAll(int fd, const uint8_t *bytes, size_t length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+
+        if (written < 0 && errno == EINTR)
+            continue;
+
+        if (written <= 0)
+            return NO;
+
+        bytes += written;
+        length -= (size_t)written;
+    }
+
+    return YES;
+}
+
+static BOOL TMDiskCacheSyncFileDescriptor(int fd)
+{
+    int result;
+
+    do {
+        result = fsync(fd);
+    } while (result != 0 && errno == EINTR);
+
+    return result == 0;
+}
+
+// Data first, then the names: a rename that reaches the disk before the data could leave an empty file behind.
+// fsync() on OS X and iOS only hands the data to the drive, one F_FULLFSYNC then flushes it for the whole group.
+- (void)commitWrites:(NSArray *)writes
+{
+    int lastFileDescriptor = -1;
+
+    for (TMDiskCacheFileWrite *write in writes) {
+        struct stat info;
+        write.succeeded = TMDiskCacheSyncFileDescriptor(write.fileDescriptor) && fstat(write.fileDescriptor, &info) == 0;
+        write.allocatedSize = write.succeeded ? (NSUInteger)info.st_blocks * 512 : 0;
+        lastFileDescriptor = write.fileDescriptor;
+    }
+
+    #ifdef F_FULLFSYNC
+    if (lastFileDescriptor >= 0 && fcntl(lastFileDescriptor, F_FULLFSYNC) != 0) {
+        for (TMDiskCacheFileWrite *write in writes)
+            write.succeeded = NO;
+    }
+    #endif
+
+    NSMutableSet *directoryPaths = [[NSMutableSet alloc] init];
+
+    for (TMDiskCacheFileWrite *write in writes) {
+        close(write.fileDescriptor);
+
+        if (write.succeeded)
+            write.succeeded = rename([write.temporaryPath fileSystemRepresentation], [write.path fileSystemRepresentation]) == 0;
+
+        if (write.succeeded)
+            [directoryPaths addObject:[write.path stringByDeletingLastPathComponent]];
+        else
+            unlink([write.temporaryPath fileSystemRepresentation]);
+    }
+
+    for (NSString *directoryPath in directoryPaths) {
+        int fd = open([directoryPath fileSystemRepresentation], O_RDONLY);
+        if (fd < 0)
+            continue;
+
+        if (!TMDiskCacheSyncFileDescriptor(fd))
+            NSLog(@"%@ ERROR: could not sync %@ (%d)", [self class], directoryPath, errno);
+
+        close(fd);
+    }
+}
+
+// Returns nil if the data could not be written to a temporary file, which is then gone again.
+- (TMDiskCacheFileWrite *)writeTemporaryFileWithData:(NSData *)data forURL:(NSURL *)url
+{
+    NSString *path = [url path];
+    NSString *temporaryPath = nil;
+
+    if (!path || !data)
+        return nil;
+
+    int fd = [self createTemporaryFile:&temporaryPath];
+    if (fd < 0)
+        return nil;
+
+    if (!TMDiskCacheWriteAll(fd, [data bytes], [data length])) {
+        close(fd);
+        unlink([temporaryPath fileSystemRepresentation]);
+        return nil;
+    }
+
+    TMDiskCacheFileWrite *write = [[TMDiskCacheFileWrite alloc] init];
+    write.fileDescriptor = fd;
+    write.temporaryPath = temporaryPath;
+    write.path = path;
+
+    return write;
+}
+
+// Writes queued together are taken by the same leader, so they are committed together.
+- (void)commitWrites:(NSArray *)writes groupCommit:(BOOL)groupCommit
+{
+    if (!groupCommit) {
+        [self commitWrites:writes];
+        return;
+    }
+
+    pthread_mutex_lock(&_lock);
+
+    [_pendingWrites addObjectsFromArray:writes];
+
+    // the first writer to find no commit in progress leads the next one, everybody else waits for theirs
+    while (![[writes lastObject] committed]) {
+        if (_committing) {
+            pthread_cond_wait(&_commitCondition, &_lock);
+            continue;
+        }
+
+        _committing = YES;
+        pthread_mutex_unlock(&_lock);
+
+        usleep(TMDiskCacheGroupCommitDelay); // for writes on other threads to join
+
+        pthread_mutex_lock(&_lock);
+        NSArray *pendingWrites = [_pendingWrites copy];
+        [_pendingWrites removeAllObjects];
+        pthread_mutex_unlock(&_lock);
+
+        [self commitWrites:pendingWrites];
+
+        pthread_mutex_lock(&_lock);
+
+        for (TMDiskCacheFileWrite *committedWrite in pendingWrites)
+            committedWrite.committed = YES;
+
+        _committing = NO;
+        pthread_cond_broadcast(&_commitCondition);
+    }
+
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark - Public Methods -
+
+- (BOOL)writeData:(NSData *)data toURL:(NSURL *)url groupCommit:(BOOL)groupCommit allocatedSize:(NSUInteger *)outSize
+{
+    if (!data || !url)
+        return NO;
+
+    id size = [[self writeData:@[ data ] toURLs:@[ url ] groupCommit:groupCommit] lastObject];
+
+    if (size == [NSNull null])
+        return NO;
+
+    *outSize = [size unsignedIntegerValue];
+    return YES;
+}
+
+- (NSArray *)writeData:(NSArray *)data toURLs:(NSArray *)fileURLs groupCommit:(BOOL)groupCommit
+{
+    NSMutableArray *writes = [[NSMutableArray alloc] initWithCapacity:[data count]];
+    NSMutableIndexSet *writeIndexes = [[NSMutableIndexSet alloc] init];
+
+    for (NSUInteger i = 0; i < [data count]; i++) {
+        TMDiskCacheFileWrite *write = [self writeTemporaryFileWithData:[data objectAtIndex:i] forURL:[fileURLs objectAtIndex:i]];
+
+        if (write) {
+            [writes addObject:write];
+            [writeIndexes addIndex:i];
+        }
+    }
+
+    if ([writes count])
+        [self commitWrites:writes groupCommit:groupCommit];
+
+    NSMutableArray *sizes = [[NSMutableArray alloc] initWithCapacity:[data count]];
+    NSUInteger writeIndex = 0;
+
+    for (NSUInteger i = 0; i < [data count]; i++) {
+        TMDiskCacheFileWrite *write = [writeIndexes containsIndex:i] ? [writes objectAtIndex:writeIndex++] : nil;
+        [sizes addObject:write.succeeded ? @(write.allocatedSize) : [NSNull null]];
+    }
+
+    return sizes;
+}
+
+- (void)removeTemporaryFiles
+{
+    [[NSFileManager defaultManager] removeItemAtPath:_temporaryDirectoryPath error:NULL];
+}
+
+@end
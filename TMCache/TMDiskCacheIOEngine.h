@@ -0,0 +1,98 @@
+/**
+ Private to `TMDiskCache`. The protocol for the file system calls behind objects that get a file of their own,
+ and the engines implementing it.
+
+ Every method takes a batch of files and returns one result per file, in the same order, so an engine that can
+ hand the kernel many calls at once gets to do so for batch operations such as
+ `-[TMDiskCache objectsForKeys:block:]`. Single keys come as batches of one. Engines are safe to call from any
+ thread. Writes replace a file atomically: a reader sees the old contents or the new ones, never part of either.
+ */
+
+#import <Foundation/Foundation.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#import <linux/io_uring.h>
+#ifdef IORING_FEAT_NATIVE_WORKERS // Linux 5.12 headers, which have every opcode the engine uses
+#define TM_DISK_CACHE_IO_URING 1
+#endif
+#endif
+#endif
+
+@protocol TMDiskCacheIOEngine <NSObject>
+
+/**
+ Reads whole files.
+
+ @param fileURLs The files.
+ @result An `NSData` for each file, mapping it where the engine can, or `NSNull` where it could not be read.
+ */
+- (NSArray *)readFilesAtURLs:(NSArray *)fileURLs;
+
+/**
+ Writes files, replacing any that exist. The directories must exist.
+
+ @param data The contents of each file.
+ @param fileURLs The files.
+ @result The number of bytes each file takes up on disk as an `NSNumber`, or `NSNull` where it could not be
+ written and still has its old contents.
+ */
+- (NSArray *)writeData:(NSArray *)data toURLs:(NSArray *)fileURLs;
+
+/**
+ Deletes files.
+
+ @param fileURLs The files.
+ @result A boolean `NSNumber` for each file, `NO` if it did not exist or could not be deleted.
+ */
+- (NSArray *)removeFilesAtURLs:(NSArray *)fileURLs;
+
+/**
+ @param fileURLs The files.
+ @result A boolean `NSNumber` for each file.
+ */
+- (NSArray *)fileExistsAtURLs:(NSArray *)fileURLs;
+
+@end
+
+/**
+ `NSData` and `NSFileManager`, as the cache has always done it: reads map the file, writes go through
+ `-[NSData writeToURL:atomically:]` and then look up the size the file takes up by path.
+ */
+@interface TMDiskCacheFoundationIOEngine : NSObject <TMDiskCacheIOEngine>
+@end
+
+/**
+ One file descriptor per file. A write creates a temporary file, writes it, takes its size from the same
+ descriptor and renames it into place; a read opens the file, sizes it and maps it.
+ */
+@interface TMDiskCachePOSIXIOEngine : NSObject <TMDiskCacheIOEngine>
+
+/**
+ @param temporaryDirectoryPath Where writes create their temporary files, created when needed. It must be on the
+ same volume as the files, and emptied by the cache before any engine writes to it.
+ */
+- (instancetype)initWithTemporaryDirectoryPath:(NSString *)temporaryDirectoryPath;
+
+@end
+
+#if TM_DISK_CACHE_IO_URING
+
+/**
+ Like `TMDiskCachePOSIXIOEngine`, but every step of a batch goes to the kernel through an io_uring, all files at
+ once: a batch of reads takes three system calls (open, size, close) plus a map of each file, a batch of writes
+ two (create, then write, size, close and rename linked together), a batch of removals one, however many files
+ there are.
+ Rings are kept in a small pool so batches on different queues don't wait for each other. Batches larger than a
+ ring go through it in turns.
+ */
+@interface TMDiskCacheIOUringEngine : NSObject <TMDiskCacheIOEngine>
+
+/**
+ @result `nil` if the kernel has no io_uring or lacks an operation the engine needs, which takes Linux 5.11.
+ */
+- (instancetype)initWithTemporaryDirectoryPath:(NSString *)temporaryDirectoryPath;
+
+@end
+
+#endif
@@ -0,0 +1,826 @@
+#import "TMDiskCacheIOEngine.h"
+
+#import <errno.h>
+#import <fcntl.h>
+#import <limits.h>
+#import <pthread.h>
+#import <stdlib.h>
+#import <string.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+
+#if TM_DISK_CACHE_IO_URING
+#import <linux/stat.h>
+#import <sys/syscall.h>
+#endif
+
+static NSUInteger TMDiskCacheAllocatedSize(uint64_t blocks)
+{
+    return (NSUInteger)(blocks * 512); // st_blocks counts 512-byte units whatever the file system's block size
+}
+
+static const char *TMDiskCacheFileSystemPath(NSURL *fileURL)
+{
+    return [[fileURL path] fileSystemRepresentation];
+}
+
+// A name no other write in any process uses at the same time. Names left behind by a crash are never reused, the
+// cache empties the directory when it opens.
+static void TMDiskCacheTemporaryPath(const char *directoryPath, char *path, size_t pathSize)
+{
+    static uint64_t counter = 0;
+    uint64_t number = __sync_add_and_fetch(&counter, 1);
+
+    snprintf(path, pathSize, "%s/io.%d.%llx", directoryPath, (int)getpid(), (unsigned long long)number);
+}
+
+// Removing all objects takes the temporary directory along with everything else, it comes back on demand.
+static BOOL TMDiskCacheCreateTemporaryDirectory(const char *directoryPath)
+{
+    return mkdir(directoryPath, 0755) == 0 || errno == EEXIST;
+}
+
+#pragma mark - Foundation -
+
+@implementation TMDiskCacheFoundationIOEngine
+
+- (NSArray *)readFilesAtURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+
+    for (NSURL *fileURL in fileURLs) {
+        NSData *data = [[NSData alloc] initWithContentsOfURL:fileURL options:NSDataReadingMappedIfSafe error:NULL];
+        [results addObject:data ?: [NSNull null]];
+    }
+
+    return results;
+}
+
+- (NSArray *)writeData:(NSArray *)data toURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+
+    [fileURLs enumerateObjectsUsingBlock:^(NSURL *fileURL, NSUInteger index, BOOL *stop) {
+        if (![[data objectAtIndex:index] writeToURL:fileURL atomically:YES]) {
+            [results addObject:[NSNull null]];
+            return;
+        }
+
+        NSDictionary *values = [fileURL resourceValuesForKeys:@[ NSURLTotalFileAllocatedSizeKey ] error:NULL];
+        [results addObject:[values objectForKey:NSURLTotalFileAllocatedSizeKey] ?: @0];
+    }];
+
+    return results;
+}
+
+- (NSArray *)removeFilesAtURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+
+    for (NSURL *fileURL in fileURLs)
+        [results addObject:@([[NSFileManager defaultManager] removeItemAtURL:fileURL error:NULL])];
+
+    return results;
+}
+
+- (NSArray *)fileExistsAtURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+
+    for (NSURL *fileURL in fileURLs)
+        [results addObject:@([[NSFileManager defaultManager] fileExistsAtPath:[fileURL path]])];
+
+    return results;
+}
+
+@end
+
+#pragma mark - POSIX -
+
+/**
+ The bytes of a file mapped into memory, unmapped when the data goes away. Cache files are never modified in
+ place, writes replace them and removals unlink them, so the mapping stays valid and unchanged for as long as it
+ lives, like the data `NSDataReadingMappedIfSafe` gives.
+ */
+@interface TMDiskCacheMappedData : NSData {
+    void *_address;
+    NSUInteger _length;
+}
+- (instancetype)initWithAddress:(void *)address length:(NSUInteger)length;
+@end
+
+@implementation TMDiskCacheMappedData
+
+- (instancetype)initWithAddress:(void *)address length:(NSUInteger)length
+{
+    if (self = [super init]) {
+        _address = address;
+        _length = length;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    munmap(_address, _length);
+}
+
+- (const void *)bytes
+{
+    return _address;
+}
+
+- (NSUInteger)length
+{
+    return _length;
+}
+
+@end
+
+// The descriptor can be closed right after, the mapping keeps the file.
+static NSData *TMDiskCacheMapFileDescriptor(int fd, size_t length)
+{
+    if (length == 0)
+        return [[NSData alloc] init]; // nothing to map
+
+    void *address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED)
+        return nil;
+
+    return [[TMDiskCacheMappedData alloc] initWithAddress:address length:(NSUInteger)length];
+}
+
+static NSData *TMDiskCacheReadFile(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nil;
+
+    struct stat info;
+    NSData *data = nil;
+
+    if (fstat(fd, &info) == 0)
+        data = TMDiskCacheMapFileDescriptor(fd, (size_t)info.st_size);
+
+    close(fd);
+
+    return data;
+}
+
+static BOOL TMDiskCacheWriteAllAtOffsetZero(int fd, const uint8_t *bytes, size_t length)
+{
+    size_t offset = 0;
+
+    while (offset < length) {
+        ssize_t count = pwrite(fd, bytes + offset, length - offset, (off_t)offset);
+
+        if (count < 0 && errno == EINTR)
+            continue;
+
+        if (count <= 0)
+            return NO;
+
+        offset += (size_t)count;
+    }
+
+    return YES;
+}
+
+static BOOL TMDiskCacheWriteFile(NSData *data, const char *path, const char *temporaryDirectoryPath, NSUInteger *outSize)
+{
+    char temporaryPath[PATH_MAX];
+    int fd = -1;
+
+    for (NSUInteger attempt = 0; attempt < 2 && fd < 0; attempt++) {
+        TMDiskCacheTemporaryPath(temporaryDirectoryPath, temporaryPath, sizeof(temporaryPath));
+        fd = open(temporaryPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+        if (fd < 0 && (errno != ENOENT || !TMDiskCacheCreateTemporaryDirectory(temporaryDirectoryPath)))
+            return NO;
+    }
+
+    if (fd < 0)
+        return NO;
+
+    struct stat info;
+    BOOL written = TMDiskCacheWriteAllAtOffsetZero(fd, [data bytes], [data length]) && fstat(fd, &info) == 0;
+
+    if (close(fd) != 0)
+        written = NO;
+
+    if (written)
+        written = rename(temporaryPath, path) == 0;
+
+    if (!written) {
+        unlink(temporaryPath);
+        return NO;
+    }
+
+    *outSize = TMDiskCacheAllocatedSize((uint64_t)info.st_blocks);
+
+    return YES;
+}
+
+@implementation TMDiskCachePOSIXIOEngine {
+    NSString *_temporaryDirectoryPath;
+}
+
+- (instancetype)initWithTemporaryDirectoryPath:(NSString *)temporaryDirectoryPath
+{
+    if (!temporaryDirectoryPath)
+        return nil;
+
+    if (self = [super init]) {
+        _temporaryDirectoryPath = [temporaryDirectoryPath copy];
+    }
+    return self;
+}
+
+- (NSArray *)readFilesAtURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+
+    for (NSURL *fileURL in fileURLs)
+        [results addObject:TMDiskCacheReadFile(TMDiskCacheFileSystemPath(fileURL)) ?: [NSNull null]];
+
+    return results;
+}
+
+- (NSArray *)writeData:(NSArray *)data toURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+    const char *temporaryDirectoryPath = [_temporaryDirectoryPath fileSystemRepresentation];
+
+    [fileURLs enumerateObjectsUsingBlock:^(NSURL *fileURL, NSUInteger index, BOOL *stop) {
+        NSUInteger size = 0;
+        BOOL written = TMDiskCacheWriteFile([data objectAtIndex:index], TMDiskCacheFileSystemPath(fileURL),
+                                            temporaryDirectoryPath, &size);
+
+        [results addObject:written ? @(size) : (id)[NSNull null]];
+    }];
+
+    return results;
+}
+
+- (NSArray *)removeFilesAtURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+
+    for (NSURL *fileURL in fileURLs)
+        [results addObject:@(unlink(TMDiskCacheFileSystemPath(fileURL)) == 0)];
+
+    return results;
+}
+
+- (NSArray *)fileExistsAtURLs:(NSArray *)fileURLs
+{
+    NSMutableArray *results = [[NSMutableArray alloc] initWithCapacity:[fileURLs count]];
+
+    for (NSURL *fileURL in fileURLs)
+        [results addObject:@(access(TMDiskCacheFileSystemPath(fileURL), F_OK) == 0)];
+
+    return results;
+}
+
+@end
+
+#pragma mark - io_uring -
+
+#if TM_DISK_CACHE_IO_URING
+
+#define TMDiskCacheIOUringPoolSize 4
+
+static const unsigned TMDiskCacheIOUringEntries = 64;
+
+// The mapped rings of one io_uring, driven straight through the system calls. Only one thread uses a ring at a
+// time, and every batch waits for all of its completions before the next one goes in, so the submission queue is
+// empty whenever a batch starts.
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingLength;
+    void *cqRing;
+    size_t cqRingLength;
+    size_t sqesLength;
+} TMDiskCacheIOUring;
+
+static void TMDiskCacheIOUringDestroy(TMDiskCacheIOUring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesLength);
+
+    if (ring->cqRing && ring->cqRing != ring->sqRing)
+        munmap(ring->cqRing, ring->cqRingLength);
+
+    if (ring->sqRing)
+        munmap(ring->sqRing, ring->sqRingLength);
+
+    close(ring->fd);
+    free(ring);
+}
+
+static void *TMDiskCacheIOUringMap(int fd, size_t length, off_t offset)
+{
+    void *address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return address == MAP_FAILED ? NULL : address;
+}
+
+static TMDiskCacheIOUring *TMDiskCacheIOUringCreate(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, TMDiskCacheIOUringEntries, &params);
+    if (fd < 0)
+        return NULL;
+
+    TMDiskCacheIOUring *ring = calloc(1, sizeof(TMDiskCacheIOUring));
+    if (!ring) {
+        close(fd);
+        return NULL;
+    }
+
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sqRingLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesLength = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqRingLength = ring->cqRingLength = MAX(ring->sqRingLength, ring->cqRingLength);
+
+    ring->sqRing = TMDiskCacheIOUringMap(fd, ring->sqRingLength, IORING_OFF_SQ_RING);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqRing = ring->sqRing;
+    else
+        ring->cqRing = TMDiskCacheIOUringMap(fd, ring->cqRingLength, IORING_OFF_CQ_RING);
+
+    ring->sqes = TMDiskCacheIOUringMap(fd, ring->sqesLength, IORING_OFF_SQES);
+
+    if (!ring->sqRing || !ring->cqRing || !ring->sqes) {
+        TMDiskCacheIOUringDestroy(ring);
+        return NULL;
+    }
+
+    uint8_t *sqRing = ring->sqRing;
+    uint8_t *cqRing = ring->cqRing;
+
+    ring->sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+
+    return ring;
+}
+
+static BOOL TMDiskCacheIOUringSupportsOperations(TMDiskCacheIOUring *ring)
+{
+    static const uint8_t operations[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_WRITE, IORING_OP_CLOSE,
+                                          IORING_OP_RENAMEAT, IORING_OP_UNLINKAT };
+    const unsigned operationCount = 256;
+
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + operationCount * sizeof(struct io_uring_probe_op));
+    if (!probe)
+        return NO;
+
+    BOOL supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, operationCount) == 0;
+
+    for (size_t i = 0; supported && i < sizeof(operations); i++)
+        supported = operations[i] <= probe->last_op && (probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+
+    return supported;
+}
+
+static void TMDiskCacheIOUringPrepare(struct io_uring_sqe *request, uint8_t opcode, int fd, const void *address,
+                                      uint32_t length, uint64_t offset)
+{
+    memset(request, 0, sizeof(struct io_uring_sqe));
+    request->opcode = opcode;
+    request->fd = fd;
+    request->addr = (uint64_t)(uintptr_t)address;
+    request->len = length;
+    request->off = offset;
+}
+
+// Runs `count` operations of `length` linked requests each, as many at a time as the ring holds, and waits for all
+// of them. The result of request `n` of operation `i` goes into `results[i * length + n]`, `-ECANCELED` if an
+// earlier request of the operation failed. Returns `NO` if the ring itself failed, it must not be used again.
+static BOOL TMDiskCacheIOUringRun(TMDiskCacheIOUring *ring, struct io_uring_sqe *requests, NSUInteger count,
+                                  NSUInteger length, int *results)
+{
+    NSUInteger operationsPerRound = ring->entries / length;
+
+    for (NSUInteger i = 0; i < count * length; i++)
+        results[i] = -ECANCELED;
+
+    for (NSUInteger first = 0; first < count; first += operationsPerRound) {
+        unsigned requestCount = (unsigned)(MIN(operationsPerRound, count - first) * length);
+        unsigned tail = *ring->sqTail;
+
+        memcpy(ring->sqes, requests + first * length, requestCount * sizeof(struct io_uring_sqe));
+
+        for (unsigned i = 0; i < requestCount; i++) {
+            ring->sqes[i].user_data = first * length + i;
+
+            if ((i + 1) % length != 0)
+                ring->sqes[i].flags |= IOSQE_IO_LINK;
+
+            ring->sqArray[(tail + i) & *ring->sqMask] = i;
+        }
+
+        __atomic_store_n(ring->sqTail, tail + requestCount, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0;
+        unsigned completed = 0;
+
+        while (completed < requestCount) {
+            int entered = (int)syscall(__NR_io_uring_enter, ring->fd, requestCount - submitted,
+                                       requestCount - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+
+            if (entered < 0 && errno == EINTR)
+                continue;
+
+            if (entered < 0 || (entered == 0 && submitted < requestCount))
+                return NO;
+
+            submitted += (unsigned)entered;
+
+            unsigned head = *ring->cqHead;
+            unsigned cqTail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+            for (; head != cqTail; head++, completed++) {
+                struct io_uring_cqe *completion = &ring->cqes[head & *ring->cqMask];
+
+                if (completion->user_data < count * length)
+                    results[completion->user_data] = completion->res;
+            }
+
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    return YES;
+}
+
+static char **TMDiskCacheCopyFileSystemPaths(NSArray *fileURLs)
+{
+    char **paths = calloc([fileURLs count] ?: 1, sizeof(char *));
+
+    [fileURLs enumerateObjectsUsingBlock:^(NSURL *fileURL, NSUInteger index, BOOL *stop) {
+        paths[index] = strdup(TMDiskCacheFileSystemPath(fileURL));
+    }];
+
+    return paths;
+}
+
+static void TMDiskCacheFreeFileSystemPaths(char **paths, NSUInteger count)
+{
+    for (NSUInteger i = 0; i < count; i++)
+        free(paths[i]);
+
+    free(paths);
+}
+
+// Closes the descriptors whose close was never run because a request linked before it failed.
+static void TMDiskCacheCloseUnclosed(int *fds, int *closeResults, NSUInteger closeStride, NSUInteger count)
+{
+    for (NSUInteger i = 0; i < count; i++) {
+        if (closeResults[i * closeStride] == -ECANCELED)
+            close(fds[i]);
+    }
+}
+
+@implementation TMDiskCacheIOUringEngine {
+    NSString *_temporaryDirectoryPath;
+    TMDiskCachePOSIXIOEngine *_fallbackEngine;
+    pthread_mutex_t _lock;
+    TMDiskCacheIOUring *_rings[TMDiskCacheIOUringPoolSize];
+    NSUInteger _ringCount;
+}
+
+#pragma mark - Initialization -
+
+- (void)dealloc
+{
+    for (NSUInteger i = 0; i < _ringCount; i++)
+        TMDiskCacheIOUringDestroy(_rings[i]);
+
+    pthread_mutex_destroy(&_lock);
+}
+
+- (instancetype)initWithTemporaryDirectoryPath:(NSString *)temporaryDirectoryPath
+{
+    if (!temporaryDirectoryPath)
+        return nil;
+
+    TMDiskCacheIOUring *ring = TMDiskCacheIOUringCreate();
+
+    if (!ring || !TMDiskCacheIOUringSupportsOperations(ring)) {
+        TMDiskCacheIOUringDestroy(ring);
+        return nil;
+    }
+
+    if (self = [super init]) {
+        _temporaryDirectoryPath = [temporaryDirectoryPath copy];
+        _fallbackEngine = [[TMDiskCachePOSIXIOEngine alloc] initWithTemporaryDirectoryPath:temporaryDirectoryPath];
+
+        pthread_mutex_init(&_lock, NULL);
+
+        _rings[0] = ring;
+        _ringCount = 1;
+    } else {
+        TMDiskCacheIOUringDestroy(ring);
+    }
+    return self;
+}
+
+#pragma mark - Private Methods -
+
+// A ring of its own for each batch in flight, so batches on different key queues run side by side.
+- (TMDiskCacheIOUring *)checkOutRing
+{
+    TMDiskCacheIOUring *ring = NULL;
+
+    pthread_mutex_lock(&_lock);
+    if (_ringCount > 0)
+        ring = _rings[--_ringCount];
+    pthread_mutex_unlock(&_lock);
+
+    return ring ?: TMDiskCacheIOUringCreate();
+}
+
+- (void)checkInRing:(TMDiskCacheIOUring *)ring failed:(BOOL)failed
+{
+    if (!failed) {
+        pthread_mutex_lock(&_lock);
+
+        if (_ringCount < TMDiskCacheIOUringPoolSize) {
+            _rings[_ringCount++] = ring;
+            ring = NULL;
+        }
+
+        pthread_mutex_unlock(&_lock);
+    }
+
+    TMDiskCacheIOUringDestroy(ring);
+}
+
+#pragma mark - Public Methods -
+
+- (NSArray *)readFilesAtURLs:(NSArray *)fileURLs
+{
+    NSUInteger count = [fileURLs count];
+    TMDiskCacheIOUring *ring = count ? [self checkOutRing] : NULL;
+
+    if (!ring)
+        return [_fallbackEngine readFilesAtURLs:fileURLs];
+
+    char **paths = TMDiskCacheCopyFileSystemPaths(fileURLs);
+    struct io_uring_sqe *requests = calloc(count, sizeof(struct io_uring_sqe));
+    int *results = calloc(count, sizeof(int));
+    int *fds = calloc(count, sizeof(int));
+    NSUInteger *opened = calloc(count, sizeof(NSUInteger)); // indexes into fileURLs
+    struct statx *info = calloc(count, sizeof(struct statx));
+    NSUInteger openedCount = 0;
+
+    // open every file, then size every descriptor, then map each one and close them all
+    for (NSUInteger i = 0; i < count; i++) {
+        TMDiskCacheIOUringPrepare(&requests[i], IORING_OP_OPENAT, AT_FDCWD, paths[i], 0, 0);
+        requests[i].open_flags = O_RDONLY | O_CLOEXEC;
+    }
+
+    BOOL ringWorks = TMDiskCacheIOUringRun(ring, requests, count, 1, results);
+
+    for (NSUInteger i = 0; ringWorks && i < count; i++) {
+        if (results[i] >= 0) {
+            fds[openedCount] = results[i];
+            opened[openedCount++] = i;
+        }
+    }
+
+    for (NSUInteger i = 0; i < openedCount; i++) {
+        TMDiskCacheIOUringPrepare(&requests[i], IORING_OP_STATX, fds[i], "", STATX_SIZE, (uint64_t)(uintptr_t)&info[i]);
+        requests[i].statx_flags = AT_EMPTY_PATH;
+    }
+
+    ringWorks = ringWorks && TMDiskCacheIOUringRun(ring, requests, openedCount, 1, results);
+
+    NSMutableArray *files = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++)
+        [files addObject:[NSNull null]];
+
+    for (NSUInteger i = 0; i < openedCount; i++) {
+        NSData *data = ringWorks && results[i] >= 0 ? TMDiskCacheMapFileDescriptor(fds[i], (size_t)info[i].stx_size) : nil;
+        if (data)
+            [files replaceObjectAtIndex:opened[i] withObject:data];
+    }
+
+    BOOL closing = ringWorks;
+
+    if (closing) {
+        for (NSUInteger i = 0; i < openedCount; i++)
+            TMDiskCacheIOUringPrepare(&requests[i], IORING_OP_CLOSE, fds[i], NULL, 0, 0);
+
+        ringWorks = TMDiskCacheIOUringRun(ring, requests, openedCount, 1, results);
+    }
+
+    // a ring that broke while closing leaks the descriptors, closing one it did close could close another thread's
+    if (!closing) {
+        for (NSUInteger i = 0; i < openedCount; i++)
+            close(fds[i]);
+    } else if (ringWorks) {
+        TMDiskCacheCloseUnclosed(fds, results, 1, openedCount);
+    }
+
+    [self checkInRing:ring failed:!ringWorks];
+
+    // if the ring broke with requests in flight, which takes io_uring itself failing, what they write to is leaked
+    // rather than freed under the kernel
+    if (ringWorks)
+        free(info);
+
+    free(opened);
+    free(fds);
+    free(results);
+    free(requests);
+    TMDiskCacheFreeFileSystemPaths(paths, count);
+
+    return files;
+}
+
+- (NSArray *)writeData:(NSArray *)data toURLs:(NSArray *)fileURLs
+{
+    NSUInteger count = [fileURLs count];
+    TMDiskCacheIOUring *ring = count ? [self checkOutRing] : NULL;
+
+    if (!ring)
+        return [_fallbackEngine writeData:data toURLs:fileURLs];
+
+    const char *temporaryDirectoryPath = [_temporaryDirectoryPath fileSystemRepresentation];
+    char **paths = TMDiskCacheCopyFileSystemPaths(fileURLs);
+    char **temporaryPaths = calloc(count, sizeof(char *));
+    struct io_uring_sqe *requests = calloc(count * 4, sizeof(struct io_uring_sqe));
+    int *results = calloc(count * 4, sizeof(int));
+    int *fds = calloc(count, sizeof(int));
+    NSUInteger *created = calloc(count, sizeof(NSUInteger)); // indexes into fileURLs
+    struct statx *info = calloc(count, sizeof(struct statx));
+    NSUInteger createdCount = 0;
+    BOOL ringWorks = YES;
+
+    for (NSUInteger i = 0; i < count; i++) {
+        temporaryPaths[i] = malloc(PATH_MAX);
+        TMDiskCacheTemporaryPath(temporaryDirectoryPath, temporaryPaths[i], PATH_MAX);
+        fds[i] = -ENOENT;
+    }
+
+    // create the temporary files, a second time if their directory was missing, then write, size, close and
+    // rename each one in a single chain
+    for (NSUInteger attempt = 0; attempt < 2 && ringWorks; attempt++) {
+        NSUInteger requestCount = 0;
+
+        for (NSUInteger i = 0; i < count; i++) {
+            if (fds[i] != -ENOENT || [[data objectAtIndex:i] length] > UINT32_MAX)
+                continue;
+
+            TMDiskCacheIOUringPrepare(&requests[requestCount], IORING_OP_OPENAT, AT_FDCWD, temporaryPaths[i], 0644, 0);
+            requests[requestCount].open_flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+            created[requestCount++] = i;
+        }
+
+        if (!requestCount || (attempt > 0 && !TMDiskCacheCreateTemporaryDirectory(temporaryDirectoryPath)))
+            break;
+
+        ringWorks = TMDiskCacheIOUringRun(ring, requests, requestCount, 1, results);
+
+        for (NSUInteger i = 0; ringWorks && i < requestCount; i++)
+            fds[created[i]] = results[i];
+    }
+
+    for (NSUInteger i = 0; ringWorks && i < count; i++) {
+        if (fds[i] >= 0)
+            created[createdCount++] = i;
+    }
+
+    for (NSUInteger i = 0; i < createdCount; i++) {
+        NSUInteger index = created[i];
+        NSData *fileData = [data objectAtIndex:index];
+        struct io_uring_sqe *chain = &requests[i * 4];
+
+        TMDiskCacheIOUringPrepare(&chain[0], IORING_OP_WRITE, fds[index], [fileData bytes], (uint32_t)[fileData length], 0);
+        TMDiskCacheIOUringPrepare(&chain[1], IORING_OP_STATX, fds[index], "", STATX_BLOCKS, (uint64_t)(uintptr_t)&info[i]);
+        chain[1].statx_flags = AT_EMPTY_PATH;
+        TMDiskCacheIOUringPrepare(&chain[2], IORING_OP_CLOSE, fds[index], NULL, 0, 0);
+        TMDiskCacheIOUringPrepare(&chain[3], IORING_OP_RENAMEAT, AT_FDCWD, temporaryPaths[index], (uint32_t)AT_FDCWD,
+                                  (uint64_t)(uintptr_t)paths[index]);
+    }
+
+    ringWorks = ringWorks && TMDiskCacheIOUringRun(ring, requests, createdCount, 4, results);
+
+    NSMutableArray *sizes = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++)
+        [sizes addObject:[NSNull null]];
+
+    if (ringWorks) {
+        for (NSUInteger i = 0; i < createdCount; i++) {
+            NSUInteger index = created[i];
+
+            if (results[i * 4 + 2] == -ECANCELED)
+                close(fds[index]);
+
+            if (results[i * 4 + 3] == 0)
+                [sizes replaceObjectAtIndex:index withObject:@(TMDiskCacheAllocatedSize(info[i].stx_blocks))];
+            else
+                unlink(temporaryPaths[index]);
+        }
+
+        // too large for one request, rare enough to take the slow way
+        [data enumerateObjectsUsingBlock:^(NSData *fileData, NSUInteger index, BOOL *stop) {
+            NSUInteger size = 0;
+
+            if ([fileData length] > UINT32_MAX && TMDiskCacheWriteFile(fileData, paths[index], temporaryDirectoryPath, &size))
+                [sizes replaceObjectAtIndex:index withObject:@(size)];
+        }];
+    }
+
+    [self checkInRing:ring failed:!ringWorks];
+
+    if (ringWorks) // see readFilesAtURLs:, temporary files left behind are removed when the cache next opens
+        free(info);
+
+    free(created);
+    free(fds);
+    free(results);
+    free(requests);
+    TMDiskCacheFreeFileSystemPaths(temporaryPaths, count);
+    TMDiskCacheFreeFileSystemPaths(paths, count);
+
+    return sizes;
+}
+
+- (NSArray *)removeFilesAtURLs:(NSArray *)fileURLs
+{
+    return [self runPathOperation:IORING_OP_UNLINKAT onFilesAtURLs:fileURLs] ?: [_fallbackEngine removeFilesAtURLs:fileURLs];
+}
+
+- (NSArray *)fileExistsAtURLs:(NSArray *)fileURLs
+{
+    return [self runPathOperation:IORING_OP_STATX onFilesAtURLs:fileURLs] ?: [_fallbackEngine fileExistsAtURLs:fileURLs];
+}
+
+// One request per file that only takes its path, returning whether it succeeded, or nil if there is no ring.
+- (NSArray *)runPathOperation:(uint8_t)opcode onFilesAtURLs:(NSArray *)fileURLs
+{
+    NSUInteger count = [fileURLs count];
+    TMDiskCacheIOUring *ring = count ? [self checkOutRing] : NULL;
+
+    if (!ring)
+        return nil;
+
+    char **paths = TMDiskCacheCopyFileSystemPaths(fileURLs);
+    struct io_uring_sqe *requests = calloc(count, sizeof(struct io_uring_sqe));
+    int *results = calloc(count, sizeof(int));
+    struct statx *info = opcode == IORING_OP_STATX ? calloc(count, sizeof(struct statx)) : NULL;
+
+    for (NSUInteger i = 0; i < count; i++)
+        TMDiskCacheIOUringPrepare(&requests[i], opcode, AT_FDCWD, paths[i], 0, info ? (uint64_t)(uintptr_t)&info[i] : 0);
+
+    BOOL ringWorks = TMDiskCacheIOUringRun(ring, requests, count, 1, results);
+
+    NSMutableArray *successes = [[NSMutableArray alloc] initWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++)
+        [successes addObject:@(ringWorks && results[i] == 0)];
+
+    [self checkInRing:ring failed:!ringWorks];
+
+    if (ringWorks) // see readFilesAtURLs:
+        free(info);
+
+    free(results);
+    free(requests);
+    TMDiskCacheFreeFileSystemPaths(paths, count);
+
+    return successes;
+}
+
+@end
+
+#endif
@@ -0,0 +1,74 @@
+/**
+ Private to `TMDiskCache`. Persists the size and access date of every file in a cache directory, and the date it
+ expires if it was stored with a time to live, so that a cache can be opened without listing the directory and
+ reading the attributes of each file.
+
+ The index is a snapshot file plus an append-only journal, both hidden in the cache directory. Changes are
+ buffered in memory and appended to the journal in batches by <flush>. When the journal has grown past the size
+ of the snapshot, <writeSnapshotWithDates:sizes:expirationDates:> replaces both with a new snapshot and an empty journal.
+
+ The record methods are safe to call from any thread. <load...>, <flush>, <writeSnapshotWithDates:sizes:expirationDates:> and
+ <removeAllRecords> touch the files and must only be called while nothing else uses the directory, i.e. in a
+ barrier block on the cache's queue.
+ */
+
+#import <Foundation/Foundation.h>
+
+@interface TMDiskCacheIndex : NSObject
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL;
+
+/**
+ Reads the snapshot and replays the journal into the dictionaries, keyed by cache key. A journal cut short by a
+ crash is truncated after its last complete record.
+
+ @result `NO` if the directory has no index yet, in which case the dictionaries are left untouched.
+ */
+- (BOOL)loadDates:(NSMutableDictionary *)dates sizes:(NSMutableDictionary *)sizes
+  expirationDates:(NSMutableDictionary *)expirationDates;
+
+/**
+ The key was written. Each record method returns `YES` if it was the first record buffered since the last
+ <flush>, meaning the caller should schedule one.
+ */
+- (BOOL)setSize:(NSUInteger)size date:(NSDate *)date forKey:(NSString *)key;
+
+/**
+ The key expires at the date. Recorded after <setSize:date:forKey:>, which clears the date the key expired at
+ before.
+ */
+- (BOOL)setExpirationDate:(NSDate *)date forKey:(NSString *)key;
+
+/**
+ The key was read.
+ */
+- (BOOL)setAccessDate:(NSDate *)date forKey:(NSString *)key;
+
+/**
+ The key was removed.
+ */
+- (BOOL)removeKey:(NSString *)key;
+
+/**
+ Appends the buffered records to the journal.
+ */
+- (void)flush;
+
+/**
+ `YES` once the journal holds more records than a new snapshot would.
+ */
+- (BOOL)needsSnapshot;
+
+/**
+ Writes the complete state as a new snapshot and starts an empty journal. Records still buffered are dropped,
+ the dictionaries passed in must already include them.
+ */
+- (void)writeSnapshotWithDates:(NSDictionary *)dates sizes:(NSDictionary *)sizes
+               expirationDates:(NSDictionary *)expirationDates;
+
+/**
+ Forgets all buffered records, to be called after the contents of the directory were removed.
+ */
+- (void)removeAllRecords;
+
+@end
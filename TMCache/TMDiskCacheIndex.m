@@ -0,0 +1,363 @@
+#import "TMDiskCacheIndex.h"
+
+#import <pthread.h>
+
+#define TMDiskCacheIndexError(error) if (error) { NSLog(@"%@ (%d) ERROR: %@", \
+                                        [[NSString stringWithUTF8String:__FILE__] lastPathComponent], \
+                                        __LINE__, [error localizedDescription]); }
+
+NSString * const TMDiskCacheIndexSnapshotName = @".TMDiskCacheIndex";
+NSString * const TMDiskCacheIndexJournalName = @".TMDiskCacheJournal";
+
+static const uint32_t TMDiskCacheIndexSnapshotMagic = 'TMIS';
+static const uint32_t TMDiskCacheIndexJournalMagic = 'TMIJ';
+static const uint32_t TMDiskCacheIndexVersion = 2; // 2 added expiration records
+static const NSUInteger TMDiskCacheIndexMinimumJournalRecords = 1024;
+
+// Both files start with a header, followed by records. Everything is in host byte order, the files never leave
+// the device. The generation ties a journal to the snapshot it was started after.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+} TMDiskCacheIndexHeader;
+
+typedef NS_ENUM(uint8_t, TMDiskCacheIndexOperation) {
+    TMDiskCacheIndexOperationSet = 'S',
+    TMDiskCacheIndexOperationAccess = 'A',
+    TMDiskCacheIndexOperationRemove = 'R',
+    TMDiskCacheIndexOperationExpire = 'E'
+};
+
+// operation (1), key length (2), date (8), size (8), then the key in UTF-8
+static const NSUInteger TMDiskCacheIndexRecordHeaderLength = 19;
+
+static void TMDiskCacheIndexAppendRecord(NSMutableData *data, TMDiskCacheIndexOperation operation, NSString *key,
+                                         NSTimeInterval date, uint64_t size)
+{
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    if (!keyData || [keyData length] > UINT16_MAX)
+        return;
+
+    uint16_t keyLength = (uint16_t)[keyData length];
+    uint8_t header[TMDiskCacheIndexRecordHeaderLength];
+
+    header[0] = operation;
+    memcpy(header + 1, &keyLength, sizeof(keyLength));
+    memcpy(header + 3, &date, sizeof(date));
+    memcpy(header + 11, &size, sizeof(size));
+
+    [data appendBytes:header length:TMDiskCacheIndexRecordHeaderLength];
+    [data appendData:keyData];
+}
+
+static NSData *TMDiskCacheIndexHeaderData(uint32_t magic, uint64_t generation)
+{
+    TMDiskCacheIndexHeader header = { magic, TMDiskCacheIndexVersion, generation };
+    return [[NSData alloc] initWithBytes:&header length:sizeof(header)];
+}
+
+static BOOL TMDiskCacheIndexReadHeader(NSData *data, uint32_t magic, uint64_t *generation)
+{
+    if ([data length] < sizeof(TMDiskCacheIndexHeader))
+        return NO;
+
+    TMDiskCacheIndexHeader header;
+    memcpy(&header, [data bytes], sizeof(header));
+
+    if (header.magic != magic || header.version != TMDiskCacheIndexVersion)
+        return NO;
+
+    *generation = header.generation;
+    return YES;
+}
+
+@interface TMDiskCacheIndex () {
+    pthread_mutex_t _lock;
+}
+@property (strong, nonatomic) NSURL *snapshotURL;
+@property (strong, nonatomic) NSURL *journalURL;
+@property (strong, nonatomic) NSMutableData *pendingRecords;
+@property (assign, nonatomic) NSUInteger pendingRecordCount;
+@property (assign, nonatomic) uint64_t generation;
+@property (assign, nonatomic) NSUInteger snapshotRecordCount;
+@property (assign, nonatomic) NSUInteger journalRecordCount;
+@end
+
+@implementation TMDiskCacheIndex
+
+#pragma mark - Initialization -
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL
+{
+    if (!directoryURL)
+        return nil;
+
+    if (self = [super init]) {
+        pthread_mutex_init(&_lock, NULL);
+
+        _snapshotURL = [directoryURL URLByAppendingPathComponent:TMDiskCacheIndexSnapshotName];
+        _journalURL = [directoryURL URLByAppendingPathComponent:TMDiskCacheIndexJournalName];
+        _pendingRecords = [[NSMutableData alloc] init];
+        _pendingRecordCount = 0;
+        _generation = 0;
+        _snapshotRecordCount = 0;
+        _journalRecordCount = 0;
+    }
+    return self;
+}
+
+#pragma mark - Private Methods -
+
+- (void)lock
+{
+    pthread_mutex_lock(&_lock);
+}
+
+- (void)unlock
+{
+    pthread_mutex_unlock(&_lock);
+}
+
+// Returns the offset just past the last complete record, and counts the records in *count.
+- (NSUInteger)replayRecords:(NSData *)data dates:(NSMutableDictionary *)dates sizes:(NSMutableDictionary *)sizes
+            expirationDates:(NSMutableDictionary *)expirationDates count:(NSUInteger *)count
+{
+    const uint8_t *bytes = [data bytes];
+    NSUInteger length = [data length];
+    NSUInteger offset = sizeof(TMDiskCacheIndexHeader);
+    NSUInteger records = 0;
+
+    while (offset + TMDiskCacheIndexRecordHeaderLength <= length) {
+        uint8_t operation = bytes[offset];
+        uint16_t keyLength;
+        NSTimeInterval date;
+        uint64_t size;
+
+        memcpy(&keyLength, bytes + offset + 1, sizeof(keyLength));
+        memcpy(&date, bytes + offset + 3, sizeof(date));
+        memcpy(&size, bytes + offset + 11, sizeof(size));
+
+        NSUInteger keyOffset = offset + TMDiskCacheIndexRecordHeaderLength;
+        if (keyOffset + keyLength > length)
+            break;
+
+        NSString *key = [[NSString alloc] initWithBytes:bytes + keyOffset length:keyLength encoding:NSUTF8StringEncoding];
+        if (!key)
+            break;
+
+        switch (operation) {
+            case TMDiskCacheIndexOperationSet:
+                [dates setObject:[[NSDate alloc] initWithTimeIntervalSinceReferenceDate:date] forKey:key];
+                [sizes setObject:@(size) forKey:key];
+                [expirationDates removeObjectForKey:key];
+                break;
+            case TMDiskCacheIndexOperationAccess:
+                if ([dates objectForKey:key])
+                    [dates setObject:[[NSDate alloc] initWithTimeIntervalSinceReferenceDate:date] forKey:key];
+                break;
+            case TMDiskCacheIndexOperationRemove:
+                [dates removeObjectForKey:key];
+                [sizes removeObjectForKey:key];
+                [expirationDates removeObjectForKey:key];
+                break;
+            case TMDiskCacheIndexOperationExpire:
+                if ([dates objectForKey:key])
+                    [expirationDates setObject:[[NSDate alloc] initWithTimeIntervalSinceReferenceDate:date] forKey:key];
+                break;
+            default:
+                *count = records;
+                return offset;
+        }
+
+        offset = keyOffset + keyLength;
+        records++;
+    }
+
+    *count = records;
+    return offset;
+}
+
+- (BOOL)bufferRecord:(TMDiskCacheIndexOperation)operation key:(NSString *)key date:(NSDate *)date size:(uint64_t)size
+{
+    if (!key)
+        return NO;
+
+    [self lock];
+
+    BOOL first = [_pendingRecords length] == 0;
+    TMDiskCacheIndexAppendRecord(_pendingRecords, operation, key, [date timeIntervalSinceReferenceDate], size);
+    _pendingRecordCount++;
+
+    [self unlock];
+
+    return first;
+}
+
+#pragma mark - Public Methods -
+
+- (BOOL)loadDates:(NSMutableDictionary *)dates sizes:(NSMutableDictionary *)sizes
+  expirationDates:(NSMutableDictionary *)expirationDates
+{
+    NSMutableDictionary *loadedDates = [[NSMutableDictionary alloc] init];
+    NSMutableDictionary *loadedSizes = [[NSMutableDictionary alloc] init];
+    NSMutableDictionary *loadedExpirationDates = [[NSMutableDictionary alloc] init];
+    uint64_t snapshotGeneration = 0;
+    uint64_t journalGeneration = 0;
+    NSUInteger count = 0;
+
+    NSData *snapshot = [[NSData alloc] initWithContentsOfURL:_snapshotURL options:NSDataReadingMappedAlways error:NULL];
+    BOOL hasSnapshot = TMDiskCacheIndexReadHeader(snapshot, TMDiskCacheIndexSnapshotMagic, &snapshotGeneration);
+
+    if (hasSnapshot) {
+        [self replayRecords:snapshot dates:loadedDates sizes:loadedSizes expirationDates:loadedExpirationDates count:&count];
+        _snapshotRecordCount = count;
+        _generation = snapshotGeneration;
+    }
+
+    NSData *journal = [[NSData alloc] initWithContentsOfURL:_journalURL options:NSDataReadingMappedAlways error:NULL];
+    BOOL hasJournal = TMDiskCacheIndexReadHeader(journal, TMDiskCacheIndexJournalMagic, &journalGeneration)
+                      && (!hasSnapshot || journalGeneration == snapshotGeneration);
+
+    if (hasJournal) {
+        NSUInteger end = [self replayRecords:journal dates:loadedDates sizes:loadedSizes
+                             expirationDates:loadedExpirationDates count:&count];
+        _journalRecordCount = count;
+        _generation = journalGeneration;
+
+        if (end < [journal length]) {
+            NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingToURL:_journalURL error:NULL];
+            [fileHandle truncateFileAtOffset:end];
+            [fileHandle closeFile];
+        }
+    } else if (journal) {
+        NSError *error = nil;
+        [[NSFileManager defaultManager] removeItemAtURL:_journalURL error:&error]; // stale, from another snapshot
+        TMDiskCacheIndexError(error);
+    }
+
+    if (!hasSnapshot && !hasJournal)
+        return NO;
+
+    [dates addEntriesFromDictionary:loadedDates];
+    [sizes addEntriesFromDictionary:loadedSizes];
+    [expirationDates addEntriesFromDictionary:loadedExpirationDates];
+
+    return YES;
+}
+
+- (BOOL)setSize:(NSUInteger)size date:(NSDate *)date forKey:(NSString *)key
+{
+    return [self bufferRecord:TMDiskCacheIndexOperationSet key:key date:date size:size];
+}
+
+- (BOOL)setExpirationDate:(NSDate *)date forKey:(NSString *)key
+{
+    return [self bufferRecord:TMDiskCacheIndexOperationExpire key:key date:date size:0];
+}
+
+- (BOOL)setAccessDate:(NSDate *)date forKey:(NSString *)key
+{
+    return [self bufferRecord:TMDiskCacheIndexOperationAccess key:key date:date size:0];
+}
+
+- (BOOL)removeKey:(NSString *)key
+{
+    return [self bufferRecord:TMDiskCacheIndexOperationRemove key:key date:nil size:0];
+}
+
+- (void)flush
+{
+    [self lock];
+    NSData *records = _pendingRecords;
+    NSUInteger recordCount = _pendingRecordCount;
+    _pendingRecords = [[NSMutableData alloc] init];
+    _pendingRecordCount = 0;
+    [self unlock];
+
+    if (![records length])
+        return;
+
+    NSString *path = [_journalURL path];
+
+    if (![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        NSData *header = TMDiskCacheIndexHeaderData(TMDiskCacheIndexJournalMagic, _generation);
+        [[NSFileManager defaultManager] createFileAtPath:path contents:header attributes:nil];
+    }
+
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:path];
+    @try {
+        [fileHandle seekToEndOfFile];
+        [fileHandle writeData:records];
+    }
+    @catch (NSException *exception) {
+        NSLog(@"%@ ERROR: %@", NSStringFromClass([self class]), [exception reason]);
+    }
+    [fileHandle closeFile];
+
+    _journalRecordCount += recordCount;
+}
+
+- (BOOL)needsSnapshot
+{
+    return _journalRecordCount > MAX(_snapshotRecordCount, TMDiskCacheIndexMinimumJournalRecords);
+}
+
+- (void)writeSnapshotWithDates:(NSDictionary *)dates sizes:(NSDictionary *)sizes
+               expirationDates:(NSDictionary *)expirationDates
+{
+    [self lock];
+    [_pendingRecords setLength:0];
+    _pendingRecordCount = 0;
+    [self unlock];
+
+    uint64_t generation = _generation + 1;
+
+    NSMutableData *snapshot = [TMDiskCacheIndexHeaderData(TMDiskCacheIndexSnapshotMagic, generation) mutableCopy];
+
+    [dates enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSDate *date, BOOL *stop) {
+        uint64_t size = [[sizes objectForKey:key] unsignedLongLongValue];
+        TMDiskCacheIndexAppendRecord(snapshot, TMDiskCacheIndexOperationSet, key, [date timeIntervalSinceReferenceDate], size);
+
+        NSDate *expirationDate = [expirationDates objectForKey:key];
+        if (expirationDate)
+            TMDiskCacheIndexAppendRecord(snapshot, TMDiskCacheIndexOperationExpire, key,
+                                         [expirationDate timeIntervalSinceReferenceDate], 0);
+    }];
+
+    NSError *error = nil;
+    BOOL written = [snapshot writeToURL:_snapshotURL options:NSDataWritingAtomic error:&error];
+    TMDiskCacheIndexError(error);
+
+    if (!written)
+        return;
+
+    // the old journal no longer matches the snapshot's generation, a crash right here only loses it
+    error = nil;
+    NSData *journal = TMDiskCacheIndexHeaderData(TMDiskCacheIndexJournalMagic, generation);
+    [journal writeToURL:_journalURL options:NSDataWritingAtomic error:&error];
+    TMDiskCacheIndexError(error);
+
+    _generation = generation;
+    _snapshotRecordCount = [dates count] + [expirationDates count];
+    _journalRecordCount = 0;
+}
+
+- (void)removeAllRecords
+{
+    [self lock];
+    [_pendingRecords setLength:0];
+    _pendingRecordCount = 0;
+    [self unlock];
+
+    _generation = 0;
+    _snapshotRecordCount = 0;
+    _journalRecordCount = 0;
+}
+
+@end
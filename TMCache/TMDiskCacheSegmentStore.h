@@ -0,0 +1,61 @@
+/**
+ Private to `TMDiskCache`. Stores small values by appending them to large segment files instead of giving each
+ one a file of its own, which would cost an inode, a directory entry and at least one allocation block.
+
+ Segments live in a hidden directory inside the cache directory. Every set appends a record, every removal
+ appends a tombstone, and an in-memory table maps each key to its latest record. Records that were replaced or
+ removed are dead space until <compact> copies the live records of all older segments forward and deletes them.
+ The table is rebuilt on <load> by reading the segments front to back.
+
+ <dataForKey:>, <setData:forKey:> and <removeDataForKey:> are safe to call from any thread. <load>, <compact> and
+ <removeAllData> must only be called while nothing else uses the store, i.e. in a barrier block on the cache's
+ queue.
+ */
+
+#import <Foundation/Foundation.h>
+
+@interface TMDiskCacheSegmentStore : NSObject
+
+/**
+ `YES` once there is more dead space in the older segments than live data.
+ */
+@property (readonly) BOOL needsCompaction;
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL;
+
+/**
+ Reads all segments and rebuilds the key table. A record cut short by a crash is truncated.
+
+ @result The number of bytes each stored key takes up, keyed by cache key.
+ */
+- (NSDictionary *)load;
+
+- (BOOL)containsDataForKey:(NSString *)key;
+
+- (NSData *)dataForKey:(NSString *)key;
+
+/**
+ Appends the value, replacing any earlier one for the key.
+
+ @result The number of bytes the record takes up in its segment, or `0` if it could not be written.
+ */
+- (NSUInteger)setData:(NSData *)data forKey:(NSString *)key;
+
+/**
+ @result `NO` if the store had no value for the key.
+ */
+- (BOOL)removeDataForKey:(NSString *)key;
+
+- (NSArray *)allKeys;
+
+/**
+ Copies the live records of every segment but the one being appended to forward and deletes those segments.
+ */
+- (void)compact;
+
+/**
+ Forgets all values and closes the segments, to be called after the contents of the directory were removed.
+ */
+- (void)removeAllData;
+
+@end
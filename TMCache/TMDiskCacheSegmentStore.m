@@ -0,0 +1,420 @@
+#import "TMDiskCacheSegmentStore.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <unistd.h>
+
+NSString * const TMDiskCacheSegmentDirectoryName = @".TMDiskCacheSegments";
+NSString * const TMDiskCacheSegmentExtension = @"segment";
+
+static const uint32_t TMDiskCacheSegmentRecordMagic = 'TMSR';
+static const uint64_t TMDiskCacheSegmentMaximumLength = 4 * 1024 * 1024;
+static const uint64_t TMDiskCacheSegmentMinimumDeadBytes = 1024 * 1024;
+
+typedef NS_OPTIONS(uint16_t, TMDiskCacheSegmentRecordFlags) {
+    TMDiskCacheSegmentRecordTombstone = 1 << 0
+};
+
+// Every record is this header, the key in UTF-8 and then the value. Host byte order, the files never leave the device.
+typedef struct {
+    uint32_t magic;
+    uint16_t keyLength;
+    uint16_t flags;
+    uint32_t valueLength;
+} TMDiskCacheSegmentRecordHeader;
+
+@interface TMDiskCacheSegmentLocation : NSObject
+@property (assign, nonatomic) uint32_t segment;
+@property (assign, nonatomic) uint64_t offset;
+@property (assign, nonatomic) uint32_t valueOffset; // from the start of the record
+@property (assign, nonatomic) uint32_t valueLength;
+@property (assign, nonatomic) uint32_t length;
+@end
+
+@implementation TMDiskCacheSegmentLocation
+@end
+
+@interface TMDiskCacheSegmentStore () {
+    pthread_mutex_t _lock;
+}
+@property (strong, nonatomic) NSURL *segmentsURL;
+@property (strong, nonatomic) NSMutableDictionary *locations;
+@property (strong, nonatomic) NSMutableDictionary *fileDescriptors;
+@property (strong, nonatomic) NSMutableDictionary *segmentLengths;
+@property (assign, nonatomic) uint32_t activeSegment;
+@property (assign, nonatomic) uint64_t liveBytes;
+@property (assign, nonatomic) uint64_t totalBytes;
+@end
+
+@implementation TMDiskCacheSegmentStore
+
+#pragma mark - Initialization -
+
+- (void)dealloc
+{
+    [self closeAllSegments];
+    pthread_mutex_destroy(&_lock);
+}
+
+- (instancetype)initWithDirectoryURL:(NSURL *)directoryURL
+{
+    if (!directoryURL)
+        return nil;
+
+    if (self = [super init]) {
+        pthread_mutex_init(&_lock, NULL);
+
+        _segmentsURL = [directoryURL URLByAppendingPathComponent:TMDiskCacheSegmentDirectoryName isDirectory:YES];
+        _locations = [[NSMutableDictionary alloc] init];
+        _fileDescriptors = [[NSMutableDictionary alloc] init];
+        _segmentLengths = [[NSMutableDictionary alloc] init];
+        _activeSegment = 0;
+        _liveBytes = 0;
+        _totalBytes = 0;
+    }
+    return self;
+}
+
+#pragma mark - Private Methods -
+
+- (void)lock
+{
+    pthread_mutex_lock(&_lock);
+}
+
+- (void)unlock
+{
+    pthread_mutex_unlock(&_lock);
+}
+
+- (NSString *)pathForSegment:(uint32_t)segment
+{
+    NSString *fileName = [[NSString alloc] initWithFormat:@"%08x.%@", segment, TMDiskCacheSegmentExtension];
+    return [[_segmentsURL path] stringByAppendingPathComponent:fileName];
+}
+
+- (int)fileDescriptorForSegment:(uint32_t)segment
+{
+    NSNumber *fileDescriptor = [_fileDescriptors objectForKey:@(segment)];
+    if (fileDescriptor)
+        return [fileDescriptor intValue];
+
+    [[NSFileManager defaultManager] createDirectoryAtURL:_segmentsURL withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    int fd = open([[self pathForSegment:segment] fileSystemRepresentation], O_RDWR | O_CREAT, 0644);
+    if (fd >= 0)
+        [_fileDescriptors setObject:@(fd) forKey:@(segment)];
+
+    return fd;
+}
+
+- (void)closeAllSegments
+{
+    for (NSNumber *fileDescriptor in [_fileDescriptors objectEnumerator])
+        close([fileDescriptor intValue]);
+
+    [_fileDescriptors removeAllObjects];
+}
+
+- (uint64_t)lengthOfSegment:(uint32_t)segment
+{
+    return [[_segmentLengths objectForKey:@(segment)] unsignedLongLongValue];
+}
+
+// Call with the lock held. Starts a new segment first if the record doesn't fit in the active one.
+- (TMDiskCacheSegmentLocation *)appendRecordWithKey:(NSString *)key data:(NSData *)data flags:(uint16_t)flags
+{
+    NSData *keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+    if (!keyData || [keyData length] > UINT16_MAX || [data length] > UINT32_MAX)
+        return nil;
+
+    TMDiskCacheSegmentRecordHeader header = { TMDiskCacheSegmentRecordMagic, (uint16_t)[keyData length], flags, (uint32_t)[data length] };
+    uint32_t valueOffset = (uint32_t)(sizeof(header) + [keyData length]);
+    uint32_t length = valueOffset + (uint32_t)[data length];
+
+    uint64_t offset = [self lengthOfSegment:_activeSegment];
+    if (offset > 0 && offset + length > TMDiskCacheSegmentMaximumLength) {
+        _activeSegment++;
+        offset = 0;
+    }
+
+    int fd = [self fileDescriptorForSegment:_activeSegment];
+    if (fd < 0)
+        return nil;
+
+    NSMutableData *record = [[NSMutableData alloc] initWithCapacity:length];
+    [record appendBytes:&header length:sizeof(header)];
+    [record appendData:keyData];
+    if (data)
+        [record appendData:data];
+
+    if (pwrite(fd, [record bytes], length, (off_t)offset) != (ssize_t)length)
+        return nil;
+
+    [_segmentLengths setObject:@(offset + length) forKey:@(_activeSegment)];
+    _totalBytes += length;
+
+    TMDiskCacheSegmentLocation *location = [[TMDiskCacheSegmentLocation alloc] init];
+    location.segment = _activeSegment;
+    location.offset = offset;
+    location.valueOffset = valueOffset;
+    location.valueLength = (uint32_t)[data length];
+    location.length = length;
+
+    return location;
+}
+
+- (NSData *)readValueAtLocation:(TMDiskCacheSegmentLocation *)location fileDescriptor:(int)fd
+{
+    NSMutableData *data = [[NSMutableData alloc] initWithLength:location.valueLength];
+    off_t offset = (off_t)(location.offset + location.valueOffset);
+
+    if (pread(fd, [data mutableBytes], location.valueLength, offset) != (ssize_t)location.valueLength)
+        return nil;
+
+    return data;
+}
+
+#pragma mark - Public Methods -
+
+- (NSDictionary *)load
+{
+    [self lock];
+
+    [self closeAllSegments];
+    [_locations removeAllObjects];
+    [_segmentLengths removeAllObjects];
+    _activeSegment = 0;
+    _liveBytes = 0;
+    _totalBytes = 0;
+
+    NSArray *fileNames = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:[_segmentsURL path] error:NULL];
+    NSMutableArray *segments = [[NSMutableArray alloc] init];
+
+    for (NSString *fileName in fileNames) {
+        if (![[fileName pathExtension] isEqualToString:TMDiskCacheSegmentExtension])
+            continue;
+
+        unsigned int segment = 0;
+        if ([[NSScanner scannerWithString:[fileName stringByDeletingPathExtension]] scanHexInt:&segment])
+            [segments addObject:@(segment)];
+    }
+
+    [segments sortUsingSelector:@selector(compare:)];
+
+    for (NSNumber *segmentNumber in segments) {
+        uint32_t segment = [segmentNumber unsignedIntValue];
+        NSData *data = [[NSData alloc] initWithContentsOfFile:[self pathForSegment:segment]
+                                                      options:NSDataReadingMappedAlways
+                                                        error:NULL];
+        const uint8_t *bytes = [data bytes];
+        uint64_t length = [data length];
+        uint64_t offset = 0;
+
+        while (offset + sizeof(TMDiskCacheSegmentRecordHeader) <= length) {
+            TMDiskCacheSegmentRecordHeader header;
+            memcpy(&header, bytes + offset, sizeof(header));
+
+            uint32_t valueOffset = (uint32_t)sizeof(header) + header.keyLength;
+            uint64_t recordLength = (uint64_t)valueOffset + header.valueLength;
+
+            if (header.magic != TMDiskCacheSegmentRecordMagic || offset + recordLength > length)
+                break;
+
+            NSString *key = [[NSString alloc] initWithBytes:bytes + offset + sizeof(header)
+                                                     length:header.keyLength
+                                                   encoding:NSUTF8StringEncoding];
+            if (!key)
+                break;
+
+            if (header.flags & TMDiskCacheSegmentRecordTombstone) {
+                [_locations removeObjectForKey:key];
+            } else {
+                TMDiskCacheSegmentLocation *location = [[TMDiskCacheSegmentLocation alloc] init];
+                location.segment = segment;
+                location.offset = offset;
+                location.valueOffset = valueOffset;
+                location.valueLength = header.valueLength;
+                location.length = (uint32_t)recordLength;
+                [_locations setObject:location forKey:key];
+            }
+
+            offset += recordLength;
+        }
+
+        if (offset < length)
+            truncate([[self pathForSegment:segment] fileSystemRepresentation], (off_t)offset);
+
+        [_segmentLengths setObject:@(offset) forKey:segmentNumber];
+        _totalBytes += offset;
+        _activeSegment = segment;
+    }
+
+    NSMutableDictionary *sizes = [[NSMutableDictionary alloc] initWithCapacity:[_locations count]];
+
+    [_locations enumerateKeysAndObjectsUsingBlock:^(NSString *key, TMDiskCacheSegmentLocation *location, BOOL *stop) {
+        _liveBytes += location.length;
+        [sizes setObject:@(location.length) forKey:key];
+    }];
+
+    [self unlock];
+
+    return sizes;
+}
+
+- (BOOL)containsDataForKey:(NSString *)key
+{
+    if (!key)
+        return NO;
+
+    [self lock];
+    BOOL contains = [_locations objectForKey:key] != nil;
+    [self unlock];
+
+    return contains;
+}
+
+- (NSData *)dataForKey:(NSString *)key
+{
+    if (!key)
+        return nil;
+
+    [self lock];
+    TMDiskCacheSegmentLocation *location = [_locations objectForKey:key];
+    int fd = location ? [self fileDescriptorForSegment:location.segment] : -1;
+    [self unlock];
+
+    if (fd < 0)
+        return nil;
+
+    // segments are only closed by -compact and -removeAllData, which never run alongside a read
+    return [self readValueAtLocation:location fileDescriptor:fd];
+}
+
+- (NSUInteger)setData:(NSData *)data forKey:(NSString *)key
+{
+    if (!data || !key)
+        return 0;
+
+    [self lock];
+
+    TMDiskCacheSegmentLocation *location = [self appendRecordWithKey:key data:data flags:0];
+
+    if (location) {
+        TMDiskCacheSegmentLocation *oldLocation = [_locations objectForKey:key];
+        if (oldLocation)
+            _liveBytes -= oldLocation.length;
+
+        [_locations setObject:location forKey:key];
+        _liveBytes += location.length;
+    }
+
+    [self unlock];
+
+    return location.length;
+}
+
+- (BOOL)removeDataForKey:(NSString *)key
+{
+    if (!key)
+        return NO;
+
+    [self lock];
+
+    TMDiskCacheSegmentLocation *location = [_locations objectForKey:key];
+
+    if (location) {
+        [self appendRecordWithKey:key data:nil flags:TMDiskCacheSegmentRecordTombstone];
+        [_locations removeObjectForKey:key];
+        _liveBytes -= location.length;
+    }
+
+    [self unlock];
+
+    return location != nil;
+}
+
+- (NSArray *)allKeys
+{
+    [self lock];
+    NSArray *keys = [_locations allKeys];
+    [self unlock];
+
+    return keys;
+}
+
+- (BOOL)needsCompaction
+{
+    [self lock];
+    uint64_t deadBytes = _totalBytes - _liveBytes;
+    BOOL needsCompaction = deadBytes > MAX(_liveBytes, TMDiskCacheSegmentMinimumDeadBytes);
+    [self unlock];
+
+    return needsCompaction;
+}
+
+// Tombstones are not copied. Every record they could hide is in a segment that is deleted along with them, the
+// segment being appended to only holds records that are newer than anything compacted.
+- (void)compact
+{
+    [self lock];
+
+    uint32_t lastCompactedSegment = _activeSegment;
+    _activeSegment++;
+
+    NSArray *keys = [_locations allKeys];
+
+    for (NSString *key in keys) {
+        TMDiskCacheSegmentLocation *location = [_locations objectForKey:key];
+        if (location.segment > lastCompactedSegment)
+            continue;
+
+        int fd = [self fileDescriptorForSegment:location.segment];
+        NSData *data = fd < 0 ? nil : [self readValueAtLocation:location fileDescriptor:fd];
+        TMDiskCacheSegmentLocation *newLocation = data ? [self appendRecordWithKey:key data:data flags:0] : nil;
+
+        _liveBytes -= location.length;
+
+        if (newLocation) {
+            [_locations setObject:newLocation forKey:key];
+            _liveBytes += newLocation.length;
+        } else {
+            [_locations removeObjectForKey:key];
+        }
+    }
+
+    for (NSNumber *segmentNumber in [_segmentLengths allKeys]) {
+        uint32_t segment = [segmentNumber unsignedIntValue];
+        if (segment > lastCompactedSegment)
+            continue;
+
+        NSNumber *fileDescriptor = [_fileDescriptors objectForKey:segmentNumber];
+        if (fileDescriptor) {
+            close([fileDescriptor intValue]);
+            [_fileDescriptors removeObjectForKey:segmentNumber];
+        }
+
+        unlink([[self pathForSegment:segment] fileSystemRepresentation]);
+
+        _totalBytes -= [self lengthOfSegment:segment];
+        [_segmentLengths removeObjectForKey:segmentNumber];
+    }
+
+    [self unlock];
+}
+
+- (void)removeAllData
+{
+    [self lock];
+
+    [self closeAllSegments];
+    [_locations removeAllObjects];
+    [_segmentLengths removeAllObjects];
+    _activeSegment = 0;
+    _liveBytes = 0;
+    _totalBytes = 0;
+
+    [self unlock];
+}
+
+@end
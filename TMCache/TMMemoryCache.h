@@ -2,14 +2,26 @@
  `TMMemoryCache` is a fast, thread safe key/value store similar to `NSCache`. On iOS it will clear itself
  automatically to reduce memory usage when the app receives a memory warning or goes into the background.
 
- Access is natively asynchronous. Every method accepts a callback block that runs on a concurrent
- <queue>, with cache writes protected by GCD barriers. Synchronous variations are provided.
+ Every method accepts a callback block that runs on a concurrent <queue>, with cache writes ordered by
+ GCD barriers. Synchronous variations are provided; they do their work directly on the calling thread
+ under the shard locks and never wait on the <queue>, so a synchronous hit costs a dictionary lookup and
+ an uncontended read lock.
+
+ Objects live in one or more shards chosen by key hash (see <initWithShardCount:>), each with its own
+ read/write lock. Cache hits only take their shard's lock for reading and log the access to be applied
+ to the recency list later, so concurrent hits never wait on a barrier or on each other.
  
- All access to the cache is dated so the that the least-used objects can be trimmed first. Setting an
- optional <ageLimit> will trigger a GCD timer to periodically to trim the cache to that age.
+ All access to the cache is dated so the that the least-used objects can be trimmed first. Objects are kept
+ in a list ordered by access, so trimming by date never needs to sort the cache. Setting an optional
+ <ageLimit> will trigger a GCD timer to periodically to trim the cache to that age.
+
+ Objects can also be set with a time to live of their own (see <setObject:forKey:ttl:>). Once it is over the
+ object reads as missing, and a timer wheel removes it within a second, touching only objects that are due.
  
  Objects can optionally be set with a "cost", which could be a byte count or any other meaningful integer.
- Setting a <costLimit> will automatically keep the cache below that value with <trimToCostByDate:>.
+ Setting a <costLimit> will automatically keep the cache below that value with <trimToCostByDate:>, which
+ evicts in the order chosen by the cache's <evictionPolicy>. The default is least recently used first; the
+ scan-resistant policies keep frequently used objects when many keys are read once.
 
  Values will not persist after application relaunch or returning from the background. See <TMCache> for
  a memory cache backed by a disk cache.
@@ -17,10 +29,25 @@
 
 #import <Foundation/Foundation.h>
 
+#import "TMCacheStatistics.h"
+
 @class TMMemoryCache;
 
+/**
+ The order in which objects are evicted when the cache is over its <[TMMemoryCache costLimit]>.
+ */
+typedef NS_ENUM(NSUInteger, TMMemoryCacheEvictionPolicy) {
+    /** Least recently used first. Cheapest to maintain, but one pass over many new keys evicts everything else. */
+    TMMemoryCacheEvictionPolicyLRU = 0,
+    /** W-TinyLFU. New objects are only kept if they are estimated to be used more often than what they would evict. */
+    TMMemoryCacheEvictionPolicyTinyLFU,
+    /** Adaptive Replacement Cache. Balances objects used once against objects used repeatedly. */
+    TMMemoryCacheEvictionPolicyARC
+};
+
 typedef void (^TMMemoryCacheBlock)(TMMemoryCache *cache);
 typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id object);
+typedef void (^TMMemoryCacheObjectsBlock)(TMMemoryCache *cache, NSDictionary *objects);
 
 @interface TMMemoryCache : NSObject
 
@@ -33,6 +60,16 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
  */
 @property (readonly) dispatch_queue_t queue;
 
+/**
+ The number of shards the cache is split into. Always a power of two.
+ */
+@property (readonly) NSUInteger shardCount;
+
+/**
+ The policy that picks which objects <trimToCostByDate:> and the <costLimit> evict. Set at initialization.
+ */
+@property (readonly) TMMemoryCacheEvictionPolicy evictionPolicy;
+
 /**
  The total accumulated cost.
  */
@@ -40,6 +77,7 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
 
 /**
  The maximum cost allowed to accumulate before objects begin to be removed with <trimToCostByDate:>.
+ The limit is divided evenly between the shards and each shard is trimmed on its own.
  */
 @property (assign) NSUInteger costLimit;
 
@@ -62,6 +100,13 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
  */
 @property (assign) BOOL removeAllObjectsOnEnteringBackground;
 
+/**
+ Hits, misses, writes, removals and evictions of this cache, and how long reads, writes and removals take,
+ including waiting for a shard. Objects dropped on a memory warning or when entering the background are not
+ counted as evictions.
+ */
+@property (readonly) TMCacheStatistics *statistics;
+
 #pragma mark -
 /// @name Event Blocks
 
@@ -123,6 +168,29 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
  */
 + (instancetype)sharedCache;
 
+#pragma mark -
+/// @name Initialization
+
+/**
+ Creates a cache with the default LRU <evictionPolicy>. Read-heavy caches shared by many threads should use
+ more than one shard so that hits on different keys touch different locks. `init` creates a cache with a
+ single shard.
+
+ @param shardCount The number of shards, rounded up to the next power of two.
+ @result A new cache with the specified number of shards.
+ */
+- (instancetype)initWithShardCount:(NSUInteger)shardCount;
+
+/**
+ Creates a cache with the specified number of shards and eviction policy. Each shard runs its own instance
+ of the policy over its share of the <costLimit>.
+
+ @param shardCount The number of shards, rounded up to the next power of two.
+ @param evictionPolicy The order in which objects are evicted when the cache is over its <costLimit>.
+ @result A new cache with the specified number of shards and eviction policy.
+ */
+- (instancetype)initWithShardCount:(NSUInteger)shardCount evictionPolicy:(TMMemoryCacheEvictionPolicy)evictionPolicy;
+
 #pragma mark -
 /// @name Asynchronous Methods
 
@@ -147,7 +215,7 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
 
 /**
  Stores an object in the cache for the specified key and the specified cost. If the cost causes the total
- to go over the <costLimit> the cache is trimmed (oldest objects first). This method returns immediately
+ to go over the <costLimit> the cache is trimmed (see <evictionPolicy>). This method returns immediately
  and executes the passed block after the object has been stored, potentially in parallel with other blocks
  on the <queue>.
  
@@ -158,6 +226,33 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
  */
 - (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost block:(TMMemoryCacheObjectBlock)block;
 
+/**
+ Stores an object in the cache for the specified key that expires after the specified number of seconds, no
+ matter how often it is used. Setting the key again replaces the time to live along with the object. This method
+ returns immediately and executes the passed block after the object has been stored, potentially in parallel with
+ other blocks on the <queue>.
+
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ @param block A block to be executed concurrently after the object has been stored, or nil.
+ */
+- (void)setObject:(id)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl block:(TMMemoryCacheObjectBlock)block;
+
+/**
+ Stores an object in the cache for the specified key, cost and time to live. If the cost causes the total to go
+ over the <costLimit> the cache is trimmed (see <evictionPolicy>). This method returns immediately and executes
+ the passed block after the object has been stored, potentially in parallel with other blocks on the <queue>.
+
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param cost An amount to add to the <totalCost>.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ @param block A block to be executed concurrently after the object has been stored, or nil.
+ */
+- (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost ttl:(NSTimeInterval)ttl
+            block:(TMMemoryCacheObjectBlock)block;
+
 /**
  Removes the object for the specified key. This method returns immediately and executes the passed
  block after the object has been removed, potentially in parallel with other blocks on the <queue>.
@@ -167,6 +262,52 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
  */
 - (void)removeObjectForKey:(NSString *)key block:(TMMemoryCacheObjectBlock)block;
 
+/**
+ Retrieves the objects for the specified keys, locking each shard once for the whole batch. This method returns
+ immediately and executes the passed block after the objects are available, potentially in parallel with other
+ blocks on the <queue>.
+
+ @param keys The keys associated with the requested objects.
+ @param block A block to be executed concurrently with the objects that were found, keyed by their keys.
+ */
+- (void)objectsForKeys:(NSArray *)keys block:(TMMemoryCacheObjectsBlock)block;
+
+/**
+ Stores several objects in the cache at once, without a cost. Each shard is locked and trimmed once for the
+ whole batch. This method returns immediately and executes the passed block after the objects have been stored,
+ potentially in parallel with other blocks on the <queue>.
+
+ @see setObjects:forKeys:withCosts:block:
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ @param block A block to be executed concurrently with the stored objects keyed by their keys, or nil.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys block:(TMMemoryCacheObjectsBlock)block;
+
+/**
+ Stores several objects in the cache at once with the specified costs. Each shard is locked and trimmed once for
+ the whole batch. This method returns immediately and executes the passed block after the objects have been
+ stored, potentially in parallel with other blocks on the <queue>.
+
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ @param costs `NSNumber` amounts to add to the <totalCost>, in the same order, or nil for no cost. Must be as
+ many as there are objects.
+ @param block A block to be executed concurrently with the stored objects keyed by their keys, or nil.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys withCosts:(NSArray *)costs
+             block:(TMMemoryCacheObjectsBlock)block;
+
+/**
+ Removes the objects for the specified keys, locking each shard once for the whole batch. This method returns
+ immediately and executes the passed block after the objects have been removed, potentially in parallel with
+ other blocks on the <queue>.
+
+ @param keys The keys associated with the objects to be removed.
+ @param block A block to be executed concurrently after the objects have been removed, or nil.
+ */
+- (void)removeObjectsForKeys:(NSArray *)keys block:(TMMemoryCacheBlock)block;
+
 /**
  Removes all objects from the cache that have not been used since the specified date.
  This method returns immediately and executes the passed block after the cache has been trimmed,
@@ -188,9 +329,10 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
 - (void)trimToCost:(NSUInteger)cost block:(TMMemoryCacheBlock)block;
 
 /**
- Removes objects from the cache, ordered by date (least recently used first), until the <totalCost> is below
- the specified value. This method returns immediately and executes the passed block after the cache has been
- trimmed, potentially in parallel with other blocks on the <queue>.
+ Removes objects from the cache, in the order chosen by the <evictionPolicy> (least recently used first by
+ default), until the <totalCost> is below the specified value. Each shard is trimmed to an even share of the
+ cost. This method returns immediately and
+ executes the passed block after the cache has been trimmed, potentially in parallel with other blocks on the <queue>.
 
  @param cost The total accumulation allowed to remain after the cache has been trimmed.
  @param block A block to be executed concurrently after the cache has been trimmed, or nil.
@@ -207,7 +349,7 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
 
 /**
  Loops through all objects in the cache within a memory barrier (reads and writes are suspended during the enumeration).
- This method returns immediately.
+ Objects are visited shard by shard, least recently used first. This method returns immediately.
 
  @param block A block to be executed for every object in the cache.
  @param completionBlock An optional block to be executed concurrently when the enumeration is complete.
@@ -239,7 +381,7 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
 
 /**
  Stores an object in the cache for the specified key and the specified cost. If the cost causes the total
- to go over the <costLimit> the cache is trimmed (oldest objects first). This method blocks the calling thread
+ to go over the <costLimit> the cache is trimmed (see <evictionPolicy>). This method blocks the calling thread
  until the object has been stored.
 
  @param object An object to store in the cache.
@@ -248,6 +390,30 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
  */
 - (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost;
 
+/**
+ Stores an object in the cache for the specified key that expires after the specified number of seconds. Reads
+ treat it as missing from then on, even before the timer wheel has removed it. This method blocks the calling
+ thread until the object has been stored.
+
+ @see setObject:forKey:ttl:block:
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ */
+- (void)setObject:(id)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl;
+
+/**
+ Stores an object in the cache for the specified key, cost and time to live. This method blocks the calling
+ thread until the object has been stored.
+
+ @see setObject:forKey:withCost:ttl:block:
+ @param object An object to store in the cache.
+ @param key A key to associate with the object. This string will be copied.
+ @param cost An amount to add to the <totalCost>.
+ @param ttl The number of seconds until the object expires, or `0.0` for never.
+ */
+- (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost ttl:(NSTimeInterval)ttl;
+
 /**
  Removes the object for the specified key. This method blocks the calling thread until the object
  has been removed.
@@ -256,6 +422,45 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
  */
 - (void)removeObjectForKey:(NSString *)key;
 
+/**
+ Retrieves the objects for the specified keys. This method blocks the calling thread until the objects are available.
+
+ @see objectsForKeys:block:
+ @param keys The keys associated with the objects.
+ @result The objects that were found, keyed by their keys.
+ */
+- (NSDictionary *)objectsForKeys:(NSArray *)keys;
+
+/**
+ Stores several objects in the cache at once, without a cost. This method blocks the calling thread until the
+ objects have been set.
+
+ @see setObjects:forKeys:block:
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys;
+
+/**
+ Stores several objects in the cache at once with the specified costs. This method blocks the calling thread
+ until the objects have been set.
+
+ @see setObjects:forKeys:withCosts:block:
+ @param objects The objects to store in the cache.
+ @param keys The keys to associate with the objects, in the same order. Must be as many as there are objects.
+ @param costs `NSNumber` amounts to add to the <totalCost>, in the same order, or nil for no cost. Must be as
+ many as there are objects.
+ */
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys withCosts:(NSArray *)costs;
+
+/**
+ Removes the objects for the specified keys. This method blocks the calling thread until the objects have been removed.
+
+ @see removeObjectsForKeys:block:
+ @param keys The keys associated with the objects to be removed.
+ */
+- (void)removeObjectsForKeys:(NSArray *)keys;
+
 /**
  Removes all objects from the cache that have not been used since the specified date.
  This method blocks the calling thread until the cache has been trimmed.
@@ -273,8 +478,9 @@ typedef void (^TMMemoryCacheObjectBlock)(TMMemoryCache *cache, NSString *key, id
 - (void)trimToCost:(NSUInteger)cost;
 
 /**
- Removes objects from the cache, ordered by date (least recently used first), until the <totalCost> is below
- the specified value. This method blocks the calling thread until the cache has been trimmed.
+ Removes objects from the cache, in the order chosen by the <evictionPolicy> (least recently used first by
+ default), until the <totalCost> is below the specified value. This method blocks the calling thread until
+ the cache has been trimmed.
 
  @param cost The total accumulation allowed to remain after the cache has been trimmed.
  */
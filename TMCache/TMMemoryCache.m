@@ -1,27 +1,236 @@
 #import "TMMemoryCache.h"
+#import "TMMemoryCachePolicy.h"
+#import "TMCacheTimerWheel.h"
+
+#import "TMCacheMachTime.h"
+#import <pthread.h>
 
 #if __IPHONE_OS_VERSION_MIN_REQUIRED >= __IPHONE_4_0
 #import <UIKit/UIKit.h>
 #endif
 
+#define TMMemoryCacheAccessBufferSize 32
+
+static const NSTimeInterval TMMemoryCacheExpiryResolution = 1.0;
+
 NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
 
-@interface TMMemoryCache ()
+@implementation TMMemoryCacheEntry
+@end
+
+/**
+ Converts a wall clock date into the monotonic time base used for access times, relative to now.
+ */
+static uint64_t TMMemoryCacheTimeForDate(NSDate *date)
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t predicate;
+
+    dispatch_once(&predicate, ^{
+        mach_timebase_info(&timebase);
+    });
+
+    uint64_t now = mach_absolute_time();
+
+    NSTimeInterval age = -[date timeIntervalSinceNow];
+    if (age <= 0.0)
+        return now;
+
+    double ticks = age * NSEC_PER_SEC * timebase.denom / timebase.numer;
+    if (ticks >= now)
+        return 0;
+
+    return now - (uint64_t)ticks;
+}
+
+static inline BOOL TMMemoryCacheEntryIsExpired(TMMemoryCacheEntry *entry)
+{
+    return entry.expirationTime > 0.0 && entry.expirationTime <= [NSDate timeIntervalSinceReferenceDate];
+}
+
+/**
+ A slice of the cache chosen by key hash, with its own lock, entry table, recency list, eviction policy and
+ timer wheel of the entries that expire.
+ Readers hold the lock shared and log hits into a small lossy buffer instead of reordering the list; whoever
+ next takes the lock exclusively replays the buffer, into the list and the policy, before doing anything else.
+ */
+@interface TMMemoryCacheShard : NSObject {
+@public
+    pthread_rwlock_t _lock;
+    NSMutableDictionary *_entries;
+    id <TMMemoryCachePolicy> _policy;
+    __unsafe_unretained TMMemoryCacheEntry *_head;
+    __unsafe_unretained TMMemoryCacheEntry *_tail;
+    NSUInteger _totalCost;
+    __unsafe_unretained TMMemoryCacheEntry *_accessBuffer[TMMemoryCacheAccessBufferSize];
+    volatile int32_t _accessCount;
+    TMCacheTimerWheel *_expirations;
+}
+- (instancetype)initWithPolicy:(id <TMMemoryCachePolicy>)policy;
+- (void)lock;
+- (void)lockForReading;
+- (void)unlock;
+- (void)insertEntryAtHead:(TMMemoryCacheEntry *)entry;
+- (void)unlinkEntry:(TMMemoryCacheEntry *)entry;
+- (void)moveEntryToHead:(TMMemoryCacheEntry *)entry;
+- (BOOL)recordAccess:(TMMemoryCacheEntry *)entry time:(uint64_t)time;
+- (void)drainAccessBuffer;
+- (TMMemoryCacheEntry *)victim;
+- (void)removeAllObjects;
+@end
+
+@implementation TMMemoryCacheShard
+
+- (void)dealloc
+{
+    pthread_rwlock_destroy(&_lock);
+}
+
+- (instancetype)initWithPolicy:(id <TMMemoryCachePolicy>)policy
+{
+    if (self = [super init]) {
+        pthread_rwlock_init(&_lock, NULL);
+
+        _entries = [[NSMutableDictionary alloc] init];
+        _policy = policy;
+        _head = nil;
+        _tail = nil;
+        _totalCost = 0;
+        _accessCount = 0;
+        _expirations = [[TMCacheTimerWheel alloc] initWithResolution:TMMemoryCacheExpiryResolution];
+    }
+    return self;
+}
+
+- (void)lock
+{
+    pthread_rwlock_wrlock(&_lock);
+    [self drainAccessBuffer];
+}
+
+- (void)lockForReading
+{
+    pthread_rwlock_rdlock(&_lock);
+}
+
+- (void)unlock
+{
+    pthread_rwlock_unlock(&_lock);
+}
+
+- (void)insertEntryAtHead:(TMMemoryCacheEntry *)entry
+{
+    entry.prev = nil;
+    entry.next = _head;
+
+    if (_head)
+        _head.prev = entry;
+
+    _head = entry;
+
+    if (!_tail)
+        _tail = entry;
+}
+
+- (void)unlinkEntry:(TMMemoryCacheEntry *)entry
+{
+    if (entry.prev)
+        entry.prev.next = entry.next;
+    else
+        _head = entry.next;
+
+    if (entry.next)
+        entry.next.prev = entry.prev;
+    else
+        _tail = entry.prev;
+
+    entry.prev = nil;
+    entry.next = nil;
+}
+
+- (void)moveEntryToHead:(TMMemoryCacheEntry *)entry
+{
+    if (entry == _head)
+        return;
+
+    [self unlinkEntry:entry];
+    [self insertEntryAtHead:entry];
+}
+
+// Called with the lock held for reading. Returns NO once the buffer is full and should be drained. The access
+// time is only stamped on hits that get buffered: a hit that stamped an entry without moving it in the list would
+// stop trimming by date at it and keep every older entry in front of it.
+- (BOOL)recordAccess:(TMMemoryCacheEntry *)entry time:(uint64_t)time
+{
+    int32_t index = __sync_fetch_and_add(&_accessCount, 1);
+    if (index < 0 || index >= TMMemoryCacheAccessBufferSize)
+        return NO; // lossy, the hit is dropped
+
+    entry.accessTime = time;
+    _accessBuffer[index] = entry;
+
+    return index < TMMemoryCacheAccessBufferSize - 1;
+}
+
+// Called with the lock held exclusively. Entries can only leave the shard under the exclusive lock, which always
+// drains first, so every buffered entry is still alive here.
+- (void)drainAccessBuffer
+{
+    int32_t count = _accessCount;
+    if (count == 0)
+        return;
+
+    if (count < 0 || count > TMMemoryCacheAccessBufferSize)
+        count = TMMemoryCacheAccessBufferSize;
+
+    for (int32_t i = 0; i < count; i++) {
+        [self moveEntryToHead:_accessBuffer[i]];
+        [_policy accessEntry:_accessBuffer[i]];
+    }
+
+    _accessCount = 0;
+}
+
+// Called with the lock held exclusively. Without a policy the shard is plain LRU.
+- (TMMemoryCacheEntry *)victim
+{
+    if (_policy)
+        return [_policy victim];
+
+    return _tail;
+}
+
+- (void)removeAllObjects
+{
+    [_policy removeAllEntries];
+    [_entries removeAllObjects];
+    _head = nil;
+    _tail = nil;
+    _totalCost = 0;
+    _accessCount = 0;
+    [_expirations removeAllKeys];
+}
+
+@end
+
+@interface TMMemoryCache () {
+    pthread_mutex_t _lock;
+    dispatch_source_t _expiryTimer;
+    NSTimeInterval _expiryTime;
+}
 #if OS_OBJECT_USE_OBJC
 @property (strong, nonatomic) dispatch_queue_t queue;
 #else
 @property (assign, nonatomic) dispatch_queue_t queue;
 #endif
-@property (strong, nonatomic) NSMutableDictionary *dictionary;
-@property (strong, nonatomic) NSMutableDictionary *dates;
-@property (strong, nonatomic) NSMutableDictionary *costs;
+@property (strong, nonatomic) NSArray *shards;
+@property (assign, nonatomic) NSUInteger shardMask;
 @end
 
 @implementation TMMemoryCache
 
 @synthesize ageLimit = _ageLimit;
 @synthesize costLimit = _costLimit;
-@synthesize totalCost = _totalCost;
 @synthesize willAddObjectBlock = _willAddObjectBlock;
 @synthesize willRemoveObjectBlock = _willRemoveObjectBlock;
 @synthesize willRemoveAllObjectsBlock = _willRemoveAllObjectsBlock;
@@ -37,21 +246,61 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
 {
     [[NSNotificationCenter defaultCenter] removeObserver:self];
 
+    pthread_mutex_destroy(&_lock);
+
+    dispatch_source_cancel(_expiryTimer);
+
     #if !OS_OBJECT_USE_OBJC
+    dispatch_release(_expiryTimer);
     dispatch_release(_queue);
     _queue = nil;
     #endif
 }
 
 - (id)init
+{
+    return [self initWithShardCount:1];
+}
+
+- (instancetype)initWithShardCount:(NSUInteger)shardCount
+{
+    return [self initWithShardCount:shardCount evictionPolicy:TMMemoryCacheEvictionPolicyLRU];
+}
+
+- (instancetype)initWithShardCount:(NSUInteger)shardCount evictionPolicy:(TMMemoryCacheEvictionPolicy)evictionPolicy
 {
     if (self = [super init]) {
+        pthread_mutex_init(&_lock, NULL);
+
         NSString *queueName = [[NSString alloc] initWithFormat:@"%@.%p", TMMemoryCachePrefix, self];
         _queue = dispatch_queue_create([queueName UTF8String], DISPATCH_QUEUE_CONCURRENT);
 
-        _dictionary = [[NSMutableDictionary alloc] init];
-        _dates = [[NSMutableDictionary alloc] init];
-        _costs = [[NSMutableDictionary alloc] init];
+        NSUInteger count = 1;
+        while (count < shardCount)
+            count <<= 1;
+
+        NSMutableArray *shards = [[NSMutableArray alloc] initWithCapacity:count];
+        for (NSUInteger i = 0; i < count; i++) {
+            id <TMMemoryCachePolicy> policy = nil;
+
+            switch (evictionPolicy) {
+                case TMMemoryCacheEvictionPolicyTinyLFU:
+                    policy = [[TMMemoryCacheTinyLFUPolicy alloc] init];
+                    break;
+                case TMMemoryCacheEvictionPolicyARC:
+                    policy = [[TMMemoryCacheARCPolicy alloc] init];
+                    break;
+                case TMMemoryCacheEvictionPolicyLRU:
+                default:
+                    break; // the shard's own recency list
+            }
+
+            [shards addObject:[[TMMemoryCacheShard alloc] initWithPolicy:policy]];
+        }
+
+        _shards = [shards copy];
+        _shardMask = count - 1;
+        _evictionPolicy = evictionPolicy;
 
         _willAddObjectBlock = nil;
         _willRemoveObjectBlock = nil;
@@ -66,10 +315,25 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
 
         _ageLimit = 0.0;
         _costLimit = 0;
-        _totalCost = 0;
 
         _removeAllObjectsOnMemoryWarning = YES;
         _removeAllObjectsOnEnteringBackground = YES;
+
+        _statistics = [[TMCacheStatistics alloc] init];
+
+        // disarmed until an object with a time to live is set
+        _expiryTime = 0.0;
+        _expiryTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        dispatch_source_set_timer(_expiryTimer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+
+        __weak TMMemoryCache *weakSelf = self;
+
+        dispatch_source_set_event_handler(_expiryTimer, ^{
+            TMMemoryCache *strongSelf = weakSelf;
+            [strongSelf removeExpiredObjects];
+        });
+
+        dispatch_resume(_expiryTimer);
         
 #if __IPHONE_OS_VERSION_MIN_REQUIRED >= __IPHONE_4_0
         [[NSNotificationCenter defaultCenter] addObserver:self
@@ -113,9 +377,10 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
         TMMemoryCache *strongSelf = weakSelf;
         if (!strongSelf)
             return;
-        
-        if (strongSelf->_didReceiveMemoryWarningBlock)
-            strongSelf->_didReceiveMemoryWarningBlock(strongSelf);
+
+        TMMemoryCacheBlock didReceiveMemoryWarningBlock = strongSelf.didReceiveMemoryWarningBlock;
+        if (didReceiveMemoryWarningBlock)
+            didReceiveMemoryWarningBlock(strongSelf);
     });
     
 #endif
@@ -134,111 +399,320 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
         TMMemoryCache *strongSelf = weakSelf;
         if (!strongSelf)
             return;
-        
-        if (strongSelf->_didEnterBackgroundBlock)
-            strongSelf->_didEnterBackgroundBlock(strongSelf);
+
+        TMMemoryCacheBlock didEnterBackgroundBlock = strongSelf.didEnterBackgroundBlock;
+        if (didEnterBackgroundBlock)
+            didEnterBackgroundBlock(strongSelf);
     });
     
 #endif
 }
 
-- (void)removeObjectAndExecuteBlocksForKey:(NSString *)key
+// Guards the configuration (event blocks and limits). Never take a shard lock while holding it.
+- (void)lock
 {
-    id object = [_dictionary objectForKey:key];
-    NSNumber *cost = [_costs objectForKey:key];
+    pthread_mutex_lock(&_lock);
+}
 
-    if (_willRemoveObjectBlock)
-        _willRemoveObjectBlock(self, key, object);
+- (void)unlock
+{
+    pthread_mutex_unlock(&_lock);
+}
 
-    if (cost)
-        _totalCost -= [cost unsignedIntegerValue];
+- (NSUInteger)shardIndexForKey:(NSString *)key
+{
+    if (_shardMask == 0)
+        return 0;
 
-    [_dictionary removeObjectForKey:key];
-    [_dates removeObjectForKey:key];
-    [_costs removeObjectForKey:key];
+    NSUInteger hash = [key hash];
+    hash ^= hash >> 16; // fold the high bits in, the mask only looks at the low ones
 
-    if (_didRemoveObjectBlock)
-        _didRemoveObjectBlock(self, key, nil);
+    return hash & _shardMask;
 }
 
-- (void)trimMemoryToDate:(NSDate *)trimDate
+- (TMMemoryCacheShard *)shardForKey:(NSString *)key
 {
-    NSArray *keysSortedByDate = [_dates keysSortedByValueUsingSelector:@selector(compare:)];
-    
-    for (NSString *key in keysSortedByDate) { // oldest objects first
-        NSDate *accessDate = [_dates objectForKey:key];
-        if (!accessDate)
-            continue;
-        
-        if ([accessDate compare:trimDate] == NSOrderedAscending) { // older than trim date
-            [self removeObjectAndExecuteBlocksForKey:key];
-        } else {
-            break;
-        }
+    return [_shards objectAtIndex:[self shardIndexForKey:key]];
+}
+
+// One index set per shard, holding the positions of the keys that belong to it.
+- (NSArray *)indexesByShardForKeys:(NSArray *)keys
+{
+    NSMutableArray *indexesByShard = [[NSMutableArray alloc] initWithCapacity:[_shards count]];
+    for (NSUInteger i = 0; i < [_shards count]; i++)
+        [indexesByShard addObject:[[NSMutableIndexSet alloc] init]];
+
+    [keys enumerateObjectsUsingBlock:^(NSString *key, NSUInteger index, BOOL *stop) {
+        [[indexesByShard objectAtIndex:[self shardIndexForKey:key]] addIndex:index];
+    }];
+
+    return indexesByShard;
+}
+
+// Rounded up, so a limit smaller than the shard count still leaves every shard room for an object rather than
+// evicting everything. The shards together may go over the total by less than one unit per shard.
+- (NSUInteger)shardCostForCost:(NSUInteger)cost
+{
+    NSUInteger shardCount = _shardMask + 1;
+    return cost / shardCount + (cost % shardCount ? 1 : 0);
+}
+
+// Called with the shard locked exclusively.
+- (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost expirationTime:(NSTimeInterval)expirationTime
+          inShard:(TMMemoryCacheShard *)shard
+{
+    [self lock];
+    TMMemoryCacheObjectBlock willAddObjectBlock = _willAddObjectBlock;
+    TMMemoryCacheObjectBlock didAddObjectBlock = _didAddObjectBlock;
+    NSUInteger costLimit = _costLimit;
+    [self unlock];
+
+    [self setObject:object forKey:key withCost:cost expirationTime:expirationTime inShard:shard
+       willAddBlock:willAddObjectBlock didAddBlock:didAddObjectBlock];
+
+    if (costLimit > 0)
+        [self trimShard:shard toCostByDate:[self shardCostForCost:costLimit]];
+
+    if (expirationTime > 0.0)
+        [self scheduleExpiryAtTime:[shard->_expirations nextAdvanceTime]];
+}
+
+// Called with the shard locked exclusively. Leaves trimming to the caller, so a batch can trim once.
+- (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost expirationTime:(NSTimeInterval)expirationTime
+          inShard:(TMMemoryCacheShard *)shard willAddBlock:(TMMemoryCacheObjectBlock)willAddObjectBlock
+      didAddBlock:(TMMemoryCacheObjectBlock)didAddObjectBlock
+{
+    if (willAddObjectBlock)
+        willAddObjectBlock(self, key, object);
+
+    TMMemoryCacheEntry *entry = [shard->_entries objectForKey:key];
+    if (entry) {
+        NSUInteger oldCost = entry.cost;
+        shard->_totalCost -= oldCost;
+
+        entry.object = object;
+        entry.cost = cost;
+
+        [shard moveEntryToHead:entry];
+        [shard->_policy updateEntry:entry oldCost:oldCost];
+    } else {
+        entry = [[TMMemoryCacheEntry alloc] init];
+        entry.key = key;
+        entry.object = object;
+        entry.cost = cost;
+
+        [shard->_entries setObject:entry forKey:key];
+        [shard insertEntryAtHead:entry];
+        [shard->_policy insertEntry:entry];
     }
+
+    if (expirationTime > 0.0 || entry.expirationTime > 0.0)
+        [shard->_expirations setExpirationTime:expirationTime forKey:key]; // 0 cancels the old one
+
+    entry.expirationTime = expirationTime;
+    entry.accessTime = mach_absolute_time();
+
+    shard->_totalCost += cost;
+
+    [_statistics addCount:1 toCounter:TMCacheStatisticsCounterWrites];
+
+    if (didAddObjectBlock)
+        didAddObjectBlock(self, key, object);
 }
 
-- (void)trimToCostLimit:(NSUInteger)limit
+// Called with the shard locked exclusively. `evicted` tells the policy a trim removed the object to make room.
+- (void)removeObjectAndExecuteBlocksForKey:(NSString *)key inShard:(TMMemoryCacheShard *)shard evicted:(BOOL)evicted
 {
-    if (_totalCost <= limit)
-        return;
+    [self lock];
+    TMMemoryCacheObjectBlock willRemoveObjectBlock = _willRemoveObjectBlock;
+    TMMemoryCacheObjectBlock didRemoveObjectBlock = _didRemoveObjectBlock;
+    [self unlock];
 
-    NSArray *keysSortedByCost = [_costs keysSortedByValueUsingSelector:@selector(compare:)];
+    [self removeObjectForKey:key inShard:shard evicted:evicted
+             willRemoveBlock:willRemoveObjectBlock didRemoveBlock:didRemoveObjectBlock];
+}
+
+// Called with the shard locked exclusively.
+- (void)removeObjectForKey:(NSString *)key inShard:(TMMemoryCacheShard *)shard evicted:(BOOL)evicted
+           willRemoveBlock:(TMMemoryCacheObjectBlock)willRemoveObjectBlock didRemoveBlock:(TMMemoryCacheObjectBlock)didRemoveObjectBlock
+{
+    TMMemoryCacheEntry *entry = [shard->_entries objectForKey:key];
 
-    for (NSString *key in [keysSortedByCost reverseObjectEnumerator]) { // costliest objects first
-        [self removeObjectAndExecuteBlocksForKey:key];
+    if (willRemoveObjectBlock)
+        willRemoveObjectBlock(self, key, entry.object);
 
-        if (_totalCost <= limit)
-            break;
+    if (entry) {
+        shard->_totalCost -= entry.cost;
+        [shard unlinkEntry:entry];
+        [shard->_policy removeEntry:entry evicted:evicted];
+        [shard->_entries removeObjectForKey:key];
+
+        if (entry.expirationTime > 0.0)
+            [shard->_expirations removeKey:key];
+
+        [_statistics addCount:1 toCounter:TMCacheStatisticsCounterRemovals];
     }
+
+    if (didRemoveObjectBlock)
+        didRemoveObjectBlock(self, key, nil);
 }
 
-- (void)trimToCostLimitByDate:(NSUInteger)limit
+// Called with the shard locked exclusively.
+- (void)trimShard:(TMMemoryCacheShard *)shard toTime:(uint64_t)trimTime
 {
-    if (_totalCost <= limit)
-        return;
+    uint64_t evictions = 0;
+
+    while (shard->_tail && shard->_tail.accessTime < trimTime) { // oldest objects first
+        [self removeObjectAndExecuteBlocksForKey:shard->_tail.key inShard:shard evicted:YES];
+        evictions++;
+    }
 
-    NSArray *keysSortedByDate = [_dates keysSortedByValueUsingSelector:@selector(compare:)];
+    [_statistics addCount:evictions toCounter:TMCacheStatisticsCounterEvictions];
+}
 
-    for (NSString *key in keysSortedByDate) { // oldest objects first
-        [self removeObjectAndExecuteBlocksForKey:key];
+// Called with the shard locked exclusively.
+- (void)trimShard:(TMMemoryCacheShard *)shard toCostByDate:(NSUInteger)limit
+{
+    uint64_t evictions = 0;
 
-        if (_totalCost <= limit)
+    while (shard->_totalCost > limit) { // in the order chosen by the policy, least recently used first by default
+        TMMemoryCacheEntry *victim = [shard victim];
+        if (!victim)
             break;
+
+        [self removeObjectAndExecuteBlocksForKey:victim.key inShard:shard evicted:YES];
+        evictions++;
+    }
+
+    [_statistics addCount:evictions toCounter:TMCacheStatisticsCounterEvictions];
+}
+
+- (void)trimMemoryToDate:(NSDate *)trimDate
+{
+    uint64_t trimTime = TMMemoryCacheTimeForDate(trimDate);
+
+    for (TMMemoryCacheShard *shard in _shards) {
+        [shard lock];
+        [self trimShard:shard toTime:trimTime];
+        [shard unlock];
+    }
+}
+
+- (void)trimToCostLimit:(NSUInteger)limit
+{
+    for (TMMemoryCacheShard *shard in _shards)
+        [shard lock];
+
+    NSUInteger totalCost = 0;
+    NSMutableArray *entries = [[NSMutableArray alloc] init];
+
+    for (TMMemoryCacheShard *shard in _shards) {
+        totalCost += shard->_totalCost;
+        [entries addObjectsFromArray:[shard->_entries allValues]];
+    }
+
+    if (totalCost > limit) {
+        NSSortDescriptor *costDescriptor = [[NSSortDescriptor alloc] initWithKey:@"cost" ascending:NO];
+        [entries sortUsingDescriptors:@[ costDescriptor ]];
+
+        for (TMMemoryCacheEntry *entry in entries) { // costliest objects first
+            totalCost -= entry.cost;
+            [self removeObjectAndExecuteBlocksForKey:entry.key inShard:[self shardForKey:entry.key] evicted:YES];
+            [_statistics addCount:1 toCounter:TMCacheStatisticsCounterEvictions];
+
+            if (totalCost <= limit)
+                break;
+        }
+    }
+
+    for (TMMemoryCacheShard *shard in _shards)
+        [shard unlock];
+}
+
+- (void)trimToCostLimitByDate:(NSUInteger)limit
+{
+    NSUInteger shardLimit = [self shardCostForCost:limit];
+
+    for (TMMemoryCacheShard *shard in _shards) {
+        [shard lock];
+        [self trimShard:shard toCostByDate:shardLimit];
+        [shard unlock];
     }
 }
 
 - (void)trimToAgeLimitRecursively
 {
-    if (_ageLimit == 0.0)
+    [self lock];
+    NSTimeInterval ageLimit = _ageLimit;
+    [self unlock];
+
+    if (ageLimit == 0.0)
         return;
 
-    NSDate *date = [[NSDate alloc] initWithTimeIntervalSinceNow:-_ageLimit];
+    NSDate *date = [[NSDate alloc] initWithTimeIntervalSinceNow:-ageLimit];
     [self trimMemoryToDate:date];
     
     __weak TMMemoryCache *weakSelf = self;
     
-    dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_ageLimit * NSEC_PER_SEC));
+    dispatch_time_t time = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(ageLimit * NSEC_PER_SEC));
     dispatch_after(time, _queue, ^(void){
         TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-        
-        __weak TMMemoryCache *weakSelf = strongSelf;
-        
-        dispatch_barrier_async(strongSelf->_queue, ^{
-            TMMemoryCache *strongSelf = weakSelf;
-            [strongSelf trimToAgeLimitRecursively];
-        });
+        [strongSelf trimToAgeLimitRecursively];
     });
 }
 
+// Moves the expiry timer up to the given time, unless it is set to go off sooner already.
+- (void)scheduleExpiryAtTime:(NSTimeInterval)time
+{
+    if (time <= 0.0)
+        return;
+
+    [self lock];
+
+    if (_expiryTime == 0.0 || time < _expiryTime) {
+        _expiryTime = time;
+        dispatch_source_set_timer(_expiryTimer, TMCacheTimerWheelDispatchTime(time), DISPATCH_TIME_FOREVER, NSEC_PER_SEC / 10);
+    }
+
+    [self unlock];
+}
+
+// Runs on the expiry timer. The wheels only give up keys that are due, keys set again without a time to live have
+// left them already. The timer is cleared before the shards are looked at, so a key set meanwhile re-arms it.
+- (void)removeExpiredObjects
+{
+    [self lock];
+    _expiryTime = 0.0;
+    [self unlock];
+
+    NSTimeInterval nextTime = 0.0;
+    uint64_t evictions = 0;
+
+    for (TMMemoryCacheShard *shard in _shards) {
+        [shard lock];
+
+        for (NSString *key in [shard->_expirations advanceToTime:[NSDate timeIntervalSinceReferenceDate]]) {
+            [self removeObjectAndExecuteBlocksForKey:key inShard:shard evicted:NO];
+            evictions++;
+        }
+
+        NSTimeInterval shardTime = [shard->_expirations nextAdvanceTime];
+
+        [shard unlock];
+
+        if (shardTime > 0.0 && (nextTime == 0.0 || shardTime < nextTime))
+            nextTime = shardTime;
+    }
+
+    [_statistics addCount:evictions toCounter:TMCacheStatisticsCounterEvictions];
+
+    [self scheduleExpiryAtTime:nextTime];
+}
+
 #pragma mark - Public Asynchronous Methods -
 
 - (void)objectForKey:(NSString *)key block:(TMMemoryCacheObjectBlock)block
 {
-    NSDate *now = [[NSDate alloc] init];
-    
     if (!key || !block)
         return;
 
@@ -249,16 +723,7 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
         if (!strongSelf)
             return;
 
-        id object = [strongSelf->_dictionary objectForKey:key];
-
-        if (object) {
-            __weak TMMemoryCache *weakSelf = strongSelf;
-            dispatch_barrier_async(strongSelf->_queue, ^{
-                TMMemoryCache *strongSelf = weakSelf;
-                if (strongSelf)
-                    [strongSelf->_dates setObject:now forKey:key];
-            });
-        }
+        id object = [strongSelf objectForKey:key];
 
         block(strongSelf, key, object);
     });
@@ -271,8 +736,17 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
 
 - (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost block:(TMMemoryCacheObjectBlock)block
 {
-    NSDate *now = [[NSDate alloc] init];
+    [self setObject:object forKey:key withCost:cost ttl:0.0 block:block];
+}
+
+- (void)setObject:(id)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl block:(TMMemoryCacheObjectBlock)block
+{
+    [self setObject:object forKey:key withCost:0 ttl:ttl block:block];
+}
 
+- (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost ttl:(NSTimeInterval)ttl
+            block:(TMMemoryCacheObjectBlock)block
+{
     if (!key || !object)
         return;
 
@@ -283,20 +757,7 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
         if (!strongSelf)
             return;
 
-        if (strongSelf->_willAddObjectBlock)
-            strongSelf->_willAddObjectBlock(strongSelf, key, object);
-
-        [strongSelf->_dictionary setObject:object forKey:key];
-        [strongSelf->_dates setObject:now forKey:key];
-        [strongSelf->_costs setObject:@(cost) forKey:key];
-
-        _totalCost += cost;
-
-        if (strongSelf->_didAddObjectBlock)
-            strongSelf->_didAddObjectBlock(strongSelf, key, object);
-
-        if (strongSelf->_costLimit > 0)
-            [strongSelf trimToCostByDate:strongSelf->_costLimit block:nil];
+        [strongSelf setObject:object forKey:key withCost:cost ttl:ttl];
 
         if (block) {
             __weak TMMemoryCache *weakSelf = strongSelf;
@@ -321,7 +782,7 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
         if (!strongSelf)
             return;
 
-        [strongSelf removeObjectAndExecuteBlocksForKey:key];
+        [strongSelf removeObjectForKey:key];
 
         if (block) {
             __weak TMMemoryCache *weakSelf = strongSelf;
@@ -334,6 +795,80 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
     });
 }
 
+- (void)objectsForKeys:(NSArray *)keys block:(TMMemoryCacheObjectsBlock)block
+{
+    if (!keys || !block)
+        return;
+
+    __weak TMMemoryCache *weakSelf = self;
+
+    dispatch_async(_queue, ^{
+        TMMemoryCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        NSDictionary *objects = [strongSelf objectsForKeys:keys];
+
+        block(strongSelf, objects);
+    });
+}
+
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys block:(TMMemoryCacheObjectsBlock)block
+{
+    [self setObjects:objects forKeys:keys withCosts:nil block:block];
+}
+
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys withCosts:(NSArray *)costs
+             block:(TMMemoryCacheObjectsBlock)block
+{
+    if (!objects || !keys || [objects count] != [keys count] || (costs && [costs count] != [keys count]))
+        return;
+
+    __weak TMMemoryCache *weakSelf = self;
+
+    dispatch_barrier_async(_queue, ^{
+        TMMemoryCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        [strongSelf setObjects:objects forKeys:keys withCosts:costs];
+
+        if (block) {
+            __weak TMMemoryCache *weakSelf = strongSelf;
+            dispatch_async(strongSelf->_queue, ^{
+                TMMemoryCache *strongSelf = weakSelf;
+                if (strongSelf)
+                    block(strongSelf, [[NSDictionary alloc] initWithObjects:objects forKeys:keys]);
+            });
+        }
+    });
+}
+
+- (void)removeObjectsForKeys:(NSArray *)keys block:(TMMemoryCacheBlock)block
+{
+    if (!keys)
+        return;
+
+    __weak TMMemoryCache *weakSelf = self;
+
+    dispatch_barrier_async(_queue, ^{
+        TMMemoryCache *strongSelf = weakSelf;
+        if (!strongSelf)
+            return;
+
+        [strongSelf removeObjectsForKeys:keys];
+
+        if (block) {
+            __weak TMMemoryCache *weakSelf = strongSelf;
+            dispatch_async(strongSelf->_queue, ^{
+                TMMemoryCache *strongSelf = weakSelf;
+                if (strongSelf)
+                    block(strongSelf);
+            });
+        }
+    });
+}
+
 - (void)trimToDate:(NSDate *)trimDate block:(TMMemoryCacheBlock)block
 {
     if (!trimDate)
@@ -417,17 +952,7 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
         if (!strongSelf)
             return;
 
-        if (strongSelf->_willRemoveAllObjectsBlock)
-            strongSelf->_willRemoveAllObjectsBlock(strongSelf);
-
-        [strongSelf->_dictionary removeAllObjects];
-        [strongSelf->_dates removeAllObjects];
-        [strongSelf->_costs removeAllObjects];
-        
-        strongSelf->_totalCost = 0;
-
-        if (strongSelf->_didRemoveAllObjectsBlock)
-            strongSelf->_didRemoveAllObjectsBlock(strongSelf);
+        [strongSelf removeAllObjects];
 
         if (block) {
             __weak TMMemoryCache *weakSelf = strongSelf;
@@ -452,11 +977,7 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
         if (!strongSelf)
             return;
 
-        NSArray *keysSortedByDate = [strongSelf->_dates keysSortedByValueUsingSelector:@selector(compare:)];
-        
-        for (NSString *key in keysSortedByDate) {
-            block(strongSelf, key, [strongSelf->_dictionary objectForKey:key]);
-        }
+        [strongSelf enumerateObjectsWithBlock:block];
 
         if (completionBlock) {
             __weak TMMemoryCache *weakSelf = strongSelf;
@@ -476,22 +997,30 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
     if (!key)
         return nil;
 
-    __block id objectForKey = nil;
+    uint64_t startTime = TMCacheStatisticsTime();
+    TMMemoryCacheShard *shard = [self shardForKey:key];
+    id object = nil;
+    BOOL drain = NO;
 
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    [shard lockForReading];
 
-    [self objectForKey:key block:^(TMMemoryCache *cache, NSString *key, id object) {
-        objectForKey = object;
-        dispatch_semaphore_signal(semaphore);
-    }];
+    TMMemoryCacheEntry *entry = [shard->_entries objectForKey:key];
+    if (entry && !TMMemoryCacheEntryIsExpired(entry)) {
+        object = entry.object;
+        drain = ![shard recordAccess:entry time:mach_absolute_time()];
+    }
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [shard unlock];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    if (drain && pthread_rwlock_trywrlock(&shard->_lock) == 0) {
+        [shard drainAccessBuffer];
+        [shard unlock];
+    }
+
+    [_statistics addCount:1 toCounter:object ? TMCacheStatisticsCounterHits : TMCacheStatisticsCounterMisses];
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRead];
 
-    return objectForKey;
+    return object;
 }
 
 - (void)setObject:(id)object forKey:(NSString *)key
@@ -500,107 +1029,234 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
 }
 
 - (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost
+{
+    [self setObject:object forKey:key withCost:cost ttl:0.0];
+}
+
+- (void)setObject:(id)object forKey:(NSString *)key ttl:(NSTimeInterval)ttl
+{
+    [self setObject:object forKey:key withCost:0 ttl:ttl];
+}
+
+- (void)setObject:(id)object forKey:(NSString *)key withCost:(NSUInteger)cost ttl:(NSTimeInterval)ttl
 {
     if (!object || !key)
         return;
 
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
-
-    [self setObject:object forKey:key withCost:cost block:^(TMMemoryCache *cache, NSString *key, id object) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    uint64_t startTime = TMCacheStatisticsTime();
+    NSTimeInterval expirationTime = ttl > 0.0 ? [NSDate timeIntervalSinceReferenceDate] + ttl : 0.0;
+    TMMemoryCacheShard *shard = [self shardForKey:key];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [shard lock];
+    [self setObject:object forKey:key withCost:cost expirationTime:expirationTime inShard:shard];
+    [shard unlock];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationWrite];
 }
 
 - (void)removeObjectForKey:(NSString *)key
 {
     if (!key)
         return;
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self removeObjectForKey:key block:^(TMMemoryCache *cache, NSString *key, id object) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    uint64_t startTime = TMCacheStatisticsTime();
+    TMMemoryCacheShard *shard = [self shardForKey:key];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [shard lock];
+    [self removeObjectAndExecuteBlocksForKey:key inShard:shard evicted:NO];
+    [shard unlock];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRemove];
 }
 
-- (void)trimToDate:(NSDate *)date
+- (NSDictionary *)objectsForKeys:(NSArray *)keys
 {
-    if (!date)
-        return;
+    NSMutableDictionary *objects = [[NSMutableDictionary alloc] initWithCapacity:[keys count]];
+    if (![keys count])
+        return objects;
 
-    if ([date isEqualToDate:[NSDate distantPast]]) {
-        [self removeAllObjects];
-        return;
+    uint64_t startTime = TMCacheStatisticsTime();
+    NSArray *indexesByShard = [self indexesByShardForKeys:keys];
+
+    for (NSUInteger i = 0; i < [_shards count]; i++) {
+        NSIndexSet *indexes = [indexesByShard objectAtIndex:i];
+        if (![indexes count])
+            continue;
+
+        TMMemoryCacheShard *shard = [_shards objectAtIndex:i];
+        NSMutableArray *missedEntries = nil;
+        uint64_t now = mach_absolute_time();
+        BOOL drain = NO;
+
+        [shard lockForReading];
+
+        for (NSUInteger index = [indexes firstIndex]; index != NSNotFound; index = [indexes indexGreaterThanIndex:index]) {
+            NSString *key = [keys objectAtIndex:index];
+            TMMemoryCacheEntry *entry = [shard->_entries objectForKey:key];
+            if (!entry || TMMemoryCacheEntryIsExpired(entry))
+                continue;
+
+            [objects setObject:entry.object forKey:key];
+
+            if (![shard recordAccess:entry time:now]) {
+                drain = YES;
+
+                // a batch easily overflows the buffer, keep the hits it dropped instead of losing them
+                if (shard->_accessCount > TMMemoryCacheAccessBufferSize) {
+                    if (!missedEntries)
+                        missedEntries = [[NSMutableArray alloc] init];
+                    [missedEntries addObject:entry];
+                }
+            }
+        }
+
+        [shard unlock];
+
+        if (missedEntries) {
+            [shard lock];
+
+            for (TMMemoryCacheEntry *entry in missedEntries) {
+                if ([shard->_entries objectForKey:entry.key] != entry)
+                    continue; // removed while the shard was unlocked
+
+                entry.accessTime = now;
+                [shard moveEntryToHead:entry];
+                [shard->_policy accessEntry:entry];
+            }
+
+            [shard unlock];
+        } else if (drain && pthread_rwlock_trywrlock(&shard->_lock) == 0) {
+            [shard drainAccessBuffer];
+            [shard unlock];
+        }
     }
-    
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
 
-    [self trimToDate:date block:^(TMMemoryCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    [_statistics addCount:[objects count] toCounter:TMCacheStatisticsCounterHits];
+    [_statistics addCount:[keys count] - [objects count] toCounter:TMCacheStatisticsCounterMisses];
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRead];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    return objects;
+}
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys
+{
+    [self setObjects:objects forKeys:keys withCosts:nil];
 }
 
-- (void)trimToCost:(NSUInteger)cost
+- (void)setObjects:(NSArray *)objects forKeys:(NSArray *)keys withCosts:(NSArray *)costs
 {
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    if (![keys count] || [objects count] != [keys count] || (costs && [costs count] != [keys count]))
+        return;
 
-    [self trimToCost:cost block:^(TMMemoryCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    uint64_t startTime = TMCacheStatisticsTime();
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [self lock];
+    TMMemoryCacheObjectBlock willAddObjectBlock = _willAddObjectBlock;
+    TMMemoryCacheObjectBlock didAddObjectBlock = _didAddObjectBlock;
+    NSUInteger costLimit = _costLimit;
+    [self unlock];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    NSArray *indexesByShard = [self indexesByShardForKeys:keys];
+
+    for (NSUInteger i = 0; i < [_shards count]; i++) {
+        NSIndexSet *indexes = [indexesByShard objectAtIndex:i];
+        if (![indexes count])
+            continue;
+
+        TMMemoryCacheShard *shard = [_shards objectAtIndex:i];
+
+        [shard lock];
+
+        for (NSUInteger index = [indexes firstIndex]; index != NSNotFound; index = [indexes indexGreaterThanIndex:index]) {
+            NSUInteger cost = costs ? [[costs objectAtIndex:index] unsignedIntegerValue] : 0;
+            [self setObject:[objects objectAtIndex:index] forKey:[keys objectAtIndex:index] withCost:cost expirationTime:0.0
+                    inShard:shard willAddBlock:willAddObjectBlock didAddBlock:didAddObjectBlock];
+        }
+
+        if (costLimit > 0)
+            [self trimShard:shard toCostByDate:[self shardCostForCost:costLimit]];
+
+        [shard unlock];
+    }
+
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationWrite];
 }
 
-- (void)trimToCostByDate:(NSUInteger)cost
+- (void)removeObjectsForKeys:(NSArray *)keys
 {
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    if (![keys count])
+        return;
 
-    [self trimToCostByDate:cost block:^(TMMemoryCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    uint64_t startTime = TMCacheStatisticsTime();
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [self lock];
+    TMMemoryCacheObjectBlock willRemoveObjectBlock = _willRemoveObjectBlock;
+    TMMemoryCacheObjectBlock didRemoveObjectBlock = _didRemoveObjectBlock;
+    [self unlock];
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+    NSArray *indexesByShard = [self indexesByShardForKeys:keys];
+
+    for (NSUInteger i = 0; i < [_shards count]; i++) {
+        NSIndexSet *indexes = [indexesByShard objectAtIndex:i];
+        if (![indexes count])
+            continue;
+
+        TMMemoryCacheShard *shard = [_shards objectAtIndex:i];
+
+        [shard lock];
+
+        for (NSUInteger index = [indexes firstIndex]; index != NSNotFound; index = [indexes indexGreaterThanIndex:index]) {
+            [self removeObjectForKey:[keys objectAtIndex:index] inShard:shard evicted:NO
+                     willRemoveBlock:willRemoveObjectBlock didRemoveBlock:didRemoveObjectBlock];
+        }
+
+        [shard unlock];
+    }
+
+    [_statistics recordLatencySinceTime:startTime forOperation:TMCacheStatisticsOperationRemove];
 }
 
-- (void)removeAllObjects
+- (void)trimToDate:(NSDate *)date
 {
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    if (!date)
+        return;
 
-    [self removeAllObjects:^(TMMemoryCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+    if ([date isEqualToDate:[NSDate distantPast]]) {
+        [self removeAllObjects];
+        return;
+    }
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    [self trimMemoryToDate:date];
+}
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+- (void)trimToCost:(NSUInteger)cost
+{
+    [self trimToCostLimit:cost];
+}
+
+- (void)trimToCostByDate:(NSUInteger)cost
+{
+    [self trimToCostLimitByDate:cost];
+}
+
+- (void)removeAllObjects
+{
+    [self lock];
+    TMMemoryCacheBlock willRemoveAllObjectsBlock = _willRemoveAllObjectsBlock;
+    TMMemoryCacheBlock didRemoveAllObjectsBlock = _didRemoveAllObjectsBlock;
+    [self unlock];
+
+    if (willRemoveAllObjectsBlock)
+        willRemoveAllObjectsBlock(self);
+
+    for (TMMemoryCacheShard *shard in _shards) {
+        [shard lock];
+        [shard removeAllObjects];
+        [shard unlock];
+    }
+
+    if (didRemoveAllObjectsBlock)
+        didRemoveAllObjectsBlock(self);
 }
 
 - (void)enumerateObjectsWithBlock:(TMMemoryCacheObjectBlock)block
@@ -608,275 +1264,218 @@ NSString * const TMMemoryCachePrefix = @"com.tumblr.TMMemoryCache";
     if (!block)
         return;
 
-    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+    for (TMMemoryCacheShard *shard in _shards) {
+        NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:[shard->_entries count]];
+        NSMutableArray *objects = [[NSMutableArray alloc] initWithCapacity:[shard->_entries count]];
 
-    [self enumerateObjectsWithBlock:block completionBlock:^(TMMemoryCache *cache) {
-        dispatch_semaphore_signal(semaphore);
-    }];
+        [shard lock];
 
-    dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+        for (TMMemoryCacheEntry *entry = shard->_tail; entry; entry = entry.prev) { // oldest objects first
+            if (TMMemoryCacheEntryIsExpired(entry))
+                continue;
 
-    #if !OS_OBJECT_USE_OBJC
-    dispatch_release(semaphore);
-    #endif
+            [keys addObject:entry.key];
+            [objects addObject:entry.object];
+        }
+
+        [shard unlock];
+
+        for (NSUInteger i = 0; i < [keys count]; i++)
+            block(self, [keys objectAtIndex:i], [objects objectAtIndex:i]);
+    }
 }
 
 #pragma mark - Public Thread Safe Accessors -
 
 - (TMMemoryCacheObjectBlock)willAddObjectBlock
 {
-    __block TMMemoryCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = self->_willAddObjectBlock;
-    });
+    [self lock];
+    TMMemoryCacheObjectBlock block = _willAddObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setWillAddObjectBlock:(TMMemoryCacheObjectBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-    
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_willAddObjectBlock = [block copy];
-    });
+    [self lock];
+    _willAddObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMMemoryCacheObjectBlock)willRemoveObjectBlock
 {
-    __block TMMemoryCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _willRemoveObjectBlock;
-    });
+    [self lock];
+    TMMemoryCacheObjectBlock block = _willRemoveObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setWillRemoveObjectBlock:(TMMemoryCacheObjectBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_willRemoveObjectBlock = [block copy];
-    });
+    [self lock];
+    _willRemoveObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMMemoryCacheBlock)willRemoveAllObjectsBlock
 {
-    __block TMMemoryCacheBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _willRemoveAllObjectsBlock;
-    });
+    [self lock];
+    TMMemoryCacheBlock block = _willRemoveAllObjectsBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setWillRemoveAllObjectsBlock:(TMMemoryCacheBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_willRemoveAllObjectsBlock = [block copy];
-    });
+    [self lock];
+    _willRemoveAllObjectsBlock = [block copy];
+    [self unlock];
 }
 
 - (TMMemoryCacheObjectBlock)didAddObjectBlock
 {
-    __block TMMemoryCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didAddObjectBlock;
-    });
+    [self lock];
+    TMMemoryCacheObjectBlock block = _didAddObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidAddObjectBlock:(TMMemoryCacheObjectBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didAddObjectBlock = [block copy];
-    });
+    [self lock];
+    _didAddObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMMemoryCacheObjectBlock)didRemoveObjectBlock
 {
-    __block TMMemoryCacheObjectBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didRemoveObjectBlock;
-    });
+    [self lock];
+    TMMemoryCacheObjectBlock block = _didRemoveObjectBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidRemoveObjectBlock:(TMMemoryCacheObjectBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didRemoveObjectBlock = [block copy];
-    });
+    [self lock];
+    _didRemoveObjectBlock = [block copy];
+    [self unlock];
 }
 
 - (TMMemoryCacheBlock)didRemoveAllObjectsBlock
 {
-    __block TMMemoryCacheBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didRemoveAllObjectsBlock;
-    });
+    [self lock];
+    TMMemoryCacheBlock block = _didRemoveAllObjectsBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidRemoveAllObjectsBlock:(TMMemoryCacheBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didRemoveAllObjectsBlock = [block copy];
-    });
+    [self lock];
+    _didRemoveAllObjectsBlock = [block copy];
+    [self unlock];
 }
 
 - (TMMemoryCacheBlock)didReceiveMemoryWarningBlock
 {
-    __block TMMemoryCacheBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didReceiveMemoryWarningBlock;
-    });
+    [self lock];
+    TMMemoryCacheBlock block = _didReceiveMemoryWarningBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidReceiveMemoryWarningBlock:(TMMemoryCacheBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didReceiveMemoryWarningBlock = [block copy];
-    });
+    [self lock];
+    _didReceiveMemoryWarningBlock = [block copy];
+    [self unlock];
 }
 
 - (TMMemoryCacheBlock)didEnterBackgroundBlock
 {
-    __block TMMemoryCacheBlock block = nil;
-
-    dispatch_sync(_queue, ^{
-        block = _didEnterBackgroundBlock;
-    });
+    [self lock];
+    TMMemoryCacheBlock block = _didEnterBackgroundBlock;
+    [self unlock];
 
     return block;
 }
 
 - (void)setDidEnterBackgroundBlock:(TMMemoryCacheBlock)block
 {
-    __weak TMMemoryCache *weakSelf = self;
-
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-
-        strongSelf->_didEnterBackgroundBlock = [block copy];
-    });
+    [self lock];
+    _didEnterBackgroundBlock = [block copy];
+    [self unlock];
 }
 
 - (NSTimeInterval)ageLimit
 {
-    __block NSTimeInterval ageLimit = 0.0;
-    
-    dispatch_sync(_queue, ^{
-        ageLimit = _ageLimit;
-    });
-    
+    [self lock];
+    NSTimeInterval ageLimit = _ageLimit;
+    [self unlock];
+
     return ageLimit;
 }
 
 - (void)setAgeLimit:(NSTimeInterval)ageLimit
 {
-    __weak TMMemoryCache *weakSelf = self;
+    [self lock];
+    _ageLimit = ageLimit;
+    [self unlock];
 
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
-        
-        strongSelf->_ageLimit = ageLimit;
-        
-        [strongSelf trimToAgeLimitRecursively];
-    });
+    [self trimToAgeLimitRecursively];
 }
 
 - (NSUInteger)costLimit
 {
-    __block NSUInteger costLimit = 0;
-
-    dispatch_sync(_queue, ^{
-        costLimit = _costLimit;
-    });
+    [self lock];
+    NSUInteger costLimit = _costLimit;
+    [self unlock];
 
     return costLimit;
 }
 
 - (void)setCostLimit:(NSUInteger)costLimit
 {
-    __weak TMMemoryCache *weakSelf = self;
+    [self lock];
+    _costLimit = costLimit;
+    [self unlock];
 
-    dispatch_barrier_async(_queue, ^{
-        TMMemoryCache *strongSelf = weakSelf;
-        if (!strongSelf)
-            return;
+    NSUInteger shardLimit = [self shardCostForCost:costLimit];
 
-        strongSelf->_costLimit = costLimit;
+    for (TMMemoryCacheShard *shard in _shards) {
+        [shard lock];
+        shard->_policy.capacity = shardLimit;
+        [shard unlock];
+    }
 
-        if (costLimit > 0)
-            [strongSelf trimToCostLimitByDate:costLimit];
-    });
+    if (costLimit > 0)
+        [self trimToCostLimitByDate:costLimit];
 }
 
 - (NSUInteger)totalCost
 {
-    __block NSUInteger cost = 0;
-    
-    dispatch_sync(_queue, ^{
-        cost = _totalCost;
-    });
-    
+    NSUInteger cost = 0;
+
+    for (TMMemoryCacheShard *shard in _shards) {
+        [shard lockForReading];
+        cost += shard->_totalCost;
+        [shard unlock];
+    }
+
     return cost;
 }
 
+- (NSUInteger)shardCount
+{
+    return [_shards count];
+}
+
 @end
@@ -0,0 +1,90 @@
+/**
+ Private to `TMMemoryCache`. The entry record shared by the memory cache and its eviction policies, and
+ the protocol those policies implement.
+ */
+
+#import "TMMemoryCache.h"
+
+/**
+ Everything the cache knows about one key: the object, its cost, when it was last accessed and its links in
+ the recency list. Entries are owned by the `entries` table of their shard, the links between them are not
+ retained. The list is ordered by access, most recently used at the head.
+
+ Policies other than LRU keep the entry in one of their own segments as well, using the segment links. The ARC
+ policy also keeps entries without objects for recently evicted keys, in segments and a table of its own.
+ */
+@interface TMMemoryCacheEntry : NSObject
+@property (strong, nonatomic) NSString *key;
+@property (strong, nonatomic) id object;
+@property (assign, nonatomic) NSUInteger cost;
+@property (assign, nonatomic) uint64_t accessTime; // mach_absolute_time()
+@property (assign, nonatomic) NSTimeInterval expirationTime; // since the reference date, 0 for never
+@property (unsafe_unretained, nonatomic) TMMemoryCacheEntry *prev;
+@property (unsafe_unretained, nonatomic) TMMemoryCacheEntry *next;
+@property (unsafe_unretained, nonatomic) TMMemoryCacheEntry *segmentPrev;
+@property (unsafe_unretained, nonatomic) TMMemoryCacheEntry *segmentNext;
+@property (assign, nonatomic) uint8_t segment;
+@end
+
+/**
+ Decides which entry of a shard goes next when the shard is over its cost. Every policy instance belongs to
+ exactly one shard and is only called with that shard's lock held exclusively, so it needs no locking of
+ its own. A shard without a policy evicts from the tail of its recency list, which is plain LRU.
+ */
+@protocol TMMemoryCachePolicy <NSObject>
+
+/**
+ The cost the shard is allowed to hold, or `0` for no limit. Policies size their segments from it.
+ */
+@property (assign, nonatomic) NSUInteger capacity;
+
+/**
+ A new key was stored.
+ */
+- (void)insertEntry:(TMMemoryCacheEntry *)entry;
+
+/**
+ An existing entry was read. Hits are buffered by the shard, so these arrive late and may be dropped.
+ */
+- (void)accessEntry:(TMMemoryCacheEntry *)entry;
+
+/**
+ An existing key was stored again, possibly with a new cost. Counts as an access.
+ */
+- (void)updateEntry:(TMMemoryCacheEntry *)entry oldCost:(NSUInteger)oldCost;
+
+/**
+ The entry is leaving the shard. `evicted` is `YES` when a trim made room by removing it, `NO` when the caller
+ removed it or it expired.
+ */
+- (void)removeEntry:(TMMemoryCacheEntry *)entry evicted:(BOOL)evicted;
+
+/**
+ The entry that should be evicted next, or nil if the policy holds none. The caller removes it with
+ <removeEntry:evicted:> before asking again.
+ */
+- (TMMemoryCacheEntry *)victim;
+
+/**
+ Forgets every entry and any history kept about keys.
+ */
+- (void)removeAllEntries;
+
+@end
+
+/**
+ W-TinyLFU: new entries go through a small LRU window, then have to beat the main cache's next victim on
+ estimated access frequency to be admitted. Frequencies come from a 4-bit count-min sketch that is halved
+ periodically so old popularity fades. A scan of one-hit keys stays in the window and never displaces the
+ frequently used entries in the main cache.
+ */
+@interface TMMemoryCacheTinyLFUPolicy : NSObject <TMMemoryCachePolicy>
+@end
+
+/**
+ Adaptive Replacement Cache: entries seen once and entries seen more than once are kept in separate lists.
+ Recently evicted keys are remembered without their objects ("ghosts"). A ghost hit moves the balance
+ between the two lists toward whichever one would have kept the key.
+ */
+@interface TMMemoryCacheARCPolicy : NSObject <TMMemoryCachePolicy>
+@end
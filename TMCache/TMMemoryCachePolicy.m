@@ -0,0 +1,481 @@
+#import "TMMemoryCachePolicy.h"
+
+/**
+ An intrusive list over the segment links of its entries, most recently used at the head.
+ */
+typedef struct {
+    __unsafe_unretained TMMemoryCacheEntry *head;
+    __unsafe_unretained TMMemoryCacheEntry *tail;
+    NSUInteger cost;
+    NSUInteger count;
+} TMMemoryCacheSegment;
+
+static void TMMemoryCacheSegmentInsert(TMMemoryCacheSegment *segment, TMMemoryCacheEntry *entry)
+{
+    entry.segmentPrev = nil;
+    entry.segmentNext = segment->head;
+
+    if (segment->head)
+        segment->head.segmentPrev = entry;
+
+    segment->head = entry;
+
+    if (!segment->tail)
+        segment->tail = entry;
+
+    segment->cost += entry.cost;
+    segment->count++;
+}
+
+static void TMMemoryCacheSegmentRemove(TMMemoryCacheSegment *segment, TMMemoryCacheEntry *entry)
+{
+    if (entry.segmentPrev)
+        entry.segmentPrev.segmentNext = entry.segmentNext;
+    else
+        segment->head = entry.segmentNext;
+
+    if (entry.segmentNext)
+        entry.segmentNext.segmentPrev = entry.segmentPrev;
+    else
+        segment->tail = entry.segmentPrev;
+
+    entry.segmentPrev = nil;
+    entry.segmentNext = nil;
+
+    segment->cost -= MIN(segment->cost, entry.cost);
+    segment->count--;
+}
+
+static void TMMemoryCacheSegmentMoveToHead(TMMemoryCacheSegment *segment, TMMemoryCacheEntry *entry)
+{
+    if (segment->head == entry)
+        return;
+
+    TMMemoryCacheSegmentRemove(segment, entry);
+    TMMemoryCacheSegmentInsert(segment, entry);
+}
+
+#pragma mark - Frequency Sketch -
+
+#define TMMemoryCacheSketchMinimumWidth 16
+
+static const uint64_t TMMemoryCacheSketchSeeds[4] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+/**
+ A count-min sketch of 4-bit counters, sixteen to a word, four hashed counters per key. When the number of
+ increments reaches ten times the width every counter is halved, so the sketch tracks recent popularity.
+ */
+@interface TMMemoryCacheFrequencySketch : NSObject {
+    uint64_t *_table;
+    NSUInteger _tableMask;
+    NSUInteger _additions;
+    NSUInteger _sampleSize;
+}
+- (void)ensureCapacity:(NSUInteger)count;
+- (NSUInteger)frequencyForKey:(NSString *)key;
+- (void)incrementKey:(NSString *)key;
+- (void)clear;
+@end
+
+@implementation TMMemoryCacheFrequencySketch
+
+- (void)dealloc
+{
+    free(_table);
+}
+
+- (id)init
+{
+    if (self = [super init]) {
+        _table = NULL;
+        _additions = 0;
+        [self ensureCapacity:TMMemoryCacheSketchMinimumWidth];
+    }
+    return self;
+}
+
+// Growing keeps the counts: a key's counters sit at its hash masked to the width, so after doubling they are at
+// the same index or one width further, and copying the table into its new half leaves every key where it looks.
+- (void)ensureCapacity:(NSUInteger)count
+{
+    if (_table && count <= _tableMask + 1)
+        return;
+
+    NSUInteger oldWidth = _table ? _tableMask + 1 : 0;
+    NSUInteger width = oldWidth ?: TMMemoryCacheSketchMinimumWidth;
+    while (width < count)
+        width <<= 1;
+
+    uint64_t *table = realloc(_table, width * sizeof(uint64_t));
+    if (!table)
+        return;
+
+    if (oldWidth) {
+        for (NSUInteger filled = oldWidth; filled < width; filled <<= 1)
+            memcpy(table + filled, table, filled * sizeof(uint64_t));
+    } else {
+        memset(table, 0, width * sizeof(uint64_t));
+    }
+
+    _table = table;
+    _tableMask = width - 1;
+    _sampleSize = width * 10;
+}
+
+static inline uint64_t TMMemoryCacheSketchSpread(NSUInteger hash)
+{
+    uint64_t x = hash;
+    x = (x ^ (x >> 17)) * 0xed5ad4bbULL;
+    x = (x ^ (x >> 11)) * 0xac4c1b51ULL;
+    x = (x ^ (x >> 15)) * 0x31848babULL;
+    return x ^ (x >> 14);
+}
+
+- (NSUInteger)indexForHash:(uint64_t)hash depth:(NSUInteger)depth
+{
+    uint64_t x = (hash + TMMemoryCacheSketchSeeds[depth]) * TMMemoryCacheSketchSeeds[depth];
+    x += x >> 32;
+    return (NSUInteger)(x & _tableMask);
+}
+
+- (NSUInteger)frequencyForKey:(NSString *)key
+{
+    uint64_t hash = TMMemoryCacheSketchSpread([key hash]);
+    NSUInteger start = (hash & 3) << 2;
+    NSUInteger frequency = 15;
+
+    for (NSUInteger i = 0; i < 4; i++) {
+        NSUInteger offset = (start + i) << 2;
+        NSUInteger count = (NSUInteger)((_table[[self indexForHash:hash depth:i]] >> offset) & 0xf);
+        frequency = MIN(frequency, count);
+    }
+
+    return frequency;
+}
+
+- (void)incrementKey:(NSString *)key
+{
+    uint64_t hash = TMMemoryCacheSketchSpread([key hash]);
+    NSUInteger start = (hash & 3) << 2;
+    BOOL added = NO;
+
+    for (NSUInteger i = 0; i < 4; i++) {
+        NSUInteger index = [self indexForHash:hash depth:i];
+        NSUInteger offset = (start + i) << 2;
+
+        if (((_table[index] >> offset) & 0xf) != 0xf) {
+            _table[index] += 1ULL << offset;
+            added = YES;
+        }
+    }
+
+    if (added && ++_additions >= _sampleSize) {
+        for (NSUInteger i = 0; i <= _tableMask; i++)
+            _table[i] = (_table[i] >> 1) & 0x7777777777777777ULL;
+
+        _additions /= 2;
+    }
+}
+
+- (void)clear
+{
+    memset(_table, 0, (_tableMask + 1) * sizeof(uint64_t));
+    _additions = 0;
+}
+
+@end
+
+#pragma mark - W-TinyLFU -
+
+typedef NS_ENUM(uint8_t, TMMemoryCacheTinyLFUSegment) {
+    TMMemoryCacheTinyLFUSegmentWindow = 0,
+    TMMemoryCacheTinyLFUSegmentProbation,
+    TMMemoryCacheTinyLFUSegmentProtected
+};
+
+@implementation TMMemoryCacheTinyLFUPolicy {
+    TMMemoryCacheSegment _segments[3];
+    NSUInteger _windowLimit;
+    NSUInteger _protectedLimit;
+    TMMemoryCacheFrequencySketch *_sketch;
+    __unsafe_unretained TMMemoryCacheEntry *_candidate; // the entry last pushed out of the window, while in probation
+}
+
+@synthesize capacity = _capacity;
+
+- (id)init
+{
+    if (self = [super init]) {
+        memset(_segments, 0, sizeof(_segments));
+        _sketch = [[TMMemoryCacheFrequencySketch alloc] init];
+        self.capacity = 0;
+    }
+    return self;
+}
+
+- (void)setCapacity:(NSUInteger)capacity
+{
+    if (_capacity == capacity && _windowLimit > 0)
+        return;
+
+    _capacity = capacity;
+
+    if (capacity == 0) {
+        _windowLimit = NSUIntegerMax;
+        _protectedLimit = NSUIntegerMax;
+        return;
+    }
+
+    _windowLimit = MAX(capacity / 100, 1); // 1% window, the rest split 20/80 between probation and protected
+    _protectedLimit = (capacity - MIN(capacity, _windowLimit)) / 5 * 4;
+}
+
+- (NSUInteger)count
+{
+    return _segments[0].count + _segments[1].count + _segments[2].count;
+}
+
+- (void)moveEntry:(TMMemoryCacheEntry *)entry toSegment:(TMMemoryCacheTinyLFUSegment)segment
+{
+    TMMemoryCacheSegmentRemove(&_segments[entry.segment], entry);
+    entry.segment = segment;
+    TMMemoryCacheSegmentInsert(&_segments[segment], entry);
+}
+
+// Entries pushed out of the window move to probation, where the last of them competes with its tail in -victim.
+// Entries demoted from protected land at the head of probation too, so the candidate is tracked on its own.
+- (void)evictFromWindow
+{
+    TMMemoryCacheSegment *window = &_segments[TMMemoryCacheTinyLFUSegmentWindow];
+
+    while (window->cost > _windowLimit && window->tail) {
+        _candidate = window->tail;
+        [self moveEntry:_candidate toSegment:TMMemoryCacheTinyLFUSegmentProbation];
+    }
+}
+
+- (void)insertEntry:(TMMemoryCacheEntry *)entry
+{
+    [_sketch ensureCapacity:[self count] + 1];
+    [_sketch incrementKey:entry.key];
+
+    entry.segment = TMMemoryCacheTinyLFUSegmentWindow;
+    TMMemoryCacheSegmentInsert(&_segments[TMMemoryCacheTinyLFUSegmentWindow], entry);
+
+    [self evictFromWindow];
+}
+
+- (void)accessEntry:(TMMemoryCacheEntry *)entry
+{
+    [_sketch incrementKey:entry.key];
+
+    switch (entry.segment) {
+        case TMMemoryCacheTinyLFUSegmentWindow:
+        case TMMemoryCacheTinyLFUSegmentProtected:
+            TMMemoryCacheSegmentMoveToHead(&_segments[entry.segment], entry);
+            break;
+
+        case TMMemoryCacheTinyLFUSegmentProbation: {
+            if (entry == _candidate)
+                _candidate = nil;
+
+            [self moveEntry:entry toSegment:TMMemoryCacheTinyLFUSegmentProtected];
+
+            TMMemoryCacheSegment *protectedSegment = &_segments[TMMemoryCacheTinyLFUSegmentProtected];
+            while (protectedSegment->cost > _protectedLimit && protectedSegment->tail != entry)
+                [self moveEntry:protectedSegment->tail toSegment:TMMemoryCacheTinyLFUSegmentProbation];
+            break;
+        }
+    }
+}
+
+- (void)updateEntry:(TMMemoryCacheEntry *)entry oldCost:(NSUInteger)oldCost
+{
+    TMMemoryCacheSegment *segment = &_segments[entry.segment];
+    segment->cost = segment->cost - MIN(segment->cost, oldCost) + entry.cost;
+
+    [self accessEntry:entry];
+    [self evictFromWindow];
+}
+
+- (void)removeEntry:(TMMemoryCacheEntry *)entry evicted:(BOOL)evicted
+{
+    if (entry == _candidate)
+        _candidate = nil;
+
+    TMMemoryCacheSegmentRemove(&_segments[entry.segment], entry);
+}
+
+- (TMMemoryCacheEntry *)victim
+{
+    TMMemoryCacheEntry *victim = _segments[TMMemoryCacheTinyLFUSegmentProbation].tail;
+
+    if (_candidate && victim && victim != _candidate) {
+        if ([_sketch frequencyForKey:_candidate.key] > [_sketch frequencyForKey:victim.key])
+            return victim;
+
+        return _candidate;
+    }
+
+    if (victim)
+        return victim;
+
+    if (_segments[TMMemoryCacheTinyLFUSegmentProtected].tail)
+        return _segments[TMMemoryCacheTinyLFUSegmentProtected].tail;
+
+    return _segments[TMMemoryCacheTinyLFUSegmentWindow].tail;
+}
+
+- (void)removeAllEntries
+{
+    memset(_segments, 0, sizeof(_segments));
+    _candidate = nil;
+    [_sketch clear];
+}
+
+@end
+
+#pragma mark - ARC -
+
+typedef NS_ENUM(uint8_t, TMMemoryCacheARCSegment) {
+    TMMemoryCacheARCSegmentRecent = 0,  // T1, seen once
+    TMMemoryCacheARCSegmentFrequent     // T2, seen more than once
+};
+
+@implementation TMMemoryCacheARCPolicy {
+    TMMemoryCacheSegment _segments[2];
+    TMMemoryCacheSegment _ghostSegments[2]; // B1 and B2, entries without their objects, oldest at the tail
+    NSMutableDictionary *_ghosts; // owns the entries in the ghost segments, by key
+    NSUInteger _target; // the cost T1 should hold, adapted on ghost hits
+}
+
+@synthesize capacity = _capacity;
+
+- (id)init
+{
+    if (self = [super init]) {
+        memset(_segments, 0, sizeof(_segments));
+        memset(_ghostSegments, 0, sizeof(_ghostSegments));
+        _ghosts = [[NSMutableDictionary alloc] init];
+        _target = 0;
+    }
+    return self;
+}
+
+- (void)setCapacity:(NSUInteger)capacity
+{
+    _capacity = capacity;
+    _target = MIN(_target, capacity);
+}
+
+// Returns the ghost of the key, or nil if there is none. Its segment tells which list it was in.
+- (TMMemoryCacheEntry *)removeGhostForKey:(NSString *)key
+{
+    TMMemoryCacheEntry *ghost = [_ghosts objectForKey:key];
+
+    if (ghost) {
+        TMMemoryCacheSegmentRemove(&_ghostSegments[ghost.segment], ghost);
+        [_ghosts removeObjectForKey:key];
+    }
+
+    return ghost;
+}
+
+- (void)insertEntry:(TMMemoryCacheEntry *)entry
+{
+    NSUInteger weight = MAX(entry.cost, 1);
+    TMMemoryCacheEntry *ghost = [self removeGhostForKey:entry.key];
+    NSUInteger recentGhostCost = _ghostSegments[TMMemoryCacheARCSegmentRecent].cost;
+    NSUInteger frequentGhostCost = _ghostSegments[TMMemoryCacheARCSegmentFrequent].cost;
+
+    if (ghost && ghost.segment == TMMemoryCacheARCSegmentRecent) {
+        NSUInteger delta = weight * MAX(frequentGhostCost / MAX(recentGhostCost, 1), 1);
+        _target = MIN(_target + delta, _capacity); // T1 was too small
+
+        entry.segment = TMMemoryCacheARCSegmentFrequent;
+    } else if (ghost) {
+        NSUInteger delta = weight * MAX(recentGhostCost / MAX(frequentGhostCost, 1), 1);
+        _target -= MIN(_target, delta); // T2 was too small
+
+        entry.segment = TMMemoryCacheARCSegmentFrequent;
+    } else {
+        entry.segment = TMMemoryCacheARCSegmentRecent;
+    }
+
+    TMMemoryCacheSegmentInsert(&_segments[entry.segment], entry);
+}
+
+- (void)accessEntry:(TMMemoryCacheEntry *)entry
+{
+    TMMemoryCacheSegmentRemove(&_segments[entry.segment], entry);
+    entry.segment = TMMemoryCacheARCSegmentFrequent;
+    TMMemoryCacheSegmentInsert(&_segments[TMMemoryCacheARCSegmentFrequent], entry);
+}
+
+- (void)updateEntry:(TMMemoryCacheEntry *)entry oldCost:(NSUInteger)oldCost
+{
+    TMMemoryCacheSegment *segment = &_segments[entry.segment];
+    segment->cost = segment->cost - MIN(segment->cost, oldCost) + entry.cost;
+
+    [self accessEntry:entry];
+}
+
+// Only evicted keys become ghosts: a key the caller removed or that expired says nothing about the list sizes.
+- (void)removeEntry:(TMMemoryCacheEntry *)entry evicted:(BOOL)evicted
+{
+    TMMemoryCacheSegmentRemove(&_segments[entry.segment], entry);
+
+    if (evicted)
+        [self addGhostForEntry:entry];
+}
+
+- (void)addGhostForEntry:(TMMemoryCacheEntry *)entry
+{
+    TMMemoryCacheEntry *ghost = [[TMMemoryCacheEntry alloc] init];
+    ghost.key = entry.key;
+    ghost.cost = MAX(entry.cost, 1);
+    ghost.segment = entry.segment;
+
+    [self removeGhostForKey:ghost.key];
+    [_ghosts setObject:ghost forKey:ghost.key];
+    TMMemoryCacheSegmentInsert(&_ghostSegments[ghost.segment], ghost);
+
+    // Keep each ghost list within the capacity, and by count within the number of resident entries so
+    // zero-cost entries can't grow them without bound.
+    TMMemoryCacheSegment *recentGhosts = &_ghostSegments[TMMemoryCacheARCSegmentRecent];
+    TMMemoryCacheSegment *frequentGhosts = &_ghostSegments[TMMemoryCacheARCSegmentFrequent];
+    NSUInteger capacity = MAX(_capacity, 1);
+    NSUInteger residentCount = MAX(_segments[0].count + _segments[1].count, 1);
+
+    while (recentGhosts->tail && (_segments[TMMemoryCacheARCSegmentRecent].cost + recentGhosts->cost > capacity
+                                  || recentGhosts->count > residentCount))
+        [self removeGhostForKey:recentGhosts->tail.key];
+
+    while (frequentGhosts->tail && (recentGhosts->cost + frequentGhosts->cost > capacity
+                                    || frequentGhosts->count > residentCount))
+        [self removeGhostForKey:frequentGhosts->tail.key];
+}
+
+- (TMMemoryCacheEntry *)victim
+{
+    TMMemoryCacheSegment *recent = &_segments[TMMemoryCacheARCSegmentRecent];
+    TMMemoryCacheSegment *frequent = &_segments[TMMemoryCacheARCSegmentFrequent];
+
+    if (recent->tail && (recent->cost > _target || !frequent->tail))
+        return recent->tail;
+
+    return frequent->tail;
+}
+
+- (void)removeAllEntries
+{
+    memset(_segments, 0, sizeof(_segments));
+    _target = 0;
+
+    memset(_ghostSegments, 0, sizeof(_ghostSegments));
+    [_ghosts removeAllObjects];
+}
+
+@end
@@ -0,0 +1,588 @@
+/**
+ Drives TMMemoryCache, TMDiskCache and TMCache with synthetic workloads and prints one result per run, as JSON
+ lines or CSV, so runs before and after a change can be compared by a script. See the Makefile for how to build.
+
+ Workloads:
+
+ - `zipf`: reads of keys drawn from a Zipfian distribution, an object is set after every miss.
+ - `scan`: reads of every key in order, over and over, an object is set after every miss.
+ - `mixed`: keys drawn like `zipf`, a share of the operations are writes (see `--write-ratio`).
+ - `write`: writes only, of keys drawn like `zipf`. With `--durability` this measures writes per second at each
+   durability level of the disk cache.
+
+ Every run starts from an empty cache, warms it up with unmeasured operations and then measures `--ops`
+ operations split evenly across the threads. The caches are limited to `--capacity` objects so hit ratios
+ mean something: a cost limit of one per object in memory and `--capacity` times the value size on disk.
+ The memory cache has no durability levels and only runs at `none`. `--engine` picks the I/O engine of the
+ disk cache runs, the `engine` column names the one it got.
+ */
+
+#import <Foundation/Foundation.h>
+#import <pthread.h>
+
+#import "TMCache.h"
+#import "TMCacheMachTime.h"
+
+typedef NS_ENUM(NSUInteger, TMBenchmarkWorkload) {
+    TMBenchmarkWorkloadZipf,
+    TMBenchmarkWorkloadScan,
+    TMBenchmarkWorkloadMixed,
+    TMBenchmarkWorkloadWrite
+};
+
+typedef struct {
+    uint64_t state;
+} TMBenchmarkRandom;
+
+// xorshift64*, one per thread so drawing keys doesn't contend
+static inline uint64_t TMBenchmarkNextRandom(TMBenchmarkRandom *random)
+{
+    random->state ^= random->state >> 12;
+    random->state ^= random->state << 25;
+    random->state ^= random->state >> 27;
+    return random->state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline double TMBenchmarkNextUniform(TMBenchmarkRandom *random)
+{
+    return (TMBenchmarkNextRandom(random) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t TMBenchmarkNanoseconds(uint64_t ticks)
+{
+    static mach_timebase_info_data_t timebase;
+    static dispatch_once_t predicate;
+
+    dispatch_once(&predicate, ^{
+        mach_timebase_info(&timebase);
+    });
+
+    return (uint64_t)((double)ticks * timebase.numer / timebase.denom);
+}
+
+static int TMBenchmarkCompareLatencies(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+static void *TMBenchmarkThreadMain(void *context)
+{
+    @autoreleasepool {
+        void (^work)(void) = (__bridge_transfer id)context;
+        work();
+    }
+    return NULL;
+}
+
+@interface TMBenchmarkOptions : NSObject
+@property (strong) NSArray *caches;
+@property (strong) NSArray *workloads;
+@property (strong) NSArray *durabilities;
+@property (strong) NSString *engine;
+@property (strong) NSArray *threadCounts;
+@property (strong) NSArray *shardCounts;
+@property (strong) NSArray *valueSizes;
+@property (strong) NSString *valueKind;
+@property (assign) NSUInteger compressionThreshold;
+@property (assign) NSUInteger keyCount;
+@property (assign) NSUInteger capacity;
+@property (assign) NSUInteger operationCount;
+@property (assign) NSUInteger warmupCount;
+@property (assign) double zipfExponent;
+@property (assign) double writeRatio;
+@property (strong) NSString *format;
+@property (strong) NSString *rootPath;
+@end
+
+@implementation TMBenchmarkOptions
+@end
+
+@interface TMBenchmark : NSObject
+- (instancetype)initWithOptions:(TMBenchmarkOptions *)options;
+- (void)run;
+@end
+
+@implementation TMBenchmark {
+    TMBenchmarkOptions *_options;
+    NSArray *_keys;
+    double *_zipfCDF;
+    BOOL _printedHeader;
+}
+
+- (instancetype)initWithOptions:(TMBenchmarkOptions *)options
+{
+    if (self = [super init]) {
+        _options = options;
+
+        NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:options.keyCount];
+        for (NSUInteger i = 0; i < options.keyCount; i++)
+            [keys addObject:[[NSString alloc] initWithFormat:@"key-%lu", (unsigned long)i]];
+        _keys = keys;
+
+        _zipfCDF = malloc(sizeof(double) * options.keyCount);
+
+        double sum = 0.0;
+        for (NSUInteger i = 0; i < options.keyCount; i++) {
+            sum += 1.0 / pow((double)(i + 1), options.zipfExponent);
+            _zipfCDF[i] = sum;
+        }
+
+        for (NSUInteger i = 0; i < options.keyCount; i++)
+            _zipfCDF[i] /= sum;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_zipfCDF);
+}
+
+- (NSUInteger)zipfIndex:(TMBenchmarkRandom *)random
+{
+    double u = TMBenchmarkNextUniform(random);
+    NSUInteger low = 0;
+    NSUInteger high = _options.keyCount - 1;
+
+    while (low < high) {
+        NSUInteger middle = low + (high - low) / 2;
+        if (_zipfCDF[middle] < u)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low;
+}
+
+#pragma mark - Caches -
+
+static TMDiskCacheDurability TMBenchmarkDurability(NSString *name)
+{
+    if ([name isEqualToString:@"group"])
+        return TMDiskCacheDurabilityGroupCommit;
+
+    if ([name isEqualToString:@"immediate"])
+        return TMDiskCacheDurabilityImmediate;
+
+    return TMDiskCacheDurabilityNone;
+}
+
+static TMDiskCacheIOEngineType TMBenchmarkIOEngine(NSString *name)
+{
+    if ([name isEqualToString:@"foundation"])
+        return TMDiskCacheIOEngineFoundation;
+
+    if ([name isEqualToString:@"uring"])
+        return TMDiskCacheIOEngineIOUring;
+
+    return TMDiskCacheIOEnginePOSIX;
+}
+
+static NSString *TMBenchmarkIOEngineName(id cache)
+{
+    if (![cache isKindOfClass:[TMDiskCache class]])
+        return [cache isKindOfClass:[TMCache class]] ? @"posix" : @"none";
+
+    switch ([(TMDiskCache *)cache ioEngine]) {
+        case TMDiskCacheIOEngineFoundation:
+            return @"foundation";
+        case TMDiskCacheIOEngineIOUring:
+            return @"uring";
+        default:
+            return @"posix";
+    }
+}
+
+- (id)cacheNamed:(NSString *)name valueSize:(NSUInteger)valueSize durability:(NSString *)durabilityName
+          shards:(NSUInteger)shardCount
+{
+    NSUInteger capacity = _options.capacity;
+
+    if ([name isEqualToString:@"memory"]) {
+        TMMemoryCache *cache = [[TMMemoryCache alloc] initWithShardCount:shardCount];
+        cache.costLimit = capacity;
+        return cache;
+    }
+
+    NSString *cacheName = [[NSString alloc] initWithFormat:@"benchmark-%@-%lu", name, (unsigned long)valueSize];
+
+    if ([name isEqualToString:@"disk"]) {
+        TMDiskCache *cache = [[TMDiskCache alloc] initWithName:cacheName rootPath:_options.rootPath
+                                                    fileLayout:TMDiskCacheFileLayoutFlat
+                                                      ioEngine:TMBenchmarkIOEngine(_options.engine)];
+        [cache removeAllObjects];
+        cache.byteLimit = capacity * valueSize;
+        cache.durability = TMBenchmarkDurability(durabilityName);
+        cache.compressionThreshold = _options.compressionThreshold;
+        return cache;
+    }
+
+    TMCache *cache = [[TMCache alloc] initWithName:cacheName rootPath:_options.rootPath];
+    [cache removeAllObjects];
+    cache.memoryCache.costLimit = capacity / 10 ?: 1; // a small memory tier in front of the disk
+    cache.diskCache.byteLimit = capacity * valueSize;
+    cache.diskCache.durability = TMBenchmarkDurability(durabilityName);
+    cache.diskCache.compressionThreshold = _options.compressionThreshold;
+    return cache;
+}
+
+- (id)objectForKey:(NSString *)key inCache:(id)cache
+{
+    return [(TMCache *)cache objectForKey:key]; // the same selector on all three caches
+}
+
+- (void)setObject:(id)object forKey:(NSString *)key inCache:(id)cache
+{
+    if ([cache isKindOfClass:[TMMemoryCache class]])
+        [(TMMemoryCache *)cache setObject:object forKey:key withCost:1];
+    else
+        [(TMCache *)cache setObject:object forKey:key];
+}
+
+- (NSUInteger)bytesOnDiskForCache:(id)cache
+{
+    if ([cache isKindOfClass:[TMDiskCache class]])
+        return [(TMDiskCache *)cache byteCount];
+
+    if ([cache isKindOfClass:[TMCache class]])
+        return [(TMCache *)cache diskByteCount];
+
+    return 0;
+}
+
+#pragma mark - Runs -
+
+// Runs the operations on the given number of threads and returns the wall clock time they took, in nanoseconds.
+// Latencies, hits and reads are collected only if the arrays are passed.
+- (uint64_t)runOperations:(NSUInteger)operationCount workload:(TMBenchmarkWorkload)workload cache:(id)cache
+                    value:(NSData *)value threads:(NSUInteger)threadCount latencies:(uint64_t *)latencies
+                     hits:(uint64_t *)hits reads:(uint64_t *)reads
+{
+    NSUInteger operationsPerThread = operationCount / threadCount;
+    NSUInteger keyCount = _options.keyCount;
+    double writeRatio = _options.writeRatio;
+    pthread_t *threads = malloc(sizeof(pthread_t) * threadCount);
+
+    uint64_t startTime = mach_absolute_time();
+
+    for (NSUInteger thread = 0; thread < threadCount; thread++) {
+        void (^work)(void) = ^{
+            TMBenchmarkRandom random = { 0x9E3779B97F4A7C15ULL * (thread + 1) ^ startTime };
+            uint64_t *threadLatencies = latencies ? latencies + thread * operationsPerThread : NULL;
+            uint64_t threadHits = 0;
+            uint64_t threadReads = 0;
+
+            for (NSUInteger i = 0; i < operationsPerThread; i++) {
+                NSUInteger index = 0;
+
+                if (workload == TMBenchmarkWorkloadScan)
+                    index = (thread * operationsPerThread + i) % keyCount;
+                else
+                    index = [self zipfIndex:&random];
+
+                NSString *key = [_keys objectAtIndex:index];
+                BOOL write = workload == TMBenchmarkWorkloadWrite
+                    || (workload == TMBenchmarkWorkloadMixed && TMBenchmarkNextUniform(&random) < writeRatio);
+
+                uint64_t operationStart = mach_absolute_time();
+
+                if (write) {
+                    [self setObject:value forKey:key inCache:cache];
+                } else {
+                    @autoreleasepool {
+                        id object = [self objectForKey:key inCache:cache];
+                        threadReads++;
+
+                        if (object)
+                            threadHits++;
+                        else
+                            [self setObject:value forKey:key inCache:cache];
+                    }
+                }
+
+                if (threadLatencies)
+                    threadLatencies[i] = TMBenchmarkNanoseconds(mach_absolute_time() - operationStart);
+            }
+
+            if (hits)
+                __sync_fetch_and_add(hits, threadHits);
+            if (reads)
+                __sync_fetch_and_add(reads, threadReads);
+        };
+
+        pthread_create(&threads[thread], NULL, TMBenchmarkThreadMain, (__bridge_retained void *)[work copy]);
+    }
+
+    for (NSUInteger thread = 0; thread < threadCount; thread++)
+        pthread_join(threads[thread], NULL);
+
+    free(threads);
+
+    return TMBenchmarkNanoseconds(mach_absolute_time() - startTime);
+}
+
+- (NSDictionary *)runCache:(NSString *)cacheName workload:(NSString *)workloadName threads:(NSUInteger)threadCount
+                 valueSize:(NSUInteger)valueSize durability:(NSString *)durabilityName shards:(NSUInteger)shardCount
+{
+    TMBenchmarkWorkload workload = TMBenchmarkWorkloadZipf;
+    if ([workloadName isEqualToString:@"scan"])
+        workload = TMBenchmarkWorkloadScan;
+    else if ([workloadName isEqualToString:@"mixed"])
+        workload = TMBenchmarkWorkloadMixed;
+    else if ([workloadName isEqualToString:@"write"])
+        workload = TMBenchmarkWorkloadWrite;
+
+    NSMutableData *value = [[NSMutableData alloc] initWithLength:valueSize];
+    TMBenchmarkRandom random = { 0x2545F4914F6CDD1DULL };
+
+    if ([_options.valueKind isEqualToString:@"text"]) {
+        NSMutableString *text = [[NSMutableString alloc] init];
+        for (NSUInteger i = 0; [text length] < valueSize; i++) // compressible, like JSON responses
+            [text appendFormat:@"{\"id\":%llu,\"type\":\"text\",\"body\":\"Post %lu, with some text.\"},",
+                               (unsigned long long)(TMBenchmarkNextRandom(&random) % 1000000), (unsigned long)i];
+        [value replaceBytesInRange:NSMakeRange(0, valueSize) withBytes:[text UTF8String]];
+    } else {
+        for (NSUInteger i = 0; i + sizeof(uint64_t) <= valueSize; i += sizeof(uint64_t)) {
+            uint64_t bytes = TMBenchmarkNextRandom(&random); // incompressible, like images or downloaded data
+            [value replaceBytesInRange:NSMakeRange(i, sizeof(bytes)) withBytes:&bytes];
+        }
+    }
+
+    id cache = [self cacheNamed:cacheName valueSize:valueSize durability:durabilityName shards:shardCount];
+
+    TMMemoryCache *memoryCache = nil;
+    if ([cache isKindOfClass:[TMMemoryCache class]])
+        memoryCache = cache;
+    else if ([cache isKindOfClass:[TMCache class]])
+        memoryCache = [(TMCache *)cache memoryCache];
+
+    [self runOperations:_options.warmupCount workload:workload cache:cache value:value threads:threadCount
+              latencies:NULL hits:NULL reads:NULL];
+
+    NSUInteger operationCount = _options.operationCount / threadCount * threadCount;
+    uint64_t *latencies = malloc(sizeof(uint64_t) * operationCount);
+    uint64_t hits = 0;
+    uint64_t reads = 0;
+
+    uint64_t elapsed = [self runOperations:operationCount workload:workload cache:cache value:value
+                                   threads:threadCount latencies:latencies hits:&hits reads:&reads];
+
+    qsort(latencies, operationCount, sizeof(uint64_t), TMBenchmarkCompareLatencies);
+
+    NSDictionary *result = @{
+        @"cache": cacheName,
+        @"workload": workloadName,
+        @"durability": durabilityName,
+        @"engine": TMBenchmarkIOEngineName(cache),
+        @"threads": @(threadCount),
+        @"shards": @(memoryCache.shardCount),
+        @"valueSize": @(valueSize),
+        @"values": _options.valueKind,
+        @"compression": @(_options.compressionThreshold),
+        @"keys": @(_options.keyCount),
+        @"capacity": @(_options.capacity),
+        @"operations": @(operationCount),
+        @"opsPerSec": @(elapsed ? operationCount * 1e9 / elapsed : 0.0),
+        @"p50": @(latencies[(operationCount - 1) * 50 / 100]),
+        @"p99": @(latencies[(operationCount - 1) * 99 / 100]),
+        @"p999": @(latencies[(operationCount - 1) * 999 / 1000]),
+        @"hitRatio": @(reads ? (double)hits / reads : 0.0),
+        @"bytesOnDisk": @([self bytesOnDiskForCache:cache])
+    };
+
+    free(latencies);
+
+    if (![cache isKindOfClass:[TMMemoryCache class]])
+        [(TMCache *)cache removeAllObjects];
+
+    return result;
+}
+
+- (void)printResult:(NSDictionary *)result
+{
+    NSArray *columns = @[ @"cache", @"workload", @"durability", @"engine", @"threads", @"shards", @"valueSize", @"values",
+                          @"compression", @"keys", @"capacity", @"operations", @"opsPerSec", @"p50", @"p99", @"p999", @"hitRatio", @"bytesOnDisk" ];
+    NSString *line = nil;
+
+    if ([_options.format isEqualToString:@"csv"]) {
+        if (!_printedHeader) {
+            printf("%s\n", [[columns componentsJoinedByString:@","] UTF8String]);
+            _printedHeader = YES;
+        }
+
+        NSMutableArray *values = [[NSMutableArray alloc] initWithCapacity:[columns count]];
+        for (NSString *column in columns)
+            [values addObject:[[result objectForKey:column] description]];
+
+        line = [values componentsJoinedByString:@","];
+    } else {
+        NSData *json = [NSJSONSerialization dataWithJSONObject:result options:0 error:NULL];
+        line = [[NSString alloc] initWithData:json encoding:NSUTF8StringEncoding];
+    }
+
+    printf("%s\n", [line UTF8String]);
+    fflush(stdout);
+}
+
+- (void)run
+{
+    for (NSString *cacheName in _options.caches) {
+        NSArray *durabilities = [cacheName isEqualToString:@"memory"] ? @[ @"none" ] : _options.durabilities;
+        NSArray *shardCounts = [cacheName isEqualToString:@"memory"] ? _options.shardCounts : @[ @0 ];
+
+        for (NSString *workloadName in _options.workloads) {
+            for (NSString *durabilityName in durabilities) {
+                for (NSNumber *valueSize in _options.valueSizes) {
+                    for (NSNumber *threadCount in _options.threadCounts) {
+                        for (NSNumber *shardCount in shardCounts) {
+                            @autoreleasepool {
+                                [self printResult:[self runCache:cacheName workload:workloadName
+                                                         threads:[threadCount unsignedIntegerValue]
+                                                       valueSize:[valueSize unsignedIntegerValue]
+                                                      durability:durabilityName
+                                                          shards:[shardCount unsignedIntegerValue]]];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+@end
+
+#pragma mark - Main -
+
+static NSArray *TMBenchmarkNumbers(NSString *list)
+{
+    NSMutableArray *numbers = [[NSMutableArray alloc] init];
+    for (NSString *item in [list componentsSeparatedByString:@","]) {
+        NSInteger number = [item integerValue];
+        if (number > 0)
+            [numbers addObject:@(number)];
+    }
+    return numbers;
+}
+
+static void TMBenchmarkUsage(void)
+{
+    fprintf(stderr,
+            "usage: TMCacheBenchmark [options]\n"
+            "  --caches memory,disk,tmcache       caches to run (default: all three)\n"
+            "  --workloads zipf,scan,mixed,write  workloads to run (default: all four)\n"
+            "  --durability none,group,immediate  durability levels of the disk caches (default: none)\n"
+            "  --engine foundation|posix|uring    I/O engine of the disk cache (default: posix)\n"
+            "  --threads 1,2,4,8                  thread counts (default: 1,4)\n"
+            "  --shards 1,16                      shard counts of the memory cache (default: 16)\n"
+            "  --value-sizes 128,4096,65536       value sizes in bytes (default: 128,4096)\n"
+            "  --values random|text               incompressible or compressible values (default: random)\n"
+            "  --compression N                    compression threshold of the disk caches (default: 0, off)\n"
+            "  --keys N                           distinct keys (default: 10000)\n"
+            "  --capacity N                       objects the caches may hold (default: keys / 10)\n"
+            "  --ops N                            measured operations per run (default: 100000)\n"
+            "  --warmup N                         unmeasured operations per run (default: ops / 5)\n"
+            "  --zipf-exponent S                  skew of zipf and mixed keys (default: 0.99)\n"
+            "  --write-ratio R                    share of writes in mixed (default: 0.2)\n"
+            "  --format json|csv                  output format (default: json, one object per line)\n"
+            "  --root PATH                        directory for the disk caches (default: temporary directory)\n");
+}
+
+int main(int argc, const char *argv[])
+{
+    @autoreleasepool {
+        TMBenchmarkOptions *options = [[TMBenchmarkOptions alloc] init];
+        options.caches = @[ @"memory", @"disk", @"tmcache" ];
+        options.workloads = @[ @"zipf", @"scan", @"mixed", @"write" ];
+        options.durabilities = @[ @"none" ];
+        options.engine = @"posix";
+        options.threadCounts = @[ @1, @4 ];
+        options.shardCounts = @[ @16 ];
+        options.valueSizes = @[ @128, @4096 ];
+        options.valueKind = @"random";
+        options.compressionThreshold = 0;
+        options.keyCount = 10000;
+        options.capacity = 0;
+        options.operationCount = 100000;
+        options.warmupCount = NSNotFound;
+        options.zipfExponent = 0.99;
+        options.writeRatio = 0.2;
+        options.format = @"json";
+        options.rootPath = NSTemporaryDirectory();
+
+        for (int i = 1; i < argc; i++) {
+            NSString *option = [[NSString alloc] initWithUTF8String:argv[i]];
+
+            if ([option isEqualToString:@"--help"] || i + 1 >= argc) {
+                TMBenchmarkUsage();
+                return [option isEqualToString:@"--help"] ? 0 : 1;
+            }
+
+            NSString *value = [[NSString alloc] initWithUTF8String:argv[++i]];
+
+            if ([option isEqualToString:@"--caches"])
+                options.caches = [value componentsSeparatedByString:@","];
+            else if ([option isEqualToString:@"--workloads"])
+                options.workloads = [value componentsSeparatedByString:@","];
+            else if ([option isEqualToString:@"--durability"])
+                options.durabilities = [value componentsSeparatedByString:@","];
+            else if ([option isEqualToString:@"--engine"])
+                options.engine = value;
+            else if ([option isEqualToString:@"--threads"])
+                options.threadCounts = TMBenchmarkNumbers(value);
+            else if ([option isEqualToString:@"--shards"])
+                options.shardCounts = TMBenchmarkNumbers(value);
+            else if ([option isEqualToString:@"--value-sizes"])
+                options.valueSizes = TMBenchmarkNumbers(value);
+            else if ([option isEqualToString:@"--values"])
+                options.valueKind = value;
+            else if ([option isEqualToString:@"--compression"])
+                options.compressionThreshold = (NSUInteger)[value integerValue];
+            else if ([option isEqualToString:@"--keys"])
+                options.keyCount = (NSUInteger)[value integerValue];
+            else if ([option isEqualToString:@"--capacity"])
+                options.capacity = (NSUInteger)[value integerValue];
+            else if ([option isEqualToString:@"--ops"])
+                options.operationCount = (NSUInteger)[value integerValue];
+            else if ([option isEqualToString:@"--warmup"])
+                options.warmupCount = (NSUInteger)[value integerValue];
+            else if ([option isEqualToString:@"--zipf-exponent"])
+                options.zipfExponent = [value doubleValue];
+            else if ([option isEqualToString:@"--write-ratio"])
+                options.writeRatio = [value doubleValue];
+            else if ([option isEqualToString:@"--format"])
+                options.format = value;
+            else if ([option isEqualToString:@"--root"])
+                options.rootPath = value;
+            else {
+                TMBenchmarkUsage();
+                return 1;
+            }
+        }
+
+        if (options.keyCount == 0 || options.operationCount == 0 || ![options.threadCounts count] || ![options.shardCounts count]) {
+            TMBenchmarkUsage();
+            return 1;
+        }
+
+        if (options.capacity == 0)
+            options.capacity = options.keyCount / 10 ?: 1;
+
+        if (options.warmupCount == NSNotFound)
+            options.warmupCount = options.operationCount / 5;
+
+        for (NSNumber *threadCount in options.threadCounts) {
+            if ([threadCount unsignedIntegerValue] > options.operationCount) {
+                TMBenchmarkUsage();
+                return 1;
+            }
+        }
+
+        [[[TMBenchmark alloc] initWithOptions:options] run];
+    }
+
+    return 0;
+}
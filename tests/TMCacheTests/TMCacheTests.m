@@ -1,5 +1,6 @@
 #import "TMCacheTests.h"
 #import "TMCache.h"
+#import "TMDiskCacheIndex.h"
 
 NSString * const TMCacheTestName = @"TMCacheTest";
 NSTimeInterval TMCacheTestBlockTimeout = 5.0;
@@ -147,6 +148,20 @@ NSTimeInterval TMCacheTestBlockTimeout = 5.0;
     STAssertTrue(self.cache.memoryCache.totalCost == 1, @"cache had an unexpected total cost");
 }
 
+- (void)testMemoryBatchCosts
+{
+    NSArray *keys = @[ @"key1", @"key2" ];
+
+    [self.cache.memoryCache setObjects:keys forKeys:keys withCosts:@[ @1, @2 ]];
+
+    STAssertTrue(self.cache.memoryCache.totalCost == 3, @"batch set did not add its costs");
+
+    [self.cache.memoryCache trimToCost:1];
+
+    STAssertNotNil([self.cache.memoryCache objectForKey:@"key1"], @"object did not survive memory cache trim to cost");
+    STAssertNil([self.cache.memoryCache objectForKey:@"key2"], @"object was not trimmed despite exceeding cost");
+}
+
 - (void)testMemoryCostByDate
 {
     NSString *key1 = @"key1";
@@ -165,6 +180,205 @@ NSTimeInterval TMCacheTestBlockTimeout = 5.0;
     STAssertTrue(self.cache.memoryCache.totalCost == 0, @"cache had an unexpected total cost");
 }
 
+- (void)testMemoryCostByDateEvictsLeastRecentlyUsed
+{
+    NSString *key1 = @"key1";
+    NSString *key2 = @"key2";
+    NSString *key3 = @"key3";
+
+    [self.cache.memoryCache setObject:key1 forKey:key1 withCost:1];
+    [self.cache.memoryCache setObject:key2 forKey:key2 withCost:1];
+    [self.cache.memoryCache setObject:key3 forKey:key3 withCost:1];
+
+    [self.cache.memoryCache objectForKey:key1]; // key2 is now the least recently used
+
+    [self.cache.memoryCache trimToCostByDate:2];
+
+    STAssertNotNil([self.cache.memoryCache objectForKey:key1], @"recently accessed object was trimmed");
+    STAssertNil([self.cache.memoryCache objectForKey:key2], @"least recently used object was not trimmed");
+    STAssertNotNil([self.cache.memoryCache objectForKey:key3], @"recently added object was trimmed");
+    STAssertTrue(self.cache.memoryCache.totalCost == 2, @"cache had an unexpected total cost");
+}
+
+- (void)testShardedMemoryCache
+{
+    TMMemoryCache *cache = [[TMMemoryCache alloc] initWithShardCount:6];
+
+    STAssertTrue(cache.shardCount == 8, @"shard count was not rounded up to a power of two");
+
+    NSUInteger objectCount = 100;
+
+    for (NSUInteger i = 0; i < objectCount; i++) {
+        NSString *key = [[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i];
+        [cache setObject:key forKey:key withCost:1];
+    }
+
+    STAssertTrue(cache.totalCost == objectCount, @"sharded cache had an unexpected total cost");
+
+    for (NSUInteger i = 0; i < objectCount; i++) {
+        NSString *key = [[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i];
+        STAssertEqualObjects([cache objectForKey:key], key, @"object was not found in its shard");
+    }
+
+    __block NSUInteger enumCount = 0;
+
+    [cache enumerateObjectsWithBlock:^(TMMemoryCache *cache, NSString *key, id object) {
+        enumCount++;
+    }];
+
+    STAssertTrue(enumCount == objectCount, @"some objects were not enumerated");
+
+    [cache trimToCostByDate:0];
+
+    STAssertTrue(cache.totalCost == 0, @"sharded cache was not trimmed");
+}
+
+- (void)testShardedMemoryCacheConcurrentHits
+{
+    NSUInteger keyCount = 1000;
+    NSUInteger hitCount = 50000;
+    size_t threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+
+    NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:keyCount];
+    for (NSUInteger i = 0; i < keyCount; i++)
+        [keys addObject:[[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i]];
+
+    for (NSNumber *shardCount in @[ @1, @16 ]) {
+        TMMemoryCache *cache = [[TMMemoryCache alloc] initWithShardCount:[shardCount unsignedIntegerValue]];
+
+        for (NSString *key in keys)
+            [cache setObject:key forKey:key];
+
+        __block NSUInteger misses = 0;
+
+        dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+            for (NSUInteger i = thread; i < hitCount; i += threadCount) {
+                if (![cache objectForKey:[keys objectAtIndex:(i * 7) % keyCount]])
+                    __sync_fetch_and_add(&misses, 1);
+            }
+        });
+
+        STAssertTrue(misses == 0, @"cache missed a key it was holding");
+    }
+}
+
+- (void)testMemoryTrimToDate
+{
+    TMMemoryCache *cache = [[TMMemoryCache alloc] init];
+
+    [cache setObject:@"old" forKey:@"old" withCost:1];
+    [NSThread sleepForTimeInterval:0.1];
+    NSDate *trimDate = [[NSDate alloc] init];
+    [NSThread sleepForTimeInterval:0.1];
+    [cache setObject:@"new" forKey:@"new" withCost:2];
+
+    [cache trimToDate:[[NSDate alloc] initWithTimeIntervalSinceNow:-60.0]];
+
+    STAssertTrue(cache.totalCost == 3, @"objects newer than the trim date were removed");
+
+    [cache trimToDate:trimDate];
+
+    STAssertNil([cache objectForKey:@"old"], @"object older than the trim date was not removed");
+    STAssertNotNil([cache objectForKey:@"new"], @"object newer than the trim date was removed");
+    STAssertTrue(cache.totalCost == 2, @"cost was not updated after trimming");
+}
+
+- (void)testMemoryCostLimitBelowShardCount
+{
+    TMMemoryCache *cache = [[TMMemoryCache alloc] initWithShardCount:16];
+    cache.costLimit = 10;
+
+    [cache setObject:@"object" forKey:@"key" withCost:1];
+
+    STAssertNotNil([cache objectForKey:@"key"], @"object within the cost limit was evicted");
+}
+
+- (void)testEvictionPolicyHitRatio
+{
+    NSUInteger keyCount = 10000;
+    NSUInteger accessCount = 100000;
+    NSUInteger capacity = 500;
+
+    // Zipfian popularity over keyCount keys, with a scan of 2000 keys that are never read again every 5000 accesses
+    double *cdf = malloc(keyCount * sizeof(double));
+    double sum = 0.0;
+    for (NSUInteger i = 0; i < keyCount; i++)
+        sum += 1.0 / (i + 1);
+    double total = 0.0;
+    for (NSUInteger i = 0; i < keyCount; i++)
+        cdf[i] = (total += 1.0 / (i + 1) / sum);
+
+    srand48(42);
+
+    NSMutableArray *trace = [[NSMutableArray alloc] init];
+    NSUInteger scanned = 0;
+
+    for (NSUInteger i = 0; i < accessCount; i++) {
+        double r = drand48();
+        NSUInteger low = 0, high = keyCount - 1;
+        while (low < high) {
+            NSUInteger mid = (low + high) / 2;
+            if (cdf[mid] < r)
+                low = mid + 1;
+            else
+                high = mid;
+        }
+        [trace addObject:[[NSString alloc] initWithFormat:@"zipf %lu", (unsigned long)low]];
+
+        if (i % 5000 == 4999) {
+            for (NSUInteger j = 0; j < 2000; j++)
+                [trace addObject:[[NSString alloc] initWithFormat:@"scan %lu", (unsigned long)scanned++]];
+        }
+    }
+
+    free(cdf);
+
+    double hitRatios[3];
+    TMMemoryCacheEvictionPolicy policies[3] = { TMMemoryCacheEvictionPolicyLRU,
+                                                TMMemoryCacheEvictionPolicyTinyLFU,
+                                                TMMemoryCacheEvictionPolicyARC };
+
+    for (NSUInteger p = 0; p < 3; p++) {
+        TMMemoryCache *cache = [[TMMemoryCache alloc] initWithShardCount:1 evictionPolicy:policies[p]];
+        cache.costLimit = capacity;
+
+        NSUInteger hits = 0;
+
+        for (NSString *key in trace) {
+            if ([cache objectForKey:key])
+                hits++;
+            else
+                [cache setObject:key forKey:key withCost:1];
+        }
+
+        STAssertTrue(cache.totalCost <= capacity, @"cache went over its cost limit");
+
+        hitRatios[p] = (double)hits / [trace count];
+    }
+
+    NSLog(@"hit ratio LRU %.3f, W-TinyLFU %.3f, ARC %.3f", hitRatios[0], hitRatios[1], hitRatios[2]);
+
+    STAssertTrue(hitRatios[1] > hitRatios[0], @"W-TinyLFU did not beat LRU on a scan-mixed trace");
+    STAssertTrue(hitRatios[2] > hitRatios[0], @"ARC did not beat LRU on a scan-mixed trace");
+}
+
+- (void)testMemoryCacheSynchronousMethodsSkipQueue
+{
+    TMMemoryCache *cache = [[TMMemoryCache alloc] init];
+
+    dispatch_suspend(cache.queue);
+
+    [cache setObject:@"object" forKey:@"key" withCost:1];
+    id object = [cache objectForKey:@"key"];
+    [cache removeObjectForKey:@"key"];
+
+    dispatch_resume(cache.queue);
+
+    STAssertEqualObjects(object, @"object", @"synchronous get waited on the queue or missed");
+    STAssertNil([cache objectForKey:@"key"], @"synchronous remove did not remove the object");
+    STAssertTrue(cache.totalCost == 0, @"synchronous remove did not update the cost");
+}
+
 - (void)testDiskByteCount
 {
     [self.cache setObject:[self image] forKey:@"image"];
@@ -172,6 +386,561 @@ NSTimeInterval TMCacheTestBlockTimeout = 5.0;
     STAssertTrue(self.cache.diskByteCount > 0, @"disk cache byte count was not greater than zero");
 }
 
+- (void)testDiskByteCountDoesNotWaitOnQueue
+{
+    [self.cache setObject:[self image] forKey:@"image"];
+
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+
+    dispatch_barrier_async(self.cache.diskCache.queue, ^{
+        dispatch_semaphore_wait(semaphore, DISPATCH_TIME_FOREVER);
+    });
+
+    NSUInteger byteCount = self.cache.diskByteCount;
+
+    dispatch_semaphore_signal(semaphore);
+
+    STAssertTrue(byteCount > 0, @"disk cache byte count waited on the queue or was zero");
+}
+
+- (void)testDiskCacheReadDoesNotModifyFile
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    [cache setObject:@"object" forKey:@"key"];
+
+    NSURL *fileURL = [cache fileURLForKey:@"key"];
+    NSDate *writeDate = [NSDate dateWithTimeIntervalSinceNow:-3600.0];
+    [[NSFileManager defaultManager] setAttributes:@{ NSFileModificationDate: writeDate }
+                                     ofItemAtPath:[fileURL path]
+                                            error:NULL];
+
+    id object = [cache objectForKey:@"key"];
+    NSDate *modificationDate = [[[NSFileManager defaultManager] attributesOfItemAtPath:[fileURL path] error:NULL]
+                                objectForKey:NSFileModificationDate];
+
+    STAssertEqualObjects(object, @"object", @"object was not read back");
+    STAssertTrue(fabs([modificationDate timeIntervalSinceDate:writeDate]) < 1.0, @"read modified the file");
+}
+
+- (void)testDiskCacheIndexReplaysJournal
+{
+    NSURL *directoryURL = [NSURL fileURLWithPath:[NSTemporaryDirectory() stringByAppendingPathComponent:TMCacheTestName]];
+    [[NSFileManager defaultManager] removeItemAtURL:directoryURL error:NULL];
+    [[NSFileManager defaultManager] createDirectoryAtURL:directoryURL withIntermediateDirectories:YES attributes:nil error:NULL];
+
+    NSDate *writeDate = [NSDate dateWithTimeIntervalSinceReferenceDate:1000.0];
+    NSDate *readDate = [NSDate dateWithTimeIntervalSinceReferenceDate:2000.0];
+
+    TMDiskCacheIndex *index = [[TMDiskCacheIndex alloc] initWithDirectoryURL:directoryURL];
+    [index setSize:100 date:writeDate forKey:@"kept"];
+    [index setSize:200 date:writeDate forKey:@"removed"];
+    [index setAccessDate:readDate forKey:@"kept"];
+    [index removeKey:@"removed"];
+    [index flush];
+
+    NSMutableDictionary *dates = [[NSMutableDictionary alloc] init];
+    NSMutableDictionary *sizes = [[NSMutableDictionary alloc] init];
+    TMDiskCacheIndex *reopenedIndex = [[TMDiskCacheIndex alloc] initWithDirectoryURL:directoryURL];
+    BOOL loaded = [reopenedIndex loadDates:dates sizes:sizes];
+
+    [[NSFileManager defaultManager] removeItemAtURL:directoryURL error:NULL];
+
+    STAssertTrue(loaded, @"index was not found");
+    STAssertEqualObjects([dates objectForKey:@"kept"], readDate, @"access date was not replayed");
+    STAssertEqualObjects([sizes objectForKey:@"kept"], @100, @"size was not replayed");
+    STAssertNil([dates objectForKey:@"removed"], @"removal was not replayed");
+}
+
+- (void)testDiskCacheSegmentStorage
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    cache.segmentByteLimit = 1024;
+
+    [cache setObject:@"small" forKey:@"small"];
+    [cache setObject:[self image] forKey:@"large"];
+
+    STAssertEqualObjects([cache objectForKey:@"small"], @"small", @"small object was not read back");
+    STAssertNil([cache fileURLForKey:@"small"], @"small object was stored in a file");
+    STAssertNotNil([cache fileURLForKey:@"large"], @"large object was not stored in a file");
+
+    [cache removeObjectForKey:@"small"];
+
+    STAssertNil([cache objectForKey:@"small"], @"small object was not removed");
+
+    cache.segmentByteLimit = 0;
+}
+
+- (void)testDiskCacheRawData
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    NSData *data = [@"raw bytes" dataUsingEncoding:NSUTF8StringEncoding];
+
+    [cache setData:data forKey:@"data"];
+    NSData *mappedData = [cache dataForKey:@"data"];
+
+    [cache removeObjectForKey:@"data"];
+
+    STAssertEqualObjects(mappedData, data, @"data was not read back unchanged");
+    STAssertNil([cache dataForKey:@"data"], @"data was not removed");
+}
+
+- (void)testDiskCacheSerializers
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    NSDictionary *object = @{ @"string": @"value", @"number": @(-42), @"double": @(0.5), @"flag": @YES,
+                              @"date": [NSDate dateWithTimeIntervalSinceReferenceDate:1000.0],
+                              @"array": @[ @1, [NSNull null], [@"data" dataUsingEncoding:NSUTF8StringEncoding] ] };
+
+    [cache setObject:object forKey:@"archived"];
+
+    cache.serializer = [[TMCachePropertyListSerializer alloc] init];
+    [cache setObject:object forKey:@"propertyList"];
+    [cache setObject:[self image] forKey:@"image"]; // not a property list, falls back to keyed archiving
+
+    cache.serializer = nil;
+
+    STAssertEqualObjects([cache objectForKey:@"archived"], object, @"keyed archive did not round trip");
+    STAssertEqualObjects([cache objectForKey:@"propertyList"], object, @"property list did not round trip");
+    STAssertNotNil([cache objectForKey:@"image"], @"fallback to keyed archiving failed");
+}
+
+- (void)testDiskCacheCompressionRoundTripsAndSavesSpace
+{
+    NSUInteger objectCount = 200;
+    NSMutableArray *objects = [[NSMutableArray alloc] initWithCapacity:objectCount];
+
+    for (NSUInteger i = 0; i < objectCount; i++) {
+        NSMutableArray *posts = [[NSMutableArray alloc] init];
+        for (NSUInteger j = 0; j < 20; j++)
+            [posts addObject:@{ @"id": @(i * 100 + j), @"type": @"text", @"blog_name": @"staff",
+                                @"body": [[NSString alloc] initWithFormat:@"Post %lu of blog %lu, with some text.", (unsigned long)j, (unsigned long)i] }];
+        [objects addObject:@{ @"posts": posts, @"total_posts": @(20) }];
+    }
+
+    NSUInteger byteCounts[2] = { 0, 0 };
+
+    for (NSUInteger compressed = 0; compressed < 2; compressed++) {
+        TMDiskCache *cache = self.cache.diskCache;
+        [cache removeAllObjects];
+        cache.compressionThreshold = compressed ? 256 : 0;
+
+        for (NSUInteger i = 0; i < objectCount; i++)
+            [cache setObject:[objects objectAtIndex:i] forKey:[[NSString alloc] initWithFormat:@"%lu", (unsigned long)i]];
+
+        for (NSUInteger i = 0; i < objectCount; i++) {
+            id object = [cache objectForKey:[[NSString alloc] initWithFormat:@"%lu", (unsigned long)i]];
+            STAssertEqualObjects(object, [objects objectAtIndex:i], @"object did not round trip");
+        }
+
+        byteCounts[compressed] = cache.byteCount;
+        cache.compressionThreshold = 0;
+    }
+
+    STAssertTrue(byteCounts[1] < byteCounts[0], @"compression did not reduce the bytes on disk");
+}
+
+- (void)testBatchMethods
+{
+    NSUInteger count = 100;
+    NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:count];
+    NSMutableArray *objects = [[NSMutableArray alloc] initWithCapacity:count];
+
+    for (NSUInteger i = 0; i < count; i++) {
+        [keys addObject:[[NSString alloc] initWithFormat:@"%lu", (unsigned long)i]];
+        [objects addObject:@(i)];
+    }
+
+    [self.cache setObjects:objects forKeys:keys];
+
+    NSArray *evictedKeys = [keys subarrayWithRange:NSMakeRange(0, count / 2)];
+    [self.cache.memoryCache removeObjectsForKeys:evictedKeys];
+
+    __block NSDictionary *found = nil;
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+
+    [self.cache objectsForKeys:[keys arrayByAddingObject:@"missing"] block:^(TMCache *cache, NSDictionary *results) {
+        found = results;
+        dispatch_semaphore_signal(semaphore);
+    }];
+
+    dispatch_semaphore_wait(semaphore, [self timeout]);
+
+    STAssertEqualObjects(found, [NSDictionary dictionaryWithObjects:objects forKeys:keys], @"batch get did not return every stored object");
+    STAssertEquals([[self.cache.memoryCache objectsForKeys:evictedKeys] count], count / 2, @"disk hits were not added to memory");
+
+    [self.cache removeObjectsForKeys:keys];
+
+    STAssertEquals([[self.cache objectsForKeys:keys] count], (NSUInteger)0, @"batch remove left objects behind");
+    STAssertEquals(self.cache.diskByteCount, (NSUInteger)0, @"batch remove left bytes on disk");
+}
+
+- (void)testWriteBehindCoalescesWrites
+{
+    NSString *key = @"key";
+    __block int32_t diskWrites = 0;
+
+    self.cache.writeBehind = YES;
+    self.cache.writeBehindInterval = 60.0;
+    self.cache.diskCache.didAddObjectBlock = ^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
+        __sync_fetch_and_add(&diskWrites, 1);
+    };
+
+    for (NSUInteger i = 0; i < 10; i++)
+        [self.cache setObject:@(i) forKey:key];
+
+    STAssertNil([self.cache.diskCache objectForKey:key], @"object was written through");
+
+    [self.cache.memoryCache removeAllObjects];
+    STAssertEqualObjects([self.cache objectForKey:key], @9, @"dirty object was not readable");
+
+    [self.cache flush];
+
+    STAssertEqualObjects([self.cache.diskCache objectForKey:key], @9, @"flush did not write the latest object");
+    STAssertEquals(diskWrites, (int32_t)1, @"writes to the same key were not coalesced");
+}
+
+- (void)testLoaderRunsOncePerKey
+{
+    NSString *key = @"key";
+    NSUInteger requestCount = 20;
+    __block int32_t loads = 0;
+    __block int32_t hits = 0;
+    dispatch_group_t group = dispatch_group_create();
+
+    TMCacheLoaderBlock loader = ^id <NSCoding>(NSString *key) {
+        __sync_fetch_and_add(&loads, 1);
+        usleep(100000);
+        return @"loaded";
+    };
+
+    for (NSUInteger i = 0; i < requestCount; i++) {
+        dispatch_group_enter(group);
+
+        [self.cache objectForKey:key loader:loader block:^(TMCache *cache, NSString *key, id object) {
+            if ([object isEqual:@"loaded"])
+                __sync_fetch_and_add(&hits, 1);
+            dispatch_group_leave(group);
+        }];
+    }
+
+    dispatch_group_wait(group, [self timeout]);
+
+    STAssertEquals(loads, (int32_t)1, @"loader ran more than once");
+    STAssertEquals(hits, (int32_t)requestCount, @"not every request got the loaded object");
+    STAssertEqualObjects([self.cache.diskCache objectForKey:key], @"loaded", @"loaded object was not stored on disk");
+}
+
+- (void)testLoaderDoesNotOverwriteNewerSet
+{
+    NSString *key = @"key";
+    dispatch_semaphore_t loading = dispatch_semaphore_create(0);
+    dispatch_semaphore_t released = dispatch_semaphore_create(0);
+    dispatch_semaphore_t finished = dispatch_semaphore_create(0);
+    __block id loadedObject = nil;
+
+    [self.cache objectForKey:key loader:^id <NSCoding>(NSString *key) {
+        dispatch_semaphore_signal(loading);
+        dispatch_semaphore_wait(released, DISPATCH_TIME_FOREVER);
+        return @"loaded";
+    } block:^(TMCache *cache, NSString *key, id object) {
+        loadedObject = object;
+        dispatch_semaphore_signal(finished);
+    }];
+
+    dispatch_semaphore_wait(loading, [self timeout]);
+    [self.cache setObject:@"set" forKey:key];
+    dispatch_semaphore_signal(released);
+    dispatch_semaphore_wait(finished, [self timeout]);
+
+    STAssertEqualObjects(loadedObject, @"loaded", @"waiter did not get the loaded object");
+    STAssertEqualObjects([self.cache.memoryCache objectForKey:key], @"set", @"loaded object overwrote a newer set in memory");
+    STAssertEqualObjects([self.cache.diskCache objectForKey:key], @"set", @"loaded object overwrote a newer set on disk");
+}
+
+- (void)testDiskCacheAccessDatesHandedOver
+{
+    TMDiskCache *cache = self.cache.diskCache;
+
+    [cache setObject:@"first" forKey:@"first"];
+    [cache setObject:@"second" forKey:@"second"];
+
+    [cache setAccessDates:@{ @"first": [[NSDate alloc] initWithTimeIntervalSinceNow:60.0] }];
+    [cache trimToSizeByDate:cache.byteCount - 1];
+
+    STAssertNotNil([cache objectForKey:@"first"], @"object used through the access dates was trimmed");
+    STAssertNil([cache objectForKey:@"second"], @"least recently used object was not trimmed");
+}
+
+- (void)testDiskCacheTrimsToWatermarkInBackground
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    NSMutableData *data = [[NSMutableData alloc] initWithLength:256];
+
+    cache.byteLimit = 8192;
+    cache.trimTargetByteCount = 4096;
+    cache.hardByteLimit = 16384;
+
+    for (NSUInteger i = 0; i < 200; i++) {
+        [cache setData:data forKey:[[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i]];
+        STAssertTrue(cache.byteCount < cache.hardByteLimit + 1024, @"writer went far past the hard limit");
+    }
+
+    NSDate *deadline = [[NSDate alloc] initWithTimeIntervalSinceNow:5.0];
+    while (cache.byteCount > cache.trimTargetByteCount && [deadline timeIntervalSinceNow] > 0.0)
+        [NSThread sleepForTimeInterval:0.01];
+
+    STAssertTrue(cache.byteCount <= cache.trimTargetByteCount, @"cache was not trimmed to the low watermark");
+    STAssertNil([cache dataForKey:@"key 0"], @"oldest object was not trimmed");
+    STAssertNotNil([cache dataForKey:@"key 199"], @"newest object was trimmed");
+}
+
+- (void)testAsynchronousWritersMakeRoomOnTheirQueue
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    NSMutableData *data = [[NSMutableData alloc] initWithLength:256];
+    dispatch_group_t group = dispatch_group_create();
+
+    cache.byteLimit = 8192;
+    cache.hardByteLimit = 16384;
+
+    for (NSUInteger i = 0; i < 400; i++) {
+        dispatch_group_enter(group);
+        [cache setData:data forKey:[[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i]
+                 block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
+            dispatch_group_leave(group);
+        }];
+    }
+
+    STAssertTrue(dispatch_group_wait(group, [self timeout]) == 0, @"asynchronous writers did not finish");
+    // every key queue may have one write in flight past the limit, each taking up at most a few disk blocks
+    STAssertTrue(cache.byteCount <= cache.hardByteLimit + 16 * 4096, @"asynchronous writers went far past the hard limit");
+}
+
+- (void)testDiskCacheRemovalsMoveFilesOutOfTheCache
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    NSMutableArray *fileURLs = [[NSMutableArray alloc] init];
+
+    for (NSUInteger i = 0; i < 100; i++) {
+        NSString *key = [[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i];
+        [cache setObject:key forKey:key];
+        [fileURLs addObject:[cache fileURLForKey:key]];
+    }
+
+    for (NSUInteger i = 0; i < 50; i++)
+        [cache removeObjectForKey:[[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i]];
+
+    [cache removeAllObjects];
+
+    for (NSURL *fileURL in fileURLs)
+        STAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[fileURL path]], @"removed file is still in the cache");
+
+    STAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:[cache.cacheURL path]], @"cache directory was not recreated");
+}
+
+- (void)testStatistics
+{
+    [self.cache setObject:@"object" forKey:@"key"];
+    [self.cache.memoryCache removeAllObjects];
+
+    STAssertNotNil([self.cache objectForKey:@"key"], @"object was not read from disk");
+    STAssertNotNil([self.cache objectForKey:@"key"], @"object was not read from memory");
+    STAssertNil([self.cache objectForKey:@"missing"], @"missing object was found");
+
+    TMCacheStatisticsSnapshot snapshot = [self.cache.statistics snapshotAndReset];
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterHits] == 2, @"cache hits were not counted");
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterMisses] == 1, @"cache miss was not counted");
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterWrites] == 1, @"cache write was not counted");
+
+    uint64_t reads = 0;
+    for (NSUInteger bucket = 0; bucket < TMCacheStatisticsLatencyBucketCount; bucket++)
+        reads += snapshot.latencies[TMCacheStatisticsOperationRead][bucket];
+    STAssertTrue(reads == 3, @"read latencies were not recorded");
+
+    snapshot = [self.cache.statistics snapshot];
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterHits] == 0, @"statistics were not reset");
+
+    snapshot = [self.cache.memoryCache.statistics snapshot];
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterHits] == 1, @"memory hit was not counted");
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterMisses] == 2, @"memory misses were not counted");
+
+    snapshot = [self.cache.diskCache.statistics snapshot];
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterBytesRead] > 0, @"bytes read were not counted");
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterBytesWritten] > 0, @"bytes written were not counted");
+
+    NSDictionary *dictionary = TMCacheStatisticsDictionary(snapshot);
+    STAssertEqualObjects([dictionary objectForKey:@"misses"], @1, @"dictionary has the wrong miss count");
+    STAssertTrue([[[dictionary objectForKey:@"latencies"] objectForKey:@"read"] count] == TMCacheStatisticsLatencyBucketCount,
+                 @"dictionary is missing latency buckets");
+}
+
+- (void)testObjectsExpireAfterTheirTTL
+{
+    [self.cache setObject:@"short" forKey:@"short" ttl:1.0];
+    [self.cache setObject:@"long" forKey:@"long" ttl:60.0];
+    [self.cache setObject:@"forever" forKey:@"forever"];
+
+    STAssertNotNil([self.cache objectForKey:@"short"], @"object expired early");
+    STAssertNotNil([self.cache.diskCache expirationDateForKey:@"short"], @"expiration date was not kept on disk");
+
+    [NSThread sleepForTimeInterval:1.1];
+
+    STAssertNil([self.cache.memoryCache objectForKey:@"short"], @"expired object was read from memory");
+    STAssertNil([self.cache.diskCache objectForKey:@"short"], @"expired object was read from disk");
+    STAssertNotNil([self.cache objectForKey:@"long"], @"object expired early");
+    STAssertNotNil([self.cache objectForKey:@"forever"], @"object without a ttl expired");
+
+    [self.cache.memoryCache setObject:@"swept" forKey:@"swept" ttl:1.0];
+    [self.cache.memoryCache setObject:@"kept" forKey:@"swept" ttl:0.0]; // setting it again clears the ttl
+    [self.cache.memoryCache setObject:@"swept" forKey:@"other" ttl:1.0];
+
+    [NSThread sleepForTimeInterval:2.5];
+
+    TMCacheStatisticsSnapshot snapshot = [self.cache.memoryCache.statistics snapshot];
+    STAssertTrue(snapshot.counters[TMCacheStatisticsCounterEvictions] >= 2, @"expired objects were not swept");
+    STAssertEqualObjects([self.cache.memoryCache objectForKey:@"swept"], @"kept", @"object set again without a ttl expired");
+}
+
+- (void)testDiskCacheRulesOutMissingKeys
+{
+    TMDiskCache *diskCache = self.cache.diskCache;
+    NSDate *deadline = [[NSDate alloc] initWithTimeIntervalSinceNow:5.0];
+
+    // the filter only answers once the index was checked against the directory after opening
+    while ([diskCache mightContainObjectForKey:@"never stored"] && [deadline timeIntervalSinceNow] > 0.0)
+        [NSThread sleepForTimeInterval:0.05];
+
+    STAssertFalse([diskCache mightContainObjectForKey:@"never stored"], @"key that was never stored was not ruled out");
+
+    [diskCache setObject:@"queued" forKey:@"queued" block:nil];
+    STAssertTrue([diskCache mightContainObjectForKey:@"queued"], @"key with a queued write was ruled out");
+
+    for (NSUInteger i = 0; i < 2000; i++) // more than the filter starts out with
+        [diskCache setObject:@(i) forKey:[[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i]];
+
+    for (NSUInteger i = 0; i < 2000; i++) {
+        NSString *key = [[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i];
+        STAssertTrue([diskCache mightContainObjectForKey:key], @"stored key was ruled out");
+    }
+
+    STAssertEqualObjects([self.cache objectForKey:@"queued"], @"queued", @"object with a queued write was not read");
+
+    [self.cache removeObjectForKey:@"queued"];
+    STAssertNil([self.cache objectForKey:@"queued"], @"removed object was read");
+}
+
+- (void)testDiskCacheInstancesSharingADirectory
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    TMDiskCache *otherCache = [[TMDiskCache alloc] initWithName:TMCacheTestName];
+
+    [otherCache setObject:@"other" forKey:@"other"];
+
+    STAssertTrue([cache mightContainObjectForKey:@"other"], @"key written by another instance was ruled out");
+    STAssertEqualObjects([cache objectForKey:@"other"], @"other", @"object written by another instance was not read");
+}
+
+- (void)testHashedFileLayout
+{
+    NSString *name = @"TMCacheHashedLayoutTest";
+    NSString *rootPath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0];
+    NSString *longKey = [@"" stringByPaddingToLength:1000 withString:@"long key " startingAtIndex:0];
+
+    TMDiskCache *flatCache = [[TMDiskCache alloc] initWithName:name rootPath:rootPath];
+    [flatCache removeAllObjects];
+    [flatCache setObject:@"flat" forKey:@"flat"];
+    flatCache = nil;
+
+    TMDiskCache *cache = [[TMDiskCache alloc] initWithName:name rootPath:rootPath fileLayout:TMDiskCacheFileLayoutHashed];
+
+    STAssertEqualObjects([cache objectForKey:@"flat"], @"flat", @"object written in the flat layout was not moved over");
+
+    [cache setObject:@"long" forKey:longKey];
+    STAssertEqualObjects([cache objectForKey:longKey], @"long", @"object with a key longer than a file name was not read");
+
+    NSURL *fileURL = [cache fileURLForKey:longKey];
+    NSArray *pathComponents = [fileURL pathComponents];
+    STAssertTrue([[fileURL lastPathComponent] length] == 32, @"file name is not a hash");
+    STAssertTrue([[pathComponents objectAtIndex:[pathComponents count] - 4] isEqualToString:[cache.cacheURL lastPathComponent]],
+                 @"file is not two directories down");
+
+    NSData *data = [@"data" dataUsingEncoding:NSUTF8StringEncoding];
+    [cache setData:data forKey:@"data"];
+    STAssertEqualObjects([cache dataForKey:@"data"], data, @"data was not read back as it was stored");
+
+    [cache removeAllObjects];
+}
+
+- (void)testDurableWrites
+{
+    TMDiskCache *cache = self.cache.diskCache;
+    NSArray *durabilities = @[ @(TMDiskCacheDurabilityImmediate), @(TMDiskCacheDurabilityGroupCommit) ];
+    NSUInteger writeCount = 20;
+
+    for (NSNumber *durability in durabilities) {
+        cache.durability = [durability unsignedIntegerValue];
+
+        dispatch_group_t group = dispatch_group_create();
+
+        for (NSUInteger i = 0; i < writeCount; i++) {
+            NSString *key = [[NSString alloc] initWithFormat:@"%@-%lu", durability, (unsigned long)i];
+            dispatch_group_enter(group);
+            [cache setObject:key forKey:key block:^(TMDiskCache *cache, NSString *key, id <NSCoding> object, NSURL *fileURL) {
+                dispatch_group_leave(group);
+            }];
+        }
+
+        dispatch_group_wait(group, [self timeout]);
+
+        for (NSUInteger i = 0; i < writeCount; i++) {
+            NSString *key = [[NSString alloc] initWithFormat:@"%@-%lu", durability, (unsigned long)i];
+            STAssertEqualObjects([cache objectForKey:key], key, @"durably written object was not read back");
+        }
+    }
+
+    NSString *writesPath = [[cache.cacheURL path] stringByAppendingPathComponent:@".TMDiskCacheWrites"];
+    NSArray *temporaryFiles = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:writesPath error:NULL];
+    STAssertTrue([temporaryFiles count] == 0, @"temporary files were left behind");
+}
+
+- (void)testIOEngines
+{
+    NSString *rootPath = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0];
+    NSArray *engines = @[ @(TMDiskCacheIOEngineFoundation), @(TMDiskCacheIOEnginePOSIX), @(TMDiskCacheIOEngineIOUring) ];
+    NSUInteger objectCount = 100;
+
+    for (NSNumber *engine in engines) {
+        NSString *name = [[NSString alloc] initWithFormat:@"TMCacheIOEngineTest-%@", engine];
+        TMDiskCache *cache = [[TMDiskCache alloc] initWithName:name rootPath:rootPath fileLayout:TMDiskCacheFileLayoutHashed
+                                                      ioEngine:[engine unsignedIntegerValue]];
+
+        if ([engine unsignedIntegerValue] == TMDiskCacheIOEngineIOUring)
+            STAssertTrue(cache.ioEngine == TMDiskCacheIOEngineIOUring || cache.ioEngine == TMDiskCacheIOEnginePOSIX,
+                         @"unsupported engine did not fall back to POSIX");
+        else
+            STAssertTrue(cache.ioEngine == [engine unsignedIntegerValue], @"engine was not used");
+
+        NSMutableArray *keys = [[NSMutableArray alloc] initWithCapacity:objectCount];
+        for (NSUInteger i = 0; i < objectCount; i++)
+            [keys addObject:[[NSString alloc] initWithFormat:@"key %lu", (unsigned long)i]];
+
+        [cache setObjects:keys forKeys:keys];
+        [cache setObject:@"single" forKey:@"single"];
+
+        STAssertEqualObjects([cache objectForKey:@"single"], @"single", @"object was not read back");
+        STAssertEqualObjects([cache objectsForKeys:keys], [[NSDictionary alloc] initWithObjects:keys forKeys:keys],
+                             @"batch of objects was not read back");
+        STAssertTrue(cache.byteCount > 0, @"sizes of the written files were not counted");
+
+        [cache removeObjectsForKeys:keys];
+
+        STAssertTrue([[cache objectsForKeys:keys] count] == 0, @"batch of objects was not removed");
+        STAssertNil([cache fileURLForKey:[keys objectAtIndex:0]], @"file of a removed object was left behind");
+
+        [cache removeAllObjects];
+    }
+}
+
 - (void)testOneThousandAndOneWrites
 {
     NSUInteger max = 1001;